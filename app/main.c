@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ctype.h>
 #include <unistd.h>
 #include "../src/lab.h"
@@ -9,121 +10,82 @@
 #include <termios.h>
 #include <signal.h>
 
-int execute_command(char **argv, struct shell *sh, int background)
-{
-  if (argv == NULL || argv[0] == NULL)
-    return 0;
-  pid_t pid;
-  int status;
-
-  pid = fork();
-  if (pid == 0)
-  {
-    if (!background)
-    {
-      pid_t child = getpid();
-      setpgid(child, child);
-      tcsetpgrp(sh->shell_terminal, child);
-
-      signal(SIGINT, SIG_DFL);
-      signal(SIGQUIT, SIG_DFL);
-      signal(SIGTSTP, SIG_DFL);
-      signal(SIGTTIN, SIG_DFL);
-      signal(SIGTTOU, SIG_DFL);
-    }
-    execvp(argv[0], argv);
-    exit(EXIT_FAILURE);
-  }
-  else if (pid < 0)
-  {
-    perror("fork failed");
-  }
-  else
-  {
+extern char **environ;
 
-    if (background)
-    {
-      sh->bg_processes[sh->num_bg_processes].job_id = sh->num_bg_processes + 1;
-      sh->bg_processes[sh->num_bg_processes].pid = pid;
-      sh->bg_processes[sh->num_bg_processes].command = strdup(argv[0]);
-      printf("[%d] %d %s\n", sh->bg_processes[sh->num_bg_processes].job_id, pid, argv[0]);
-      sh->num_bg_processes++;
-    }
-    else
-    {
-      do
-      {
-        waitpid(pid, &status, WUNTRACED);
-        if (WIFSTOPPED(status))
-        {
-          tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
-        }
-      } while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-      tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
-
-      tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
-      tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
-    }
-  }
-  return 1;
-}
-
-int is_background(char *line)
+/**
+ * @brief Read one more line of a command that is still open, such as an
+ * if without its fi or a here-document.
+ *
+ * @param arg Set to non zero, the command spans more than one line
+ * @return The line to be freed or NULL at the end of the input
+ */
+static char *continue_line(void *arg)
 {
-  size_t len = strlen(line);
-  while (len > 0 && isspace(line[len - 1]))
-    len--;
-  if (len > 0 && line[len - 1] == '&')
-  {
-    line[len - 1] = '\0';
-    return 1;
-  }
-  return 0;
+  *(int *)arg = 1;
+  return readline("> ");
 }
 
 int main(int argc, char **argv)
 {
 
-  parse_args(argc, argv);
+  struct shell_options opts = {0};
+  parse_args(argc, argv, &opts);
   if (argc > 1 && strcmp(argv[1], "-v") == 0)
   {
     return 0;
   }
 
+  /* A client hands its command and its stdin, stdout and stderr over */
+  if (opts.connect != NULL)
+  {
+    if (opts.command == NULL)
+    {
+      fprintf(stderr, "usage: %s -s socket -c command\n", argv[0]);
+      return 2;
+    }
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    int status = serve_request(opts.connect, opts.command, environ, fds);
+    return status < 0 ? 127 : status;
+  }
+
   struct shell my_shell = {0};
+  if (opts.serve != NULL)
+  {
+    sh_init_state(&my_shell);
+    source_rc(&my_shell);
+    int status = shell_serve(&my_shell, opts.serve);
+    sh_destroy(&my_shell);
+    return status;
+  }
   sh_init(&my_shell);
+  source_rc(&my_shell);
 
   char *line;
   using_history();
-  int status;
   while ((line = readline(my_shell.prompt)))
   {
     line = trim_white(line);
     add_history(line);
 
-    int background = is_background(line);
-    char **argv = cmd_parse(line);
-    if (do_builtin(&my_shell, argv))
+    /* Only a command that fits on its line can be found by its line again */
+    struct ast *tree = line_cache_get(&my_shell.lines, line);
+    if (tree == NULL)
     {
-      cmd_free(argv);
-      free(line);
+      int more = 0;
+      tree = ast_parse(line, continue_line, &more);
+      if (tree != NULL && !more)
+        line_cache_put(&my_shell.lines, line, tree);
     }
-    else
+    if (tree != NULL)
     {
-      execute_command(argv, &my_shell, background);
-      cmd_free(argv);
-      free(line);
+      exec_tree(&my_shell, tree);
+      ast_release(tree);
     }
+    else
+      my_shell.last_status = 2;
+    free(line);
 
-    for (int i = 0; i < my_shell.num_bg_processes; i++)
-    {
-      pid_t pid = waitpid(my_shell.bg_processes[i].pid, &status, WNOHANG);
-      if (pid > 0)
-      {
-        my_shell.bg_processes[i].is_done = 1;
-      }
-    }
+    update_jobs(&my_shell);
   }
 
   sh_destroy(&my_shell);
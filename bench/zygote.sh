@@ -0,0 +1,22 @@
+# Launch latency of an external command as the shell's heap grows, with
+# commands forked by the shell and started from the zygote.
+#   MY_ZYGOTE=1 ./myprogram < bench/zygote.sh
+zygote
+echo "heap: startup"
+zygote off
+bench -n 200 -w 20 -q /bin/true
+zygote on
+bench -n 200 -w 20 -q /bin/true
+A=$(head -c 67108864 /dev/zero | tr '\0' a)
+echo "heap: +64M"
+zygote off
+bench -n 200 -w 20 -q /bin/true
+zygote on
+bench -n 200 -w 20 -q /bin/true
+B=$(head -c 268435456 /dev/zero | tr '\0' b)
+echo "heap: +320M"
+zygote off
+bench -n 200 -w 20 -q /bin/true
+zygote on
+bench -n 200 -w 20 -q /bin/true
+zygote
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* Room left for the auxiliary vector and the program name, as xargs does */
+#define BATCH_HEADROOM 4096
+/* The kernel refuses any single string longer than this */
+#define BATCH_MAX_STRLEN (32 * 4096)
+
+/**
+ * @brief The space one argument takes on the new process stack.
+ *
+ * @param arg The argument
+ * @return The number of bytes
+ */
+static size_t arg_cost(const char *arg)
+{
+  return strlen(arg) + 1 + sizeof(char *);
+}
+
+/**
+ * @brief Count how many items fit in one command line.
+ *
+ * @param items The items
+ * @param count The number of items
+ * @param budget The bytes left for the items
+ * @param max_items The largest number of items per command, 0 for no limit
+ * @return The number of items that fit, at least one if count is not zero
+ */
+size_t batch_chunk(char **items, size_t count, size_t budget, size_t max_items)
+{
+  size_t used = 0;
+  size_t n = 0;
+
+  while (n < count && (max_items == 0 || n < max_items))
+  {
+    size_t cost = arg_cost(items[n]);
+    if (n > 0 && used + cost > budget)
+      break;
+    used += cost;
+    n++;
+  }
+  return n;
+}
+
+/**
+ * @brief Start one chunk in the process group of the batch.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param envp The environment
+ * @param pgid The process group, 0 to start a new one
+ * @return The child or -1 if the fork failed
+ */
+static pid_t batch_spawn(struct shell *sh, char **argv, char **envp, pid_t pgid)
+{
+  pid_t pid = shell_fork(sh);
+  if (pid == 0)
+  {
+    setpgid(0, pgid);
+    if (sh->shell_is_interactive)
+    {
+      if (pgid == 0)
+        tcsetpgrp(sh->shell_terminal, getpid());
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+      signal(SIGTTIN, SIG_DFL);
+      signal(SIGTTOU, SIG_DFL);
+    }
+    if (envp != NULL)
+      environ = envp;
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  if (pid < 0)
+  {
+    perror("fork");
+    return -1;
+  }
+  setpgid(pid, pgid ? pgid : pid);
+  if (pgid == 0 && sh->shell_is_interactive)
+    tcsetpgrp(sh->shell_terminal, pid);
+  return pid;
+}
+
+/**
+ * @brief Convert a wait status to an exit status.
+ *
+ * @param status The wait status
+ * @return The exit status
+ */
+static int batch_status(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+/**
+ * @brief The batch builtin. Runs a command once per chunk of items, each
+ * chunk as large as the kernel accepts, like xargs without the pipe.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The largest exit status of any chunk, 0 if all succeeded
+ */
+int builtin_batch(struct shell *sh, char **argv)
+{
+  long jobs = 1;
+  long max_items = 0;
+  long max_bytes = 0;
+  int verbose = 0;
+  int i = 1;
+
+  for (; argv[i] != NULL && argv[i][0] == '-'; i++)
+  {
+    if (strcmp(argv[i], "--") == 0)
+    {
+      i++;
+      break;
+    }
+    if (strcmp(argv[i], "-v") == 0)
+    {
+      verbose = 1;
+      continue;
+    }
+    long *val = strcmp(argv[i], "-j") == 0   ? &jobs
+                : strcmp(argv[i], "-n") == 0 ? &max_items
+                : strcmp(argv[i], "-s") == 0 ? &max_bytes
+                                             : NULL;
+    char *end;
+    if (val == NULL || argv[i + 1] == NULL)
+      break;
+    *val = strtol(argv[++i], &end, 10);
+    if (*end != '\0' || *val < 1)
+    {
+      fprintf(stderr, "batch: bad number '%s'\n", argv[i]);
+      return 1;
+    }
+  }
+  if (argv[i] == NULL || argv[i][0] == '-')
+  {
+    fprintf(stderr, "usage: batch [-j JOBS] [-n MAX] [-s BYTES] [-v] cmd [args... --] items...\n");
+    return 1;
+  }
+
+  /* Words before a -- go to every chunk, the rest are split up */
+  char **cmd = &argv[i];
+  size_t fixed = 0;
+  while (cmd[fixed] != NULL && strcmp(cmd[fixed], "--") != 0)
+    fixed++;
+  char **items = cmd[fixed] != NULL ? &cmd[fixed + 1] : &cmd[1];
+  if (cmd[fixed] == NULL)
+    fixed = 1;
+  size_t count = 0;
+  while (items[count] != NULL)
+    count++;
+
+  char **envp = var_envp(&sh->vars);
+  long arg_max = sysconf(_SC_ARG_MAX);
+  if (arg_max <= 0)
+    arg_max = 4096 * 32;
+  long budget = arg_max - BATCH_HEADROOM - (long)sizeof(char *);
+  for (size_t k = 0; envp != NULL && envp[k] != NULL; k++)
+    budget -= (long)arg_cost(envp[k]);
+  for (size_t k = 0; k < fixed; k++)
+    budget -= (long)arg_cost(cmd[k]);
+  if (max_bytes > 0 && max_bytes < budget)
+    budget = max_bytes;
+  for (size_t k = 0; k < count; k++)
+  {
+    if (strlen(items[k]) >= BATCH_MAX_STRLEN || (long)arg_cost(items[k]) > budget)
+    {
+      fprintf(stderr, "batch: argument too long: %.40s...\n", items[k]);
+      return 1;
+    }
+  }
+
+  char **chunk_argv = malloc((fixed + count + 1) * sizeof(char *));
+  if (chunk_argv == NULL)
+  {
+    perror("malloc");
+    return 1;
+  }
+  memcpy(chunk_argv, cmd, fixed * sizeof(char *));
+
+  /* Builtins never leave the shell, so they always run one chunk at a time */
+  int parallel = jobs > 1 && !is_builtin(cmd[0]);
+  int rval = 0;
+  int chunks = 0;
+  int running = 0;
+  int interrupted = 0;
+  pid_t pgid = 0;
+  size_t start = 0;
+
+  do
+  {
+    size_t n = batch_chunk(items + start, count - start, (size_t)budget, (size_t)max_items);
+    memcpy(chunk_argv + fixed, items + start, n * sizeof(char *));
+    chunk_argv[fixed + n] = NULL;
+    start += n;
+    chunks++;
+    if (verbose)
+      fprintf(stderr, "batch: chunk %d, %zu items\n", chunks, n);
+
+    if (!parallel)
+    {
+      int status = run_command(sh, chunk_argv, 0);
+      if (status > rval)
+        rval = status;
+      interrupted = status == 128 + SIGINT;
+      continue;
+    }
+
+    pid_t pid = batch_spawn(sh, chunk_argv, envp, pgid);
+    if (pid < 0)
+    {
+      rval = rval > 1 ? rval : 1;
+      interrupted = 1;
+    }
+    else
+    {
+      if (pgid == 0)
+        pgid = pid;
+      running++;
+    }
+    /* Keep at most jobs chunks running, and wait for all after the last */
+    while (running > 0 && (running >= jobs || start >= count || interrupted))
+    {
+      int status;
+      if (waitpid(-pgid, &status, 0) < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        perror("waitpid");
+        running = 0;
+        break;
+      }
+      if (--running == 0)
+        pgid = 0; /* the group may be gone, the next chunk starts a new one */
+      if (batch_status(status) > rval)
+        rval = batch_status(status);
+      if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+        interrupted = 1;
+    }
+  } while (start < count && !interrupted);
+
+  if (parallel && sh->shell_is_interactive)
+  {
+    tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+  }
+  if (verbose)
+    fprintf(stderr, "batch: %zu items in %d chunks, status %d\n", count, chunks, rval);
+  free(chunk_argv);
+  return rval;
+}
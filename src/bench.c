@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+/**
+ * @brief One measured run of a command.
+ */
+struct run_usage
+{
+  double real;
+  double user;
+  double sys;
+  long maxrss;
+  long nvcsw;
+  long nivcsw;
+  int status;
+};
+
+static double tv_seconds(const struct timeval *tv)
+{
+  return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+static double now_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Run a command through the shell's launch path and measure it.
+ * External commands report the usage returned by wait4, builtins the
+ * difference in the usage of the shell itself and of any children it
+ * waited for.
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @param usage The measurement to fill in
+ */
+static void measure_command(struct shell *sh, char **argv, struct run_usage *usage)
+{
+  struct rusage self_before, self_after, child_before, child_after;
+
+  getrusage(RUSAGE_SELF, &self_before);
+  getrusage(RUSAGE_CHILDREN, &child_before);
+  double start = now_seconds();
+  usage->status = run_command(sh, argv, 0);
+  usage->real = now_seconds() - start;
+  getrusage(RUSAGE_SELF, &self_after);
+  getrusage(RUSAGE_CHILDREN, &child_after);
+
+  const struct rusage *ru = &sh->last_usage;
+  if (ru->ru_maxrss != 0)
+  {
+    usage->user = tv_seconds(&ru->ru_utime);
+    usage->sys = tv_seconds(&ru->ru_stime);
+    usage->maxrss = ru->ru_maxrss;
+    usage->nvcsw = ru->ru_nvcsw;
+    usage->nivcsw = ru->ru_nivcsw;
+  }
+  else
+  {
+    usage->user = tv_seconds(&self_after.ru_utime) - tv_seconds(&self_before.ru_utime) +
+                  tv_seconds(&child_after.ru_utime) - tv_seconds(&child_before.ru_utime);
+    usage->sys = tv_seconds(&self_after.ru_stime) - tv_seconds(&self_before.ru_stime) +
+                 tv_seconds(&child_after.ru_stime) - tv_seconds(&child_before.ru_stime);
+    usage->maxrss = self_after.ru_maxrss;
+    usage->nvcsw = self_after.ru_nvcsw - self_before.ru_nvcsw +
+                   child_after.ru_nvcsw - child_before.ru_nvcsw;
+    usage->nivcsw = self_after.ru_nivcsw - self_before.ru_nivcsw +
+                    child_after.ru_nivcsw - child_before.ru_nivcsw;
+  }
+}
+
+/**
+ * @brief Point stdout at /dev/null, or restore it.
+ *
+ * @param saved The saved stdout, -1 when nothing is saved
+ * @param quiet Non zero to silence stdout, zero to restore it
+ */
+static void quiet_stdout(int *saved, int quiet)
+{
+  fflush(stdout);
+  if (quiet && *saved < 0)
+  {
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null < 0)
+      return;
+    *saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+  else if (!quiet && *saved >= 0)
+  {
+    dup2(*saved, STDOUT_FILENO);
+    close(*saved);
+    *saved = -1;
+  }
+}
+
+/**
+ * @brief The time builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the timed command
+ */
+int builtin_time(struct shell *sh, char **argv)
+{
+  int json = 0;
+  int first = 1;
+  struct run_usage usage;
+
+  if (argv[first] != NULL && strcmp(argv[first], "-j") == 0)
+  {
+    json = 1;
+    first++;
+  }
+  if (argv[first] != NULL && strcmp(argv[first], "--") == 0)
+    first++;
+  if (argv[first] == NULL)
+  {
+    fprintf(stderr, "usage: time [-j] cmd [args...]\n");
+    return 1;
+  }
+
+  measure_command(sh, &argv[first], &usage);
+  if (json)
+  {
+    fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                    "\"vcsw\":%ld,\"ivcsw\":%ld,\"status\":%d}\n",
+            usage.real, usage.user, usage.sys, usage.maxrss,
+            usage.nvcsw, usage.nivcsw, usage.status);
+  }
+  else
+  {
+    fprintf(stderr, "real   %.3fs\nuser   %.3fs\nsys    %.3fs\nmaxrss %ldK\n"
+                    "csw    %ld voluntary, %ld involuntary\n",
+            usage.real, usage.user, usage.sys, usage.maxrss,
+            usage.nvcsw, usage.nivcsw);
+  }
+  return usage.status;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Compute summary statistics.
+ *
+ * @param samples The samples
+ * @param n The number of samples, must be at least one
+ * @param stats The statistics to fill in
+ */
+void bench_compute(double *samples, int n, struct bench_stats *stats)
+{
+  double sum = 0;
+  double sq = 0;
+
+  qsort(samples, n, sizeof(double), compare_double);
+  for (int i = 0; i < n; i++)
+    sum += samples[i];
+  stats->mean = sum / n;
+  for (int i = 0; i < n; i++)
+    sq += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+  stats->stddev = n > 1 ? sqrt(sq / (n - 1)) : 0.0;
+  stats->min = samples[0];
+  stats->max = samples[n - 1];
+  stats->p50 = samples[(int)ceil(0.50 * n) - 1];
+  stats->p99 = samples[(int)ceil(0.99 * n) - 1];
+}
+
+/**
+ * @brief The bench builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_bench(struct shell *sh, char **argv)
+{
+  long runs = 10;
+  long warmup = 0;
+  int json = 0;
+  int quiet = 0;
+  int i = 1;
+
+  for (; argv[i] != NULL && argv[i][0] == '-'; i++)
+  {
+    char *end;
+    if (strcmp(argv[i], "--") == 0)
+    {
+      i++;
+      break;
+    }
+    else if (strcmp(argv[i], "-j") == 0)
+      json = 1;
+    else if (strcmp(argv[i], "-q") == 0)
+      quiet = 1;
+    else if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-w") == 0) && argv[i + 1] != NULL)
+    {
+      long *val = argv[i][1] == 'n' ? &runs : &warmup;
+      *val = strtol(argv[i + 1], &end, 10);
+      if (*end != '\0' || *val < 0 || (val == &runs && *val == 0))
+      {
+        fprintf(stderr, "bench: bad count '%s'\n", argv[i + 1]);
+        return -1;
+      }
+      i++;
+    }
+    else
+      break;
+  }
+  if (argv[i] == NULL)
+  {
+    fprintf(stderr, "usage: bench [-n N] [-w WARMUP] [-q] [-j] cmd [args...]\n");
+    return -1;
+  }
+
+  double *samples = malloc(sizeof(double) * runs);
+  if (samples == NULL)
+  {
+    perror("malloc");
+    return -1;
+  }
+
+  int saved = -1;
+  int failures = 0;
+  double user = 0, sys = 0;
+  struct run_usage usage;
+
+  quiet_stdout(&saved, quiet);
+  for (long n = 0; n < warmup; n++)
+    measure_command(sh, &argv[i], &usage);
+  for (long n = 0; n < runs; n++)
+  {
+    measure_command(sh, &argv[i], &usage);
+    samples[n] = usage.real;
+    user += usage.user;
+    sys += usage.sys;
+    if (usage.status != 0)
+      failures++;
+  }
+  quiet_stdout(&saved, 0);
+
+  struct bench_stats stats;
+  bench_compute(samples, (int)runs, &stats);
+  if (json)
+  {
+    printf("{\"runs\":%ld,\"warmup\":%ld,\"failures\":%d,\"mean\":%.9f,\"stddev\":%.9f,"
+           "\"min\":%.9f,\"p50\":%.9f,\"p99\":%.9f,\"max\":%.9f,"
+           "\"user_mean\":%.9f,\"sys_mean\":%.9f}\n",
+           runs, warmup, failures, stats.mean, stats.stddev, stats.min,
+           stats.p50, stats.p99, stats.max, user / runs, sys / runs);
+  }
+  else
+  {
+    printf("runs %ld (warmup %ld, failures %d)\n", runs, warmup, failures);
+    printf("mean   %10.3f ms +- %.3f ms\n", stats.mean * 1e3, stats.stddev * 1e3);
+    printf("min    %10.3f ms\n", stats.min * 1e3);
+    printf("p50    %10.3f ms\n", stats.p50 * 1e3);
+    printf("p99    %10.3f ms\n", stats.p99 * 1e3);
+    printf("max    %10.3f ms\n", stats.max * 1e3);
+    printf("user   %10.3f ms  sys %.3f ms (mean)\n", user / runs * 1e3, sys / runs * 1e3);
+  }
+  free(samples);
+  return 0;
+}
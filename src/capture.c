@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define DEFAULT_CAPTURE_CAP (1024 * 1024)
+#define FOLLOW_POLL_MS 250
+
+static volatile sig_atomic_t follow_interrupted;
+
+static void follow_sigint(int sig)
+{
+  UNUSED(sig);
+  follow_interrupted = 1;
+}
+
+/**
+ * @brief Create the output buffer for a new background job.
+ *
+ * @param sh The shell
+ * @return The memfd or -1 if capture is off or the memfd could not be made
+ */
+int capture_open(struct shell *sh)
+{
+  if (!sh->capture)
+    return -1;
+
+  int fd = memfd_create("job-output", MFD_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("memfd_create");
+    return -1;
+  }
+  /* stdout and stderr share the description, append keeps them ordered */
+  fcntl(fd, F_SETFL, O_APPEND);
+  return fd;
+}
+
+/**
+ * @brief Discard captured output older than the byte cap.
+ *
+ * @param sh The shell
+ * @param bgp The job
+ */
+void capture_trim(struct shell *sh, struct bg_process *bgp)
+{
+  struct stat st;
+  size_t cap = sh->capture_cap ? sh->capture_cap : DEFAULT_CAPTURE_CAP;
+
+  if (bgp->out_fd < 0 || fstat(bgp->out_fd, &st) != 0)
+    return;
+  if ((size_t)(st.st_size - bgp->out_start) <= cap)
+    return;
+
+  /* Only whole pages are given back, the file offset keeps growing */
+  off_t start = st.st_size - (off_t)cap;
+  long page = sysconf(_SC_PAGESIZE);
+  off_t from = bgp->out_start & ~(off_t)(page - 1);
+  off_t to = start & ~(off_t)(page - 1);
+  if (to > from)
+    fallocate(bgp->out_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from);
+  bgp->out_start = start;
+}
+
+/**
+ * @brief Send captured output to stdout without copying it through the
+ * shell.
+ *
+ * @param sh The shell
+ * @param bgp The job
+ * @param offset The offset to start from, advanced past what was sent
+ * @param end The offset to stop at
+ * @return 0 on success, -1 on error
+ */
+static int capture_send(struct shell *sh, struct bg_process *bgp, off_t *offset, off_t end)
+{
+  fflush(stdout);
+  int out = shell_output_fd(sh, STDOUT_FILENO);
+  while (*offset < end)
+  {
+    ssize_t n = sendfile(out, bgp->out_fd, offset, (size_t)(end - *offset));
+    if (n < 0)
+    {
+      if (errno == EINTR || errno == EAGAIN)
+        continue;
+      perror("sendfile");
+      return -1;
+    }
+    if (n == 0)
+      break;
+  }
+  return 0;
+}
+
+/**
+ * @brief Follow the output of a job until it finishes or SIGINT.
+ *
+ * @param sh The shell
+ * @param bgp The job
+ * @return 0 on success, -1 on error
+ */
+static int capture_follow(struct shell *sh, struct bg_process *bgp)
+{
+  char path[64];
+  int job_id = bgp->job_id;
+  off_t offset = bgp->out_start;
+
+  /* The memfd inode can be watched through its /proc/self/fd link */
+  int ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (ifd >= 0)
+  {
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", bgp->out_fd);
+    if (inotify_add_watch(ifd, path, IN_MODIFY) < 0)
+    {
+      close(ifd);
+      ifd = -1;
+    }
+  }
+
+  struct sigaction sa = {0}, old;
+  sa.sa_handler = follow_sigint;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old);
+  follow_interrupted = 0;
+
+  int rval = 0;
+  while (!follow_interrupted)
+  {
+    struct stat st;
+    char spec[16];
+
+    update_jobs(sh);
+    snprintf(spec, sizeof(spec), "%d", job_id);
+    bgp = job_find(sh, spec);
+    if (bgp == NULL || fstat(bgp->out_fd, &st) != 0)
+      break;
+    capture_trim(sh, bgp);
+    if (offset < bgp->out_start)
+      offset = bgp->out_start;
+    if (capture_send(sh, bgp, &offset, st.st_size) != 0)
+    {
+      rval = -1;
+      break;
+    }
+    if (job_finished(bgp) && offset >= st.st_size)
+      break;
+
+    struct pollfd pfd = {ifd, POLLIN, 0};
+    if (poll(&pfd, ifd >= 0 ? 1 : 0, FOLLOW_POLL_MS) > 0)
+    {
+      char buf[4096];
+      while (read(ifd, buf, sizeof(buf)) > 0)
+      {
+      }
+    }
+  }
+  sigaction(SIGINT, &old, NULL);
+  if (ifd >= 0)
+    close(ifd);
+  return rval;
+}
+
+/**
+ * @brief Dump or follow the captured output of a job.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments, "jobs -o ID" or "jobs -f ID"
+ * @return 0 on success, -1 on error
+ */
+int job_output(struct shell *sh, char **argv)
+{
+  if (argv[2] == NULL || argv[3] != NULL)
+  {
+    fprintf(stderr, "usage: jobs -o|-f JOB\n");
+    return -1;
+  }
+
+  update_jobs(sh);
+  struct bg_process *bgp = job_find(sh, argv[2]);
+  if (bgp == NULL)
+  {
+    fprintf(stderr, "jobs: %s: no such job\n", argv[2]);
+    return -1;
+  }
+  if (bgp->out_fd < 0)
+  {
+    fprintf(stderr, "jobs: %s: output was not captured\n", argv[2]);
+    return -1;
+  }
+
+  if (strcmp(argv[1], "-f") == 0)
+    return capture_follow(sh, bgp);
+
+  struct stat st;
+  if (fstat(bgp->out_fd, &st) != 0)
+  {
+    perror("fstat");
+    return -1;
+  }
+  capture_trim(sh, bgp);
+  off_t offset = bgp->out_start;
+  return capture_send(sh, bgp, &offset, st.st_size);
+}
+
+/**
+ * @brief The capture builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_capture(struct shell *sh, char **argv)
+{
+  if (argv[1] == NULL)
+  {
+    printf("capture %s, cap %zu bytes\n", sh->capture ? "on" : "off",
+           sh->capture_cap ? sh->capture_cap : (size_t)DEFAULT_CAPTURE_CAP);
+    return 0;
+  }
+
+  for (int i = 1; argv[i] != NULL; i++)
+  {
+    if (strcmp(argv[i], "on") == 0)
+      sh->capture = 1;
+    else if (strcmp(argv[i], "off") == 0)
+      sh->capture = 0;
+    else if (strcmp(argv[i], "-c") == 0 && argv[i + 1] != NULL)
+    {
+      char *end;
+      unsigned long long cap = strtoull(argv[++i], &end, 10);
+      if (*end == 'K' || *end == 'k')
+        cap <<= 10, end++;
+      else if (*end == 'M' || *end == 'm')
+        cap <<= 20, end++;
+      else if (*end == 'G' || *end == 'g')
+        cap <<= 30, end++;
+      if (*end != '\0' || cap == 0)
+      {
+        fprintf(stderr, "capture: bad size '%s'\n", argv[i]);
+        return -1;
+      }
+      sh->capture_cap = (size_t)cap;
+    }
+    else
+    {
+      fprintf(stderr, "usage: capture [on|off] [-c BYTES[K|M|G]]\n");
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,409 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+/* Builtins print through stdout and cd moves the whole process */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief The state an embedded shell keeps apart from the process.
+ */
+struct shell_io
+{
+  shell_output_fn output;
+  void *arg;
+  pthread_mutex_t lock;   /* one call of output at a time */
+  pthread_cond_t drained; /* signaled after each chunk read from a pipe */
+
+  FILE *out; /* stdout and stderr of builtins while the shell runs */
+  FILE *err;
+  FILE *saved_out; /* the process's own, put back after the run */
+  FILE *saved_err;
+
+  int out_pipe[2]; /* stdout and stderr of children */
+  int err_pipe[2];
+  int stop_pipe[2]; /* wakes the drain thread to end it */
+  pthread_t drain;
+  int draining;
+
+  int cwd_fd; /* the working directory of the shell */
+};
+
+/**
+ * @brief Pass output to the callback.
+ *
+ * @param io The embedded state
+ * @param fd 1 for stdout, 2 for stderr
+ * @param data The output
+ * @param len The length of the output
+ */
+static void io_emit(struct shell_io *io, int fd, const char *data, size_t len)
+{
+  pthread_mutex_lock(&io->lock);
+  io->output(io->arg, fd, data, len);
+  pthread_mutex_unlock(&io->lock);
+}
+
+static ssize_t io_write_out(void *cookie, const char *data, size_t len)
+{
+  io_emit(cookie, 1, data, len);
+  return (ssize_t)len;
+}
+
+static ssize_t io_write_err(void *cookie, const char *data, size_t len)
+{
+  io_emit(cookie, 2, data, len);
+  return (ssize_t)len;
+}
+
+/**
+ * @brief Pass what the children wrote to the callback until the shell is
+ * freed. Reads happen under the output lock so the end of a run can tell
+ * that nothing is left in flight.
+ *
+ * @param arg The embedded state
+ * @return NULL
+ */
+static void *io_drain(void *arg)
+{
+  struct shell_io *io = arg;
+  struct pollfd fds[3] = {
+      {io->out_pipe[0], POLLIN, 0},
+      {io->err_pipe[0], POLLIN, 0},
+      {io->stop_pipe[0], POLLIN, 0},
+  };
+  char chunk[65536];
+
+  for (;;)
+  {
+    if (poll(fds, 3, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[2].revents != 0)
+      break;
+    for (int i = 0; i < 2; i++)
+    {
+      if (fds[i].revents == 0)
+        continue;
+      pthread_mutex_lock(&io->lock);
+      ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+      if (n > 0)
+        io->output(io->arg, i + 1, chunk, (size_t)n);
+      pthread_cond_broadcast(&io->drained);
+      pthread_mutex_unlock(&io->lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Wait until the drain thread has passed on everything the
+ * children wrote so far.
+ *
+ * @param io The embedded state
+ */
+static void io_settle(struct shell_io *io)
+{
+  pthread_mutex_lock(&io->lock);
+  for (;;)
+  {
+    int out = 0;
+    int err = 0;
+    ioctl(io->out_pipe[0], FIONREAD, &out);
+    ioctl(io->err_pipe[0], FIONREAD, &err);
+    if (out == 0 && err == 0)
+      break;
+    pthread_cond_wait(&io->drained, &io->lock);
+  }
+  pthread_mutex_unlock(&io->lock);
+}
+
+/**
+ * @brief Close the descriptors of the embedded state that are open.
+ *
+ * @param io The embedded state
+ */
+static void io_close(struct shell_io *io)
+{
+  int *fds[] = {io->out_pipe, io->err_pipe, io->stop_pipe};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+  {
+    for (int j = 0; j < 2; j++)
+    {
+      if (fds[i][j] >= 0)
+        close(fds[i][j]);
+    }
+  }
+  if (io->cwd_fd >= 0)
+    close(io->cwd_fd);
+  if (io->out != NULL)
+    fclose(io->out);
+  if (io->err != NULL)
+    fclose(io->err);
+}
+
+/**
+ * @brief Set up the output capture of an embedded shell.
+ *
+ * @param io The embedded state
+ * @return 0 on success, -1 on error
+ */
+static int io_open(struct shell_io *io)
+{
+  cookie_io_functions_t out_funcs = {.write = io_write_out};
+  cookie_io_functions_t err_funcs = {.write = io_write_err};
+
+  if (pipe2(io->out_pipe, O_CLOEXEC) != 0 || pipe2(io->err_pipe, O_CLOEXEC) != 0 ||
+      pipe2(io->stop_pipe, O_CLOEXEC) != 0)
+    return -1;
+  /* Only the drain thread reads, and only what poll said is there */
+  fcntl(io->out_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(io->err_pipe[0], F_SETFL, O_NONBLOCK);
+  io->out = fopencookie(io, "w", out_funcs);
+  io->err = fopencookie(io, "w", err_funcs);
+  if (io->out == NULL || io->err == NULL)
+    return -1;
+  setvbuf(io->err, NULL, _IONBF, 0);
+  if (pthread_create(&io->drain, NULL, io_drain, io) != 0)
+    return -1;
+  io->draining = 1;
+  return 0;
+}
+
+/**
+ * @brief Make a non-interactive shell to run commands inside another
+ * program. Every shell has its own variables, functions, jobs and
+ * working directory, and only waits for its own children. Calls on
+ * different shells may come from different threads, they take turns
+ * running because builtins print through the process-wide stdout, and
+ * while a shell with an output callback runs, whatever else the program
+ * prints to stdout goes to that callback too.
+ *
+ * @param output Receives stdout and stderr, NULL to leave them on the
+ * process's own. It is never called twice at once, but output of
+ * background jobs may arrive from a helper thread between runs. It
+ * must not run commands in a shell itself.
+ * @param arg Passed to output
+ * @return The shell or NULL if out of memory
+ */
+struct shell *shell_new(shell_output_fn output, void *arg)
+{
+  struct shell *sh = calloc(1, sizeof(*sh));
+  struct shell_io *io = calloc(1, sizeof(*io));
+  if (sh == NULL || io == NULL)
+  {
+    free(sh);
+    free(io);
+    return NULL;
+  }
+  io->output = output;
+  io->arg = arg;
+  pthread_mutex_init(&io->lock, NULL);
+  pthread_cond_init(&io->drained, NULL);
+  io->out_pipe[0] = io->out_pipe[1] = -1;
+  io->err_pipe[0] = io->err_pipe[1] = -1;
+  io->stop_pipe[0] = io->stop_pipe[1] = -1;
+  io->cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (io->cwd_fd < 0 || (output != NULL && io_open(io) != 0))
+  {
+    io_close(io);
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->drained);
+    free(io);
+    free(sh);
+    return NULL;
+  }
+
+  sh_init_state(sh);
+  sh->io = io;
+  return sh;
+}
+
+/**
+ * @brief Switch the process to the shell: its working directory and, if
+ * its output is captured, its stdout and stderr.
+ *
+ * @param sh The shell
+ * @return The working directory of the process, to be given to
+ * io_leave, or -1 if it could not be opened
+ */
+static int io_enter(struct shell *sh)
+{
+  struct shell_io *io = sh->io;
+
+  pthread_mutex_lock(&run_lock);
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fchdir(io->cwd_fd) != 0)
+    perror("shell: cd");
+  if (io->output != NULL)
+  {
+    fflush(stdout);
+    io->saved_out = stdout;
+    io->saved_err = stderr;
+    stdout = io->out;
+    stderr = io->err;
+  }
+  return cwd;
+}
+
+/**
+ * @brief Switch the process back after a run and keep where the shell
+ * moved to.
+ *
+ * @param sh The shell
+ * @param cwd The working directory returned by io_enter
+ */
+static void io_leave(struct shell *sh, int cwd)
+{
+  struct shell_io *io = sh->io;
+
+  if (io->output != NULL)
+  {
+    fflush(stdout);
+    stdout = io->saved_out;
+    stderr = io->saved_err;
+    io_settle(io);
+  }
+  int now = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (now >= 0)
+  {
+    close(io->cwd_fd);
+    io->cwd_fd = now;
+  }
+  if (cwd >= 0)
+  {
+    if (fchdir(cwd) != 0)
+      perror("shell: cd");
+    close(cwd);
+  }
+  pthread_mutex_unlock(&run_lock);
+}
+
+/**
+ * @brief Run one command line or a snippet of several lines. All output
+ * of the foreground commands has been passed to the output callback
+ * when this returns.
+ *
+ * @param sh The shell
+ * @param line The commands
+ * @return The exit status, 2 if the commands could not be parsed
+ */
+int shell_run_line(struct shell *sh, const char *line)
+{
+  if (sh->exiting)
+    return sh->last_status;
+
+  int cwd = io_enter(sh);
+  /* Without a way to read more lines every parsed snippet is complete */
+  struct ast *tree = line_cache_get(&sh->lines, line);
+  if (tree == NULL && (tree = ast_parse(line, NULL, NULL)) != NULL)
+    line_cache_put(&sh->lines, line, tree);
+  if (tree != NULL)
+  {
+    exec_tree(sh, tree);
+    ast_release(tree);
+  }
+  else
+    sh->last_status = 2;
+  update_jobs(sh);
+  io_leave(sh, cwd);
+  return sh->last_status;
+}
+
+/**
+ * @brief Run a script file in the shell, as the source builtin does.
+ *
+ * @param sh The shell
+ * @param path The script
+ * @param args The positional parameters or NULL to keep the current ones
+ * @return The exit status
+ */
+int shell_run_script(struct shell *sh, const char *path, char **args)
+{
+  if (sh->exiting)
+    return sh->last_status;
+
+  int cwd = io_enter(sh);
+  source_file(sh, path, args);
+  update_jobs(sh);
+  io_leave(sh, cwd);
+  return sh->last_status;
+}
+
+/**
+ * @brief Free a shell made by shell_new. Background jobs keep running
+ * but are no longer waited for.
+ *
+ * @param sh The shell, may be NULL
+ */
+void shell_free(struct shell *sh)
+{
+  if (sh == NULL)
+    return;
+  struct shell_io *io = sh->io;
+
+  pthread_mutex_lock(&run_lock);
+  sh_destroy(sh);
+  pthread_mutex_unlock(&run_lock);
+  if (io->draining)
+  {
+    while (write(io->stop_pipe[1], "", 1) < 0 && errno == EINTR)
+    {
+    }
+    pthread_join(io->drain, NULL);
+  }
+  io_close(io);
+  pthread_mutex_destroy(&io->lock);
+  pthread_cond_destroy(&io->drained);
+  free(io);
+  free(sh);
+}
+
+/**
+ * @brief Point stdout and stderr of a newly forked child at the output
+ * of its embedded shell. Does nothing for the process's own shell.
+ *
+ * @param sh The shell
+ */
+void shell_child_io(struct shell *sh)
+{
+  struct shell_io *io = sh->io;
+  if (io == NULL || io->output == NULL || io->saved_out == NULL)
+    return;
+  dup2(io->out_pipe[1], STDOUT_FILENO);
+  dup2(io->err_pipe[1], STDERR_FILENO);
+  /* The callback lives in the parent, the child writes to the pipes */
+  stdout = io->saved_out;
+  stderr = io->saved_err;
+  /* Its own children inherit the pipes or whatever it redirects to */
+  io->output = NULL;
+}
+
+/**
+ * @brief The descriptor that output written straight to stdout or
+ * stderr, not through the streams, should go to while a command runs.
+ *
+ * @param sh The shell
+ * @param fd STDOUT_FILENO or STDERR_FILENO
+ * @return The write end of the matching output pipe of an embedded
+ * shell, fd itself otherwise
+ */
+int shell_output_fd(struct shell *sh, int fd)
+{
+  struct shell_io *io = sh->io;
+  if (io == NULL || io->output == NULL || io->saved_out == NULL)
+    return fd;
+  /* The drain thread passes it on after what the streams already sent */
+  fflush(stdout);
+  return fd == STDERR_FILENO ? io->err_pipe[1] : io->out_pipe[1];
+}
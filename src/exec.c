@@ -0,0 +1,1029 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/* Deeper recursion would run out of C stack before it ran out of memory */
+#define FUNC_MAX_DEPTH 1000
+
+static void exec_node(struct shell *sh, struct ast *t, uint32_t n);
+static void exec_compound(struct shell *sh, struct ast *t, uint32_t n);
+
+/**
+ * @brief Hash a function name into a bucket.
+ *
+ * @param name The name
+ * @return The bucket
+ */
+static unsigned func_bucket(const char *name)
+{
+  uint32_t h = 2166136261u;
+  for (; *name != '\0'; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h % FUNC_BUCKETS;
+}
+
+/**
+ * @brief Find a shell function.
+ *
+ * @param sh The shell
+ * @param name The name of the function
+ * @return The function or NULL
+ */
+struct func *func_find(struct shell *sh, const char *name)
+{
+  for (struct func *f = sh->funcs[func_bucket(name)]; f != NULL; f = f->next)
+  {
+    if (strcmp(f->name, name) == 0)
+      return f;
+  }
+  return NULL;
+}
+
+/**
+ * @brief Define or redefine a shell function. The function keeps a
+ * reference to the tree its body is in.
+ *
+ * @param sh The shell
+ * @param name The name of the function
+ * @param t The tree
+ * @param body The body of the function
+ * @return 0 on success, -1 if out of memory
+ */
+int func_define(struct shell *sh, const char *name, struct ast *t, uint32_t body)
+{
+  struct func *f = func_find(sh, name);
+  if (f == NULL)
+  {
+    f = calloc(1, sizeof(*f));
+    if (f == NULL || (f->name = strdup(name)) == NULL)
+    {
+      free(f);
+      return -1;
+    }
+    unsigned b = func_bucket(name);
+    f->next = sh->funcs[b];
+    sh->funcs[b] = f;
+  }
+  else
+    ast_release(f->tree);
+  f->tree = ast_ref(t);
+  f->body = body;
+  return 0;
+}
+
+/**
+ * @brief Call a shell function with argv[1]... as the positional
+ * parameters.
+ *
+ * @param sh The shell
+ * @param f The function
+ * @param argv The command
+ * @return The exit status of the function
+ */
+int func_call(struct shell *sh, struct func *f, char **argv)
+{
+  if (sh->func_depth >= FUNC_MAX_DEPTH)
+  {
+    fprintf(stderr, "%s: maximum function nesting exceeded\n", argv[0]);
+    return sh->last_status = 1;
+  }
+
+  /* The function may redefine itself while it runs */
+  struct ast *t = ast_ref(f->tree);
+  char **args = sh->args;
+  int nargs = sh->nargs;
+  int loop_depth = sh->loop_depth;
+
+  sh->args = argv + 1;
+  for (sh->nargs = 0; sh->args[sh->nargs] != NULL; sh->nargs++)
+  {
+  }
+  sh->loop_depth = 0;
+  sh->func_depth++;
+  exec_node(sh, t, f->body);
+  sh->func_depth--;
+  sh->returning = 0;
+  sh->breaking = 0;
+  sh->continuing = 0;
+  sh->loop_depth = loop_depth;
+  sh->args = args;
+  sh->nargs = nargs;
+  ast_release(t);
+  return sh->last_status;
+}
+
+/**
+ * @brief Remove every shell function.
+ *
+ * @param sh The shell
+ */
+static void func_clear(struct shell *sh)
+{
+  for (int i = 0; i < FUNC_BUCKETS; i++)
+  {
+    while (sh->funcs[i] != NULL)
+    {
+      struct func *f = sh->funcs[i];
+      sh->funcs[i] = f->next;
+      ast_release(f->tree);
+      free(f->name);
+      free(f);
+    }
+  }
+}
+
+/**
+ * @brief Take the expansion buffers of the next nesting level. Each level
+ * keeps its buffers, so a loop reuses them on every iteration.
+ *
+ * @param sh The shell
+ * @return The expansion or NULL if out of memory
+ */
+static struct expansion *exp_push(struct shell *sh)
+{
+  if (sh->exp_depth == sh->exp_cap)
+  {
+    size_t cap = sh->exp_cap ? sh->exp_cap * 2 : 8;
+    struct expansion **exps = realloc(sh->exps, cap * sizeof(*exps));
+    if (exps == NULL)
+      return NULL;
+    memset(exps + sh->exp_cap, 0, (cap - sh->exp_cap) * sizeof(*exps));
+    sh->exps = exps;
+    sh->exp_cap = cap;
+  }
+  if (sh->exps[sh->exp_depth] == NULL)
+  {
+    sh->exps[sh->exp_depth] = calloc(1, sizeof(struct expansion));
+    if (sh->exps[sh->exp_depth] == NULL)
+      return NULL;
+  }
+  return sh->exps[sh->exp_depth++];
+}
+
+static void exp_pop(struct shell *sh, struct expansion *ex)
+{
+  procsubst_reap(sh, ex);
+  sh->exp_depth--;
+}
+
+/**
+ * @brief Free the functions and expansion buffers of the shell.
+ *
+ * @param sh The shell
+ */
+void exec_free(struct shell *sh)
+{
+  for (size_t i = 0; i < sh->exp_cap; i++)
+  {
+    if (sh->exps[i] != NULL)
+      expansion_free(sh->exps[i]);
+    free(sh->exps[i]);
+  }
+  free(sh->exps);
+  sh->exps = NULL;
+  sh->exp_cap = 0;
+  sh->exp_depth = 0;
+  func_clear(sh);
+}
+
+/**
+ * @brief Check if a break, continue or return is unwinding.
+ *
+ * @param sh The shell
+ * @return Non zero if the rest of a list must be skipped
+ */
+static int jumping(const struct shell *sh)
+{
+  return sh->breaking || sh->continuing || sh->returning || sh->exiting;
+}
+
+/**
+ * @brief Account for a break or continue at the end of one loop iteration.
+ *
+ * @param sh The shell
+ * @return Non zero if the loop must stop
+ */
+static int loop_jump(struct shell *sh)
+{
+  if (sh->breaking > 0)
+  {
+    sh->breaking--;
+    return 1;
+  }
+  if (sh->continuing > 0)
+    return --sh->continuing > 0;
+  return sh->returning || sh->exiting || sh->last_status == 128 + SIGINT;
+}
+
+/**
+ * @brief Point the words of a node at the string table.
+ *
+ * @param t The tree
+ * @param first The first word
+ * @param count The number of words
+ * @param words Room for count + 1 words
+ */
+static void node_words(struct ast *t, uint32_t first, uint32_t count, char **words)
+{
+  for (uint32_t i = 0; i < count; i++)
+    words[i] = t->strings + t->words[first + i];
+  words[count] = NULL;
+}
+
+/**
+ * @brief Run a simple command. The words were split once by the parser and
+ * are only expanded here.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param node The command
+ */
+static void exec_simple(struct shell *sh, struct ast *t, const struct ast_node *node)
+{
+  char *words[node->b + 1];
+  node_words(t, node->a, node->b, words);
+
+  struct expansion *ex = exp_push(sh);
+  if (ex == NULL)
+  {
+    sh->last_status = 1;
+    return;
+  }
+  int here_fd = sh->here_fd;
+  int ok = 1;
+  if (node->flags & AST_HERE)
+  {
+    int fd = heredoc_open(sh, t->strings + node->c, node->flags & AST_HERE_STRING,
+                          node->flags & AST_HERE_QUOTED);
+    ok = fd >= 0;
+    sh->here_fd = ok ? fd : 0;
+  }
+  if (ok && expand_words(sh, words, ex) == 0)
+    run_command(sh, ex->argv, node->flags & AST_BACKGROUND);
+  else
+    sh->last_status = 1;
+  if (node->flags & AST_HERE)
+  {
+    heredoc_done(sh);
+    sh->here_fd = here_fd;
+  }
+  exp_pop(sh, ex);
+}
+
+/**
+ * @brief Run a while or until loop.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param node The loop
+ */
+static void exec_while(struct shell *sh, struct ast *t, const struct ast_node *node)
+{
+  int status = 0;
+
+  sh->loop_depth++;
+  for (;;)
+  {
+    exec_node(sh, t, node->a);
+    if (jumping(sh) && loop_jump(sh))
+      break;
+    if ((sh->last_status == 0) != (node->kind == AST_WHILE))
+      break;
+    exec_node(sh, t, node->b);
+    status = sh->last_status;
+    if (loop_jump(sh))
+      break;
+  }
+  sh->loop_depth--;
+  sh->last_status = status;
+}
+
+/**
+ * @brief Run a for loop. The words are expanded once before the first
+ * iteration.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param node The loop
+ */
+static void exec_for(struct shell *sh, struct ast *t, const struct ast_node *node)
+{
+  struct expansion *ex = exp_push(sh);
+  char **items = sh->args;
+  size_t count = (size_t)sh->nargs;
+
+  if (ex == NULL)
+  {
+    sh->last_status = 1;
+    return;
+  }
+  if (node->flags & AST_FOR_IN)
+  {
+    char *words[node->d + 1];
+    node_words(t, node->c, node->d, words);
+    if (expand_words(sh, words, ex) != 0)
+    {
+      sh->last_status = 1;
+      exp_pop(sh, ex);
+      return;
+    }
+    items = ex->argv;
+    count = ex->argc;
+  }
+
+  const char *name = t->strings + node->a;
+  int status = 0;
+  sh->loop_depth++;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (var_set(&sh->vars, name, items[i], 0) != 0)
+    {
+      fprintf(stderr, "%s: cannot assign\n", name);
+      status = 1;
+      break;
+    }
+    exec_node(sh, t, node->b);
+    status = sh->last_status;
+    if (loop_jump(sh))
+      break;
+  }
+  sh->loop_depth--;
+  sh->last_status = status;
+  exp_pop(sh, ex);
+}
+
+/**
+ * @brief Expand a case word or pattern to one string. The fields of the
+ * expansion are back to back, so they are joined in place.
+ *
+ * @param sh The shell
+ * @param word The word
+ * @param ex The expansion
+ * @return The string or NULL after an error
+ */
+static char *case_word(struct shell *sh, char *word, struct expansion *ex)
+{
+  char *words[] = {word, NULL};
+
+  ex->pattern = 1;
+  int rval = expand_words(sh, words, ex);
+  ex->pattern = 0;
+  if (rval != 0)
+    return NULL;
+  if (ex->argc == 0)
+    return "";
+  for (size_t i = 0; i + 1 < ex->argc; i++)
+    ex->argv[i][strlen(ex->argv[i])] = ' ';
+  return ex->argv[0];
+}
+
+/**
+ * @brief Run the first item of a case command whose pattern matches.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param node The case command
+ */
+static void exec_case(struct shell *sh, struct ast *t, const struct ast_node *node)
+{
+  struct expansion *subject_ex = exp_push(sh);
+  struct expansion *pattern_ex = subject_ex ? exp_push(sh) : NULL;
+  char *subject = pattern_ex ? case_word(sh, t->strings + node->a, subject_ex) : NULL;
+
+  sh->last_status = subject == NULL ? 1 : 0;
+  if (subject != NULL)
+    subject[glob_unescape(subject, strlen(subject))] = '\0';
+
+  for (uint32_t i = node->b; subject != NULL && i != 0; i = t->nodes[i].next)
+  {
+    const struct ast_node *item = &t->nodes[i];
+    int match = 0;
+    for (uint32_t k = 0; k < item->b && !match; k++)
+    {
+      char *pattern = case_word(sh, t->strings + t->words[item->a + k], pattern_ex);
+      if (pattern == NULL)
+      {
+        sh->last_status = 1;
+        subject = NULL;
+        break;
+      }
+      match = glob_match(pattern, strlen(pattern), subject);
+    }
+    if (match)
+    {
+      if (item->c != 0)
+        exec_node(sh, t, item->c);
+      break;
+    }
+  }
+  if (pattern_ex != NULL)
+    exp_pop(sh, pattern_ex);
+  if (subject_ex != NULL)
+    exp_pop(sh, subject_ex);
+}
+
+/**
+ * @brief Convert a wait status to an exit status.
+ *
+ * @param status The wait status
+ * @return The exit status
+ */
+int exit_status(int status)
+{
+  if (WIFEXITED(status))
+    return WEXITSTATUS(status);
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return 1;
+}
+
+/**
+ * @brief A builtin stage of a pipeline. The shell prints the output of
+ * the builtin to memory and a worker thread writes it to the pipe, so
+ * the shell goes on starting the other stages instead of blocking on a
+ * reader that has not started yet.
+ */
+struct pipe_writer
+{
+  int fd;
+  char *data;
+  size_t len;
+  struct pipe_writer *next;
+};
+
+/* Writers still running, their pipes must not leak into forked shells */
+static struct pipe_writer *writers;
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Fork the shell. Every copy of the shell is made here: the child
+ * closes the pipes of running writers, which only an exec would close
+ * otherwise, so their readers see the end, and never inherits the lock
+ * of the writers held by one of their threads. It also gets the output
+ * of its embedded shell.
+ *
+ * @param sh The shell
+ * @return The pid as returned by fork
+ */
+pid_t shell_fork(struct shell *sh)
+{
+  fflush(stdout);
+  pthread_mutex_lock(&writers_lock);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    for (struct pipe_writer *w = writers; w != NULL; w = w->next)
+      close(w->fd);
+    writers = NULL;
+    pthread_mutex_init(&writers_lock, NULL);
+    shell_child_io(sh);
+    return 0;
+  }
+  pthread_mutex_unlock(&writers_lock);
+  return pid;
+}
+
+static void *pipe_write(void *arg)
+{
+  struct pipe_writer *w = arg;
+
+  for (size_t done = 0; done < w->len;)
+  {
+    ssize_t n = write(w->fd, w->data + done, w->len - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break; /* the reader is gone */
+    done += (size_t)n;
+  }
+
+  pthread_mutex_lock(&writers_lock);
+  struct pipe_writer **pp = &writers;
+  while (*pp != w)
+    pp = &(*pp)->next;
+  *pp = w->next;
+  close(w->fd);
+  pthread_mutex_unlock(&writers_lock);
+  free(w->data);
+  free(w);
+  return NULL;
+}
+
+/**
+ * @brief Write the output of a builtin into a pipe on a detached thread.
+ *
+ * @param fd The write end of the pipe, closed when the output is written
+ * @param data The output, freed when it is written
+ * @param len The length of the output
+ * @return 0 on success, -1 on error with nothing freed or closed
+ */
+static int pipe_writer_start(int fd, char *data, size_t len)
+{
+  struct pipe_writer *w = malloc(sizeof(*w));
+  if (w == NULL)
+    return -1;
+  w->fd = fd;
+  w->data = data;
+  w->len = len;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  /* A write to a closed pipe fails with EPIPE instead of killing the shell */
+  sigset_t pipe_set, old;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+
+  pthread_mutex_lock(&writers_lock);
+  w->next = writers;
+  writers = w;
+  pthread_t tid;
+  int rval = pthread_create(&tid, &attr, pipe_write, w);
+  if (rval != 0)
+    writers = w->next;
+  pthread_mutex_unlock(&writers_lock);
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  pthread_attr_destroy(&attr);
+  if (rval != 0)
+  {
+    free(w);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Start one forked stage of a pipeline.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param n The stage
+ * @param argv The expanded words of a simple stage or NULL
+ * @param in The read end of the previous pipe or -1
+ * @param out The pipe to the next stage, both ends -1 for the last stage
+ * @param pgid The process group of the pipeline, 0 for the first stage
+ * @return The child or -1 if the fork failed
+ */
+static pid_t pipe_spawn(struct shell *sh, struct ast *t, uint32_t n, char **argv, int in,
+                        const int out[2], pid_t pgid)
+{
+  char **envp = argv != NULL ? var_envp(&sh->vars) : NULL;
+  pid_t pid = shell_fork(sh);
+
+  if (pid < 0)
+  {
+    perror("fork");
+    return -1;
+  }
+  if (pid > 0)
+  {
+    if (sh->shell_is_interactive)
+    {
+      setpgid(pid, pgid ? pgid : pid);
+      if (pgid == 0)
+        tcsetpgrp(sh->shell_terminal, pid);
+    }
+    return pid;
+  }
+
+  if (sh->shell_is_interactive)
+  {
+    setpgid(0, pgid);
+    if (pgid == 0)
+      tcsetpgrp(sh->shell_terminal, getpid());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+  }
+  if (in >= 0)
+  {
+    dup2(in, STDIN_FILENO);
+    close(in);
+  }
+  if (out[1] >= 0)
+  {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+  }
+  if (argv != NULL && !is_builtin(argv[0]) && func_find(sh, argv[0]) == NULL &&
+      var_assignment(argv[0]) == 0)
+  {
+    if (envp != NULL)
+      environ = envp;
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  /* Other builtins and compound commands change this copy of the shell */
+  sh->shell_is_interactive = 0;
+  if (argv != NULL)
+    run_command(sh, argv, 0);
+  else
+    exec_compound(sh, t, n);
+  fflush(stdout);
+  _exit(sh->last_status);
+}
+
+/**
+ * @brief Keep a stopped pipeline as a job so fg and bg can resume it.
+ *
+ * @param sh The shell
+ * @param pids The forked stages, 0 for the ones already reaped
+ * @param npids The number of forked stages
+ * @param pgid The process group of the pipeline
+ * @param desc The command to show
+ */
+static void pipe_stopped(struct shell *sh, pid_t *pids, int npids, pid_t pgid, char **desc)
+{
+  /* The last stage leads, its exit status is the one of the pipeline */
+  int lead = npids - 1;
+  while (lead > 0 && pids[lead] == 0)
+    lead--;
+  struct bg_process *bgp = job_add(sh, pids[lead], desc);
+  if (bgp == NULL)
+    return;
+  bgp->pgid = pgid;
+  bgp->state = JOB_STOPPED;
+  for (int i = 0; i < npids; i++)
+  {
+    if (i != lead && pids[i] != 0)
+      job_track(bgp, pids[i]);
+  }
+  printf("\n[%d] %d Stopped %s\n", bgp->job_id, pids[lead], bgp->command);
+}
+
+/**
+ * @brief Run a pipeline. Builtins that only print run inside the shell,
+ * with a thread writing their output into the pipe; the last stage prints
+ * straight to the terminal. Every other stage is forked.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param node The pipeline
+ */
+static void exec_pipeline(struct shell *sh, struct ast *t, const struct ast_node *node)
+{
+  uint32_t count = node->b;
+  pid_t pids[count];
+  struct expansion *exps[count];
+  char *desc[2 * count];
+  int npids = 0;
+  int nexps = 0;
+  pid_t pgid = 0;
+  int in = -1;
+  int status = 0;
+  int waited = 0; /* the last stage ran in the shell */
+
+  uint32_t n = node->a;
+  for (uint32_t i = 0; i < count; i++, n = t->nodes[n].next)
+  {
+    const struct ast_node *stage = &t->nodes[n];
+    int last = i + 1 == count;
+    int out[2] = {-1, -1};
+    if (!last && pipe2(out, O_CLOEXEC) != 0)
+    {
+      perror("pipe");
+      status = 1;
+      break;
+    }
+
+    /* A here-document is only opened in the stage's own process */
+    char **argv = NULL;
+    if (stage->kind == AST_SIMPLE && !(stage->flags & AST_HERE))
+    {
+      char *words[stage->b + 1];
+      node_words(t, stage->a, stage->b, words);
+      struct expansion *ex = exp_push(sh);
+      if (ex != NULL)
+      {
+        exps[nexps++] = ex;
+        if (expand_words(sh, words, ex) == 0 && ex->argc > 0)
+          argv = ex->argv;
+      }
+    }
+    desc[2 * i] = argv != NULL ? argv[0] : "(...)";
+    desc[2 * i + 1] = last ? NULL : "|";
+
+    if (argv != NULL && builtin_pure(sh, argv))
+    {
+      if (last)
+      {
+        close(in);
+        in = -1;
+        status = run_command(sh, argv, 0);
+        waited = 1;
+      }
+      else
+      {
+        size_t len;
+        char *data = builtin_render(sh, argv, &len);
+        if (data != NULL && pipe_writer_start(out[1], data, len) == 0)
+          out[1] = -1;
+        else
+          free(data);
+      }
+    }
+    else if (stage->kind != AST_SIMPLE || argv != NULL || (stage->flags & AST_HERE))
+    {
+      pid_t pid = pipe_spawn(sh, t, n, argv, in, out, pgid);
+      if (pid > 0)
+      {
+        pids[npids++] = pid;
+        if (pgid == 0)
+          pgid = pid;
+      }
+      else
+        status = 1;
+    }
+    else
+      status = 1; /* the words expanded to nothing or failed */
+
+    if (in >= 0)
+      close(in);
+    if (out[1] >= 0)
+      close(out[1]);
+    in = out[0];
+  }
+  if (in >= 0)
+    close(in);
+
+  int stopped = 0;
+  for (int i = 0; i < npids; i++)
+  {
+    int ws;
+    while (waitpid(pids[i], &ws, WUNTRACED) < 0)
+    {
+      if (errno != EINTR)
+      {
+        ws = 0;
+        break;
+      }
+    }
+    if (WIFSTOPPED(ws))
+    {
+      stopped = 128 + WSTOPSIG(ws);
+      pipe_stopped(sh, pids, npids, pgid, desc);
+      break;
+    }
+    pids[i] = 0;
+    if (i == npids - 1 && !waited)
+      status = exit_status(ws);
+  }
+  if (pgid != 0 && sh->shell_is_interactive)
+  {
+    tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+  }
+  while (nexps > 0)
+    exp_pop(sh, exps[--nexps]);
+  sh->last_status = stopped ? stopped : status;
+}
+
+/**
+ * @brief Run a command in a forked copy of the shell, either ( list ) or a
+ * compound command followed by &.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param n The node to run in the child, its & is ignored
+ * @param background Non zero to start a job instead of waiting
+ */
+static void exec_fork(struct shell *sh, struct ast *t, uint32_t n, int background)
+{
+  pid_t pid = shell_fork(sh);
+  if (pid == 0)
+  {
+    if (background)
+    {
+      /* A job must never take the terminal from the shell */
+      setpgid(0, 0);
+      sh->shell_is_interactive = 0;
+      sh->shell_terminal = -1;
+    }
+    exec_compound(sh, t, n);
+    fflush(stdout);
+    _exit(sh->last_status);
+  }
+  if (pid < 0)
+  {
+    perror("fork");
+    sh->last_status = 1;
+    return;
+  }
+
+  if (background)
+  {
+    static const char *const names[] = {
+        [AST_SIMPLE] = "", [AST_LIST] = "", [AST_IF] = "if", [AST_WHILE] = "while",
+        [AST_UNTIL] = "until", [AST_FOR] = "for", [AST_CASE] = "case",
+        [AST_CASE_ITEM] = "", [AST_GROUP] = "{", [AST_SUBSHELL] = "(",
+        [AST_FUNCTION] = "function", [AST_AND] = "&&", [AST_OR] = "||",
+        [AST_PIPELINE] = "|",
+    };
+    /* A list or pipeline is named after the command it starts with */
+    uint32_t lead = n;
+    while (t->nodes[lead].kind == AST_AND || t->nodes[lead].kind == AST_OR ||
+           t->nodes[lead].kind == AST_PIPELINE)
+      lead = t->nodes[lead].a;
+    const struct ast_node *first = &t->nodes[lead];
+    const char *name = names[first->kind];
+    if (first->kind == AST_SIMPLE && first->b > 0)
+      name = t->strings + t->words[first->a];
+    char *argv[] = {(char *)name, "...", NULL};
+    setpgid(pid, pid);
+    struct bg_process *bgp = job_add(sh, pid, argv);
+    if (bgp != NULL)
+      printf("[%d] %d %s\n", bgp->job_id, pid, bgp->command);
+    sh->last_status = 0;
+    return;
+  }
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      status = 0;
+      break;
+    }
+  }
+  sh->last_status = exit_status(status);
+}
+
+/**
+ * @brief Run a compound command, ignoring a trailing &.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param n The node
+ */
+static void exec_compound(struct shell *sh, struct ast *t, uint32_t n)
+{
+  const struct ast_node *node = &t->nodes[n];
+
+  switch (node->kind)
+  {
+  case AST_SIMPLE:
+    exec_simple(sh, t, node);
+    break;
+  case AST_LIST:
+    for (uint32_t c = node->a; c != 0 && !jumping(sh); c = t->nodes[c].next)
+      exec_node(sh, t, c);
+    break;
+  case AST_IF:
+    exec_node(sh, t, node->a);
+    if (jumping(sh))
+      break;
+    if (sh->last_status == 0)
+      exec_node(sh, t, node->b);
+    else if (node->c != 0)
+      exec_node(sh, t, node->c);
+    else
+      sh->last_status = 0;
+    break;
+  case AST_WHILE:
+  case AST_UNTIL:
+    exec_while(sh, t, node);
+    break;
+  case AST_FOR:
+    exec_for(sh, t, node);
+    break;
+  case AST_CASE:
+    exec_case(sh, t, node);
+    break;
+  case AST_GROUP:
+    exec_node(sh, t, node->a);
+    break;
+  case AST_SUBSHELL:
+    exec_fork(sh, t, node->a, 0);
+    break;
+  case AST_FUNCTION:
+    sh->last_status = func_define(sh, t->strings + node->a, t, node->b) == 0 ? 0 : 1;
+    break;
+  case AST_PIPELINE:
+    exec_pipeline(sh, t, node);
+    break;
+  case AST_AND:
+  case AST_OR:
+    exec_node(sh, t, node->a);
+    if (!jumping(sh) && (sh->last_status == 0) == (node->kind == AST_AND))
+      exec_node(sh, t, node->b);
+    break;
+  case AST_CASE_ITEM:
+    break;
+  }
+}
+
+/**
+ * @brief Run a node of a tree.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @param n The node
+ */
+static void exec_node(struct shell *sh, struct ast *t, uint32_t n)
+{
+  const struct ast_node *node = &t->nodes[n];
+
+  /* Simple commands go to the background through the normal job path */
+  if ((node->flags & AST_BACKGROUND) && node->kind != AST_SIMPLE)
+    exec_fork(sh, t, n, 1);
+  else
+    exec_compound(sh, t, n);
+}
+
+/**
+ * @brief Run a parsed command line or script.
+ *
+ * @param sh The shell
+ * @param t The tree
+ * @return The exit status of the last command
+ */
+int exec_tree(struct shell *sh, struct ast *t)
+{
+  /* Globs on one line share directory listings, the next line reads again */
+  glob_cache_reset(sh);
+  ast_ref(t);
+  exec_node(sh, t, t->root);
+  ast_release(t);
+  /* A break or continue outside of any loop does nothing */
+  sh->breaking = 0;
+  sh->continuing = 0;
+  return sh->last_status;
+}
+
+/**
+ * @brief The break and continue builtins.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, 1 on error
+ */
+int builtin_break(struct shell *sh, char **argv)
+{
+  long n = 1;
+
+  if (argv[1] != NULL)
+  {
+    char *end;
+    n = strtol(argv[1], &end, 10);
+    if (*end != '\0' || n < 1)
+    {
+      fprintf(stderr, "%s: %s: loop count out of range\n", argv[0], argv[1]);
+      return 1;
+    }
+  }
+  if (sh->loop_depth == 0)
+  {
+    fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+    return 1;
+  }
+  if (n > sh->loop_depth)
+    n = sh->loop_depth;
+  if (strcmp(argv[0], "break") == 0)
+    sh->breaking = (int)n;
+  else
+    sh->continuing = (int)n;
+  return 0;
+}
+
+/**
+ * @brief The return builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status to return with
+ */
+int builtin_return(struct shell *sh, char **argv)
+{
+  int status = sh->last_status;
+
+  if (sh->func_depth == 0 && sh->source_depth == 0)
+  {
+    fprintf(stderr, "return: can only return from a function or sourced script\n");
+    return 1;
+  }
+  if (argv[1] != NULL)
+  {
+    char *end;
+    status = (int)(strtol(argv[1], &end, 10) & 0xff);
+    if (*end != '\0')
+    {
+      fprintf(stderr, "return: %s: numeric argument required\n", argv[1]);
+      status = 2;
+    }
+  }
+  sh->returning = 1;
+  return status;
+}
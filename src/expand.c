@@ -0,0 +1,1512 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define ARITH_MAX_OPS 256
+#define SUBST_READ_CHUNK (64 * 1024)
+#define SUBST_PIPE_SIZE (1024 * 1024)
+
+/* How emit treats the text it is given */
+#define EMIT_SPLIT 0x1  /* blanks separate fields */
+#define EMIT_QUOTED 0x2 /* glob characters match themselves */
+
+/* in_double of a here-document body, quotes are ordinary characters */
+#define TEXT_HEREDOC 2
+
+/**
+ * @brief Operators of the arithmetic evaluator. The order of the binary
+ * operators does not matter, their precedence comes from arith_prec.
+ */
+enum arith_kind
+{
+  A_NUM,
+  A_VAR,
+  A_LPAREN,
+  A_NEG,
+  A_POS,
+  A_NOT,
+  A_BNOT,
+  A_MUL,
+  A_DIV,
+  A_MOD,
+  A_ADD,
+  A_SUB,
+  A_SHL,
+  A_SHR,
+  A_LT,
+  A_LE,
+  A_GT,
+  A_GE,
+  A_EQ,
+  A_NE,
+  A_BAND,
+  A_XOR,
+  A_BOR,
+  A_AND,
+  A_OR,
+};
+
+/**
+ * @brief One instruction of a compiled expression, in postfix order.
+ */
+struct arith_op
+{
+  enum arith_kind kind;
+  long long val;
+  const char *name;
+  size_t len;
+};
+
+/**
+ * @brief State of one expansion.
+ */
+struct expander
+{
+  struct shell *sh;
+  struct expansion *ex;
+  int field_open;     /* the current field exists even if it is still empty */
+  size_t field_start; /* offset of the current field in the buffer */
+  int glob;           /* the current field has unquoted glob characters */
+  int escaped;        /* the current field has backslash escapes */
+};
+
+/**
+ * @brief How the value of an expansion is emitted.
+ *
+ * @param in_double Non zero inside double quotes
+ * @return The emit mode
+ */
+static int value_mode(int in_double)
+{
+  return in_double ? EMIT_QUOTED : EMIT_SPLIT;
+}
+
+static int arith_prec(enum arith_kind kind)
+{
+  switch (kind)
+  {
+  case A_NEG:
+  case A_POS:
+  case A_NOT:
+  case A_BNOT:
+    return 14;
+  case A_MUL:
+  case A_DIV:
+  case A_MOD:
+    return 13;
+  case A_ADD:
+  case A_SUB:
+    return 12;
+  case A_SHL:
+  case A_SHR:
+    return 11;
+  case A_LT:
+  case A_LE:
+  case A_GT:
+  case A_GE:
+    return 10;
+  case A_EQ:
+  case A_NE:
+    return 9;
+  case A_BAND:
+    return 8;
+  case A_XOR:
+    return 7;
+  case A_BOR:
+    return 6;
+  case A_AND:
+    return 5;
+  case A_OR:
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+static int arith_unary(enum arith_kind kind)
+{
+  return kind == A_NEG || kind == A_POS || kind == A_NOT || kind == A_BNOT;
+}
+
+/**
+ * @brief Read a binary operator.
+ *
+ * @param p The expression
+ * @param kind The operator
+ * @return The length of the operator or 0 if there is none at p
+ */
+static int arith_binary(const char *p, enum arith_kind *kind)
+{
+  static const struct
+  {
+    const char *text;
+    enum arith_kind kind;
+  } ops[] = {
+      {"<<", A_SHL}, {">>", A_SHR}, {"<=", A_LE}, {">=", A_GE}, {"==", A_EQ},
+      {"!=", A_NE}, {"&&", A_AND}, {"||", A_OR}, {"*", A_MUL}, {"/", A_DIV},
+      {"%", A_MOD}, {"+", A_ADD}, {"-", A_SUB}, {"<", A_LT}, {">", A_GT},
+      {"&", A_BAND}, {"^", A_XOR}, {"|", A_BOR},
+  };
+
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+  {
+    size_t n = strlen(ops[i].text);
+    if (strncmp(p, ops[i].text, n) == 0)
+    {
+      *kind = ops[i].kind;
+      return (int)n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Compile an arithmetic expression to postfix with the shunting
+ * yard algorithm. Variables are compiled to references so the program
+ * reads the current value when it runs.
+ *
+ * @param expr The expression
+ * @param end The end of the expression
+ * @param prog The program
+ * @return The number of instructions or -1 on a syntax error
+ */
+static int arith_compile(const char *expr, const char *end, struct arith_op *prog)
+{
+  enum arith_kind stack[ARITH_MAX_OPS];
+  int depth = 0;
+  int n = 0;
+  int operand = 1; /* an operand is expected next */
+
+  for (const char *p = expr; p < end;)
+  {
+    if (isspace((unsigned char)*p))
+    {
+      p++;
+      continue;
+    }
+    if (n >= ARITH_MAX_OPS || depth >= ARITH_MAX_OPS)
+      return -1;
+
+    if (operand)
+    {
+      if (isdigit((unsigned char)*p))
+      {
+        char *num_end;
+        errno = 0;
+        prog[n].kind = A_NUM;
+        prog[n++].val = strtoll(p, &num_end, 0);
+        if (errno != 0 || num_end > end || isalnum((unsigned char)*num_end))
+          return -1;
+        p = num_end;
+        operand = 0;
+      }
+      else if (*p == '$' || isalpha((unsigned char)*p) || *p == '_')
+      {
+        int brace = 0;
+        if (*p == '$')
+          p++;
+        if (p < end && *p == '{')
+          brace = 1, p++;
+        const char *name = p;
+        while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+          p++;
+        if (p == name || !var_valid_name(name, (size_t)(p - name)))
+          return -1;
+        prog[n].kind = A_VAR;
+        prog[n].name = name;
+        prog[n++].len = (size_t)(p - name);
+        if (brace && (p >= end || *p++ != '}'))
+          return -1;
+        operand = 0;
+      }
+      else if (*p == '(')
+      {
+        stack[depth++] = A_LPAREN;
+        p++;
+      }
+      else if (*p == '-' || *p == '+' || *p == '!' || *p == '~')
+      {
+        stack[depth++] = *p == '-' ? A_NEG : *p == '+' ? A_POS : *p == '!' ? A_NOT : A_BNOT;
+        p++;
+      }
+      else
+        return -1;
+      continue;
+    }
+
+    if (*p == ')')
+    {
+      while (depth > 0 && stack[depth - 1] != A_LPAREN)
+        prog[n++].kind = stack[--depth];
+      if (depth == 0)
+        return -1;
+      depth--;
+      p++;
+      continue;
+    }
+
+    enum arith_kind kind;
+    int len = arith_binary(p, &kind);
+    if (len == 0)
+      return -1;
+    /* Unary operators bind right to left, binary ones left to right */
+    while (depth > 0 && stack[depth - 1] != A_LPAREN &&
+           arith_prec(stack[depth - 1]) >= arith_prec(kind))
+    {
+      if (n >= ARITH_MAX_OPS)
+        return -1;
+      prog[n++].kind = stack[--depth];
+    }
+    stack[depth++] = kind;
+    p += len;
+    operand = 1;
+  }
+
+  if (operand)
+    return -1;
+  while (depth > 0)
+  {
+    if (stack[depth - 1] == A_LPAREN || n >= ARITH_MAX_OPS)
+      return -1;
+    prog[n++].kind = stack[--depth];
+  }
+  return n;
+}
+
+/**
+ * @brief Read the value of a variable used in an expression. Unset and
+ * empty variables are zero.
+ *
+ * @param vars The variables
+ * @param op The reference
+ * @param val The value
+ * @return 0 on success, -1 if the value is not a number
+ */
+static int arith_var(struct var_table *vars, const struct arith_op *op, long long *val)
+{
+  const char *str = var_get_n(vars, op->name, op->len);
+  char *end;
+
+  *val = 0;
+  if (str == NULL || *str == '\0')
+    return 0;
+  errno = 0;
+  *val = strtoll(str, &end, 0);
+  while (isspace((unsigned char)*end))
+    end++;
+  return errno == 0 && *end == '\0' ? 0 : -1;
+}
+
+/**
+ * @brief Evaluate an arithmetic expression. Integers are 64 bit and the
+ * operators are the C ones without assignment, increment and the
+ * conditional operator.
+ *
+ * @param vars The variables the expression can refer to
+ * @param expr The expression
+ * @param len The length of the expression
+ * @param result The value of the expression
+ * @return 0 on success, -1 after printing an error
+ */
+int arith_eval(struct var_table *vars, const char *expr, size_t len, long long *result)
+{
+  struct arith_op prog[ARITH_MAX_OPS];
+  long long stack[ARITH_MAX_OPS];
+  int depth = 0;
+
+  int n = arith_compile(expr, expr + len, prog);
+  if (n <= 0)
+  {
+    fprintf(stderr, "%.*s: arithmetic syntax error\n", (int)len, expr);
+    return -1;
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    const struct arith_op *op = &prog[i];
+    if (op->kind == A_NUM)
+    {
+      stack[depth++] = op->val;
+      continue;
+    }
+    if (op->kind == A_VAR)
+    {
+      if (arith_var(vars, op, &stack[depth++]) != 0)
+      {
+        fprintf(stderr, "%.*s: not a number\n", (int)op->len, op->name);
+        return -1;
+      }
+      continue;
+    }
+    if (arith_unary(op->kind))
+    {
+      long long *a = &stack[depth - 1];
+      if (op->kind == A_NEG)
+        *a = (long long)(0ULL - (unsigned long long)*a);
+      else if (op->kind == A_NOT)
+        *a = !*a;
+      else if (op->kind == A_BNOT)
+        *a = ~*a;
+      continue;
+    }
+
+    long long b = stack[--depth];
+    long long *a = &stack[depth - 1];
+    /* Unsigned arithmetic so overflow wraps instead of being undefined */
+    unsigned long long ua = (unsigned long long)*a, ub = (unsigned long long)b;
+    switch (op->kind)
+    {
+    case A_DIV:
+    case A_MOD:
+      if (b == 0)
+      {
+        fprintf(stderr, "%.*s: division by zero\n", (int)len, expr);
+        return -1;
+      }
+      if (b == -1)
+        *a = op->kind == A_DIV ? (long long)(0ULL - ua) : 0;
+      else
+        *a = op->kind == A_DIV ? *a / b : *a % b;
+      break;
+    case A_MUL:
+      *a = (long long)(ua * ub);
+      break;
+    case A_ADD:
+      *a = (long long)(ua + ub);
+      break;
+    case A_SUB:
+      *a = (long long)(ua - ub);
+      break;
+    case A_SHL:
+      *a = (long long)(ua << (ub & 63));
+      break;
+    case A_SHR:
+      *a = *a >> (ub & 63);
+      break;
+    case A_LT:
+      *a = *a < b;
+      break;
+    case A_LE:
+      *a = *a <= b;
+      break;
+    case A_GT:
+      *a = *a > b;
+      break;
+    case A_GE:
+      *a = *a >= b;
+      break;
+    case A_EQ:
+      *a = *a == b;
+      break;
+    case A_NE:
+      *a = *a != b;
+      break;
+    case A_BAND:
+      *a = *a & b;
+      break;
+    case A_XOR:
+      *a = *a ^ b;
+      break;
+    case A_BOR:
+      *a = *a | b;
+      break;
+    case A_AND:
+      *a = *a && b;
+      break;
+    case A_OR:
+      *a = *a || b;
+      break;
+    default:
+      break;
+    }
+  }
+  *result = stack[0];
+  return 0;
+}
+
+/**
+ * @brief Make room in the output buffer.
+ *
+ * @param ex The expansion
+ * @param extra The number of bytes that will be added
+ * @return 0 on success, -1 if out of memory
+ */
+static int buf_reserve(struct expansion *ex, size_t extra)
+{
+  if (ex->len + extra <= ex->cap)
+    return 0;
+  size_t cap = ex->cap ? ex->cap : 256;
+  while (cap < ex->len + extra)
+    cap *= 2;
+  char *buf = realloc(ex->buf, cap);
+  if (buf == NULL)
+    return -1;
+  ex->buf = buf;
+  ex->cap = cap;
+  return 0;
+}
+
+/**
+ * @brief Finish the current field. A field with unquoted glob characters
+ * is replaced by the paths it matches, any other field just loses the
+ * escapes that protected its quoted characters.
+ *
+ * @param e The expander
+ * @return 0 on success, -1 if out of memory
+ */
+static int field_end(struct expander *e)
+{
+  struct expansion *ex = e->ex;
+  int rval = 0;
+
+  if (!e->field_open)
+    return 0;
+  if (e->glob && !ex->pattern)
+    rval = glob_expand(ex, e->field_start);
+  else
+  {
+    if (e->escaped && !ex->pattern)
+      ex->len = e->field_start + glob_unescape(ex->buf + e->field_start, ex->len - e->field_start);
+    rval = buf_reserve(ex, 1);
+    if (rval == 0)
+    {
+      ex->buf[ex->len++] = '\0';
+      ex->argc++;
+    }
+  }
+  e->field_open = 0;
+  e->field_start = ex->len;
+  e->glob = 0;
+  e->escaped = 0;
+  return rval;
+}
+
+/**
+ * @brief Append text to the current field. Backslashes and quoted glob
+ * characters are escaped so the glob stage can tell them apart from the
+ * pattern characters, field_end removes the escapes again.
+ *
+ * @param e The expander
+ * @param s The text
+ * @param len The length of the text
+ * @param mode EMIT_SPLIT and EMIT_QUOTED
+ * @return 0 on success, -1 if out of memory
+ */
+static int emit(struct expander *e, const char *s, size_t len, int mode)
+{
+  if (buf_reserve(e->ex, len * 2) != 0)
+    return -1;
+  for (size_t i = 0; i < len; i++)
+  {
+    char c = s[i];
+    if ((mode & EMIT_SPLIT) && (c == ' ' || c == '\t' || c == '\n'))
+    {
+      if (field_end(e) != 0 || buf_reserve(e->ex, (len - i) * 2) != 0)
+        return -1;
+      continue;
+    }
+    int special = c == '*' || c == '?' || c == '[';
+    if (c == '\\' || (special && (mode & EMIT_QUOTED)))
+    {
+      e->ex->buf[e->ex->len++] = '\\';
+      e->escaped = 1;
+    }
+    else if (special)
+      e->glob = 1;
+    e->ex->buf[e->ex->len++] = c;
+    e->field_open = 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Find the closing bracket of ${...} or $(...), skipping quotes and
+ * nested brackets.
+ *
+ * @param p The first character after the opening bracket
+ * @param end The end of the word
+ * @param close The closing bracket
+ * @return The closing bracket or NULL if there is none
+ */
+static const char *find_close(const char *p, const char *end, char close)
+{
+  char open = close == '}' ? '{' : '(';
+  char quote = '\0';
+  int depth = 0;
+
+  for (; p < end; p++)
+  {
+    if (*p == '\\' && quote != '\'' && p + 1 < end)
+      p++;
+    else if (quote != '\0')
+    {
+      if (*p == quote)
+        quote = '\0';
+    }
+    else if (*p == '\'' || *p == '"')
+      quote = *p;
+    else if (*p == open)
+      depth++;
+    else if (*p == close && depth-- == 0)
+      return p;
+  }
+  return NULL;
+}
+
+static int expand_text(struct expander *e, const char *p, const char *end, int in_double,
+                       int nested);
+
+/**
+ * @brief Run a command with stdout going to a FILE in memory and append
+ * what it printed to the buffer, after the current end.
+ *
+ * @param e The expander
+ * @param argv The command
+ * @return The number of bytes captured or -1 on error
+ */
+static ssize_t subst_inline_run(struct expander *e, char **argv)
+{
+  size_t size;
+  char *data = builtin_render(e->sh, argv, &size);
+  if (data == NULL)
+    return -1;
+
+  ssize_t rval = -1;
+  if (buf_reserve(e->ex, size) == 0)
+  {
+    memcpy(e->ex->buf + e->ex->len, data, size);
+    rval = (ssize_t)size;
+  }
+  free(data);
+  return rval;
+}
+
+/**
+ * @brief Run the command of a substitution in the child, which never
+ * returns.
+ *
+ * @param sh The shell
+ * @param t The parsed command, or NULL to run argv
+ * @param argv The expanded words of a lone simple command
+ * @param envp The environment for an external command
+ */
+static void subst_child(struct shell *sh, struct ast *t, char **argv, char **envp)
+{
+  signal(SIGINT, SIG_DFL);
+  signal(SIGQUIT, SIG_DFL);
+  if (t != NULL)
+  {
+    sh->shell_is_interactive = 0;
+    exec_tree(sh, t);
+    fflush(stdout);
+    _exit(sh->last_status);
+  }
+  if (!is_builtin(argv[0]) && func_find(sh, argv[0]) == NULL)
+  {
+    if (envp != NULL)
+      environ = envp;
+    execvp(argv[0], argv);
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+    _exit(127);
+  }
+  /* A builtin changes the state of this copy of the shell only */
+  sh->shell_is_interactive = 0;
+  run_command(sh, argv, 0);
+  fflush(stdout);
+  _exit(sh->last_status);
+}
+
+/**
+ * @brief Run a command in a child with stdout on a pipe and read the
+ * output in large chunks straight into the buffer, after the current end.
+ *
+ * @param e The expander
+ * @param t The parsed command, or NULL to run argv
+ * @param argv The expanded words of a lone simple command
+ * @return The number of bytes captured or -1 on error
+ */
+static ssize_t subst_fork_run(struct expander *e, struct ast *t, char **argv)
+{
+  struct shell *sh = e->sh;
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0)
+  {
+    perror("pipe");
+    return -1;
+  }
+  /* A bigger pipe means fewer round trips for large outputs */
+  fcntl(fds[1], F_SETPIPE_SZ, SUBST_PIPE_SIZE);
+  char **envp = var_envp(&sh->vars);
+
+  pid_t pid = shell_fork(sh);
+  if (pid == 0)
+  {
+    dup2(fds[1], STDOUT_FILENO);
+    subst_child(sh, t, argv, envp);
+  }
+  close(fds[1]);
+  if (pid < 0)
+  {
+    perror("fork");
+    close(fds[0]);
+    return -1;
+  }
+
+  size_t total = 0;
+  for (;;)
+  {
+    if (buf_reserve(e->ex, total + SUBST_READ_CHUNK) != 0)
+      break;
+    char *at = e->ex->buf + e->ex->len + total;
+    ssize_t n = read(fds[0], at, e->ex->cap - e->ex->len - total);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    total += (size_t)n;
+  }
+  close(fds[0]);
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      status = 0;
+      break;
+    }
+  }
+  sh->last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  return (ssize_t)total;
+}
+
+/**
+ * @brief Add captured output that sits right after the end of the buffer
+ * to the current field. Trailing newlines are dropped. Unless the output
+ * needs escapes, it is split in place, turning blanks into field ends
+ * without copying.
+ *
+ * @param e The expander
+ * @param n The number of bytes captured
+ * @param mode EMIT_SPLIT or EMIT_QUOTED
+ * @return 0 on success, -1 if out of memory
+ */
+static int emit_captured(struct expander *e, size_t n, int mode)
+{
+  struct expansion *ex = e->ex;
+  char *out = ex->buf + ex->len;
+  int split = mode & EMIT_SPLIT;
+
+  while (n > 0 && out[n - 1] == '\n')
+    n--;
+  if (n == 0)
+    return 0;
+
+  /* Escapes or a glob in the current field need the copying path */
+  int slow = split && (e->glob || e->escaped);
+  for (size_t i = 0; i < n && !slow; i++)
+    slow = out[i] == '\\' || out[i] == '*' || out[i] == '?' || out[i] == '[';
+  if (slow)
+  {
+    char *copy = malloc(n);
+    if (copy == NULL)
+      return -1;
+    memcpy(copy, out, n);
+    int rval = emit(e, copy, n, mode);
+    free(copy);
+    return rval;
+  }
+
+  if (!split)
+  {
+    ex->len += n;
+    e->field_open = 1;
+    return 0;
+  }
+  /* The write position never passes the read position */
+  size_t w = ex->len;
+  for (size_t r = ex->len; r < ex->len + n; r++)
+  {
+    char c = ex->buf[r];
+    if (c == ' ' || c == '\t' || c == '\n')
+    {
+      if (e->field_open)
+      {
+        ex->buf[w++] = '\0';
+        ex->argc++;
+        e->field_open = 0;
+        e->field_start = w;
+      }
+      continue;
+    }
+    ex->buf[w++] = c;
+    e->field_open = 1;
+  }
+  ex->len = w;
+  return 0;
+}
+
+/**
+ * @brief Parse the command of a substitution. A lone simple command is
+ * expanded right away, so it can be run without a copy of the shell.
+ *
+ * @param sh The shell
+ * @param cmd The command
+ * @param len The length of the command
+ * @param tree The parsed command, NULL if it was a simple command
+ * @param inner The expansion that receives the words of a simple command
+ * @return 0 on success, 1 if the words did not expand and -1 on error
+ */
+static int subst_parse(struct shell *sh, const char *cmd, size_t len, struct ast **tree,
+                       struct expansion *inner)
+{
+  char *line = strndup(cmd, len);
+  struct ast *t = line ? ast_parse(line, NULL, NULL) : NULL;
+  free(line);
+  *tree = NULL;
+  if (t == NULL)
+    return -1;
+
+  uint32_t first = t->nodes[t->root].a;
+  const struct ast_node *node = &t->nodes[first];
+  if (first == 0 || node->next != 0 || node->kind != AST_SIMPLE || node->flags != 0)
+  {
+    *tree = t;
+    return 0;
+  }
+  char *words[node->b + 1];
+  for (uint32_t i = 0; i < node->b; i++)
+    words[i] = t->strings + t->words[node->a + i];
+  words[node->b] = NULL;
+  int rval = 0;
+  if (expand_words(sh, words, inner) != 0)
+  {
+    sh->last_status = 1;
+    rval = 1;
+  }
+  ast_release(t);
+  return rval;
+}
+
+/**
+ * @brief Close the shell's ends of the process substitutions started so
+ * far, in the child of another one.
+ *
+ * @param sh The shell
+ * @param ex The expansion being expanded, which may not be one of the shell's
+ */
+static void procsubst_close(struct shell *sh, struct expansion *ex)
+{
+  for (size_t i = 0; i < ex->nprocs; i++)
+    close(ex->procs[i].fd);
+  ex->nprocs = 0;
+  for (size_t level = 0; level < sh->exp_depth; level++)
+  {
+    struct expansion *outer = sh->exps[level];
+    if (outer == ex)
+      continue;
+    for (size_t i = 0; i < outer->nprocs; i++)
+      close(outer->procs[i].fd);
+    outer->nprocs = 0;
+  }
+}
+
+/**
+ * @brief Start a process substitution. The command runs concurrently with
+ * one end of a pipe as its stdout for <(...) or stdin for >(...), and the
+ * word is replaced by the /dev/fd path of the other end.
+ *
+ * @param e The expander
+ * @param pp The < or >, advanced past the closing parenthesis
+ * @param end The end of the word
+ * @return 0 on success, -1 on error
+ */
+static int expand_procsubst(struct expander *e, const char **pp, const char *end)
+{
+  const char *p = *pp;
+  int output = *p == '>';
+  const char *rparen = find_close(p + 2, end, ')');
+  if (rparen == NULL)
+  {
+    fprintf(stderr, "%c(: missing )\n", *p);
+    return -1;
+  }
+  *pp = rparen + 1;
+
+  struct expansion *ex = e->ex;
+  if (ex->nprocs == ex->procs_cap)
+  {
+    size_t cap = ex->procs_cap ? ex->procs_cap * 2 : 4;
+    struct proc_subst *procs = realloc(ex->procs, cap * sizeof(*procs));
+    if (procs == NULL)
+      return -1;
+    ex->procs = procs;
+    ex->procs_cap = cap;
+  }
+
+  struct expansion inner = {0};
+  struct ast *t;
+  int rval = subst_parse(e->sh, p + 2, (size_t)(rparen - p - 2), &t, &inner);
+  if (rval != 0 || (t == NULL && inner.argc == 0))
+  {
+    procsubst_reap(e->sh, &inner);
+    expansion_free(&inner);
+    return rval < 0 ? -1 : 0;
+  }
+
+  /* Both ends stay close on exec until every substitution has started */
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0)
+  {
+    perror("pipe");
+    ast_release(t);
+    expansion_free(&inner);
+    return -1;
+  }
+  char **envp = var_envp(&e->sh->vars);
+  pid_t pid = shell_fork(e->sh);
+  if (pid == 0)
+  {
+    dup2(fds[output ? 0 : 1], output ? STDIN_FILENO : STDOUT_FILENO);
+    /* A body that does not exec must not hold a pipe open for a reader */
+    close(fds[0]);
+    close(fds[1]);
+    procsubst_close(e->sh, ex);
+    subst_child(e->sh, t, inner.argv, envp);
+  }
+  close(fds[output ? 0 : 1]);
+  ast_release(t);
+  procsubst_reap(e->sh, &inner);
+  expansion_free(&inner);
+  if (pid < 0)
+  {
+    perror("fork");
+    close(fds[output ? 1 : 0]);
+    return -1;
+  }
+  ex->procs[ex->nprocs].pid = pid;
+  ex->procs[ex->nprocs++].fd = fds[output ? 1 : 0];
+
+  char path[32];
+  int n = snprintf(path, sizeof(path), "/dev/fd/%d", fds[output ? 1 : 0]);
+  return emit(e, path, (size_t)n, EMIT_QUOTED);
+}
+
+/**
+ * @brief Expand a command substitution.
+ *
+ * @param e The expander
+ * @param cmd The command
+ * @param len The length of the command
+ * @param in_double Non zero inside double quotes
+ * @return 0 on success, -1 on error
+ */
+static int expand_subst(struct expander *e, const char *cmd, size_t len, int in_double)
+{
+  struct expansion inner = {0};
+  struct ast *t;
+  ssize_t n = 0;
+
+  int rval = subst_parse(e->sh, cmd, len, &t, &inner);
+  if (rval < 0)
+    n = -1;
+  else if (t != NULL)
+    n = subst_fork_run(e, t, NULL);
+  else if (rval == 0 && inner.argc > 0)
+    n = builtin_pure(e->sh, inner.argv) ? subst_inline_run(e, inner.argv)
+                                 : subst_fork_run(e, NULL, inner.argv);
+  ast_release(t);
+  procsubst_reap(e->sh, &inner);
+  expansion_free(&inner);
+
+  if (n < 0)
+    return -1;
+  return emit_captured(e, (size_t)n, value_mode(in_double));
+}
+
+/**
+ * @brief Expand a `command` substitution. Inside the backquotes a
+ * backslash only escapes $, ` and another backslash.
+ *
+ * @param e The expander
+ * @param pp The opening backquote, advanced past the closing one
+ * @param end The end of the word
+ * @param in_double Non zero inside double quotes
+ * @return 0 on success, -1 on error
+ */
+static int expand_backquote(struct expander *e, const char **pp, const char *end, int in_double)
+{
+  const char *p = *pp + 1;
+  const char *close = p;
+  while (close < end && *close != '`')
+    close += *close == '\\' && close + 1 < end ? 2 : 1;
+  if (close >= end)
+  {
+    fprintf(stderr, "`: missing `\n");
+    return -1;
+  }
+  *pp = close + 1;
+
+  char cmd[close - p + 1];
+  size_t n = 0;
+  for (; p < close; p++)
+  {
+    if (*p == '\\' && p + 1 < close && strchr("$`\\", p[1]) != NULL)
+      p++;
+    cmd[n++] = *p;
+  }
+  return expand_subst(e, cmd, n, in_double);
+}
+
+/**
+ * @brief Look up a special or positional parameter: $?, $$, $# or $N.
+ *
+ * @param e The expander
+ * @param name The name
+ * @param len The length of the name
+ * @param num Room for a number
+ * @param size The size of num
+ * @return The value or NULL if the parameter is unset
+ */
+static const char *special_param(struct expander *e, const char *name, size_t len, char *num,
+                                 size_t size)
+{
+  struct shell *sh = e->sh;
+
+  switch (*name)
+  {
+  case '?':
+    snprintf(num, size, "%d", sh->last_status);
+    return num;
+  case '$':
+    snprintf(num, size, "%d", (int)getpid());
+    return num;
+  case '#':
+    snprintf(num, size, "%d", sh->nargs);
+    return num;
+  }
+  long n = 0;
+  for (size_t i = 0; i < len && n <= sh->nargs; i++)
+    n = n * 10 + (name[i] - '0');
+  return n >= 1 && n <= sh->nargs ? sh->args[n - 1] : NULL;
+}
+
+/**
+ * @brief Expand $@ or $*. Inside double quotes "$@" makes one field per
+ * parameter and "$*" joins them with spaces.
+ *
+ * @param e The expander
+ * @param which @ or *
+ * @param in_double Non zero inside double quotes
+ * @return 0 on success, -1 on error
+ */
+static int expand_args(struct expander *e, char which, int in_double)
+{
+  for (int i = 0; i < e->sh->nargs; i++)
+  {
+    const char *arg = e->sh->args[i];
+    if (i > 0 && in_double == 1 && which == '@')
+    {
+      if (field_end(e) != 0)
+        return -1;
+      e->field_open = 1;
+    }
+    else if (i > 0 && emit(e, " ", 1, value_mode(in_double)) != 0)
+      return -1;
+    if (emit(e, arg, strlen(arg), value_mode(in_double)) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Expand ${NAME op word}.
+ *
+ * @param e The expander
+ * @param p The text between the braces
+ * @param end The closing brace
+ * @param in_double Non zero inside double quotes
+ * @return 0 on success, -1 on error
+ */
+static int expand_braced(struct expander *e, const char *p, const char *end, int in_double)
+{
+  char num[32];
+  int length = 0;
+
+  if (*p == '#' && p + 1 < end)
+  {
+    length = 1;
+    p++;
+  }
+  const char *name = p;
+  const char *value;
+  if (p < end && strchr("?$#@*", *p) != NULL)
+    p++;
+  else if (p < end && isdigit((unsigned char)*p))
+  {
+    while (p < end && isdigit((unsigned char)*p))
+      p++;
+  }
+  else
+  {
+    while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+      p++;
+    if (!var_valid_name(name, (size_t)(p - name)))
+    {
+      fprintf(stderr, "${%.*s}: bad substitution\n", (int)(end - name), name);
+      return -1;
+    }
+  }
+  size_t name_len = (size_t)(p - name);
+
+  if ((*name == '@' || *name == '*') && p == end && !length)
+    return expand_args(e, *name, in_double);
+  if (*name == '@' || *name == '*')
+    value = NULL;
+  else if (!var_valid_name(name, name_len))
+    value = special_param(e, name, name_len, num, sizeof(num));
+  else
+    value = var_get_n(&e->sh->vars, name, name_len);
+
+  if (length)
+  {
+    if (p != end)
+    {
+      fprintf(stderr, "${#%.*s}: bad substitution\n", (int)(end - name), name);
+      return -1;
+    }
+    snprintf(num, sizeof(num), "%zu", value ? strlen(value) : (size_t)0);
+    return emit(e, num, strlen(num), EMIT_QUOTED);
+  }
+  if (p == end)
+    return value ? emit(e, value, strlen(value), value_mode(in_double)) : 0;
+
+  /* With a colon an empty value counts as unset */
+  int colon = *p == ':';
+  if (colon)
+    p++;
+  char op = p < end ? *p++ : '\0';
+  int set = value != NULL && (!colon || *value != '\0');
+
+  switch (op)
+  {
+  case '-':
+    if (set)
+      return emit(e, value, strlen(value), value_mode(in_double));
+    return expand_text(e, p, end, in_double, 1);
+  case '+':
+    return set ? expand_text(e, p, end, in_double, 1) : 0;
+  case '=':
+  case '?':
+  {
+    if (set)
+      return emit(e, value, strlen(value), value_mode(in_double));
+    /* The word is expanded in place and then read back from the buffer */
+    size_t start = e->ex->len;
+    int field_open = e->field_open;
+    int escaped = e->escaped;
+    size_t argc = e->ex->argc;
+    if (expand_text(e, p, end, 1, 1) != 0 || buf_reserve(e->ex, 1) != 0)
+      return -1;
+    char *word = e->ex->buf + start;
+    word[glob_unescape(word, e->ex->len - start)] = '\0';
+    if (op == '?')
+    {
+      fprintf(stderr, "%.*s: %s\n", (int)name_len, name, *word ? word : "parameter not set");
+      return -1;
+    }
+    char *var = strndup(name, name_len);
+    int rval = var == NULL ? -1 : var_set(&e->sh->vars, var, word, 0);
+    free(var);
+    if (rval != 0)
+    {
+      fprintf(stderr, "%.*s: cannot assign\n", (int)name_len, name);
+      return -1;
+    }
+    /* Emit the assigned value again so it is split like any other value */
+    e->ex->len = start;
+    e->ex->argc = argc;
+    e->field_open = field_open;
+    e->escaped = escaped;
+    value = var_get_n(&e->sh->vars, name, name_len);
+    return emit(e, value, strlen(value), value_mode(in_double));
+  }
+  default:
+    fprintf(stderr, "${%.*s}: bad substitution\n", (int)(end - name), name);
+    return -1;
+  }
+}
+
+/**
+ * @brief Expand a $ expansion.
+ *
+ * @param e The expander
+ * @param pp The $, advanced past the expansion
+ * @param end The end of the word
+ * @param in_double Non zero inside double quotes
+ * @return 0 on success, -1 on error
+ */
+static int expand_dollar(struct expander *e, const char **pp, const char *end, int in_double)
+{
+  const char *p = *pp + 1;
+  char num[32];
+
+  if (p + 1 < end && p[0] == '(' && p[1] == '(')
+  {
+    const char *close = find_close(p + 2, end, ')');
+    if (close == NULL || close + 1 >= end || close[1] != ')')
+    {
+      fprintf(stderr, "$((: missing ))\n");
+      return -1;
+    }
+    long long val;
+    const char *expr = p + 2;
+    size_t expr_len = (size_t)(close - expr);
+    if (memchr(expr, '$', expr_len) == NULL && memchr(expr, '`', expr_len) == NULL)
+    {
+      if (arith_eval(&e->sh->vars, expr, expr_len, &val) != 0)
+        return -1;
+    }
+    else
+    {
+      /* Substitutions are expanded in place and the result evaluated */
+      size_t start = e->ex->len;
+      int field_open = e->field_open;
+      int escaped = e->escaped;
+      size_t argc = e->ex->argc;
+      if (expand_text(e, expr, close, 1, 1) != 0)
+        return -1;
+      size_t n = glob_unescape(e->ex->buf + start, e->ex->len - start);
+      int rval = arith_eval(&e->sh->vars, e->ex->buf + start, n, &val);
+      e->ex->len = start;
+      e->ex->argc = argc;
+      e->field_open = field_open;
+      e->escaped = escaped;
+      if (rval != 0)
+        return -1;
+    }
+    *pp = close + 2;
+    snprintf(num, sizeof(num), "%lld", val);
+    return emit(e, num, strlen(num), 0);
+  }
+  if (p < end && *p == '(')
+  {
+    const char *close = find_close(p + 1, end, ')');
+    if (close == NULL)
+    {
+      fprintf(stderr, "$(: missing )\n");
+      return -1;
+    }
+    *pp = close + 1;
+    return expand_subst(e, p + 1, (size_t)(close - p - 1), in_double);
+  }
+  if (p < end && *p == '{')
+  {
+    const char *close = find_close(p + 1, end, '}');
+    if (close == NULL)
+    {
+      fprintf(stderr, "${: missing }\n");
+      return -1;
+    }
+    *pp = close + 1;
+    return expand_braced(e, p + 1, close, in_double);
+  }
+  if (p < end && (*p == '@' || *p == '*'))
+  {
+    *pp = p + 1;
+    return expand_args(e, *p, in_double);
+  }
+  if (p < end && (*p == '?' || *p == '$' || *p == '#' || isdigit((unsigned char)*p)))
+  {
+    *pp = p + 1;
+    const char *value = special_param(e, p, 1, num, sizeof(num));
+    return value ? emit(e, value, strlen(value), value_mode(in_double)) : 0;
+  }
+
+  const char *name = p;
+  while (p < end && (isalnum((unsigned char)*p) || *p == '_'))
+    p++;
+  if (!var_valid_name(name, (size_t)(p - name)))
+  {
+    /* A lone $ is literal */
+    *pp = name;
+    return emit(e, "$", 1, 0);
+  }
+  *pp = p;
+  const char *value = var_get_n(&e->sh->vars, name, (size_t)(p - name));
+  return value ? emit(e, value, strlen(value), value_mode(in_double)) : 0;
+}
+
+/**
+ * @brief Expand ~ or ~user at the start of a word.
+ *
+ * @param e The expander
+ * @param pp The ~, advanced past the user name if it was expanded
+ * @param end The end of the word
+ * @return 0 on success, -1 on error
+ */
+static int expand_tilde(struct expander *e, const char **pp, const char *end)
+{
+  const char *p = *pp + 1;
+  const char *user = p;
+  const char *home;
+
+  while (p < end && *p != '/' && (isalnum((unsigned char)*p) || *p == '_' || *p == '-' || *p == '.'))
+    p++;
+  if (p < end && *p != '/')
+  {
+    *pp = user;
+    return emit(e, "~", 1, 0);
+  }
+
+  if (p == user)
+    home = home_dir(var_get(&e->sh->vars, "HOME"));
+  else
+  {
+    char name[256];
+    if ((size_t)(p - user) >= sizeof(name))
+    {
+      *pp = user;
+      return emit(e, "~", 1, 0);
+    }
+    memcpy(name, user, (size_t)(p - user));
+    name[p - user] = '\0';
+    struct passwd *pw = getpwnam(name);
+    home = pw ? pw->pw_dir : NULL;
+  }
+  if (home == NULL)
+  {
+    /* An unknown user is left alone */
+    *pp = user;
+    return emit(e, "~", 1, 0);
+  }
+  *pp = p;
+  return emit(e, home, strlen(home), EMIT_QUOTED);
+}
+
+/**
+ * @brief Expand text into the output buffer, removing quotes.
+ *
+ * @param e The expander
+ * @param p The text
+ * @param end The end of the text
+ * @param in_double Non zero if the text is inside double quotes
+ * @param nested Non zero for the word of ${NAME:-word}, where unquoted
+ * blanks separate fields
+ * @return 0 on success, -1 on error
+ */
+static int expand_text(struct expander *e, const char *p, const char *end, int in_double,
+                       int nested)
+{
+  while (p < end)
+  {
+    const char *run = p;
+    /* Copy plain characters in one go */
+    while (p < end && *p != '\\' && *p != '\'' && *p != '"' && *p != '$' && *p != '`' &&
+           !(nested && !in_double && (*p == ' ' || *p == '\t' || *p == '\n')) &&
+           !(!nested && !in_double && (*p == '<' || *p == '>') && p + 1 < end && p[1] == '('))
+      p++;
+    if (p > run && emit(e, run, (size_t)(p - run), in_double ? EMIT_QUOTED : 0) != 0)
+      return -1;
+    if (p >= end)
+      break;
+
+    int rval = 0;
+    switch (*p)
+    {
+    case '\\':
+      if (p + 1 >= end)
+        rval = emit(e, p++, 1, EMIT_QUOTED);
+      else if (p[1] == '\n')
+        p += 2; /* line continuation */
+      else if (!in_double || strchr(in_double == TEXT_HEREDOC ? "$`\\" : "$`\"\\", p[1]) != NULL)
+      {
+        rval = emit(e, p + 1, 1, EMIT_QUOTED);
+        p += 2;
+      }
+      else
+        rval = emit(e, p++, 1, EMIT_QUOTED);
+      break;
+    case '\'':
+      if (in_double)
+      {
+        rval = emit(e, p++, 1, EMIT_QUOTED);
+        break;
+      }
+      run = ++p;
+      while (p < end && *p != '\'')
+        p++;
+      rval = emit(e, run, (size_t)(p - run), EMIT_QUOTED);
+      if (p < end)
+        p++;
+      break;
+    case '"':
+      if (in_double == TEXT_HEREDOC)
+      {
+        rval = emit(e, p++, 1, EMIT_QUOTED);
+        break;
+      }
+      in_double = !in_double;
+      e->field_open = 1;
+      p++;
+      break;
+    case '$':
+      rval = expand_dollar(e, &p, end, in_double);
+      break;
+    case '`':
+      rval = expand_backquote(e, &p, end, in_double);
+      break;
+    case '<':
+    case '>':
+      rval = expand_procsubst(e, &p, end);
+      break;
+    default:
+      rval = emit(e, p++, 1, EMIT_SPLIT);
+      break;
+    }
+    if (rval != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Expand the words of a command: parameters, ~, $((...)), command
+ * and process substitution, then pathname expansion and quote removal.
+ * Unquoted results of expansions are split on blanks. All fields are
+ * written to one buffer that is reused for the next command, so the work
+ * done is linear in the length of the output.
+ *
+ * @param sh The shell
+ * @param words The words from cmd_parse
+ * @param ex The expansion, argv is NULL terminated and points into buf
+ * @return 0 on success, -1 after printing an error
+ */
+int expand_words(struct shell *sh, char **words, struct expansion *ex)
+{
+  struct expander e = {sh, ex, 0, 0, 0, 0};
+
+  /* Left over if the caller did not run the last command */
+  procsubst_reap(sh, ex);
+  ex->jobs_seen = sh->jobs_started;
+  const char *threads = var_get(&sh->vars, "GLOB_THREADS");
+  ex->glob_threads = threads ? atoi(threads) : 0;
+  ex->len = 0;
+  ex->argc = 0;
+  for (int i = 0; words != NULL && words[i] != NULL; i++)
+  {
+    const char *p = words[i];
+    const char *end = p + strlen(p);
+    if (*p == '~' && expand_tilde(&e, &p, end) != 0)
+      return -1;
+    if (expand_text(&e, p, end, 0, 0) != 0 || field_end(&e) != 0)
+      return -1;
+  }
+  /* Only now can the command inherit the pipes */
+  for (size_t i = 0; i < ex->nprocs; i++)
+    fcntl(ex->procs[i].fd, F_SETFD, 0);
+
+  if (ex->argc + 1 > ex->argv_cap)
+  {
+    size_t cap = ex->argv_cap ? ex->argv_cap : 16;
+    while (cap < ex->argc + 1)
+      cap *= 2;
+    char **argv = realloc(ex->argv, cap * sizeof(char *));
+    if (argv == NULL)
+      return -1;
+    ex->argv = argv;
+    ex->argv_cap = cap;
+  }
+
+  /* The fields are back to back, each one ends with a NUL */
+  char *field = ex->buf;
+  for (size_t i = 0; i < ex->argc; i++)
+  {
+    ex->argv[i] = field;
+    field += strlen(field) + 1;
+  }
+  ex->argv[ex->argc] = NULL;
+  return 0;
+}
+
+/**
+ * @brief Expand the body of a here-document: parameters, $((...)) and
+ * command substitution as inside double quotes, but quotes are kept.
+ *
+ * @param sh The shell
+ * @param text The body
+ * @param len The length of the body
+ * @param ex The expansion, the result is the NUL terminated start of buf
+ * @return The length of the result or -1 after printing an error
+ */
+ssize_t expand_heredoc(struct shell *sh, const char *text, size_t len, struct expansion *ex)
+{
+  struct expander e = {sh, ex, 0, 0, 0, 0};
+
+  procsubst_reap(sh, ex);
+  ex->jobs_seen = sh->jobs_started;
+  ex->len = 0;
+  ex->argc = 0;
+  if (expand_text(&e, text, text + len, TEXT_HEREDOC, 0) != 0 || field_end(&e) != 0)
+    return -1;
+  return ex->argc > 0 ? (ssize_t)ex->len - 1 : 0;
+}
+
+/**
+ * @brief Free the buffers of an expansion.
+ *
+ * @param ex The expansion
+ */
+void expansion_free(struct expansion *ex)
+{
+  for (size_t i = 0; i < ex->nprocs; i++)
+    close(ex->procs[i].fd);
+  free(ex->procs);
+  glob_cache_clear(ex);
+  free(ex->glob);
+  free(ex->buf);
+  free(ex->argv);
+  memset(ex, 0, sizeof(*ex));
+}
+
+/**
+ * @brief Close the shell's end of the process substitutions of a command
+ * after it ran. If the command became a job the processes are tracked by
+ * that job, otherwise they are waited for.
+ *
+ * @param sh The shell
+ * @param ex The expansion the command came from
+ */
+void procsubst_reap(struct shell *sh, struct expansion *ex)
+{
+  struct bg_process *bgp = NULL;
+  if (sh->jobs_started != ex->jobs_seen && sh->num_bg_processes > 0)
+    bgp = &sh->bg_processes[sh->num_bg_processes - 1];
+
+  for (size_t i = 0; i < ex->nprocs; i++)
+  {
+    close(ex->procs[i].fd);
+    pid_t pid = ex->procs[i].pid;
+    if (bgp != NULL)
+    {
+      job_track(bgp, pid);
+      continue;
+    }
+    /* An interrupted command does not leave a reader or writer behind */
+    if (sh->last_status == 128 + SIGINT)
+      kill(pid, SIGINT);
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+    {
+    }
+  }
+  ex->nprocs = 0;
+  ex->jobs_seen = sh->jobs_started;
+}
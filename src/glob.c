@@ -0,0 +1,1076 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define GLOB_BUCKETS 256
+#define GETDENTS_BUF (64 * 1024)
+#define GLOB_MAX_THREADS 64
+#define GLOB_DEFAULT_THREADS 8
+
+/**
+ * @brief A directory entry as returned by getdents64.
+ */
+struct raw_dirent64
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * @brief The listing of one directory. The names are stored back to back
+ * in one block.
+ */
+struct glob_dir
+{
+  struct glob_dir *next;
+  char *path;
+  char *names;
+  size_t *offsets;
+  unsigned char *types;
+  size_t count;
+  dev_t dev; /* the directory as it was listed, 0 if it could not be */
+  ino_t ino;
+  struct timespec mtime;
+};
+
+/**
+ * @brief Directory listings cached for the duration of a command line.
+ */
+struct glob_cache
+{
+  struct glob_dir *buckets[GLOB_BUCKETS];
+};
+
+/**
+ * @brief One component of a pattern, the text between two slashes.
+ */
+struct glob_comp
+{
+  const char *text;
+  size_t len;
+  int meta;     /* has unescaped glob characters */
+  int globstar; /* is exactly ** */
+};
+
+/**
+ * @brief State of one pattern expansion.
+ */
+struct glob_walk
+{
+  struct expansion *ex;
+  struct glob_comp *comps;
+  int ncomps;
+  int dir_only; /* the pattern ended with a slash */
+  char *path;
+  size_t len;
+  size_t cap;
+  size_t matches;
+  int threads;
+};
+
+/**
+ * @brief A double ended queue of directories, relative to the base of a
+ * parallel walk. The owner works at the tail, thieves take from the head.
+ */
+struct walk_deque
+{
+  pthread_mutex_t lock;
+  char **items;
+  size_t head;
+  size_t count;
+  size_t cap;
+};
+
+/**
+ * @brief A parallel walk of the tree below one directory.
+ */
+struct par_walk
+{
+  int base_fd;
+  const struct glob_comp *tail; /* the component after **, NULL if none */
+  char *literal;                /* the tail without escapes if it has no glob characters */
+  int dots;                     /* the tail may match hidden names */
+  int nthreads;
+  struct walk_deque queues[GLOB_MAX_THREADS];
+  atomic_size_t pending; /* queued plus in progress directories */
+  atomic_int failed;
+};
+
+/**
+ * @brief One thread of a parallel walk and the matches it found, each one
+ * a d_type byte followed by a NUL terminated path.
+ */
+struct walk_worker
+{
+  struct par_walk *pw;
+  int id;
+  pthread_t thread;
+  char *out;
+  size_t len;
+  size_t cap;
+  size_t count;
+};
+
+/**
+ * @brief Remove backslash escapes in place.
+ *
+ * @param s The text
+ * @param len The length of the text
+ * @return The new length
+ */
+size_t glob_unescape(char *s, size_t len)
+{
+  size_t j = 0;
+  for (size_t i = 0; i < len; i++)
+  {
+    if (s[i] == '\\' && i + 1 < len)
+      i++;
+    s[j++] = s[i];
+  }
+  return j;
+}
+
+/**
+ * @brief Match one character against a bracket expression.
+ *
+ * @param pp The character after the opening bracket, advanced past the
+ * closing one
+ * @param end The end of the pattern
+ * @param c The character
+ * @return 1 on a match, 0 if there is no match and -1 if the bracket is
+ * not closed and should be matched literally
+ */
+static int match_bracket(const char **pp, const char *end, unsigned char c)
+{
+  const char *p = *pp;
+  int negate = 0;
+  int match = 0;
+
+  if (p < end && (*p == '!' || *p == '^'))
+  {
+    negate = 1;
+    p++;
+  }
+  for (int first = 1; p < end && (first || *p != ']'); first = 0)
+  {
+    unsigned char lo = (unsigned char)*p;
+    if (lo == '\\' && p + 1 < end)
+      lo = (unsigned char)*++p;
+    p++;
+    unsigned char hi = lo;
+    if (p + 1 < end && *p == '-' && p[1] != ']')
+    {
+      hi = (unsigned char)*++p;
+      if (hi == '\\' && p + 1 < end)
+        hi = (unsigned char)*++p;
+      p++;
+    }
+    if (lo <= c && c <= hi)
+      match = 1;
+  }
+  if (p >= end)
+    return -1;
+  *pp = p + 1;
+  return match != negate;
+}
+
+/**
+ * @brief Match a name against one pattern component. A * backtracks to
+ * the last star only, so the match is linear for all practical patterns.
+ *
+ * @param pat The pattern
+ * @param len The length of the pattern
+ * @param name The name
+ * @return Non zero if the name matches
+ */
+int glob_match(const char *pat, size_t len, const char *name)
+{
+  const char *p = pat;
+  const char *end = pat + len;
+  const char *star_p = NULL;
+  const char *star_s = NULL;
+  const char *s = name;
+
+  while (*s != '\0')
+  {
+    if (p < end && *p == '*')
+    {
+      star_p = ++p;
+      star_s = s;
+      continue;
+    }
+    if (p < end)
+    {
+      const char *next = p + 1;
+      int match;
+      if (*p == '?')
+        match = 1;
+      else if (*p == '[' && (match = match_bracket(&next, end, (unsigned char)*s)) >= 0)
+      {
+      }
+      else if (*p == '\\' && p + 1 < end)
+      {
+        match = p[1] == *s;
+        next = p + 2;
+      }
+      else
+        match = *p == *s;
+      if (match)
+      {
+        p = next;
+        s++;
+        continue;
+      }
+    }
+    if (star_p == NULL)
+      return 0;
+    p = star_p;
+    s = ++star_s;
+  }
+  while (p < end && *p == '*')
+    p++;
+  return p == end;
+}
+
+static uint32_t path_hash(const char *path)
+{
+  uint32_t h = 2166136261u;
+  for (; *path != '\0'; path++)
+  {
+    h ^= (unsigned char)*path;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Read a directory in bulk with getdents64.
+ *
+ * @param path The directory, "" for the current one
+ * @return The listing, empty if the directory cannot be read, or NULL if
+ * out of memory
+ */
+static struct glob_dir *dir_read(const char *path)
+{
+  struct glob_dir *dir = calloc(1, sizeof(struct glob_dir));
+  if (dir == NULL || (dir->path = strdup(path)) == NULL)
+  {
+    free(dir);
+    return NULL;
+  }
+
+  int fd = open(*path ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return dir;
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+  {
+    dir->dev = st.st_dev;
+    dir->ino = st.st_ino;
+    dir->mtime = st.st_mtim;
+  }
+
+  char *buf = malloc(GETDENTS_BUF);
+  size_t used = 0, names_cap = 0, cap = 0;
+  long n = 0;
+  while (buf != NULL && (n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF)) > 0)
+  {
+    for (long pos = 0; pos < n;)
+    {
+      struct raw_dirent64 *de = (struct raw_dirent64 *)(buf + pos);
+      pos += de->d_reclen;
+      if (de->d_name[0] == '.' &&
+          (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+        continue;
+
+      size_t len = strlen(de->d_name) + 1;
+      if (used + len > names_cap)
+      {
+        size_t ncap = names_cap ? names_cap * 2 : 4096;
+        while (ncap < used + len)
+          ncap *= 2;
+        char *names = realloc(dir->names, ncap);
+        if (names == NULL)
+          goto out;
+        dir->names = names;
+        names_cap = ncap;
+      }
+      if (dir->count == cap)
+      {
+        size_t ncap = cap ? cap * 2 : 64;
+        size_t *offsets = realloc(dir->offsets, ncap * sizeof(size_t));
+        if (offsets == NULL)
+          goto out;
+        dir->offsets = offsets;
+        unsigned char *types = realloc(dir->types, ncap);
+        if (types == NULL)
+          goto out;
+        dir->types = types;
+        cap = ncap;
+      }
+      memcpy(dir->names + used, de->d_name, len);
+      dir->offsets[dir->count] = used;
+      dir->types[dir->count++] = de->d_type;
+      used += len;
+    }
+  }
+out:
+  free(buf);
+  close(fd);
+  return dir;
+}
+
+/**
+ * @brief Free the listing of a directory.
+ *
+ * @param dir The listing
+ */
+static void dir_free(struct glob_dir *dir)
+{
+  free(dir->path);
+  free(dir->names);
+  free(dir->offsets);
+  free(dir->types);
+  free(dir);
+}
+
+/**
+ * @brief Check that a listing still shows its directory. One stat is far
+ * cheaper than listing a large directory again.
+ *
+ * @param dir The listing
+ * @return Non zero if the directory is the same and unchanged
+ */
+static int dir_current(const struct glob_dir *dir)
+{
+  struct stat st;
+  if (stat(*dir->path ? dir->path : ".", &st) != 0)
+    return dir->dev == 0;
+  return st.st_dev == dir->dev && st.st_ino == dir->ino &&
+         st.st_mtim.tv_sec == dir->mtime.tv_sec && st.st_mtim.tv_nsec == dir->mtime.tv_nsec;
+}
+
+/**
+ * @brief Find the listing of a directory, reading it on first use and
+ * again if it changed since.
+ *
+ * @param ex The expansion that owns the cache
+ * @param path The directory, "" for the current one
+ * @return The listing or NULL if out of memory
+ */
+static struct glob_dir *dir_lookup(struct expansion *ex, const char *path)
+{
+  if (ex->glob == NULL && (ex->glob = calloc(1, sizeof(struct glob_cache))) == NULL)
+    return NULL;
+
+  struct glob_dir **bucket = &ex->glob->buckets[path_hash(path) % GLOB_BUCKETS];
+  for (struct glob_dir **at = bucket; *at != NULL; at = &(*at)->next)
+  {
+    struct glob_dir *dir = *at;
+    if (strcmp(dir->path, path) != 0)
+      continue;
+    if (dir_current(dir))
+      return dir;
+    /* The line changed the directory, or moved to another one */
+    *at = dir->next;
+    dir_free(dir);
+    break;
+  }
+  struct glob_dir *dir = dir_read(path);
+  if (dir != NULL)
+  {
+    dir->next = *bucket;
+    *bucket = dir;
+  }
+  return dir;
+}
+
+/**
+ * @brief Drop the cached directory listings.
+ *
+ * @param ex The expansion that owns the cache
+ */
+void glob_cache_clear(struct expansion *ex)
+{
+  if (ex->glob == NULL)
+    return;
+  for (int i = 0; i < GLOB_BUCKETS; i++)
+  {
+    struct glob_dir *dir = ex->glob->buckets[i];
+    while (dir != NULL)
+    {
+      struct glob_dir *next = dir->next;
+      dir_free(dir);
+      dir = next;
+    }
+    ex->glob->buckets[i] = NULL;
+  }
+}
+
+/**
+ * @brief Drop the directory listings of every expansion of the shell. A
+ * listing is only kept for one command line.
+ *
+ * @param sh The shell
+ */
+void glob_cache_reset(struct shell *sh)
+{
+  for (size_t i = 0; i < sh->exp_cap; i++)
+  {
+    if (sh->exps[i] != NULL)
+      glob_cache_clear(sh->exps[i]);
+  }
+}
+
+/**
+ * @brief Append to the path being built.
+ *
+ * @param w The walk
+ * @param s The text
+ * @param len The length of the text
+ * @return 0 on success, -1 if out of memory
+ */
+static int path_push(struct glob_walk *w, const char *s, size_t len)
+{
+  int slash = w->len > 0 && w->path[w->len - 1] != '/';
+  if (w->len + len + 2 > w->cap)
+  {
+    size_t cap = w->cap ? w->cap : 256;
+    while (cap < w->len + len + 2)
+      cap *= 2;
+    char *path = realloc(w->path, cap);
+    if (path == NULL)
+      return -1;
+    w->path = path;
+    w->cap = cap;
+  }
+  if (slash)
+    w->path[w->len++] = '/';
+  memcpy(w->path + w->len, s, len);
+  w->len += len;
+  w->path[w->len] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Check the type of the file at the current path.
+ *
+ * @param w The walk
+ * @param type The d_type from the listing
+ * @param follow Non zero to follow symbolic links
+ * @return Non zero if the path is a directory
+ */
+static int path_is_dir(struct glob_walk *w, unsigned char type, int follow)
+{
+  struct stat st;
+  if (type == DT_DIR)
+    return 1;
+  if (type != DT_UNKNOWN && !(follow && type == DT_LNK))
+    return 0;
+  if (fstatat(AT_FDCWD, w->path, &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) != 0)
+    return 0;
+  return S_ISDIR(st.st_mode);
+}
+
+/**
+ * @brief Make room in the output buffer.
+ *
+ * @param ex The expansion
+ * @param extra The number of bytes that will be added
+ * @return 0 on success, -1 if out of memory
+ */
+static int out_reserve(struct expansion *ex, size_t extra)
+{
+  if (ex->len + extra <= ex->cap)
+    return 0;
+  size_t cap = ex->cap ? ex->cap : 256;
+  while (cap < ex->len + extra)
+    cap *= 2;
+  char *buf = realloc(ex->buf, cap);
+  if (buf == NULL)
+    return -1;
+  ex->buf = buf;
+  ex->cap = cap;
+  return 0;
+}
+
+/**
+ * @brief Add the current path to the results.
+ *
+ * @param w The walk
+ * @param type The d_type of the path, DT_UNKNOWN if it is not known
+ * @return 0 on success, -1 if out of memory
+ */
+static int walk_emit(struct glob_walk *w, unsigned char type)
+{
+  struct expansion *ex = w->ex;
+  int slash = w->dir_only;
+
+  if (slash && !path_is_dir(w, type, 1))
+    return 0;
+  if (out_reserve(ex, w->len + 2) != 0)
+    return -1;
+  memcpy(ex->buf + ex->len, w->path, w->len);
+  ex->len += w->len;
+  if (slash && (w->len == 0 || w->path[w->len - 1] != '/'))
+    ex->buf[ex->len++] = '/';
+  ex->buf[ex->len++] = '\0';
+  ex->argc++;
+  w->matches++;
+  return 0;
+}
+
+static int walk_parallel(struct glob_walk *w, int i);
+
+/**
+ * @brief Match the components from i on below the current path.
+ *
+ * @param w The walk
+ * @param i The component to match
+ * @return 0 on success, -1 if out of memory
+ */
+static int walk(struct glob_walk *w, int i)
+{
+  if (i == w->ncomps)
+    return walk_emit(w, DT_UNKNOWN);
+
+  const struct glob_comp *c = &w->comps[i];
+  size_t len = w->len;
+  int last = i == w->ncomps - 1;
+  int rval = 0;
+
+  if (!c->meta)
+  {
+    char name[c->len + 1];
+    memcpy(name, c->text, c->len);
+    size_t n = glob_unescape(name, c->len);
+    if (path_push(w, name, n) != 0)
+      return -1;
+    struct stat st;
+    if (!last)
+      rval = walk(w, i + 1);
+    else if (fstatat(AT_FDCWD, w->path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+      rval = walk_emit(w, DT_UNKNOWN);
+    w->len = len;
+    w->path[len] = '\0';
+    return rval;
+  }
+
+  /* A ** followed by at most one plain component is walked in parallel */
+  if (c->globstar && w->threads > 1 && i + 2 >= w->ncomps &&
+      (last || !w->comps[i + 1].globstar))
+    return walk_parallel(w, i);
+
+  /* ** matches no directory at all as well as any number of them */
+  if (c->globstar && !last && (rval = walk(w, i + 1)) != 0)
+    return rval;
+
+  char dir_path[len + 1];
+  memcpy(dir_path, w->path ? w->path : "", len);
+  dir_path[len] = '\0';
+  struct glob_dir *dir = dir_lookup(w->ex, dir_path);
+  if (dir == NULL)
+    return -1;
+
+  /* Hidden names only match a pattern that starts with a dot */
+  int dots = c->text[0] == '.' || (c->text[0] == '\\' && c->len > 1 && c->text[1] == '.');
+  for (size_t k = 0; k < dir->count && rval == 0; k++)
+  {
+    const char *name = dir->names + dir->offsets[k];
+    unsigned char type = dir->types[k];
+    if (name[0] == '.' && (!dots || c->globstar))
+      continue;
+    if (!c->globstar && !glob_match(c->text, c->len, name))
+      continue;
+    if (path_push(w, name, strlen(name)) != 0)
+      return -1;
+    if (c->globstar)
+    {
+      /* Symbolic links are not followed, so a walk cannot loop */
+      if (last)
+        rval = walk_emit(w, type);
+      if (rval == 0 && path_is_dir(w, type, 0))
+        rval = walk(w, i);
+    }
+    else if (last)
+      rval = walk_emit(w, type);
+    else if (path_is_dir(w, type, 1))
+      rval = walk(w, i + 1);
+    w->len = len;
+    if (w->path)
+      w->path[len] = '\0';
+  }
+  return rval;
+}
+
+/**
+ * @brief Add a directory to a queue.
+ *
+ * @param q The queue
+ * @param rel The directory, owned by the queue on success
+ * @return 0 on success, -1 if out of memory
+ */
+static int deque_push(struct walk_deque *q, char *rel)
+{
+  int rval = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->cap)
+  {
+    size_t cap = q->cap ? q->cap * 2 : 64;
+    char **items = malloc(cap * sizeof(char *));
+    if (items == NULL)
+      rval = -1;
+    else
+    {
+      for (size_t i = 0; i < q->count; i++)
+        items[i] = q->items[(q->head + i) % q->cap];
+      free(q->items);
+      q->items = items;
+      q->head = 0;
+      q->cap = cap;
+    }
+  }
+  if (rval == 0)
+    q->items[(q->head + q->count++) % q->cap] = rel;
+  pthread_mutex_unlock(&q->lock);
+  return rval;
+}
+
+/**
+ * @brief Take a directory from a queue.
+ *
+ * @param q The queue
+ * @param steal Non zero to take the oldest directory instead of the newest
+ * @return The directory or NULL if the queue is empty
+ */
+static char *deque_pop(struct walk_deque *q, int steal)
+{
+  char *rel = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0)
+  {
+    if (steal)
+    {
+      rel = q->items[q->head];
+      q->head = (q->head + 1) % q->cap;
+    }
+    else
+      rel = q->items[(q->head + q->count - 1) % q->cap];
+    q->count--;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return rel;
+}
+
+/**
+ * @brief Record a match found by a worker.
+ *
+ * @param wk The worker
+ * @param rel The directory the match is in
+ * @param name The name of the match
+ * @param type The d_type of the match
+ * @return 0 on success, -1 if out of memory
+ */
+static int worker_record(struct walk_worker *wk, const char *rel, const char *name,
+                         unsigned char type)
+{
+  size_t rlen = strlen(rel);
+  size_t nlen = strlen(name);
+  size_t need = 1 + rlen + 1 + nlen + 1;
+  if (wk->len + need > wk->cap)
+  {
+    size_t cap = wk->cap ? wk->cap * 2 : 4096;
+    while (cap < wk->len + need)
+      cap *= 2;
+    char *out = realloc(wk->out, cap);
+    if (out == NULL)
+      return -1;
+    wk->out = out;
+    wk->cap = cap;
+  }
+  char *p = wk->out + wk->len;
+  *p++ = (char)type;
+  memcpy(p, rel, rlen);
+  p += rlen;
+  if (rlen > 0)
+    *p++ = '/';
+  memcpy(p, name, nlen + 1);
+  wk->len = (size_t)(p + nlen + 1 - wk->out);
+  wk->count++;
+  return 0;
+}
+
+/**
+ * @brief List one directory of a parallel walk, record what matches the
+ * tail and queue the subdirectories.
+ *
+ * @param wk The worker
+ * @param rel The directory relative to the base
+ * @param buf A buffer of GETDENTS_BUF bytes
+ * @return 0 on success, -1 if out of memory
+ */
+static int worker_visit(struct walk_worker *wk, const char *rel, char *buf)
+{
+  struct par_walk *pw = wk->pw;
+  int fd = openat(pw->base_fd, *rel ? rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  long n;
+  int rval = 0;
+  size_t rlen = strlen(rel);
+  while (rval == 0 && (n = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF)) > 0)
+  {
+    for (long pos = 0; pos < n && rval == 0;)
+    {
+      struct raw_dirent64 *de = (struct raw_dirent64 *)(buf + pos);
+      const char *name = de->d_name;
+      pos += de->d_reclen;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        continue;
+
+      unsigned char type = de->d_type;
+      struct stat st;
+      if (type == DT_UNKNOWN && fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK : DT_REG;
+
+      int hidden = name[0] == '.';
+      if (pw->tail == NULL)
+      {
+        if (!hidden)
+          rval = worker_record(wk, rel, name, type);
+      }
+      else if (pw->literal != NULL ? strcmp(pw->literal, name) == 0
+                                   : (!hidden || pw->dots) && glob_match(pw->tail->text, pw->tail->len, name))
+        rval = worker_record(wk, rel, name, type);
+
+      if (rval != 0 || type != DT_DIR || hidden)
+        continue;
+      char *child = malloc(rlen + strlen(name) + 2);
+      if (child == NULL)
+      {
+        rval = -1;
+        break;
+      }
+      sprintf(child, rlen ? "%s/%s" : "%s%s", rel, name);
+      atomic_fetch_add(&pw->pending, 1);
+      if (deque_push(&pw->queues[wk->id], child) != 0)
+      {
+        free(child);
+        atomic_fetch_sub(&pw->pending, 1);
+        rval = -1;
+      }
+    }
+  }
+  close(fd);
+  return rval;
+}
+
+/**
+ * @brief Work on the own queue, steal from the others when it runs dry
+ * and stop once no directory is queued or being listed anywhere.
+ *
+ * @param arg The worker
+ * @return NULL
+ */
+static void *worker_run(void *arg)
+{
+  struct walk_worker *wk = arg;
+  struct par_walk *pw = wk->pw;
+  char *buf = malloc(GETDENTS_BUF);
+
+  if (buf == NULL)
+  {
+    atomic_store(&pw->failed, 1);
+    return NULL;
+  }
+  for (;;)
+  {
+    char *rel = deque_pop(&pw->queues[wk->id], 0);
+    for (int k = 1; rel == NULL && k < pw->nthreads; k++)
+      rel = deque_pop(&pw->queues[(wk->id + k) % pw->nthreads], 1);
+    if (rel == NULL)
+    {
+      if (atomic_load(&pw->pending) == 0)
+        break;
+      sched_yield();
+      continue;
+    }
+    if (!atomic_load(&pw->failed) && worker_visit(wk, rel, buf) != 0)
+      atomic_store(&pw->failed, 1);
+    free(rel);
+    atomic_fetch_sub(&pw->pending, 1);
+  }
+  free(buf);
+  return NULL;
+}
+
+/**
+ * @brief Match a ** component followed by at most one more component
+ * with several threads. The tree is walked with openat relative to the
+ * directory the ** starts in, every thread has its own queue of
+ * directories and idle threads steal from the others.
+ *
+ * @param w The walk
+ * @param i The ** component
+ * @return 0 on success, -1 if out of memory
+ */
+static int walk_parallel(struct glob_walk *w, int i)
+{
+  struct par_walk *pw = calloc(1, sizeof(struct par_walk));
+  struct walk_worker *workers = calloc((size_t)w->threads, sizeof(struct walk_worker));
+  int rval = -1;
+  int started = 0;
+
+  if (pw != NULL)
+    pw->base_fd = -1;
+  if (pw == NULL || workers == NULL)
+    goto out;
+  for (int k = 0; k < w->threads; k++)
+    pthread_mutex_init(&pw->queues[k].lock, NULL);
+  pw->nthreads = w->threads;
+  pw->base_fd = open(w->len ? w->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (pw->base_fd < 0)
+  {
+    /* Nothing below a directory that cannot be opened */
+    rval = 0;
+    goto out;
+  }
+  if (i + 1 < w->ncomps)
+  {
+    const struct glob_comp *c = &w->comps[i + 1];
+    pw->tail = c;
+    pw->dots = c->text[0] == '.' || (c->text[0] == '\\' && c->len > 1 && c->text[1] == '.');
+    if (!c->meta)
+    {
+      if ((pw->literal = strndup(c->text, c->len)) == NULL)
+        goto out;
+      pw->literal[glob_unescape(pw->literal, c->len)] = '\0';
+    }
+  }
+  char *root = strdup("");
+  atomic_store(&pw->pending, 1);
+  if (root == NULL || deque_push(&pw->queues[0], root) != 0)
+  {
+    free(root);
+    goto out;
+  }
+  for (started = 1; started < pw->nthreads; started++)
+  {
+    workers[started].pw = pw;
+    workers[started].id = started;
+    if (pthread_create(&workers[started].thread, NULL, worker_run, &workers[started]) != 0)
+      break;
+  }
+  /* This thread is worker 0, fewer threads only make the walk slower */
+  workers[0].pw = pw;
+  worker_run(&workers[0]);
+  for (int k = 1; k < started; k++)
+    pthread_join(workers[k].thread, NULL);
+
+  /* Leftovers after a failure */
+  for (int k = 0; k < w->threads; k++)
+  {
+    char *rel;
+    while ((rel = deque_pop(&pw->queues[k], 0)) != NULL)
+      free(rel);
+  }
+  if (atomic_load(&pw->failed))
+    goto out;
+
+  size_t len = w->len;
+  rval = 0;
+  for (int k = 0; k < started && rval == 0; k++)
+  {
+    const char *p = workers[k].out;
+    for (size_t m = 0; m < workers[k].count && rval == 0; m++)
+    {
+      unsigned char type = (unsigned char)*p++;
+      size_t n = strlen(p);
+      if (path_push(w, p, n) != 0)
+        rval = -1;
+      else
+        rval = walk_emit(w, type);
+      w->len = len;
+      if (w->path != NULL)
+        w->path[len] = '\0';
+      p += n + 1;
+    }
+  }
+out:
+  if (pw != NULL)
+  {
+    if (pw->base_fd >= 0)
+      close(pw->base_fd);
+    for (int k = 0; k < pw->nthreads; k++)
+    {
+      free(pw->queues[k].items);
+      pthread_mutex_destroy(&pw->queues[k].lock);
+    }
+    free(pw->literal);
+  }
+  if (workers != NULL)
+  {
+    for (int k = 0; k < w->threads; k++)
+      free(workers[k].out);
+  }
+  free(workers);
+  free(pw);
+  return rval;
+}
+
+static int compare_path(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief Sort the fields from start on in byte order.
+ *
+ * @param ex The expansion
+ * @param start The offset of the first field
+ * @param count The number of fields
+ * @return 0 on success, -1 if out of memory
+ */
+static int sort_fields(struct expansion *ex, size_t start, size_t count)
+{
+  size_t len = ex->len - start;
+  char **fields = malloc(count * sizeof(char *));
+  char *copy = malloc(len);
+  if (fields == NULL || copy == NULL)
+  {
+    free(fields);
+    free(copy);
+    return -1;
+  }
+  memcpy(copy, ex->buf + start, len);
+  char *field = copy;
+  for (size_t i = 0; i < count; i++)
+  {
+    fields[i] = field;
+    field += strlen(field) + 1;
+  }
+  qsort(fields, count, sizeof(char *), compare_path);
+  char *out = ex->buf + start;
+  for (size_t i = 0; i < count; i++)
+  {
+    size_t n = strlen(fields[i]) + 1;
+    memcpy(out, fields[i], n);
+    out += n;
+  }
+  free(fields);
+  free(copy);
+  return 0;
+}
+
+/**
+ * @brief Pick the number of threads for a ** walk.
+ *
+ * @param requested The requested number, 0 for the default
+ * @return The number of threads
+ */
+static int glob_thread_count(int requested)
+{
+  if (requested <= 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    requested = cpus < 1 ? 1 : cpus > GLOB_DEFAULT_THREADS ? GLOB_DEFAULT_THREADS : (int)cpus;
+  }
+  return requested > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : requested;
+}
+
+/**
+ * @brief Replace the pattern at the end of the buffer by the sorted paths
+ * it matches, or by the pattern itself without escapes if nothing matches.
+ * Directory listings are cached in the expansion until the next command.
+ * A ** followed by at most one more component is walked with
+ * glob_threads threads.
+ *
+ * @param ex The expansion
+ * @param start The offset of the pattern, which runs to the end of the buffer
+ * @return 0 on success, -1 if out of memory
+ */
+int glob_expand(struct expansion *ex, size_t start)
+{
+  size_t len = ex->len - start;
+  char *pat = malloc(len + 1);
+  struct glob_comp *comps = malloc((len / 2 + 2) * sizeof(struct glob_comp));
+  struct glob_walk w = {ex, comps, 0, 0, NULL, 0, 0, 0, glob_thread_count(ex->glob_threads)};
+  int rval = -1;
+
+  if (pat == NULL || comps == NULL)
+    goto out;
+  memcpy(pat, ex->buf + start, len);
+  pat[len] = '\0';
+
+  const char *p = pat;
+  if (*p == '/')
+  {
+    if (path_push(&w, "/", 1) != 0)
+      goto out;
+    while (*p == '/')
+      p++;
+  }
+  while (*p != '\0')
+  {
+    struct glob_comp *c = &comps[w.ncomps];
+    c->text = p;
+    c->meta = 0;
+    while (*p != '\0' && *p != '/')
+    {
+      if (*p == '\\' && p[1] != '\0')
+        p++;
+      else if (*p == '*' || *p == '?')
+        c->meta = 1;
+      else if (*p == '[' && strcspn(p + 1, "]/") < strcspn(p + 1, "/"))
+        c->meta = 1;
+      p++;
+    }
+    c->len = (size_t)(p - c->text);
+    c->globstar = c->len == 2 && strncmp(c->text, "**", 2) == 0;
+    w.ncomps++;
+    while (*p == '/')
+      p++;
+    if (*p == '\0' && p[-1] == '/')
+      w.dir_only = 1;
+  }
+
+  ex->len = start;
+  size_t argc = ex->argc;
+  if (walk(&w, 0) != 0)
+    goto out;
+
+  if (w.matches == 0)
+  {
+    /* No match leaves the word as it was, less the escapes */
+    size_t n = glob_unescape(pat, len);
+    if (out_reserve(ex, n + 1) != 0)
+      goto out;
+    memcpy(ex->buf + start, pat, n);
+    ex->len = start + n;
+    ex->buf[ex->len++] = '\0';
+    ex->argc = argc + 1;
+    rval = 0;
+  }
+  else
+    rval = sort_fields(ex, start, w.matches);
+out:
+  free(w.path);
+  free(pat);
+  free(comps);
+  return rval;
+}
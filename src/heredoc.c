@@ -0,0 +1,204 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+/* A pipe holds this much without a reader, larger bodies go to a memfd */
+#define HEREDOC_PIPE_MAX PIPE_BUF
+
+/**
+ * @brief A growable buffer for the body of a here-document.
+ */
+struct here_buf
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+/**
+ * @brief Append text to a body.
+ *
+ * @param b The body
+ * @param s The text
+ * @param n The length of the text
+ * @return 0 on success, -1 if out of memory
+ */
+static int here_append(struct here_buf *b, const char *s, size_t n)
+{
+  if (b->len + n > b->cap)
+  {
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (data == NULL)
+      return -1;
+    b->data = data;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+  return 0;
+}
+
+/**
+ * @brief Remove quotes and backslashes from a delimiter.
+ *
+ * @param word The delimiter as written, changed in place
+ * @return Non zero if any part of the delimiter was quoted
+ */
+int heredoc_unquote(char *word)
+{
+  char *w = word;
+  int quoted = 0;
+
+  for (char *p = word; *p != '\0'; p++)
+  {
+    if (*p == '\'' || *p == '"')
+    {
+      quoted = 1;
+      continue;
+    }
+    if (*p == '\\' && p[1] != '\0')
+    {
+      quoted = 1;
+      p++;
+    }
+    *w++ = *p;
+  }
+  *w = '\0';
+  return quoted;
+}
+
+/**
+ * @brief Put data in a file descriptor that reads it from the start. Small
+ * data goes into a pipe, larger data into a sealed memfd, so nothing is
+ * ever written to disk.
+ *
+ * @param data The data
+ * @param len The length of the data
+ * @return The descriptor, close on exec, or -1 on error
+ */
+int heredoc_fd(const char *data, size_t len)
+{
+  int fds[2];
+
+  if (len <= HEREDOC_PIPE_MAX)
+  {
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+      perror("pipe");
+      return -1;
+    }
+    /* The body fits in the pipe, so writing and closing never block */
+    struct iovec iov = {(void *)data, len};
+    struct io_file f = {.fd = fds[1], .off = -1, .iov = &iov, .count = len > 0};
+    if (io_commit(&f, 1) != 0)
+    {
+      perror("write");
+      close(fds[0]);
+      fds[0] = -1;
+    }
+    return fds[0];
+  }
+
+  int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+  {
+    perror("memfd_create");
+    return -1;
+  }
+  /* Written at offset 0 the descriptor stays at the start for the command */
+  struct iovec iov = {(void *)data, len};
+  struct io_file f = {.fd = fd, .keep = 1, .off = 0, .iov = &iov, .count = 1};
+  if (io_commit(&f, 1) != 0)
+  {
+    perror("write");
+    close(fd);
+    return -1;
+  }
+  /* The command can read the body but never change it */
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  return fd;
+}
+
+/**
+ * @brief Build the text of one here-document or here-string.
+ *
+ * @param sh The shell
+ * @param b The body, replaced by the text
+ * @param word The here-string or NULL for a here-document
+ * @param quoted Non zero if the here-document is not expanded
+ * @return 0 on success, -1 after printing an error
+ */
+static int here_text(struct shell *sh, struct here_buf *b, char *word, int quoted)
+{
+  struct expansion ex = {0};
+  int rval = 0;
+
+  if (word != NULL)
+  {
+    char *words[] = {word, NULL};
+    rval = expand_words(sh, words, &ex);
+    b->len = 0;
+    for (size_t i = 0; rval == 0 && i < ex.argc; i++)
+    {
+      if (i > 0)
+        rval = here_append(b, " ", 1);
+      if (rval == 0)
+        rval = here_append(b, ex.argv[i], strlen(ex.argv[i]));
+    }
+    if (rval == 0)
+      rval = here_append(b, "\n", 1);
+  }
+  else if (!quoted && b->len > 0)
+  {
+    ssize_t n = expand_heredoc(sh, b->data, b->len, &ex);
+    b->len = 0;
+    rval = n < 0 ? -1 : here_append(b, ex.buf, (size_t)n);
+  }
+  procsubst_reap(sh, &ex);
+  expansion_free(&ex);
+  return rval;
+}
+
+/**
+ * @brief Make the stdin of a command with a here-document or here-string.
+ *
+ * @param sh The shell
+ * @param text The body of the here-document or the word of the here-string
+ * @param string Non zero for a here-string
+ * @param quoted Non zero if the here-document is not expanded
+ * @return The descriptor, close on exec, or -1 after printing an error
+ */
+int heredoc_open(struct shell *sh, const char *text, int string, int quoted)
+{
+  struct here_buf body = {0};
+  int fd = -1;
+
+  if (string || here_append(&body, text, strlen(text)) == 0)
+  {
+    if (here_text(sh, &body, string ? (char *)text : NULL, quoted) == 0)
+      fd = heredoc_fd(body.data, body.len);
+  }
+  free(body.data);
+  return fd;
+}
+
+/**
+ * @brief Close the here-document of the last command.
+ *
+ * @param sh The shell
+ */
+void heredoc_done(struct shell *sh)
+{
+  if (sh->here_fd > 0)
+    close(sh->here_fd);
+  sh->here_fd = 0;
+}
@@ -0,0 +1,1070 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define CPU_WORD_BITS (8 * sizeof(unsigned long))
+
+/**
+ * @brief Reset a policy so that everything is inherited.
+ *
+ * @param policy The policy to reset
+ */
+void job_policy_init(struct job_policy *policy)
+{
+  memset(policy, 0, sizeof(*policy));
+  policy->sched = -1;
+}
+
+/**
+ * @brief Parse a cpu list such as "0-3,6" into the policy mask.
+ *
+ * @param policy The policy to fill in
+ * @param list The list to parse
+ * @return 0 on success, -1 if the list is malformed
+ */
+static int parse_cpu_list(struct job_policy *policy, const char *list)
+{
+  const char *p = list;
+
+  memset(policy->cpus, 0, sizeof(policy->cpus));
+  while (*p)
+  {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    long hi = lo;
+    if (end == p || lo < 0)
+      return -1;
+    p = end;
+    if (*p == '-')
+    {
+      p++;
+      hi = strtol(p, &end, 10);
+      if (end == p || hi < lo)
+        return -1;
+      p = end;
+    }
+    if (hi >= MAX_CPUS)
+      return -1;
+    for (long cpu = lo; cpu <= hi; cpu++)
+    {
+      policy->cpus[cpu / CPU_WORD_BITS] |= 1UL << (cpu % CPU_WORD_BITS);
+    }
+    if (*p == ',')
+      p++;
+    else if (*p != '\0')
+      return -1;
+  }
+  policy->has_cpus = 1;
+  return 0;
+}
+
+/**
+ * @brief Parse placement options from the front of an argument list.
+ *
+ * @param policy The policy to fill in
+ * @param argv The arguments, argv[0] is the builtin name
+ * @return The index of the first non option argument or -1 on error
+ */
+int job_policy_parse(struct job_policy *policy, char **argv)
+{
+  int i = 1;
+
+  while (argv[i] != NULL && argv[i][0] == '-')
+  {
+    const char *opt = argv[i];
+    if (strcmp(opt, "--") == 0)
+      return i + 1;
+    if (strlen(opt) != 2 || strchr("cns", opt[1]) == NULL)
+    {
+      fprintf(stderr, "%s: unknown option '%s'\n", argv[0], opt);
+      return -1;
+    }
+    if (argv[i + 1] == NULL)
+    {
+      fprintf(stderr, "%s: option '%s' needs a value\n", argv[0], opt);
+      return -1;
+    }
+
+    const char *val = argv[i + 1];
+    switch (opt[1])
+    {
+    case 'c':
+      if (parse_cpu_list(policy, val) != 0)
+      {
+        fprintf(stderr, "%s: bad cpu list '%s'\n", argv[0], val);
+        return -1;
+      }
+      break;
+    case 'n':
+    {
+      char *end;
+      long nice = strtol(val, &end, 10);
+      if (*val == '\0' || *end != '\0' || nice < -20 || nice > 19)
+      {
+        fprintf(stderr, "%s: bad nice value '%s'\n", argv[0], val);
+        return -1;
+      }
+      policy->has_nice = 1;
+      policy->nice = (int)nice;
+      break;
+    }
+    case 's':
+      if (strcmp(val, "idle") == 0)
+        policy->sched = SCHED_IDLE;
+      else if (strcmp(val, "batch") == 0)
+        policy->sched = SCHED_BATCH;
+      else if (strcmp(val, "other") == 0)
+        policy->sched = SCHED_OTHER;
+      else
+      {
+        fprintf(stderr, "%s: unknown scheduler '%s'\n", argv[0], val);
+        return -1;
+      }
+      break;
+    }
+    i += 2;
+  }
+  return i;
+}
+
+/**
+ * @brief Apply a policy to the calling process.
+ *
+ * @param policy The policy to apply
+ */
+void job_policy_apply(const struct job_policy *policy)
+{
+  if (policy == NULL)
+    return;
+
+  if (policy->has_cpus)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu = 0; cpu < MAX_CPUS && cpu < CPU_SETSIZE; cpu++)
+    {
+      if (policy->cpus[cpu / CPU_WORD_BITS] & (1UL << (cpu % CPU_WORD_BITS)))
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+      perror("sched_setaffinity");
+  }
+  if (policy->sched != -1)
+  {
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, policy->sched, &param) != 0)
+      perror("sched_setscheduler");
+  }
+  if (policy->has_nice)
+  {
+    if (setpriority(PRIO_PROCESS, 0, policy->nice) != 0)
+      perror("setpriority");
+  }
+}
+
+/**
+ * @brief Print a policy in the same form that job_policy_parse accepts.
+ *
+ * @param policy The policy to print
+ */
+static void job_policy_print(const struct job_policy *policy)
+{
+  int printed = 0;
+
+  if (policy->has_cpus)
+  {
+    printf("-c ");
+    int first = 1;
+    for (int cpu = 0; cpu < MAX_CPUS; cpu++)
+    {
+      if (!(policy->cpus[cpu / CPU_WORD_BITS] & (1UL << (cpu % CPU_WORD_BITS))))
+        continue;
+      int last = cpu;
+      while (last + 1 < MAX_CPUS &&
+             (policy->cpus[(last + 1) / CPU_WORD_BITS] & (1UL << ((last + 1) % CPU_WORD_BITS))))
+        last++;
+      printf(first ? "%d" : ",%d", cpu);
+      if (last != cpu)
+        printf("-%d", last);
+      first = 0;
+      cpu = last;
+    }
+    printed = 1;
+  }
+  if (policy->has_nice)
+  {
+    printf("%s-n %d", printed ? " " : "", policy->nice);
+    printed = 1;
+  }
+  if (policy->sched != -1)
+  {
+    const char *name = policy->sched == SCHED_IDLE    ? "idle"
+                       : policy->sched == SCHED_BATCH ? "batch"
+                                                      : "other";
+    printf("%s-s %s", printed ? " " : "", name);
+    printed = 1;
+  }
+  printf("%s\n", printed ? "" : "inherit");
+}
+
+/**
+ * @brief The run builtin. Launch a command with an explicit placement,
+ * for example "run -c 0-1 -n 10 make -j2 &".
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the command
+ */
+int builtin_run(struct shell *sh, char **argv)
+{
+  struct job_policy policy;
+
+  job_policy_init(&policy);
+  if (sh->launch_background)
+    policy = sh->bg_policy;
+
+  int first = job_policy_parse(&policy, argv);
+  if (first < 0)
+    return 1;
+  if (argv[first] == NULL)
+  {
+    fprintf(stderr, "usage: run [-c CPUS] [-n NICE] [-s idle|batch|other] [--] cmd [args...]\n");
+    return 1;
+  }
+  if (!execute_command(&argv[first], sh, sh->launch_background, &policy))
+    return 1;
+  return sh->launch_background ? 0 : sh->last_status;
+}
+
+/**
+ * @brief The bgpolicy builtin. With no arguments print the default
+ * placement of background jobs, "bgpolicy -r" resets it and any other
+ * options replace it.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_bgpolicy(struct shell *sh, char **argv)
+{
+  struct job_policy policy;
+
+  if (argv[1] == NULL)
+  {
+    job_policy_print(&sh->bg_policy);
+    return 0;
+  }
+  job_policy_init(&policy);
+  if (strcmp(argv[1], "-r") == 0 && argv[2] == NULL)
+  {
+    sh->bg_policy = policy;
+    return 0;
+  }
+
+  int first = job_policy_parse(&policy, argv);
+  if (first < 0)
+    return -1;
+  if (argv[first] != NULL)
+  {
+    fprintf(stderr, "bgpolicy: unexpected argument '%s'\n", argv[first]);
+    return -1;
+  }
+  sh->bg_policy = policy;
+  return 0;
+}
+
+/**
+ * @brief Join an argument list into a single string for display.
+ *
+ * @param argv The arguments
+ * @return The joined string, the caller must free it
+ */
+static char *join_argv(char **argv)
+{
+  size_t len = 1;
+  for (int i = 0; argv[i] != NULL; i++)
+    len += strlen(argv[i]) + 1;
+
+  char *line = malloc(len);
+  if (line == NULL)
+    return NULL;
+  char *p = line;
+  for (int i = 0; argv[i] != NULL; i++)
+  {
+    if (i > 0)
+      *p++ = ' ';
+    size_t n = strlen(argv[i]);
+    memcpy(p, argv[i], n);
+    p += n;
+  }
+  *p = '\0';
+  return line;
+}
+
+/**
+ * @brief Add a process to the job table as a running job.
+ *
+ * @param sh The shell
+ * @param pid The job leader, also the process group
+ * @param argv The command the job runs
+ * @return The new job or NULL if the table is full
+ */
+struct bg_process *job_add(struct shell *sh, pid_t pid, char **argv)
+{
+  char path[32];
+
+  if (sh->num_bg_processes >= MAX_BG_PROCESSES)
+    job_compact(sh);
+  if (sh->num_bg_processes >= MAX_BG_PROCESSES)
+    return NULL;
+
+  struct bg_process *bgp = &sh->bg_processes[sh->num_bg_processes];
+  memset(bgp, 0, sizeof(*bgp));
+  bgp->job_id = ++sh->last_job_id;
+  sh->jobs_started++;
+  bgp->pid = pid;
+  bgp->pgid = pid;
+  bgp->out_fd = -1;
+  bgp->state = JOB_RUNNING;
+  bgp->command = join_argv(argv);
+  snprintf(path, sizeof(path), "/proc/%d", pid);
+  bgp->proc_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  clock_gettime(CLOCK_MONOTONIC, &bgp->last_sample);
+  sh->num_bg_processes++;
+  return bgp;
+}
+
+/**
+ * @brief Free the memory and descriptors held by a job.
+ *
+ * @param bgp The job
+ */
+void job_release(struct bg_process *bgp)
+{
+  free(bgp->command);
+  free(bgp->tracked);
+  if (bgp->proc_fd >= 0)
+    close(bgp->proc_fd);
+  if (bgp->out_fd >= 0)
+    close(bgp->out_fd);
+  bgp->command = NULL;
+  bgp->tracked = NULL;
+  bgp->proc_fd = -1;
+  bgp->out_fd = -1;
+}
+
+/**
+ * @brief Release every finished job from the job table. Job ids of the
+ * remaining jobs do not change.
+ *
+ * @param sh The shell
+ */
+void job_compact(struct shell *sh)
+{
+  int kept = 0;
+
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    if (job_finished(bgp))
+    {
+      job_release(bgp);
+      continue;
+    }
+    if (kept != i)
+      sh->bg_processes[kept] = *bgp;
+    kept++;
+  }
+  sh->num_bg_processes = kept;
+  if (kept == 0)
+    sh->last_job_id = 0;
+}
+
+/**
+ * @brief Fork and exec a command.
+ *
+ * @param argv The command to run
+ * @param sh The shell
+ * @param background Non zero to run the command as a background job
+ * @param policy The placement to apply or NULL for the default
+ * @return 1 if the command was launched, 0 otherwise
+ */
+int execute_command(char **argv, struct shell *sh, int background,
+                    const struct job_policy *policy)
+{
+  if (argv == NULL || argv[0] == NULL)
+    return 0;
+  pid_t pid;
+  int status = 0;
+
+  if (policy == NULL && background)
+    policy = &sh->bg_policy;
+
+  if (sh->num_bg_processes >= MAX_BG_PROCESSES)
+    job_compact(sh);
+  if (background && sh->num_bg_processes >= MAX_BG_PROCESSES)
+  {
+    fprintf(stderr, "too many background jobs\n");
+    return 0;
+  }
+
+  int out_fd = background ? capture_open(sh) : -1;
+  /* Built before the fork so the cached array survives for the next spawn */
+  char **envp = var_envp(&sh->vars);
+
+  fflush(stdout);
+  int fds[3] = {sh->here_fd > 0 ? sh->here_fd : STDIN_FILENO,
+                out_fd >= 0 ? out_fd : STDOUT_FILENO, out_fd >= 0 ? out_fd : STDERR_FILENO};
+  pid = zygote_spawn(sh, argv, envp, fds, !background, policy);
+  if (pid == 0)
+  {
+    pid_t child = getpid();
+    setpgid(child, child);
+    if (out_fd >= 0)
+    {
+      dup2(out_fd, STDOUT_FILENO);
+      dup2(out_fd, STDERR_FILENO);
+    }
+    if (sh->here_fd > 0)
+      dup2(sh->here_fd, STDIN_FILENO);
+    if (!background)
+    {
+      tcsetpgrp(sh->shell_terminal, child);
+
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+      signal(SIGTSTP, SIG_DFL);
+      signal(SIGTTIN, SIG_DFL);
+      signal(SIGTTOU, SIG_DFL);
+    }
+    job_policy_apply(policy);
+    if (envp != NULL)
+      environ = envp;
+    execvp(argv[0], argv);
+    exit(EXIT_FAILURE);
+  }
+  else if (pid < 0)
+  {
+    perror("fork failed");
+    if (out_fd >= 0)
+      close(out_fd);
+    return 0;
+  }
+  else
+  {
+
+    setpgid(pid, pid);
+    if (background)
+    {
+      struct bg_process *bgp = job_add(sh, pid, argv);
+      bgp->out_fd = out_fd;
+      printf("[%d] %d %s\n", bgp->job_id, pid, bgp->command);
+    }
+    else
+    {
+      double limit = sh->command_timeout > 0 ? sh->command_timeout : sh->default_timeout;
+      int timed_out = -1;
+
+      if (limit > 0)
+        timed_out = wait_deadline(sh, pid, &status, limit);
+      while (timed_out < 0)
+      {
+        if (wait4(pid, &status, WUNTRACED, &sh->last_usage) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          perror("wait4");
+          break;
+        }
+        if (WIFSTOPPED(status) || WIFEXITED(status) || WIFSIGNALED(status))
+          break;
+      }
+
+      if (timed_out <= 0 && WIFSTOPPED(status))
+      {
+        /* Keep the stopped command so it can be resumed with fg or bg */
+        struct bg_process *bgp = job_add(sh, pid, argv);
+        if (bgp != NULL)
+        {
+          bgp->state = JOB_STOPPED;
+          printf("\n[%d] %d Stopped %s\n", bgp->job_id, pid, bgp->command);
+        }
+        sh->last_status = 128 + WSTOPSIG(status);
+      }
+      else if (timed_out > 0)
+        sh->last_status = 124;
+      else if (WIFEXITED(status))
+        sh->last_status = WEXITSTATUS(status);
+      else if (WIFSIGNALED(status))
+        sh->last_status = 128 + WTERMSIG(status);
+
+      tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+
+      tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
+      tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Run a command through the normal launch path.
+ *
+ * @param sh The shell
+ * @param argv The command to run
+ * @param background Non zero to run the command as a background job
+ * @return The exit status of the command
+ */
+int run_command(struct shell *sh, char **argv, int background)
+{
+  if (argv == NULL || argv[0] == NULL)
+    return sh->last_status;
+
+  if (var_assignment(argv[0]) > 0)
+    return run_assignments(sh, argv, background);
+  struct func *f = func_find(sh, argv[0]);
+  if (f != NULL)
+    return func_call(sh, f, argv);
+
+  sh->launch_background = background;
+  memset(&sh->last_usage, 0, sizeof(sh->last_usage));
+  if (do_builtin(sh, argv))
+  {
+    /* Only report the usage of a child that was the command itself */
+    memset(&sh->last_usage, 0, sizeof(sh->last_usage));
+    return sh->last_status;
+  }
+  if (!execute_command(argv, sh, background, NULL))
+    sh->last_status = 1;
+  else if (background)
+    sh->last_status = 0;
+  return sh->last_status;
+}
+
+/**
+ * @brief Read the process group of a process from /proc.
+ *
+ * @param pid The process
+ * @return The process group or -1 if it could not be read
+ */
+pid_t proc_pgid(pid_t pid)
+{
+  char path[32];
+  char buf[512];
+  int pgid = -1;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  char *p = strrchr(buf, ')');
+  if (p == NULL || sscanf(p + 2, "%*c %*d %d", &pgid) != 1)
+    return -1;
+  return pgid;
+}
+
+/**
+ * @brief Add the usage of a reaped process to a job.
+ *
+ * @param bgp The job
+ * @param ru The usage returned by wait4
+ */
+static void job_add_usage(struct bg_process *bgp, const struct rusage *ru)
+{
+  timeradd(&bgp->usage.ru_utime, &ru->ru_utime, &bgp->usage.ru_utime);
+  timeradd(&bgp->usage.ru_stime, &ru->ru_stime, &bgp->usage.ru_stime);
+  if (ru->ru_maxrss > bgp->usage.ru_maxrss)
+    bgp->usage.ru_maxrss = ru->ru_maxrss;
+  bgp->usage.ru_minflt += ru->ru_minflt;
+  bgp->usage.ru_majflt += ru->ru_majflt;
+  bgp->usage.ru_inblock += ru->ru_inblock;
+  bgp->usage.ru_oublock += ru->ru_oublock;
+  bgp->usage.ru_nvcsw += ru->ru_nvcsw;
+  bgp->usage.ru_nivcsw += ru->ru_nivcsw;
+  bgp->reaped++;
+}
+
+/**
+ * @brief Find the job a process belongs to.
+ *
+ * @param sh The shell
+ * @param pid The process
+ * @param pgid The process group of the process or -1 if unknown
+ * @return The job or NULL
+ */
+struct bg_process *job_for_pid(struct shell *sh, pid_t pid, pid_t pgid)
+{
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    if (bgp->pid == pid && !bgp->leader_done)
+      return bgp;
+    for (size_t j = 0; j < bgp->num_tracked; j++)
+    {
+      if (bgp->tracked[j] == pid)
+        return bgp;
+    }
+  }
+  if (pgid <= 0)
+    return NULL;
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    if (!job_finished(&sh->bg_processes[i]) && sh->bg_processes[i].pgid == pgid)
+      return &sh->bg_processes[i];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Remove a pid from the tracked descendants of a job.
+ *
+ * @param bgp The job
+ * @param pid The pid to remove
+ */
+static void job_untrack(struct bg_process *bgp, pid_t pid)
+{
+  for (size_t j = 0; j < bgp->num_tracked; j++)
+  {
+    if (bgp->tracked[j] == pid)
+    {
+      bgp->tracked[j] = bgp->tracked[--bgp->num_tracked];
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Record the final state of a job whose leader has exited.
+ *
+ * @param bgp The job
+ * @param status The wait status of the leader
+ */
+static void job_leader_exit(struct bg_process *bgp, int status)
+{
+  bgp->leader_done = 1;
+  bgp->state = JOB_RUNNING;
+  bgp->status = status;
+  if (bgp->proc_fd >= 0)
+  {
+    close(bgp->proc_fd);
+    bgp->proc_fd = -1;
+  }
+}
+
+/* Written to on SIGCHLD while the shell waits, see child_wake_start */
+static int wake_pipe[2] = {-1, -1};
+static pthread_once_t wake_once = PTHREAD_ONCE_INIT;
+static struct sigaction wake_prev;
+
+static void wake_open(void)
+{
+  if (pipe2(wake_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+    wake_pipe[0] = wake_pipe[1] = -1;
+}
+
+static void wake_sigchld(int sig, siginfo_t *info, void *ctx)
+{
+  int saved = errno;
+  if (write(wake_pipe[1], "", 1) < 0)
+  {
+  }
+  errno = saved;
+  /* A program embedding the shell may reap or count children itself */
+  if (wake_prev.sa_flags & SA_SIGINFO)
+    wake_prev.sa_sigaction(sig, info, ctx);
+  else if (wake_prev.sa_handler != SIG_DFL && wake_prev.sa_handler != SIG_IGN)
+    wake_prev.sa_handler(sig);
+}
+
+/**
+ * @brief Start noticing child state changes that a pidfd does not show,
+ * such as stops. Until child_wake_stop every SIGCHLD makes the returned
+ * descriptor readable, whichever thread the signal is delivered to. A
+ * handler the program had is still called.
+ *
+ * @return The descriptor to poll or -1 if SIGCHLD can not be caught
+ */
+int child_wake_start(void)
+{
+  pthread_once(&wake_once, wake_open);
+  if (wake_pipe[0] < 0)
+    return -1;
+  struct sigaction sa = {0};
+  sa.sa_sigaction = wake_sigchld;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, &wake_prev) != 0)
+    return -1;
+  child_wake_clear();
+  return wake_pipe[0];
+}
+
+/**
+ * @brief Put back the SIGCHLD action replaced by child_wake_start.
+ */
+void child_wake_stop(void)
+{
+  sigaction(SIGCHLD, &wake_prev, NULL);
+}
+
+/**
+ * @brief Empty the descriptor returned by child_wake_start.
+ *
+ * @return Non zero if a SIGCHLD had arrived
+ */
+int child_wake_clear(void)
+{
+  char buf[64];
+  int woken = 0;
+  while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+    woken = 1;
+  return woken;
+}
+
+/**
+ * @brief Keep a pidfd open for a process of a job.
+ *
+ * @param sh The shell
+ * @param pid The process
+ */
+static void job_watch(struct shell *sh, pid_t pid)
+{
+  for (size_t i = 0; i < sh->num_watch; i++)
+  {
+    if (sh->watch[i].pid == pid)
+      return;
+  }
+  if (sh->num_watch == sh->cap_watch)
+  {
+    size_t cap = sh->cap_watch ? sh->cap_watch * 2 : 16;
+    struct job_watch *grown = realloc(sh->watch, cap * sizeof(*grown));
+    if (grown == NULL)
+      return;
+    sh->watch = grown;
+    sh->cap_watch = cap;
+  }
+  sh->watch[sh->num_watch].pid = pid;
+  sh->watch[sh->num_watch].fd = (int)syscall(SYS_pidfd_open, pid, 0);
+  sh->num_watch++;
+}
+
+/**
+ * @brief Close the pidfd of a process that was reaped.
+ *
+ * @param sh The shell
+ * @param pid The process
+ */
+static void job_unwatch_pid(struct shell *sh, pid_t pid)
+{
+  for (size_t i = 0; i < sh->num_watch; i++)
+  {
+    if (sh->watch[i].pid == pid)
+    {
+      if (sh->watch[i].fd >= 0)
+        close(sh->watch[i].fd);
+      sh->watch[i] = sh->watch[--sh->num_watch];
+      return;
+    }
+  }
+}
+
+/**
+ * @brief Close the pidfds of processes that left every job and open
+ * them for the leaders and tracked descendants not yet watched.
+ *
+ * @param sh The shell
+ */
+static void job_watch_sync(struct shell *sh)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < sh->num_watch; i++)
+  {
+    struct job_watch w = sh->watch[i];
+    if (job_for_pid(sh, w.pid, -1) == NULL)
+    {
+      if (w.fd >= 0)
+        close(w.fd);
+      continue;
+    }
+    sh->watch[kept++] = w;
+  }
+  sh->num_watch = kept;
+
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    if (!bgp->leader_done)
+      job_watch(sh, bgp->pid);
+    for (size_t j = 0; j < bgp->num_tracked; j++)
+      job_watch(sh, bgp->tracked[j]);
+  }
+}
+
+/**
+ * @brief Close the pidfds an embedded shell keeps for its jobs.
+ *
+ * @param sh The shell
+ */
+void job_unwatch(struct shell *sh)
+{
+  for (size_t i = 0; i < sh->num_watch; i++)
+  {
+    if (sh->watch[i].fd >= 0)
+      close(sh->watch[i].fd);
+  }
+  free(sh->watch);
+  sh->watch = NULL;
+  sh->num_watch = 0;
+  sh->cap_watch = 0;
+}
+
+/**
+ * @brief Peek at a state change of one process of the shell's own jobs.
+ *
+ * @param sh The shell
+ * @param flags The waitid flags
+ * @param si Set to the change
+ * @return 1 if a change was found, 0 if not and -1 if the jobs have no
+ * processes left
+ */
+static int job_peek_round(struct shell *sh, int flags, siginfo_t *si)
+{
+  int live = 0;
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    for (size_t j = 0; j <= bgp->num_tracked; j++)
+    {
+      pid_t pid = j < bgp->num_tracked ? bgp->tracked[j] : bgp->pid;
+      if (j == bgp->num_tracked && bgp->leader_done)
+        continue;
+      live++;
+      memset(si, 0, sizeof(*si));
+      if (waitid(P_PID, (id_t)pid, si, flags | WNOHANG) == 0 && si->si_pid != 0)
+        return 1;
+    }
+  }
+  return live == 0 ? -1 : 0;
+}
+
+/**
+ * @brief Peek at a state change of one of the shell's own jobs. An
+ * embedded shell shares its process with other children, which are not
+ * its to reap. Exits are seen on pidfds kept open across calls and stops
+ * and continues through SIGCHLD.
+ *
+ * @param sh The shell
+ * @param flags The waitid flags, without WNOHANG to sleep until a change
+ * @param si Set to the change
+ * @return 1 if a change was found, 0 if nothing was pending or the wait
+ * was interrupted and -1 if there are no jobs to wait for
+ */
+static int job_peek_own(struct shell *sh, int flags, siginfo_t *si)
+{
+  if (flags & WNOHANG)
+    return job_peek_round(sh, flags, si);
+
+  /* Caught before the first round so no change falls between it and poll */
+  int wake = child_wake_start();
+  struct pollfd *fds = NULL;
+  int got;
+  for (;;)
+  {
+    got = job_peek_round(sh, flags, si);
+    if (got != 0)
+      break;
+    job_watch_sync(sh);
+    struct pollfd *grown = realloc(fds, (sh->num_watch + 1) * sizeof(*fds));
+    if (grown == NULL)
+      break;
+    fds = grown;
+    fds[0] = (struct pollfd){wake, POLLIN, 0};
+    for (size_t i = 0; i < sh->num_watch; i++)
+      fds[i + 1] = (struct pollfd){sh->watch[i].fd, POLLIN, 0};
+    /* Without SIGCHLD stops are only seen by the next round */
+    if (poll(fds, sh->num_watch + 1, wake >= 0 ? -1 : 100) < 0)
+    {
+      if (errno == EINTR && wake >= 0 && child_wake_clear())
+        continue;
+      break;
+    }
+    if (wake >= 0)
+      child_wake_clear();
+    for (size_t i = 0; i < sh->num_watch; i++)
+    {
+      siginfo_t exited = {0};
+      if (!(fds[i + 1].revents & POLLIN))
+        continue;
+      /* Gone without being this shell's to reap, so it would wake every poll */
+      if (waitid(P_PID, (id_t)sh->watch[i].pid, &exited, WEXITED | WNOHANG | WNOWAIT) != 0 ||
+          exited.si_pid == 0)
+      {
+        close(sh->watch[i].fd);
+        sh->watch[i].fd = -1;
+      }
+    }
+  }
+  free(fds);
+  if (wake >= 0)
+    child_wake_stop();
+  return got;
+}
+
+/**
+ * @brief Handle one child state change.
+ *
+ * @param sh The shell
+ * @param block Non zero to sleep until a child changes state
+ * @return 1 if an event was handled, 0 if nothing was pending or the wait
+ * was interrupted and -1 if there are no children to wait for
+ */
+int job_event(struct shell *sh, int block)
+{
+  siginfo_t si;
+  struct rusage ru;
+  int status;
+  int flags = WEXITED | WSTOPPED | WCONTINUED | WNOWAIT | (block ? 0 : WNOHANG);
+
+  /* Peek first so the process group can still be read from /proc */
+  memset(&si, 0, sizeof(si));
+  if (sh->io != NULL)
+  {
+    int got = job_peek_own(sh, flags, &si);
+    if (got <= 0)
+      return got;
+  }
+  else if (waitid(P_ALL, 0, &si, flags) != 0)
+    return errno == EINTR ? 0 : -1;
+  if (si.si_pid == 0)
+    return 0;
+
+  pid_t pid = si.si_pid;
+  struct bg_process *bgp = job_for_pid(sh, pid, sh->subreaper ? proc_pgid(pid) : -1);
+
+  if (si.si_code == CLD_STOPPED || si.si_code == CLD_TRAPPED)
+  {
+    waitpid(pid, &status, WUNTRACED | WNOHANG);
+    if (bgp != NULL && pid == bgp->pid)
+      bgp->state = JOB_STOPPED;
+    return 1;
+  }
+  if (si.si_code == CLD_CONTINUED)
+  {
+    waitpid(pid, &status, WCONTINUED | WNOHANG);
+    if (bgp != NULL && pid == bgp->pid)
+      bgp->state = JOB_RUNNING;
+    return 1;
+  }
+
+  if (wait4(pid, &status, 0, &ru) != pid)
+    return 0;
+  job_unwatch_pid(sh, pid);
+  if (bgp == NULL)
+  {
+    sh->orphans_reaped++;
+    return 1;
+  }
+  job_add_usage(bgp, &ru);
+  if (pid == bgp->pid)
+    job_leader_exit(bgp, status);
+  else
+    job_untrack(bgp, pid);
+  job_settle(bgp);
+  return 1;
+}
+
+/**
+ * @brief Move a job to its final state once the leader and every tracked
+ * descendant are gone.
+ *
+ * @param bgp The job
+ */
+void job_settle(struct bg_process *bgp)
+{
+  if (bgp->leader_done && bgp->num_tracked == 0 && bgp->state == JOB_RUNNING)
+    bgp->state = WIFSIGNALED(bgp->status) ? JOB_SIGNALED : JOB_DONE;
+}
+
+/**
+ * @brief Check if a job has finished.
+ *
+ * @param bgp The job
+ * @return Non zero if the job is done or was killed by a signal
+ */
+int job_finished(const struct bg_process *bgp)
+{
+  return bgp->state == JOB_DONE || bgp->state == JOB_SIGNALED;
+}
+
+/**
+ * @brief The exit status of a finished job in the form used for $?.
+ *
+ * @param bgp The job
+ * @return The exit status, 128 + signal if the job was killed
+ */
+int job_exit_status(const struct bg_process *bgp)
+{
+  if (WIFSIGNALED(bgp->status))
+    return 128 + WTERMSIG(bgp->status);
+  return WEXITSTATUS(bgp->status);
+}
+
+/**
+ * @brief Poll the background jobs for state changes without blocking.
+ *
+ * @param sh The shell
+ */
+void update_jobs(struct shell *sh)
+{
+  while (job_event(sh, 0) > 0)
+  {
+  }
+
+  if (sh->subreaper)
+    track_descendants(sh);
+
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    job_settle(&sh->bg_processes[i]);
+    capture_trim(sh, &sh->bg_processes[i]);
+  }
+}
+
+/**
+ * @brief Check for a trailing '&' on the line. If one is found it is
+ * removed from the line.
+ *
+ * @param line The line to check
+ * @return 1 if the line should run in the background
+ */
+int is_background(char *line)
+{
+  size_t len = strlen(line);
+  while (len > 0 && isspace((unsigned char)line[len - 1]))
+    len--;
+  if (len > 0 && line[len - 1] == '&')
+  {
+    line[len - 1] = '\0';
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,258 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+static volatile sig_atomic_t wait_interrupted;
+
+static void wait_sigint(int sig)
+{
+  UNUSED(sig);
+  wait_interrupted = 1;
+}
+
+/**
+ * @brief Find a job from a job spec.
+ *
+ * @param sh The shell
+ * @param spec The job spec or NULL
+ * @return The job or NULL if there is no such job
+ */
+struct bg_process *job_find(struct shell *sh, const char *spec)
+{
+  if (spec == NULL)
+  {
+    for (int i = sh->num_bg_processes - 1; i >= 0; i--)
+    {
+      if (!job_finished(&sh->bg_processes[i]))
+        return &sh->bg_processes[i];
+    }
+    return NULL;
+  }
+
+  if (*spec == '%')
+    spec++;
+  char *end;
+  long id = strtol(spec, &end, 10);
+  if (*spec == '\0' || *end != '\0')
+    return NULL;
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    if (sh->bg_processes[i].job_id == id)
+      return &sh->bg_processes[i];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Print one line describing a job.
+ *
+ * @param bgp The job
+ */
+void job_print(const struct bg_process *bgp)
+{
+  switch (bgp->state)
+  {
+  case JOB_RUNNING:
+    printf("[%d] %d Running %s &\n", bgp->job_id, bgp->pid, bgp->command);
+    break;
+  case JOB_STOPPED:
+    printf("[%d] %d Stopped %s\n", bgp->job_id, bgp->pid, bgp->command);
+    break;
+  case JOB_DONE:
+    if (WEXITSTATUS(bgp->status) == 0)
+      printf("[%d] Done    %s &\n", bgp->job_id, bgp->command);
+    else
+      printf("[%d] Exit %d  %s &\n", bgp->job_id, WEXITSTATUS(bgp->status), bgp->command);
+    break;
+  case JOB_SIGNALED:
+    printf("[%d] %s  %s &\n", bgp->job_id, strsignal(WTERMSIG(bgp->status)), bgp->command);
+    break;
+  }
+}
+
+/**
+ * @brief Find the job named by the only argument of fg or bg.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The job or NULL after printing an error
+ */
+static struct bg_process *job_from_args(struct shell *sh, char **argv)
+{
+  if (argv[1] != NULL && argv[2] != NULL)
+  {
+    fprintf(stderr, "usage: %s [JOB]\n", argv[0]);
+    return NULL;
+  }
+  update_jobs(sh);
+  struct bg_process *bgp = job_find(sh, argv[1]);
+  if (bgp == NULL || job_finished(bgp))
+  {
+    fprintf(stderr, "%s: %s: no such job\n", argv[0], argv[1] ? argv[1] : "current");
+    return NULL;
+  }
+  return bgp;
+}
+
+/**
+ * @brief The fg builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the job
+ */
+int builtin_fg(struct shell *sh, char **argv)
+{
+  struct bg_process *bgp = job_from_args(sh, argv);
+  if (bgp == NULL)
+    return 1;
+
+  printf("%s\n", bgp->command);
+  fflush(stdout);
+  if (sh->shell_is_interactive)
+    tcsetpgrp(sh->shell_terminal, bgp->pgid);
+  if (kill(-bgp->pgid, SIGCONT) != 0 && errno != ESRCH)
+    perror("kill");
+  bgp->state = JOB_RUNNING;
+
+  /* The same event path as background jobs, until this one stops or exits */
+  while (!bgp->leader_done && bgp->state != JOB_STOPPED)
+  {
+    if (job_event(sh, 1) < 0)
+      break;
+  }
+
+  if (sh->shell_is_interactive)
+  {
+    tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+  }
+
+  if (bgp->state == JOB_STOPPED)
+  {
+    printf("\n[%d] %d Stopped %s\n", bgp->job_id, bgp->pid, bgp->command);
+    return 128 + SIGTSTP;
+  }
+  job_settle(bgp);
+  return bgp->leader_done ? job_exit_status(bgp) : 0;
+}
+
+/**
+ * @brief The bg builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, 1 on error
+ */
+int builtin_bg(struct shell *sh, char **argv)
+{
+  struct bg_process *bgp = job_from_args(sh, argv);
+  if (bgp == NULL)
+    return 1;
+
+  if (kill(-bgp->pgid, SIGCONT) != 0 && errno != ESRCH)
+  {
+    perror("kill");
+    return 1;
+  }
+  bgp->state = JOB_RUNNING;
+  printf("[%d] %d %s &\n", bgp->job_id, bgp->pid, bgp->command);
+  return 0;
+}
+
+/**
+ * @brief Check if a wait is still blocked on a job.
+ *
+ * @param bgp The job
+ * @return Non zero while the job is running
+ */
+static int job_pending(const struct bg_process *bgp)
+{
+  return bgp->state == JOB_RUNNING;
+}
+
+/**
+ * @brief The wait builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the last job waited for, 127 for an unknown
+ * job and 130 if interrupted
+ */
+int builtin_wait(struct shell *sh, char **argv)
+{
+  int any = argv[1] != NULL && strcmp(argv[1], "-n") == 0;
+  int first = any ? 2 : 1;
+  int ids[MAX_BG_PROCESSES];
+  int count = 0;
+  int rval = 0;
+
+  update_jobs(sh);
+  for (int i = first; argv[i] != NULL && count < MAX_BG_PROCESSES; i++)
+  {
+    struct bg_process *bgp = job_find(sh, argv[i]);
+    if (bgp == NULL)
+    {
+      fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+      rval = 127;
+      continue;
+    }
+    ids[count++] = bgp->job_id;
+  }
+  if (count == 0 && argv[first] == NULL)
+  {
+    for (int i = 0; i < sh->num_bg_processes; i++)
+    {
+      if (job_pending(&sh->bg_processes[i]))
+        ids[count++] = sh->bg_processes[i].job_id;
+    }
+  }
+  if (count == 0)
+    return any ? 127 : rval;
+
+  struct sigaction sa = {0}, old;
+  sa.sa_handler = wait_sigint;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old);
+  wait_interrupted = 0;
+
+  /* -n finishes on the first job, otherwise when none is left pending */
+  int done = 0;
+  int no_children = 0;
+  while (!wait_interrupted)
+  {
+    int pending = 0;
+    for (int i = 0; i < count; i++)
+    {
+      char spec[16];
+      if (ids[i] < 0)
+        continue;
+      snprintf(spec, sizeof(spec), "%d", ids[i]);
+      struct bg_process *bgp = job_find(sh, spec);
+      if (bgp != NULL && job_pending(bgp))
+      {
+        pending++;
+        continue;
+      }
+      if (bgp != NULL)
+        rval = job_finished(bgp) ? job_exit_status(bgp) : 128 + SIGTSTP;
+      ids[i] = -1;
+      done++;
+    }
+    if (pending == 0 || (any && done > 0) || no_children)
+      break;
+
+    /* Sleep until a child changes state, then settle what it affected */
+    if (job_event(sh, 1) < 0)
+      no_children = 1;
+    update_jobs(sh);
+  }
+  sigaction(SIGINT, &old, NULL);
+  return wait_interrupted ? 130 : rval;
+}
@@ -0,0 +1,370 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define STAT_BUF_SIZE 4096
+
+/**
+ * @brief A single sample of a job and all of its descendants.
+ */
+struct job_sample
+{
+  unsigned long long ticks; /* utime + stime */
+  unsigned long long rss_pages;
+  unsigned long long read_bytes;
+  unsigned long long write_bytes;
+  long threads;
+  int procs;
+  char state;
+};
+
+static volatile sig_atomic_t stats_interrupted;
+
+static void stats_sigint(int sig)
+{
+  UNUSED(sig);
+  stats_interrupted = 1;
+}
+
+/**
+ * @brief Read a small proc file relative to a /proc/<pid> directory fd.
+ *
+ * @param dirfd The /proc/<pid> directory
+ * @param name The file to read
+ * @param buf The buffer to read into, always NUL terminated
+ * @param size The size of buf
+ * @return The number of bytes read or -1 on error
+ */
+static ssize_t read_proc_file(int dirfd, const char *name, char *buf, size_t size)
+{
+  int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, buf, size - 1);
+  close(fd);
+  if (n < 0)
+    return -1;
+  buf[n] = '\0';
+  return n;
+}
+
+/**
+ * @brief Add the stat and io counters of one process to a sample.
+ *
+ * @param dirfd The /proc/<pid> directory of the process
+ * @param sample The sample to add to
+ * @return 0 on success, -1 if the process is gone
+ */
+static int sample_process(int dirfd, struct job_sample *sample)
+{
+  char buf[STAT_BUF_SIZE];
+
+  if (read_proc_file(dirfd, "stat", buf, sizeof(buf)) < 0)
+    return -1;
+
+  /* The command name may contain spaces so start after the last ')' */
+  char *p = strrchr(buf, ')');
+  if (p == NULL)
+    return -1;
+  p += 2;
+
+  char state = '?';
+  unsigned long long utime = 0, stime = 0, rss = 0;
+  long threads = 0;
+  if (sscanf(p, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+                "%*d %*d %*d %*d %ld %*d %*u %*u %llu",
+             &state, &utime, &stime, &threads, &rss) != 5)
+    return -1;
+
+  if (sample->procs == 0)
+    sample->state = state;
+  sample->ticks += utime + stime;
+  sample->rss_pages += rss;
+  sample->threads += threads;
+  sample->procs++;
+
+  /* io needs ptrace access which we may not have for setuid descendants */
+  if (read_proc_file(dirfd, "io", buf, sizeof(buf)) > 0)
+  {
+    unsigned long long val;
+    char *line = buf;
+    while (line != NULL && *line)
+    {
+      if (sscanf(line, "rchar: %llu", &val) == 1)
+        sample->read_bytes += val;
+      else if (sscanf(line, "wchar: %llu", &val) == 1)
+        sample->write_bytes += val;
+      line = strchr(line, '\n');
+      if (line)
+        line++;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Append the children of every thread of a process to a pid list.
+ *
+ * @param dirfd The /proc/<pid> directory of the process
+ * @param pids The list to append to, grown as needed
+ * @param count Number of pids in the list
+ * @param cap Capacity of the list
+ */
+void proc_children(int dirfd, pid_t **pids, size_t *count, size_t *cap)
+{
+  int taskfd = openat(dirfd, "task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (taskfd < 0)
+    return;
+  DIR *dir = fdopendir(taskfd);
+  if (dir == NULL)
+  {
+    close(taskfd);
+    return;
+  }
+
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL)
+  {
+    if (de->d_name[0] == '.')
+      continue;
+    char path[sizeof(de->d_name) + 16];
+    char buf[STAT_BUF_SIZE];
+    snprintf(path, sizeof(path), "task/%s/children", de->d_name);
+    if (read_proc_file(dirfd, path, buf, sizeof(buf)) <= 0)
+      continue;
+
+    char *p = buf;
+    char *end;
+    long pid;
+    while ((pid = strtol(p, &end, 10)) > 0 && end != p)
+    {
+      if (*count == *cap)
+      {
+        size_t grown_cap = *cap ? *cap * 2 : 16;
+        pid_t *grown = realloc(*pids, grown_cap * sizeof(pid_t));
+        if (grown == NULL)
+          break;
+        *pids = grown;
+        *cap = grown_cap;
+      }
+      (*pids)[(*count)++] = (pid_t)pid;
+      p = end;
+    }
+  }
+  closedir(dir);
+}
+
+/**
+ * @brief Sample a job and all of its descendants. The job leader is read
+ * through the directory fd held in the job table, descendants are found
+ * through the children lists of each process. In subreaper mode the
+ * orphans adopted by the shell are included through the tracked pids.
+ *
+ * @param bgp The job to sample
+ * @param sample The sample to fill in
+ * @return 0 on success, -1 if the job is gone
+ */
+static int sample_job(struct bg_process *bgp, struct job_sample *sample)
+{
+  pid_t *pids = NULL;
+  size_t count = 0, cap = 0;
+
+  memset(sample, 0, sizeof(*sample));
+  if (bgp->proc_fd >= 0 && sample_process(bgp->proc_fd, sample) == 0)
+    proc_children(bgp->proc_fd, &pids, &count, &cap);
+  for (size_t i = 0; i < bgp->num_tracked; i++)
+  {
+    if (count == cap)
+    {
+      size_t grown_cap = cap ? cap * 2 : 16;
+      pid_t *grown = realloc(pids, grown_cap * sizeof(pid_t));
+      if (grown == NULL)
+        break;
+      pids = grown;
+      cap = grown_cap;
+    }
+    pids[count++] = bgp->tracked[i];
+  }
+
+  for (size_t i = 0; i < count; i++)
+  {
+    char path[32];
+    size_t j;
+
+    for (j = 0; j < i && pids[j] != pids[i]; j++)
+    {
+    }
+    if (j < i || pids[i] == bgp->pid)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%d", pids[i]);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    if (sample_process(fd, sample) == 0)
+      proc_children(fd, &pids, &count, &cap);
+    close(fd);
+  }
+  free(pids);
+  return sample->procs > 0 ? 0 : -1;
+}
+
+/**
+ * @brief Format a byte count with a binary unit suffix.
+ *
+ * @param buf The buffer to write to
+ * @param size The size of buf
+ * @param bytes The value to format
+ * @return buf
+ */
+static char *format_bytes(char *buf, size_t size, unsigned long long bytes)
+{
+  const char *units = "BKMGTP";
+  double val = (double)bytes;
+  int unit = 0;
+
+  while (val >= 1024.0 && units[unit + 1])
+  {
+    val /= 1024.0;
+    unit++;
+  }
+  if (unit == 0)
+    snprintf(buf, size, "%lluB", bytes);
+  else
+    snprintf(buf, size, "%.1f%c", val, units[unit]);
+  return buf;
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+  return (double)(a->tv_sec - b->tv_sec) + (double)(a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/**
+ * @brief Print one table of statistics for every live job.
+ *
+ * @param sh The shell
+ * @return The number of live jobs
+ */
+static int print_job_stats(struct shell *sh)
+{
+  long hz = sysconf(_SC_CLK_TCK);
+  long page = sysconf(_SC_PAGESIZE);
+  int live = 0;
+
+  printf("%-5s %-7s %-5s %6s %8s %8s %8s %4s %5s %s\n",
+         "JOB", "PID", "STATE", "CPU%", "RSS", "READ", "WRITE", "THR", "PROCS", "COMMAND");
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    struct job_sample sample;
+    struct timespec now;
+
+    if (job_finished(bgp) || sample_job(bgp, &sample) != 0)
+      continue;
+    live++;
+
+    /* CPU usage over the time since the previous sample, or since launch */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = timespec_diff(&now, &bgp->last_sample);
+    double cpu = 0.0;
+    if (elapsed > 0 && sample.ticks > bgp->last_ticks)
+      cpu = 100.0 * (double)(sample.ticks - bgp->last_ticks) / (double)hz / elapsed;
+    bgp->last_ticks = sample.ticks;
+    bgp->last_sample = now;
+
+    char id[16], rss[16], rd[16], wr[16];
+    snprintf(id, sizeof(id), "[%d]", bgp->job_id);
+    printf("%-5s %-7d %-5c %6.1f %8s %8s %8s %4ld %5d %s\n",
+           id, bgp->pid, sample.state, cpu,
+           format_bytes(rss, sizeof(rss), sample.rss_pages * (unsigned long long)page),
+           format_bytes(rd, sizeof(rd), sample.read_bytes),
+           format_bytes(wr, sizeof(wr), sample.write_bytes),
+           sample.threads, sample.procs, bgp->command);
+  }
+  fflush(stdout);
+  return live;
+}
+
+/**
+ * @brief Show resource usage of the live background jobs.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int job_stats(struct shell *sh, char **argv)
+{
+  double interval = 0;
+  long count = -1;
+
+  for (int i = 2; argv[i] != NULL; i++)
+  {
+    char *end;
+    if (strcmp(argv[i], "-i") == 0 && argv[i + 1] != NULL)
+    {
+      interval = strtod(argv[++i], &end);
+      if (*end != '\0' || interval <= 0)
+      {
+        fprintf(stderr, "jobs: bad interval '%s'\n", argv[i]);
+        return -1;
+      }
+    }
+    else if (strcmp(argv[i], "-n") == 0 && argv[i + 1] != NULL)
+    {
+      count = strtol(argv[++i], &end, 10);
+      if (*end != '\0' || count <= 0)
+      {
+        fprintf(stderr, "jobs: bad count '%s'\n", argv[i]);
+        return -1;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "usage: jobs --stats [-i SECONDS] [-n COUNT]\n");
+      return -1;
+    }
+  }
+
+  /* A single table, or with an interval refresh until stopped */
+  if (count < 0)
+    count = interval > 0 ? 0 : 1;
+  if (interval == 0)
+  {
+    update_jobs(sh);
+    print_job_stats(sh);
+    return 0;
+  }
+
+  /* Refresh until interrupted, the count runs out or every job is done */
+  struct sigaction sa = {0}, old;
+  sa.sa_handler = stats_sigint;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, &old);
+  stats_interrupted = 0;
+
+  for (long n = 0; !stats_interrupted && (count == 0 || n < count); n++)
+  {
+    if (n > 0)
+    {
+      struct timespec ts;
+      ts.tv_sec = (time_t)interval;
+      ts.tv_nsec = (long)((interval - (double)ts.tv_sec) * 1e9);
+      if (nanosleep(&ts, NULL) != 0 && errno == EINTR)
+        break;
+      printf("\n");
+    }
+    update_jobs(sh);
+    if (print_job_stats(sh) == 0)
+      break;
+  }
+  sigaction(SIGINT, &old, NULL);
+  return 0;
+}
@@ -13,6 +13,8 @@
 #include <signal.h>
 #include <sys/wait.h>
 
+extern char **environ;
+
 /**
  * @brief Set the shell prompt. This function will attempt to load a prompt
  * from the requested environment variable, if the environment variable is
@@ -48,6 +50,27 @@ char *get_prompt(const char *env)
   return prompt;
 }
 
+/**
+ * @brief Find the home directory of the user. The value of HOME wins,
+ * otherwise the password database is asked.
+ *
+ * @param home The value of HOME or NULL if it is not set
+ * @return The home directory or NULL if it could not be found
+ */
+const char *home_dir(const char *home)
+{
+  if (home != NULL)
+    return home;
+
+  struct passwd *pw = getpwuid(getuid());
+  if (pw == NULL)
+  {
+    perror("getpwuid");
+    return NULL;
+  }
+  return pw->pw_dir;
+}
+
 /**
  * Changes the current working directory of the shell. Uses the linux system
  * call chdir. With no arguments the users home directory is used as the
@@ -63,17 +86,9 @@ int change_dir(char **dir)
 
   if (dir[1] == NULL)
   {
-    path = getenv("HOME");
+    path = home_dir(getenv("HOME"));
     if (path == NULL)
-    {
-      struct passwd *pw = getpwuid(getuid());
-      if (pw == NULL)
-      {
-        perror("getpwuid");
-        return -1;
-      }
-      path = pw->pw_dir;
-    }
+      return -1;
   }
   else
   {
@@ -88,6 +103,51 @@ int change_dir(char **dir)
   return 0;
 }
 
+/**
+ * @brief Find the end of the word starting at p. Blanks inside quotes,
+ * backquotes or inside ${...}, $(...), $((...)), <(...) and >(...) do not
+ * end the word. The quotes are
+ * left in the word for the expansion stage to remove.
+ *
+ * @param p The start of the word
+ * @return One past the last character of the word
+ */
+static const char *word_end(const char *p)
+{
+  char quote = '\0';
+  int depth = 0;
+
+  for (; *p != '\0'; p++)
+  {
+    if (*p == '\\' && quote != '\'')
+    {
+      if (p[1] == '\0')
+        break;
+      p++;
+    }
+    else if (quote != '\0')
+    {
+      if (*p == quote)
+        quote = '\0';
+    }
+    else if (*p == '\'' || *p == '"' || *p == '`')
+      quote = *p;
+    else if ((*p == '$' && (p[1] == '(' || p[1] == '{')) ||
+             ((*p == '<' || *p == '>') && p[1] == '('))
+    {
+      depth++;
+      p++;
+    }
+    else if (depth > 0 && *p == '(')
+      depth++;
+    else if (depth > 0 && (*p == ')' || *p == '}'))
+      depth--;
+    else if (depth == 0 && (*p == ' ' || *p == '\t' || *p == '\n'))
+      break;
+  }
+  return p;
+}
+
 /**
  * @brief Convert line read from the user into to format that will work with
  * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
@@ -107,27 +167,32 @@ char **cmd_parse(char const *line)
   }
 
   char **argv = malloc(sizeof(char *) * (arg_max + 1));
-  char *mutable_line = strdup(line);
+  if (argv == NULL)
+    return NULL;
 
-  char *token = strtok(mutable_line, " \t\n");
+  const char *p = line;
   int i = 0;
-  while (token != NULL && i < arg_max)
+  while (i < arg_max)
   {
-    argv[i] = strdup(token);
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+      p++;
+    if (*p == '\0')
+      break;
+    const char *end = word_end(p);
+    argv[i] = strndup(p, (size_t)(end - p));
     if (argv[i] == NULL)
     {
       cmd_free(argv);
-      free(mutable_line);
       return NULL;
     }
-    token = strtok(NULL, " \t\n");
-    i++;
+    p = end;
+    argv[++i] = NULL;
   }
   argv[i] = NULL;
 
-  free(mutable_line); // Free the mutable copy
   return argv;
 }
+
 /**
  * @brief Free the line that was constructed with parse_cmd
  *
@@ -203,6 +268,82 @@ char *trim_white(char *line)
   return line;
 }
 
+/**
+ * @brief Check if a command name is a built in command.
+ *
+ * @param name The command name
+ * @return True if do_builtin handles the command
+ */
+bool is_builtin(const char *name)
+{
+  static const char *const builtins[] = {
+      "exit", "cd", "pwd", "history", "export", "unset", "set", "run",
+      "bgpolicy", "time", "timeout", "bench", "batch", "subreaper", "capture",
+      "fg", "bg", "wait", "jobs", "true", "false", ":", "break", "continue",
+      "return", "source", ".", "linecache", "echo", "printf",
+      "cache", "zygote", NULL,
+  };
+
+  for (int i = 0; builtins[i] != NULL; i++)
+  {
+    if (strcmp(name, builtins[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * @brief Check if a command is a builtin that only prints, so it can run
+ * inside the shell with its output captured instead of in a child.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @return True if the command changes nothing and reads no input
+ */
+bool builtin_pure(struct shell *sh, char **argv)
+{
+  static const char *const printing[] = {
+      "echo", "printf", "pwd", "history", "true", "false", ":", NULL,
+  };
+  const char *name = argv[0];
+
+  if (func_find(sh, name) != NULL)
+    return false;
+  for (int i = 0; printing[i] != NULL; i++)
+  {
+    if (strcmp(name, printing[i]) == 0)
+      return true;
+  }
+  /* Listing only, assignments must not leak out of the child's copy */
+  if ((strcmp(name, "set") == 0 || strcmp(name, "export") == 0) && argv[1] == NULL)
+    return true;
+  return strcmp(name, "jobs") == 0 && argv[1] == NULL;
+}
+
+/**
+ * @brief Run a builtin with stdout going to memory.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param len Set to the number of bytes printed
+ * @return What the builtin printed, to be freed, or NULL if out of memory
+ */
+char *builtin_render(struct shell *sh, char **argv, size_t *len)
+{
+  char *data = NULL;
+  FILE *mem = open_memstream(&data, len);
+  if (mem == NULL)
+    return NULL;
+
+  fflush(stdout);
+  FILE *saved = stdout;
+  stdout = mem;
+  run_command(sh, argv, 0);
+  stdout = saved;
+  fclose(mem);
+  return data;
+}
+
 /**
  * @brief Takes an argument list and checks if the first argument is a
  * built in command such as exit, cd, jobs, etc. If the command is a
@@ -221,14 +362,26 @@ bool do_builtin(struct shell *sh, char **argv)
 
   if (strcmp(argv[0], "exit") == 0)
   {
+    /* An embedded shell ends, the program it is embedded in goes on */
+    if (argv[1] != NULL)
+      sh->last_status = atoi(argv[1]) & 0xff;
+    if (sh->io != NULL)
+    {
+      sh->exiting = 1;
+      return true;
+    }
+    int status = sh->last_status;
     sh_destroy(sh);
-    exit(0);
+    exit(status);
   }
 
   if (strcmp(argv[0], "cd") == 0)
   {
-    if (change_dir(argv) == 0)
+    /* A HOME set in the shell wins over the one the shell started with */
+    char *home[] = {argv[0], (char *)var_get(&sh->vars, "HOME"), NULL};
+    if (change_dir(argv[1] == NULL && home[1] != NULL ? home : argv) == 0)
     {
+      sh->last_status = 0;
       return true;
     }
     return false;
@@ -267,18 +420,174 @@ bool do_builtin(struct shell *sh, char **argv)
     }
   }
 
+  if (strcmp(argv[0], "true") == 0 || strcmp(argv[0], ":") == 0)
+  {
+    sh->last_status = 0;
+    return true;
+  }
+
+  if (strcmp(argv[0], "false") == 0)
+  {
+    sh->last_status = 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "break") == 0 || strcmp(argv[0], "continue") == 0)
+  {
+    sh->last_status = builtin_break(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "return") == 0)
+  {
+    sh->last_status = builtin_return(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "source") == 0 || strcmp(argv[0], ".") == 0)
+  {
+    sh->last_status = builtin_source(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "echo") == 0)
+  {
+    sh->last_status = builtin_echo(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "printf") == 0)
+  {
+    sh->last_status = builtin_printf(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "linecache") == 0)
+  {
+    sh->last_status = builtin_linecache(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "cache") == 0)
+  {
+    sh->last_status = builtin_cache(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "zygote") == 0)
+  {
+    sh->last_status = builtin_zygote(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "run") == 0)
+  {
+    sh->last_status = builtin_run(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "bgpolicy") == 0)
+  {
+    sh->last_status = builtin_bgpolicy(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "export") == 0)
+  {
+    sh->last_status = builtin_export(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "unset") == 0)
+  {
+    sh->last_status = builtin_unset(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "set") == 0)
+  {
+    sh->last_status = builtin_set(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "time") == 0)
+  {
+    sh->last_status = builtin_time(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "timeout") == 0)
+  {
+    sh->last_status = builtin_timeout(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "bench") == 0)
+  {
+    sh->last_status = builtin_bench(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "batch") == 0)
+  {
+    sh->last_status = builtin_batch(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "subreaper") == 0)
+  {
+    sh->last_status = builtin_subreaper(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "capture") == 0)
+  {
+    sh->last_status = builtin_capture(sh, argv) == 0 ? 0 : 1;
+    return true;
+  }
+
+  if (strcmp(argv[0], "fg") == 0)
+  {
+    sh->last_status = builtin_fg(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "bg") == 0)
+  {
+    sh->last_status = builtin_bg(sh, argv);
+    return true;
+  }
+
+  if (strcmp(argv[0], "wait") == 0)
+  {
+    sh->last_status = builtin_wait(sh, argv);
+    return true;
+  }
+
   if (strcmp(argv[0], "jobs") == 0)
   {
+    if (argv[1] != NULL && strcmp(argv[1], "--stats") == 0)
+    {
+      job_stats(sh, argv);
+      return true;
+    }
+    if (argv[1] != NULL && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "-f") == 0))
+    {
+      sh->last_status = job_output(sh, argv) == 0 ? 0 : 1;
+      return true;
+    }
+    int usage = argv[1] != NULL && strcmp(argv[1], "-u") == 0;
+    update_jobs(sh);
     for (int i = 0; i < sh->num_bg_processes; i++)
     {
       struct bg_process *bgp = &sh->bg_processes[i];
-      if (bgp->is_done)
-      {
-        printf("[%d] Done    %s &\n", bgp->job_id, bgp->command);
-      }
-      else
+      job_print(bgp);
+      if (usage)
       {
-        printf("[%d] %d Running %s &\n", bgp->job_id, bgp->pid, bgp->command);
+        printf("    user %ld.%03lds sys %ld.%03lds maxrss %ldK reaped %d\n",
+               (long)bgp->usage.ru_utime.tv_sec, (long)bgp->usage.ru_utime.tv_usec / 1000,
+               (long)bgp->usage.ru_stime.tv_sec, (long)bgp->usage.ru_stime.tv_usec / 1000,
+               bgp->usage.ru_maxrss, bgp->reaped);
       }
     }
     return true;
@@ -299,9 +608,7 @@ bool do_builtin(struct shell *sh, char **argv)
  */
 void sh_init(struct shell *sh)
 {
-  sh->prompt = get_prompt("MY_PROMPT");
-
-  sh->shell_terminal = STDIN_FILENO;
+  sh_init_state(sh);
   sh->shell_is_interactive = isatty(sh->shell_terminal);
 
   if (sh->shell_is_interactive)
@@ -325,6 +632,32 @@ void sh_init(struct shell *sh)
     tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
     tcgetattr(sh->shell_terminal, &sh->shell_tmodes);
   }
+
+  /* Files the shell writes go through io_uring unless turned off */
+  const char *uring = var_get(&sh->vars, "MY_URING");
+  if (uring != NULL && strcmp(uring, "0") == 0)
+    io_use_uring(0);
+
+  /* Forked now, before history and caches make the shell expensive to copy */
+  const char *zygote = var_get(&sh->vars, "MY_ZYGOTE");
+  if (zygote != NULL && *zygote != '\0' && strcmp(zygote, "0") != 0 && zygote_start(sh) != 0)
+    perror("zygote");
+}
+
+/**
+ * @brief Initialize everything but the terminal. The shell is left
+ * non-interactive and the signal dispositions of the process untouched.
+ *
+ * @param sh The shell
+ */
+void sh_init_state(struct shell *sh)
+{
+  sh->prompt = get_prompt("MY_PROMPT");
+  job_policy_init(&sh->bg_policy);
+  vars_init(&sh->vars);
+  vars_import(&sh->vars, environ);
+  line_cache_resize(&sh->lines, LINE_CACHE_DEFAULT);
+  sh->shell_terminal = STDIN_FILENO;
 }
 
 /**
@@ -339,6 +672,15 @@ void sh_destroy(struct shell *sh)
   {
     free(sh->prompt);
   }
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    job_release(&sh->bg_processes[i]);
+  }
+  job_unwatch(sh);
+  zygote_stop(sh);
+  line_cache_free(&sh->lines);
+  exec_free(sh);
+  vars_free(&sh->vars);
 }
 
 /**
@@ -346,17 +688,27 @@ void sh_destroy(struct shell *sh)
  *
  * @param argc Number of arguments
  * @param argv The argument array
+ * @param opts Set to the modes picked
  */
-void parse_args(int argc, char **argv)
+void parse_args(int argc, char **argv, struct shell_options *opts)
 {
   int opt;
-  while ((opt = getopt(argc, argv, "v")) != -1)
+  while ((opt = getopt(argc, argv, "vS:s:c:")) != -1)
   {
     switch (opt)
     {
     case 'v':
       printf("Shell version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
       break;
+    case 'S':
+      opts->serve = optarg;
+      break;
+    case 's':
+      opts->connect = optarg;
+      break;
+    case 'c':
+      opts->command = optarg;
+      break;
     case '?':
       if (isprint(optopt))
         fprintf(stderr, "Unknown option: '%c'\n", optopt);
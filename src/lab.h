@@ -2,28 +2,274 @@
 #define LAB_H
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define lab_VERSION_MAJOR 1
 #define lab_VERSION_MINOR 0
 #define UNUSED(x) (void)x;
 #define MAX_BG_PROCESSES 1024
+#define MAX_CPUS 1024
+#define FUNC_BUCKETS 64
+#define LINE_CACHE_DEFAULT 64
 
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+  /**
+   * @brief Placement applied to a job between fork and exec. Anything that
+   * is not set is inherited from the shell unchanged.
+   */
+  struct job_policy
+  {
+    int has_cpus;
+    unsigned long cpus[MAX_CPUS / (8 * sizeof(unsigned long))];
+    int has_nice;
+    int nice;
+    int sched; /* -1 to inherit, otherwise SCHED_OTHER, SCHED_BATCH or SCHED_IDLE */
+  };
+
+#define VAR_EXPORT 0x1
+
+  /**
+   * @brief A shell variable. The name and value are stored together as
+   * "NAME=value" so the same string can be handed to exec as is.
+   */
+  struct var
+  {
+    char *name; /* "NAME=value", NULL for an empty slot */
+    size_t name_len;
+    const char *value;
+    unsigned int hash;
+    int flags;
+  };
+
+  /**
+   * @brief Open addressing hash table of shell variables. The envp array
+   * of exported variables is cached and only rebuilt after an exported
+   * variable changes.
+   */
+  struct var_table
+  {
+    struct var *slots;
+    size_t cap; /* always a power of two */
+    size_t count;
+    size_t tombstones;
+    char **envp;
+    int envp_dirty;
+  };
+
+  /**
+   * @brief The expanded words of one command. The fields are stored back
+   * to back in buf and argv points into it. Both buffers are kept and
+   * reused by the next expansion.
+   */
+  struct expansion
+  {
+    char *buf;
+    size_t len;
+    size_t cap;
+    char **argv;
+    size_t argc;
+    size_t argv_cap;
+    struct glob_cache *glob; /* directory listings of the current line */
+    int glob_threads;        /* threads for ** walks, 0 for the default */
+    int pattern;             /* no pathname expansion and escapes are kept */
+
+    struct proc_subst *procs; /* <(...) and >(...) started for the command */
+    size_t nprocs;
+    size_t procs_cap;
+    unsigned long jobs_seen; /* jobs_started when the words were expanded */
+  };
+
+  /**
+   * @brief A process substitution. The shell keeps its end of the pipe
+   * open until the command that was given /dev/fd/N has been started.
+   */
+  struct proc_subst
+  {
+    pid_t pid;
+    int fd;
+  };
+
+  /**
+   * @brief Kinds of nodes in a parsed command. Node and string references
+   * are indexes, so a tree can be moved or mapped from a file as is.
+   */
+  enum ast_kind
+  {
+    AST_SIMPLE,   /* words a..a+b of the word table, here-document c */
+    AST_LIST,     /* commands chained through next starting at a */
+    AST_IF,       /* condition a, then b, else c which may be another if */
+    AST_WHILE,    /* condition a, body b */
+    AST_UNTIL,    /* condition a, body b */
+    AST_FOR,      /* variable a, body b, words c..c+d */
+    AST_CASE,     /* word a, items chained through next starting at b */
+    AST_CASE_ITEM,/* patterns a..a+b of the word table, body c */
+    AST_GROUP,    /* { list a } */
+    AST_SUBSHELL, /* ( list a ) */
+    AST_FUNCTION, /* name a, body b */
+    AST_AND,      /* a && b */
+    AST_OR,       /* a || b */
+    AST_PIPELINE, /* b commands from a, linked by next */
+  };
+
+#define AST_BACKGROUND 0x1  /* the command ended with & */
+#define AST_HERE 0x2        /* c of a simple command is a here-document */
+#define AST_HERE_STRING 0x4 /* c is the word of a here-string */
+#define AST_HERE_QUOTED 0x8 /* the delimiter was quoted, no expansion */
+#define AST_FOR_IN 0x10     /* the for loop has an in list */
+
+  /**
+   * @brief One node of a parsed command. Index 0 is never a node, so 0
+   * means none for a, b, c and next.
+   */
+  struct ast_node
+  {
+    uint16_t kind;
+    uint16_t flags;
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+    uint32_t d;
+    uint32_t next;
+  };
+
+  /**
+   * @brief A parsed command line or script. Words are offsets into strings
+   * and every node lives in one array, so the tree is parsed once and
+   * run any number of times. Function definitions keep a reference.
+   */
+  struct ast
+  {
+    int refs;
+    uint32_t root;
+    struct ast_node *nodes;
+    uint32_t nnodes;
+    uint32_t nodes_cap;
+    uint32_t *words;
+    uint32_t nwords;
+    uint32_t words_cap;
+    char *strings;
+    uint32_t strings_len;
+    uint32_t strings_cap;
+    void *map; /* the tables point into this cache mapping, NULL if allocated */
+    size_t map_len;
+  };
+
+  /**
+   * @brief A shell function.
+   */
+  struct func
+  {
+    char *name;
+    struct ast *tree;
+    uint32_t body;
+    struct func *next;
+  };
+
+  /**
+   * @brief A command line in the parsed-line cache.
+   */
+  struct line_entry
+  {
+    uint64_t hash;
+    char *line;
+    struct ast *tree;
+    struct line_entry *chain; /* next in the same bucket */
+    struct line_entry *prev;  /* more recently used */
+    struct line_entry *next;  /* less recently used */
+  };
+
+  /**
+   * @brief Least recently used cache of parsed command lines, so a line
+   * that is typed or generated again is not parsed again.
+   */
+  struct line_cache
+  {
+    struct line_entry **buckets;
+    size_t nbuckets; /* always a power of two */
+    struct line_entry *head;
+    struct line_entry *tail;
+    size_t count;
+    size_t size; /* most entries kept, 0 turns the cache off */
+    unsigned long hits;
+    unsigned long misses;
+  };
+
+  enum job_state
+  {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+    JOB_SIGNALED
+  };
+
   struct bg_process
   {
     int job_id;
     pid_t pid;
     char *command;
-    int is_done;
+    enum job_state state;
+    int status; /* wait status of the leader once it has exited */
+
+    int proc_fd; /* open /proc/<pid> directory while the job is live */
+    unsigned long long last_ticks;
+    struct timespec last_sample;
+
+    pid_t pgid;
+    int leader_done;
+    int reaped;             /* processes of this job reaped so far */
+    struct rusage usage;    /* summed over every reaped process */
+    pid_t *tracked;         /* known descendants, kept in subreaper mode */
+    size_t num_tracked;
+    size_t cap_tracked;
+
+    int out_fd;      /* memfd holding stdout and stderr when captured */
+    off_t out_start; /* output before this offset was discarded */
+  };
+
+  /**
+   * @brief A pidfd kept open for a process of a job, see job_event.
+   */
+  struct job_watch
+  {
+    pid_t pid;
+    int fd; /* -1 if the process can not be watched */
+  };
+
+  /**
+   * @brief A helper process forked while the shell is small that starts
+   * external commands for it, see zygote_start.
+   */
+  struct zygote
+  {
+    int fd;     /* the shell's end of the socket pair */
+    pid_t pid;  /* 0 if there is no zygote */
+    pid_t owner; /* the shell that started it, its forks do not use it */
+    int paused; /* zygote off: fork the shell instead */
+    unsigned long spawns;
   };
 
+  /**
+   * @brief Receives the output of an embedded shell.
+   *
+   * @param arg The argument given to shell_new
+   * @param fd 1 for stdout, 2 for stderr
+   * @param data The output, not NUL terminated
+   * @param len The length of the output
+   */
+  typedef void (*shell_output_fn)(void *arg, int fd, const char *data, size_t len);
+
+  struct shell_io;
+
   struct shell
   {
     int shell_is_interactive;
@@ -34,8 +280,188 @@ extern "C"
 
     struct bg_process bg_processes[MAX_BG_PROCESSES];
     int num_bg_processes;
+    int last_job_id;
+    unsigned long jobs_started; /* bumped by job_add, never reset */
+
+    struct job_policy bg_policy;
+    int launch_background;
+
+    int subreaper;
+    unsigned long orphans_reaped; /* adopted processes matching no job */
+
+    struct job_watch *watch; /* job processes an embedded shell waits on */
+    size_t num_watch;
+    size_t cap_watch;
+
+    int last_status;
+    struct rusage last_usage; /* usage of the last foreground child */
+
+    double default_timeout; /* seconds, 0 for no deadline */
+    double command_timeout; /* set by the timeout builtin for one command */
+    double kill_after;      /* grace between SIGTERM and SIGKILL */
+
+    int capture;
+    size_t capture_cap; /* bytes kept per job, 0 for the default */
+
+    struct var_table vars;
+
+    int here_fd; /* stdin of the next command from a here-document, 0 for none */
+
+    struct func *funcs[FUNC_BUCKETS];
+    char **args; /* positional parameters of the running function */
+    int nargs;
+    int func_depth;
+    int source_depth;
+    int loop_depth;
+    int breaking;   /* loops left to break out of */
+    int continuing; /* loops left to continue, the innermost one resumes */
+    int returning;  /* a return is unwinding the running function or script */
+
+    struct expansion **exps; /* one per level of running commands */
+    size_t exp_depth;
+    size_t exp_cap;
+
+    struct line_cache lines;
+
+    unsigned long memo_hits;   /* cache builtin runs replayed */
+    unsigned long memo_misses; /* cache builtin runs executed */
+
+    struct zygote zygote;
+
+    struct shell_io *io; /* set in a shell made by shell_new */
+    int exiting;         /* exit ran in an embedded shell, nothing more runs */
   };
 
+  /**
+   * @brief Initialize an empty variable table.
+   *
+   * @param t The table
+   */
+  void vars_init(struct var_table *t);
+
+  /**
+   * @brief Free a variable table and everything in it.
+   *
+   * @param t The table
+   */
+  void vars_free(struct var_table *t);
+
+  /**
+   * @brief Import an environment array as exported variables.
+   *
+   * @param t The table
+   * @param env The environment, usually environ
+   */
+  void vars_import(struct var_table *t, char **env);
+
+  /**
+   * @brief Check if a string is a valid variable name.
+   *
+   * @param name The string
+   * @param len The number of characters to check
+   * @return Non zero if the name is valid
+   */
+  int var_valid_name(const char *name, size_t len);
+
+  /**
+   * @brief Look up a variable.
+   *
+   * @param t The table
+   * @param name The name
+   * @return The value or NULL if the variable is not set
+   */
+  const char *var_get(struct var_table *t, const char *name);
+
+  /**
+   * @brief Look up a variable by a name that is not NUL terminated.
+   *
+   * @param t The table
+   * @param name The name
+   * @param len The length of the name
+   * @return The value or NULL if the variable is not set
+   */
+  const char *var_get_n(struct var_table *t, const char *name, size_t len);
+
+  /**
+   * @brief Set a variable. Flags are added to the ones the variable
+   * already has, so assigning to an exported variable keeps it exported.
+   *
+   * @param t The table
+   * @param name The name
+   * @param value The value, NULL keeps the current value
+   * @param flags VAR_EXPORT to export the variable
+   * @return 0 on success, -1 if the name is invalid or out of memory
+   */
+  int var_set(struct var_table *t, const char *name, const char *value, int flags);
+
+  /**
+   * @brief Remove a variable.
+   *
+   * @param t The table
+   * @param name The name
+   * @return 0 if the variable was removed, -1 if it was not set
+   */
+  int var_unset(struct var_table *t, const char *name);
+
+  /**
+   * @brief Get the environment for a new process. The array is cached in
+   * the table and only rebuilt when an exported variable has changed since
+   * the last call. The entries point into the table, nothing is copied.
+   *
+   * @param t The table
+   * @return A NULL terminated array of "NAME=value" strings owned by the table
+   */
+  char **var_envp(struct var_table *t);
+
+  /**
+   * @brief Check if a word is an assignment such as NAME=value.
+   *
+   * @param word The word
+   * @return The length of the name or 0 if the word is not an assignment
+   */
+  size_t var_assignment(const char *word);
+
+  /**
+   * @brief Run a command with assignments in front of it. Without a command
+   * the assignments set shell variables, otherwise they are exported to the
+   * command only and the old values are put back afterwards.
+   *
+   * @param sh The shell
+   * @param argv The words, starting with at least one assignment
+   * @param background Non zero to run the command as a background job
+   * @return The exit status
+   */
+  int run_assignments(struct shell *sh, char **argv, int background);
+
+  /**
+   * @brief The export builtin.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_export(struct shell *sh, char **argv);
+
+  /**
+   * @brief The unset builtin. Unsetting a variable that is not set is not
+   * an error.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_unset(struct shell *sh, char **argv);
+
+  /**
+   * @brief The set builtin. Lists every variable, or sets shell variables
+   * from NAME=value arguments without exporting them.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_set(struct shell *sh, char **argv);
+
   /**
    * @brief Set the shell prompt. This function will attempt to load a prompt
    * from the requested environment variable, if the environment variable is
@@ -59,75 +485,1160 @@ extern "C"
   int change_dir(char **dir);
 
   /**
-   * @brief Convert line read from the user into to format that will work with
-   * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-   * This function allocates memory that must be reclaimed with the cmd_free
-   * function.
+   * @brief Find the home directory of the user. The value of HOME wins,
+   * otherwise the password database is asked.
    *
-   * @param line The line to process
+   * @param home The value of HOME or NULL if it is not set
+   * @return The home directory or NULL if it could not be found
+   */
+  const char *home_dir(const char *home);
+
+  /**
+   * @brief Expand the words of a command: parameters, ~, $((...)), command
+   * and process substitution, then pathname expansion and quote removal.
+   * Unquoted results of expansions are split on blanks. All fields are
+   * written to one buffer that is reused for the next command, so the work
+   * done is linear in the length of the output.
    *
-   * @return The line read in a format suitable for exec
+   * @param sh The shell
+   * @param words The words from cmd_parse
+   * @param ex The expansion, argv is NULL terminated and points into buf
+   * @return 0 on success, -1 after printing an error
    */
-  char **cmd_parse(char const *line);
+  int expand_words(struct shell *sh, char **words, struct expansion *ex);
 
   /**
-   * @brief Free the line that was constructed with parse_cmd
+   * @brief Free the buffers of an expansion.
    *
-   * @param line the line to free
+   * @param ex The expansion
    */
-  void cmd_free(char **line);
+  void expansion_free(struct expansion *ex);
 
   /**
-   * @brief Trim the whitespace from the start and end of a string.
-   * For example "   ls -a   " becomes "ls -a". This function modifies
-   * the argument line so that all printable chars are moved to the
-   * front of the string
+   * @brief Expand the body of a here-document: parameters, $((...)) and
+   * command substitution as inside double quotes, but quotes are kept.
    *
-   * @param line The line to trim
-   * @return The new line with no whitespace
+   * @param sh The shell
+   * @param text The body
+   * @param len The length of the body
+   * @param ex The expansion, the result is the NUL terminated start of buf
+   * @return The length of the result or -1 after printing an error
    */
-  char *trim_white(char *line);
+  ssize_t expand_heredoc(struct shell *sh, const char *text, size_t len, struct expansion *ex);
 
   /**
-   * @brief Takes an argument list and checks if the first argument is a
-   * built in command such as exit, cd, jobs, etc. If the command is a
-   * built in command this function will handle the command and then return
-   * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * @brief Put data in a file descriptor that reads it from the start. Small
+   * data goes into a pipe, larger data into a sealed memfd, so nothing is
+   * ever written to disk.
+   *
+   * @param data The data
+   * @param len The length of the data
+   * @return The descriptor, close on exec, or -1 on error
+   */
+  int heredoc_fd(const char *data, size_t len);
+
+  /**
+   * @brief Remove quotes and backslashes from a delimiter.
+   *
+   * @param word The delimiter as written, changed in place
+   * @return Non zero if any part of the delimiter was quoted
+   */
+  int heredoc_unquote(char *word);
+
+  /**
+   * @brief Make the stdin of a command with a here-document or here-string.
    *
    * @param sh The shell
-   * @param argv The command to check
-   * @return True if the command was a built in command
+   * @param text The body of the here-document or the word of the here-string
+   * @param string Non zero for a here-string
+   * @param quoted Non zero if the here-document is not expanded
+   * @return The descriptor, close on exec, or -1 after printing an error
    */
-  bool do_builtin(struct shell *sh, char **argv);
+  int heredoc_open(struct shell *sh, const char *text, int string, int quoted);
 
   /**
-   * @brief Initialize the shell for use. Allocate all data structures
-   * Grab control of the terminal and put the shell in its own
-   * process group. NOTE: This function will block until the shell is
-   * in its own program group. Attaching a debugger will always cause
-   * this function to fail because the debugger maintains control of
-   * the subprocess it is debugging.
+   * @brief Close the here-document of the last command.
    *
-   * @param sh
+   * @param sh The shell
    */
-  void sh_init(struct shell *sh);
+  void heredoc_done(struct shell *sh);
 
   /**
-   * @brief Destroy shell. Free any allocated memory and resources and exit
-   * normally.
+   * @brief Close the shell's end of the process substitutions of a command
+   * after it ran. If the command became a job the processes are tracked by
+   * that job, otherwise they are waited for.
    *
-   * @param sh
+   * @param sh The shell
+   * @param ex The expansion the command came from
    */
-  void sh_destroy(struct shell *sh);
+  void procsubst_reap(struct shell *sh, struct expansion *ex);
 
   /**
-   * @brief Parse command line args from the user when the shell was launched
+   * @brief Replace the pattern at the end of the buffer by the sorted paths
+   * it matches, or by the pattern itself without escapes if nothing matches.
+   * Directory listings are cached in the expansion until the next command.
+   * A ** followed by at most one more component is walked with
+   * glob_threads threads.
    *
-   * @param argc Number of args
-   * @param argv The arg array
+   * @param ex The expansion
+   * @param start The offset of the pattern, which runs to the end of the buffer
+   * @return 0 on success, -1 if out of memory
+   */
+  int glob_expand(struct expansion *ex, size_t start);
+
+  /**
+   * @brief Drop the cached directory listings.
+   *
+   * @param ex The expansion that owns the cache
+   */
+  void glob_cache_clear(struct expansion *ex);
+
+  /**
+   * @brief Drop the directory listings of every expansion of the shell. A
+   * listing is only kept for one command line.
+   *
+   * @param sh The shell
+   */
+  void glob_cache_reset(struct shell *sh);
+
+  /**
+   * @brief Match a name against one pattern component. A * backtracks to
+   * the last star only, so the match is linear for all practical patterns.
+   *
+   * @param pat The pattern
+   * @param len The length of the pattern
+   * @param name The name
+   * @return Non zero if the name matches
+   */
+  int glob_match(const char *pat, size_t len, const char *name);
+
+  /**
+   * @brief Remove backslash escapes in place.
+   *
+   * @param s The text
+   * @param len The length of the text
+   * @return The new length
+   */
+  size_t glob_unescape(char *s, size_t len);
+
+  /**
+   * @brief Evaluate an arithmetic expression. Integers are 64 bit and the
+   * operators are the C ones without assignment, increment and the
+   * conditional operator.
+   *
+   * @param vars The variables the expression can refer to
+   * @param expr The expression
+   * @param len The length of the expression
+   * @param result The value of the expression
+   * @return 0 on success, -1 after printing an error
+   */
+  int arith_eval(struct var_table *vars, const char *expr, size_t len, long long *result);
+
+  /**
+   * @brief Parse a command line or a script into a tree. Lines are read with
+   * next_line while an if, loop, quote or here-document is still open.
+   *
+   * @param text The first line or the whole script
+   * @param next_line Returns the next line to be freed or NULL at the end,
+   * may be NULL if there is no more input
+   * @param arg Passed to next_line
+   * @return The tree with one reference or NULL after printing an error
+   */
+  struct ast *ast_parse(const char *text, char *(*next_line)(void *), void *arg);
+
+  /**
+   * @brief Take a reference to a tree.
+   *
+   * @param t The tree
+   * @return The tree
+   */
+  struct ast *ast_ref(struct ast *t);
+
+  /**
+   * @brief Drop a reference to a tree and free it with the last one.
+   *
+   * @param t The tree or NULL
+   */
+  void ast_release(struct ast *t);
+
+  /**
+   * @brief Run a parsed command line or script.
+   *
+   * @param sh The shell
+   * @param t The tree
+   * @return The exit status of the last command
+   */
+  int exec_tree(struct shell *sh, struct ast *t);
+
+  /**
+   * @brief Free the functions and expansion buffers of the shell.
+   *
+   * @param sh The shell
+   */
+  void exec_free(struct shell *sh);
+
+  /**
+   * @brief Find a shell function.
+   *
+   * @param sh The shell
+   * @param name The name of the function
+   * @return The function or NULL
+   */
+  struct func *func_find(struct shell *sh, const char *name);
+
+  /**
+   * @brief Define or redefine a shell function. The function keeps a
+   * reference to the tree its body is in.
+   *
+   * @param sh The shell
+   * @param name The name of the function
+   * @param t The tree
+   * @param body The body of the function
+   * @return 0 on success, -1 if out of memory
+   */
+  int func_define(struct shell *sh, const char *name, struct ast *t, uint32_t body);
+
+  /**
+   * @brief Call a shell function with argv[1]... as the positional
+   * parameters.
+   *
+   * @param sh The shell
+   * @param f The function
+   * @param argv The command
+   * @return The exit status of the function
+   */
+  int func_call(struct shell *sh, struct func *f, char **argv);
+
+  /**
+   * @brief The break and continue builtins.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, 1 on error
+   */
+  int builtin_break(struct shell *sh, char **argv);
+
+  /**
+   * @brief The return builtin.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status to return with
+   */
+  int builtin_return(struct shell *sh, char **argv);
+
+  /**
+   * @brief Find the cache directory of the shell, creating it if needed.
+   * The directory is MY_CACHE_DIR, $XDG_CACHE_HOME/mysh or ~/.cache/mysh.
+   * An empty MY_CACHE_DIR turns every cache off.
+   *
+   * @param sh The shell
+   * @param sub A subdirectory to use instead, or NULL
+   * @param out Room for the name of the directory
+   * @param size The size of out
+   * @return 0 on success, -1 if there is no cache
+   */
+  int cache_dir(struct shell *sh, const char *sub, char *out, size_t size);
+
+  /**
+   * @brief Run a script in the current shell. The parsed tree is kept in
+   * the cache directory and mapped back in while the script is unchanged.
+   *
+   * @param sh The shell
+   * @param path The script
+   * @param args The positional parameters or NULL to keep the current ones
+   * @return The exit status of the script
+   */
+  int source_file(struct shell *sh, const char *path, char **args);
+
+  /**
+   * @brief The source and . builtins.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the script
+   */
+  int builtin_source(struct shell *sh, char **argv);
+
+  /**
+   * @brief Run the startup file named by MY_RC, or ~/.myshrc, if it exists.
+   *
+   * @param sh The shell
+   */
+  void source_rc(struct shell *sh);
+
+  /**
+   * @brief Find the tree of a command line.
+   *
+   * @param c The cache
+   * @param line The trimmed line
+   * @return A new reference to the tree or NULL on a miss
+   */
+  struct ast *line_cache_get(struct line_cache *c, const char *line);
+
+  /**
+   * @brief Add the tree of a command line, dropping the least recently
+   * used line if the cache is full.
+   *
+   * @param c The cache
+   * @param line The trimmed line
+   * @param t The tree, the cache takes its own reference
+   */
+  void line_cache_put(struct line_cache *c, const char *line, struct ast *t);
+
+  /**
+   * @brief Change the number of lines kept, dropping the least recently
+   * used ones.
+   *
+   * @param c The cache
+   * @param size The most lines kept, 0 turns the cache off
+   * @return 0 on success, -1 if the size is too large
+   */
+  int line_cache_resize(struct line_cache *c, size_t size);
+
+  /**
+   * @brief Drop every line in the cache.
+   *
+   * @param c The cache
+   */
+  void line_cache_free(struct line_cache *c);
+
+  /**
+   * @brief The linecache builtin. Shows the hit and miss counters or sets
+   * the size of the parsed-line cache.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, 1 on error
+   */
+  int builtin_linecache(struct shell *sh, char **argv);
+
+  /**
+   * @brief Convert line read from the user into to format that will work with
+   * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
+   * This function allocates memory that must be reclaimed with the cmd_free
+   * function.
+   *
+   * @param line The line to process
+   *
+   * @return The line read in a format suitable for exec
+   */
+  char **cmd_parse(char const *line);
+
+  /**
+   * @brief Free the line that was constructed with parse_cmd
+   *
+   * @param line the line to free
+   */
+  void cmd_free(char **line);
+
+  /**
+   * @brief Trim the whitespace from the start and end of a string.
+   * For example "   ls -a   " becomes "ls -a". This function modifies
+   * the argument line so that all printable chars are moved to the
+   * front of the string
+   *
+   * @param line The line to trim
+   * @return The new line with no whitespace
+   */
+  char *trim_white(char *line);
+
+  /**
+   * @brief Check if a command name is a built in command.
+   *
+   * @param name The command name
+   * @return True if do_builtin handles the command
+   */
+  bool is_builtin(const char *name);
+
+  /**
+   * @brief Check if a command is a builtin that only prints, so it can run
+   * inside the shell with its output captured instead of in a child.
+   *
+   * @param sh The shell
+   * @param argv The command
+   * @return True if the command changes nothing and reads no input
+   */
+  bool builtin_pure(struct shell *sh, char **argv);
+
+  /**
+   * @brief Run a builtin with stdout going to memory.
+   *
+   * @param sh The shell
+   * @param argv The command
+   * @param len Set to the number of bytes printed
+   * @return What the builtin printed, to be freed, or NULL if out of memory
+   */
+  char *builtin_render(struct shell *sh, char **argv, size_t *len);
+
+  /**
+   * @brief The echo builtin. -n leaves out the newline, -e turns on
+   * backslash escapes and -E turns them off again.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0
+   */
+  int builtin_echo(struct shell *sh, char **argv);
+
+  /**
+   * @brief The printf builtin. The format is used again until every
+   * argument is consumed. Supports the flags, width and precision of C
+   * printf, * for either, and the conversions diouxXcs, eEfFgGaA and b.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, 1 if an argument was not a number
+   */
+  int builtin_printf(struct shell *sh, char **argv);
+
+  /**
+   * @brief The cache builtin. Runs a command once and replays its stdout,
+   * stderr and exit status while the command line, the working directory,
+   * the selected variables and the dependencies stay the same.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the command
+   */
+  int builtin_cache(struct shell *sh, char **argv);
+
+  /**
+   * @brief Count how many items fit in one command line.
+   *
+   * @param items The items
+   * @param count The number of items
+   * @param budget The bytes left for the items
+   * @param max_items The largest number of items per command, 0 for no limit
+   * @return The number of items that fit, at least one if count is not zero
+   */
+  size_t batch_chunk(char **items, size_t count, size_t budget, size_t max_items);
+
+  /**
+   * @brief The batch builtin. Runs a command once per chunk of items, each
+   * chunk as large as the kernel accepts, like xargs without the pipe.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The largest exit status of any chunk, 0 if all succeeded
+   */
+  int builtin_batch(struct shell *sh, char **argv);
+
+  /**
+   * @brief Takes an argument list and checks if the first argument is a
+   * built in command such as exit, cd, jobs, etc. If the command is a
+   * built in command this function will handle the command and then return
+   * true. If the first argument is NOT a built in command this function will
+   * return false.
+   *
+   * @param sh The shell
+   * @param argv The command to check
+   * @return True if the command was a built in command
+   */
+  bool do_builtin(struct shell *sh, char **argv);
+
+  /**
+   * @brief Fork and exec a command. Foreground commands are given the
+   * terminal and waited on; background commands are recorded in the job
+   * table. The policy is applied in the child before exec, when it is NULL
+   * the shell default for background jobs is used (foreground jobs run
+   * with the inherited placement).
+   *
+   * @param argv The command to run
+   * @param sh The shell
+   * @param background Non zero to run the command as a background job
+   * @param policy The placement to apply or NULL for the default
+   * @return 1 if the command was launched, 0 otherwise
+   */
+  int execute_command(char **argv, struct shell *sh, int background,
+                      const struct job_policy *policy);
+
+  /**
+   * @brief Add a process to the job table as a running job. Finished jobs
+   * are released first if the table is full.
+   *
+   * @param sh The shell
+   * @param pid The job leader, also the process group
+   * @param argv The command the job runs
+   * @return The new job or NULL if the table is full
+   */
+  struct bg_process *job_add(struct shell *sh, pid_t pid, char **argv);
+
+  /**
+   * @brief Free the memory and descriptors held by a job.
+   *
+   * @param bgp The job
+   */
+  void job_release(struct bg_process *bgp);
+
+  /**
+   * @brief Release every finished job from the job table. Job ids of the
+   * remaining jobs do not change.
+   *
+   * @param sh The shell
+   */
+  void job_compact(struct shell *sh);
+
+  /**
+   * @brief Handle one child state change. Exited children are reaped with
+   * wait4 and their usage is added to the job they belong to, stops and
+   * continues update the state of the job. This is the single path every
+   * background child goes through.
+   *
+   * @param sh The shell
+   * @param block Non zero to sleep until a child changes state
+   * @return 1 if an event was handled, 0 if nothing was pending or the wait
+   * was interrupted and -1 if there are no children to wait for
+   */
+  int job_event(struct shell *sh, int block);
+
+  /**
+   * @brief Close the pidfds an embedded shell keeps for its jobs.
+   *
+   * @param sh The shell
+   */
+  void job_unwatch(struct shell *sh);
+
+  /**
+   * @brief Start noticing child state changes that a pidfd does not show,
+   * such as stops. Until child_wake_stop every SIGCHLD makes the returned
+   * descriptor readable, whichever thread the signal is delivered to. A
+   * handler the program had is still called.
+   *
+   * @return The descriptor to poll or -1 if SIGCHLD can not be caught
+   */
+  int child_wake_start(void);
+
+  /**
+   * @brief Put back the SIGCHLD action replaced by child_wake_start.
+   */
+  void child_wake_stop(void);
+
+  /**
+   * @brief Empty the descriptor returned by child_wake_start.
+   *
+   * @return Non zero if a SIGCHLD had arrived
+   */
+  int child_wake_clear(void);
+
+  /**
+   * @brief Move a job to its final state once the leader and every tracked
+   * descendant are gone.
+   *
+   * @param bgp The job
+   */
+  void job_settle(struct bg_process *bgp);
+
+  /**
+   * @brief Check if a job has finished.
+   *
+   * @param bgp The job
+   * @return Non zero if the job is done or was killed by a signal
+   */
+  int job_finished(const struct bg_process *bgp);
+
+  /**
+   * @brief The exit status of a finished job in the form used for $?.
+   *
+   * @param bgp The job
+   * @return The exit status, 128 + signal if the job was killed
+   */
+  int job_exit_status(const struct bg_process *bgp);
+
+  /**
+   * @brief Poll the background jobs for state changes without blocking.
+   *
+   * @param sh The shell
+   */
+  void update_jobs(struct shell *sh);
+
+  /**
+   * @brief Create the output buffer for a new background job. When capture
+   * is on, stdout and stderr of background jobs go to a memfd instead of
+   * the terminal.
+   *
+   * @param sh The shell
+   * @return The memfd or -1 if capture is off or the memfd could not be made
+   */
+  int capture_open(struct shell *sh);
+
+  /**
+   * @brief Discard captured output older than the byte cap. Whole pages
+   * are punched out of the memfd so the memory is given back while the
+   * file offsets keep growing. Called whenever the jobs are polled.
+   *
+   * @param sh The shell
+   * @param bgp The job
+   */
+  void capture_trim(struct shell *sh, struct bg_process *bgp);
+
+  /**
+   * @brief Dump or follow the captured output of a job. "jobs -o JOB"
+   * writes what was kept so far, "jobs -f JOB" keeps writing new output
+   * until the job finishes or SIGINT. Output is moved with sendfile so it
+   * never passes through user space.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int job_output(struct shell *sh, char **argv);
+
+  /**
+   * @brief The capture builtin. "capture on" sends the output of new
+   * background jobs to per job buffers, "capture off" sends it to the
+   * terminal again and "-c BYTES" sets how much output each job keeps.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_capture(struct shell *sh, char **argv);
+
+  /**
+   * @brief Find a job from a job spec such as "%2" or "2". With a NULL
+   * spec the most recent job that has not finished is returned.
+   *
+   * @param sh The shell
+   * @param spec The job spec or NULL
+   * @return The job or NULL if there is no such job
+   */
+  struct bg_process *job_find(struct shell *sh, const char *spec);
+
+  /**
+   * @brief Print one line describing a job in the format used by jobs.
+   *
+   * @param bgp The job
+   */
+  void job_print(const struct bg_process *bgp);
+
+  /**
+   * @brief The fg builtin. Continue a stopped or background job in the
+   * foreground, handing it the terminal until it stops or exits.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the job
+   */
+  int builtin_fg(struct shell *sh, char **argv);
+
+  /**
+   * @brief The bg builtin. Continue a stopped job in the background.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, 1 on error
+   */
+  int builtin_bg(struct shell *sh, char **argv);
+
+  /**
+   * @brief The wait builtin. "wait" blocks until every running job has
+   * finished, "wait JOB..." until the listed jobs have finished and
+   * "wait -n" until the next job finishes. The shell sleeps on child
+   * events while waiting and SIGINT interrupts the wait.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the last job waited for, 127 for an unknown
+   * job and 130 if interrupted
+   */
+  int builtin_wait(struct shell *sh, char **argv);
+
+  /**
+   * @brief Append the pids of the children of every thread of a process
+   * to a list. The list is grown with realloc as needed.
+   *
+   * @param dirfd The /proc/<pid> directory of the process
+   * @param pids The list to append to
+   * @param count Number of pids in the list
+   * @param cap Capacity of the list
+   */
+  void proc_children(int dirfd, pid_t **pids, size_t *count, size_t *cap);
+
+  /**
+   * @brief Read the process group of a process from /proc. This still
+   * works for a zombie that has not been reaped yet.
+   *
+   * @param pid The process
+   * @return The process group or -1 if it could not be read
+   */
+  pid_t proc_pgid(pid_t pid);
+
+  /**
+   * @brief Find the job a process belongs to. A process belongs to a job
+   * if it is the job leader, a tracked descendant or a member of the job's
+   * process group.
+   *
+   * @param sh The shell
+   * @param pid The process
+   * @param pgid The process group of the process or -1 if unknown
+   * @return The job or NULL
+   */
+  struct bg_process *job_for_pid(struct shell *sh, pid_t pid, pid_t pgid);
+
+  /**
+   * @brief Record the current descendants of every live job so they can
+   * still be attributed after they are orphaned and change their process
+   * group. Only used in subreaper mode.
+   *
+   * @param sh The shell
+   */
+  void track_descendants(struct shell *sh);
+
+  /**
+   * @brief Add a pid to the tracked descendants of a job unless it is
+   * already there.
+   *
+   * @param bgp The job
+   * @param pid The pid to add
+   */
+  void job_track(struct bg_process *bgp, pid_t pid);
+
+  /**
+   * @brief The subreaper builtin. "subreaper on" makes the shell adopt the
+   * orphaned descendants of its jobs (PR_SET_CHILD_SUBREAPER) so that they
+   * are reaped and accounted to the job that started them, "subreaper off"
+   * turns it off again and no argument prints the current mode.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_subreaper(struct shell *sh, char **argv);
+
+  /**
+   * @brief Show resource usage of the live background jobs and their
+   * descendants, sampled from /proc. Called for "jobs --stats", the
+   * options "-i SECONDS" and "-n COUNT" refresh the table periodically
+   * until interrupted, the count runs out or no job is left running.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int job_stats(struct shell *sh, char **argv);
+
+  /**
+   * @brief Run a command through the normal launch path. Builtins run in
+   * the shell, everything else is forked with execute_command. The exit
+   * status is also stored in sh->last_status and for a foreground child
+   * its resource usage in sh->last_usage.
+   *
+   * @param sh The shell
+   * @param argv The command to run
+   * @param background Non zero to run the command as a background job
+   * @return The exit status of the command
+   */
+  int run_command(struct shell *sh, char **argv, int background);
+
+  /**
+   * @brief Convert a wait status to an exit status.
+   *
+   * @param status The wait status
+   * @return The exit status
+   */
+  int exit_status(int status);
+
+  /**
+   * @brief Fork the shell. Every copy of the shell is made here: the child
+   * closes the pipes of running writers, which only an exec would close
+   * otherwise, so their readers see the end, and never inherits the lock
+   * of the writers held by one of their threads. It also gets the output
+   * of its embedded shell.
+   *
+   * @param sh The shell
+   * @return The pid as returned by fork
+   */
+  pid_t shell_fork(struct shell *sh);
+
+  /**
+   * @brief The time builtin. Run a command, builtins included, and report
+   * wall, user and sys time, max RSS and context switches on stderr. With
+   * -j the report is a single JSON object.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the timed command
+   */
+  int builtin_time(struct shell *sh, char **argv);
+
+  /**
+   * @brief The bench builtin. "bench -n N [-w WARMUP] [-q] [-j] cmd" runs
+   * a command WARMUP times untimed and then N times through the shell's own
+   * launch path and prints mean, stddev, min, p50, p99 and max of the wall
+   * time. -q discards the output of the command and -j prints JSON.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_bench(struct shell *sh, char **argv);
+
+  /**
+   * @brief Summary statistics over a set of samples.
+   */
+  struct bench_stats
+  {
+    double mean;
+    double stddev;
+    double min;
+    double p50;
+    double p99;
+    double max;
+  };
+
+  /**
+   * @brief Compute summary statistics. The samples are sorted in place.
+   * Percentiles use the nearest rank method and stddev is the sample
+   * standard deviation.
+   *
+   * @param samples The samples
+   * @param n The number of samples, must be at least one
+   * @param stats The statistics to fill in
+   */
+  void bench_compute(double *samples, int n, struct bench_stats *stats);
+
+  /**
+   * @brief Parse a duration such as "10", "1.5s", "250ms", "2m" or "1h".
+   *
+   * @param str The string to parse
+   * @param seconds The parsed duration in seconds
+   * @return 0 on success, -1 if the string is not a valid duration
+   */
+  int parse_duration(const char *str, double *seconds);
+
+  /**
+   * @brief Wait for a foreground child with a deadline. The child is
+   * watched through a pidfd and the deadline through a timerfd in a single
+   * poll. When the deadline passes the child's process group is sent
+   * SIGTERM and, if it is still around after sh->kill_after seconds,
+   * SIGKILL. The child is reaped before returning unless it stopped
+   * before the deadline, which SIGCHLD reports, and then status says so.
+   *
+   * @param sh The shell
+   * @param pid The child, also the leader of its process group
+   * @param status The wait status of the child
+   * @param limit The deadline in seconds
+   * @return 1 if the deadline expired, 0 if the child exited or stopped on
+   * its own and -1 if pidfd or timerfd are unavailable and nothing was
+   * waited for
+   */
+  int wait_deadline(struct shell *sh, pid_t pid, int *status, double limit);
+
+  /**
+   * @brief The timeout builtin. "timeout [-k KILL_AFTER] DURATION cmd" runs
+   * a command with a deadline and returns 124 if it had to be killed.
+   * "timeout -d DURATION" sets a default deadline for every foreground
+   * command (0 turns it off), "timeout -k DURATION" alone changes the
+   * default grace period and no arguments print the current settings.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the command, 124 if it timed out
+   */
+  int builtin_timeout(struct shell *sh, char **argv);
+
+  /**
+   * @brief Check for a trailing '&' on the line. If one is found it is
+   * removed from the line.
+   *
+   * @param line The line to check
+   * @return 1 if the line should run in the background
+   */
+  int is_background(char *line);
+
+  /**
+   * @brief Reset a policy so that everything is inherited.
+   *
+   * @param policy The policy to reset
+   */
+  void job_policy_init(struct job_policy *policy);
+
+  /**
+   * @brief Parse placement options from the front of an argument list.
+   * Recognized options are -c CPUS (a list such as 0-3,6), -n NICE and
+   * -s idle|batch|other. Parsing stops at "--" or the first argument that
+   * is not an option.
+   *
+   * @param policy The policy to fill in
+   * @param argv The arguments, argv[0] is the builtin name
+   * @return The index of the first non option argument or -1 on error
+   */
+  int job_policy_parse(struct job_policy *policy, char **argv);
+
+  /**
+   * @brief Apply a policy to the calling process. Failures are reported
+   * on stderr but are not fatal.
+   *
+   * @param policy The policy to apply
+   */
+  void job_policy_apply(const struct job_policy *policy);
+
+  /**
+   * @brief The run builtin. Launch a command with an explicit placement,
+   * for example "run -c 0-1 -n 10 make -j2 &".
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return The exit status of the command
+   */
+  int builtin_run(struct shell *sh, char **argv);
+
+  /**
+   * @brief The bgpolicy builtin. With no arguments print the default
+   * placement of background jobs, "bgpolicy -r" resets it and any other
+   * options replace it. For example "bgpolicy -s idle" makes every
+   * background job yield to the foreground.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, -1 on error
+   */
+  int builtin_bgpolicy(struct shell *sh, char **argv);
+
+  /**
+   * @brief Initialize the shell for use. Allocate all data structures
+   * Grab control of the terminal and put the shell in its own
+   * process group. NOTE: This function will block until the shell is
+   * in its own program group. Attaching a debugger will always cause
+   * this function to fail because the debugger maintains control of
+   * the subprocess it is debugging.
+   *
+   * @param sh
+   */
+  void sh_init(struct shell *sh);
+
+  /**
+   * @brief Initialize everything but the terminal. The shell is left
+   * non-interactive and the signal dispositions of the process untouched.
+   *
+   * @param sh The shell
+   */
+  void sh_init_state(struct shell *sh);
+
+  /**
+   * @brief Destroy shell. Free any allocated memory and resources and exit
+   * normally.
+   *
+   * @param sh
+   */
+  void sh_destroy(struct shell *sh);
+
+  /**
+   * @brief The modes picked on the command line.
+   */
+  struct shell_options
+  {
+    const char *serve;   /* -S: serve requests on this socket */
+    const char *connect; /* -s: send the command to this socket */
+    const char *command; /* -c: the command to send */
+  };
+
+  /**
+   * @brief Parse command line args from the user when the shell was launched
+   *
+   * @param argc Number of args
+   * @param argv The arg array
+   * @param opts Set to the modes picked
+   */
+  void parse_args(int argc, char **argv, struct shell_options *opts);
+
+  /**
+   * @brief Serve command requests on a Unix socket until SIGINT or SIGTERM.
+   * Each request runs in a forked child of the already initialized shell,
+   * so it starts with the functions and variables of the rc file but
+   * without the cost of starting a shell.
+   *
+   * @param sh The shell
+   * @param path The socket path
+   * @return 0 after a clean shutdown, 1 on error
+   */
+  int shell_serve(struct shell *sh, const char *path);
+
+  /**
+   * @brief Send a command to a shell serving on a Unix socket and wait for
+   * it to finish.
+   *
+   * @param path The socket path
+   * @param command The command
+   * @param env The environment for the command, usually environ
+   * @param fds The stdin, stdout and stderr for the command
+   * @return The exit status or -1 after printing an error
+   */
+  int serve_request(const char *path, const char *command, char **env, const int fds[3]);
+
+  /**
+   * @brief Start the zygote, a copy of the shell made while it is still
+   * small, which forks commands for it. The fork cost of the shell grows
+   * with its heap, that of the zygote stays the same.
+   *
+   * @param sh The shell
+   * @return 0 on success, -1 on error
+   */
+  int zygote_start(struct shell *sh);
+
+  /**
+   * @brief Stop the zygote. Commands it started keep running.
+   *
+   * @param sh The shell
+   */
+  void zygote_stop(struct shell *sh);
+
+  /**
+   * @brief Start a command from the zygote, or fork the shell if there is
+   * none. Returns as fork does, so the caller has to handle a child that
+   * returns 0 like after fork. A forked copy of the shell always forks
+   * itself, the zygote's processes become children of the shell that
+   * started it.
+   *
+   * @param sh The shell
+   * @param argv The command
+   * @param envp The environment or NULL to keep the one the shell started with
+   * @param fds The stdin, stdout and stderr for the command
+   * @param foreground Non zero to give the command the terminal
+   * @param policy The placement to apply or NULL
+   * @return The new process, 0 in a child forked by the shell, -1 on error
+   */
+  pid_t zygote_spawn(struct shell *sh, char **argv, char **envp, const int fds[3], int foreground,
+                     const struct job_policy *policy);
+
+  /**
+   * @brief The zygote builtin. Shows the zygote, or with on or off picks
+   * whether commands start from it or from a fork of the shell. The zygote
+   * itself only starts with the shell, when MY_ZYGOTE is set.
+   *
+   * @param sh The shell
+   * @param argv The builtin arguments
+   * @return 0 on success, 1 on error
+   */
+  int builtin_zygote(struct shell *sh, char **argv);
+
+  /* The most pieces the contents of one io_file may have */
+#define IO_FILE_IOV_MAX 8
+
+  /**
+   * @brief A file for io_commit to write. The data goes to fd at off, or
+   * at the position of fd when off is -1, then fd is closed unless keep
+   * is set, then tmp, if not NULL, is renamed to path. A linked file is
+   * only written if the file before it was, so a file that refers to
+   * others can be made visible after them.
+   */
+  struct io_file
+  {
+    int fd;
+    int keep;
+    int linked;
+    off_t off;
+    const struct iovec *iov;
+    int count;
+    const char *tmp;
+    const char *path;
+    int ok; /* set by io_commit */
+  };
+
+  /**
+   * @brief Write files the shell made itself in as few system calls as
+   * possible. With io_uring every file is written, closed and renamed
+   * by one batch of linked operations and a few files share a single
+   * system call, which counts where seccomp makes each one expensive.
+   * Without it, or in a forked copy of the shell, plain syscalls do the
+   * same. A file whose write fails is closed anyway and its temporary
+   * name removed.
+   *
+   * @param files The files, ok is set for each
+   * @param n The number of files
+   * @return 0 if every file was written, -1 if any failed
+   */
+  int io_commit(struct io_file *files, size_t n);
+
+  /**
+   * @brief Copy part of a file to a descriptor, for when sendfile cannot
+   * write to it, such as a file open for appending. With io_uring a few
+   * chunks are read and written for each system call, without it every
+   * chunk takes a pread and a write.
+   *
+   * @param in The source
+   * @param off Where to start in the source
+   * @param len The number of bytes
+   * @param out The destination, written at its position
+   * @return 0 if all of it was copied, -1 on error
+   */
+  int io_copy(int in, off_t off, size_t len, int out);
+
+  /**
+   * @brief Pick whether io_commit and io_copy may use io_uring. It is on by default
+   * and falls back to plain syscalls by itself where io_uring is missing.
+   *
+   * @param on Non zero to use io_uring when it is there
+   * @return Non zero if io_uring is now in use
+   */
+  int io_use_uring(int on);
+
+  /**
+   * @brief Make a non-interactive shell to run commands inside another
+   * program. Every shell has its own variables, functions, jobs and
+   * working directory, and only waits for its own children. Calls on
+   * different shells may come from different threads, they take turns
+   * running because builtins print through the process-wide stdout, and
+   * while a shell with an output callback runs, whatever else the program
+   * prints to stdout goes to that callback too.
+   *
+   * @param output Receives stdout and stderr, NULL to leave them on the
+   * process's own. It is never called twice at once, but output of
+   * background jobs may arrive from a helper thread between runs. It
+   * must not run commands in a shell itself.
+   * @param arg Passed to output
+   * @return The shell or NULL if out of memory
+   */
+  struct shell *shell_new(shell_output_fn output, void *arg);
+
+  /**
+   * @brief Run one command line or a snippet of several lines. All output
+   * of the foreground commands has been passed to the output callback
+   * when this returns.
+   *
+   * @param sh The shell
+   * @param line The commands
+   * @return The exit status, 2 if the commands could not be parsed
+   */
+  int shell_run_line(struct shell *sh, const char *line);
+
+  /**
+   * @brief Run a script file in the shell, as the source builtin does.
+   *
+   * @param sh The shell
+   * @param path The script
+   * @param args The positional parameters or NULL to keep the current ones
+   * @return The exit status
+   */
+  int shell_run_script(struct shell *sh, const char *path, char **args);
+
+  /**
+   * @brief Free a shell made by shell_new. Background jobs keep running
+   * but are no longer waited for.
+   *
+   * @param sh The shell, may be NULL
+   */
+  void shell_free(struct shell *sh);
+
+  /**
+   * @brief Point stdout and stderr of a newly forked child at the output
+   * of its embedded shell. Does nothing for the process's own shell.
+   *
+   * @param sh The shell
+   */
+  void shell_child_io(struct shell *sh);
+
+  /**
+   * @brief The descriptor that output written straight to stdout or
+   * stderr, not through the streams, should go to while a command runs.
+   *
+   * @param sh The shell
+   * @param fd STDOUT_FILENO or STDERR_FILENO
+   * @return The write end of the matching output pipe of an embedded
+   * shell, fd itself otherwise
    */
-  void parse_args(int argc, char **argv);
+  int shell_output_fd(struct shell *sh, int fd);
 
 #ifdef __cplusplus
 } // extern "C"
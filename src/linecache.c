@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parsed lines are small, but a cache this big would only hide a leak */
+#define LINE_CACHE_MAX 65536
+
+/**
+ * @brief Hash a line with 64 bit FNV-1a.
+ *
+ * @param line The line
+ * @return The hash
+ */
+static uint64_t line_hash(const char *line)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (; *line != '\0'; line++)
+    h = (h ^ (unsigned char)*line) * 1099511628211ull;
+  return h;
+}
+
+/**
+ * @brief Take an entry out of the recently used list.
+ *
+ * @param c The cache
+ * @param e The entry
+ */
+static void lru_unlink(struct line_cache *c, struct line_entry *e)
+{
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+}
+
+/**
+ * @brief Put an entry at the front of the recently used list.
+ *
+ * @param c The cache
+ * @param e The entry
+ */
+static void lru_push(struct line_cache *c, struct line_entry *e)
+{
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL)
+    c->head->prev = e;
+  else
+    c->tail = e;
+  c->head = e;
+}
+
+/**
+ * @brief Remove the least recently used entry.
+ *
+ * @param c The cache
+ */
+static void evict(struct line_cache *c)
+{
+  struct line_entry *e = c->tail;
+  struct line_entry **pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+  while (*pp != e)
+    pp = &(*pp)->chain;
+  *pp = e->chain;
+  lru_unlink(c, e);
+  ast_release(e->tree);
+  free(e->line);
+  free(e);
+  c->count--;
+}
+
+/**
+ * @brief Find the tree of a command line.
+ *
+ * @param c The cache
+ * @param line The trimmed line
+ * @return A new reference to the tree or NULL on a miss
+ */
+struct ast *line_cache_get(struct line_cache *c, const char *line)
+{
+  if (c->size == 0)
+    return NULL;
+  uint64_t hash = line_hash(line);
+  for (struct line_entry *e = c->buckets[hash & (c->nbuckets - 1)]; e != NULL; e = e->chain)
+  {
+    if (e->hash == hash && strcmp(e->line, line) == 0)
+    {
+      lru_unlink(c, e);
+      lru_push(c, e);
+      c->hits++;
+      return ast_ref(e->tree);
+    }
+  }
+  c->misses++;
+  return NULL;
+}
+
+/**
+ * @brief Add the tree of a command line, dropping the least recently
+ * used line if the cache is full.
+ *
+ * @param c The cache
+ * @param line The trimmed line
+ * @param t The tree, the cache takes its own reference
+ */
+void line_cache_put(struct line_cache *c, const char *line, struct ast *t)
+{
+  if (c->size == 0)
+    return;
+  struct line_entry *e = calloc(1, sizeof(*e));
+  if (e == NULL || (e->line = strdup(line)) == NULL)
+  {
+    free(e);
+    return;
+  }
+  while (c->count >= c->size)
+    evict(c);
+  e->hash = line_hash(line);
+  e->tree = ast_ref(t);
+  struct line_entry **bucket = &c->buckets[e->hash & (c->nbuckets - 1)];
+  e->chain = *bucket;
+  *bucket = e;
+  lru_push(c, e);
+  c->count++;
+}
+
+/**
+ * @brief Change the number of lines kept, dropping the least recently
+ * used ones.
+ *
+ * @param c The cache
+ * @param size The most lines kept, 0 turns the cache off
+ * @return 0 on success, -1 if the size is too large
+ */
+int line_cache_resize(struct line_cache *c, size_t size)
+{
+  if (size > LINE_CACHE_MAX)
+    return -1;
+  while (c->count > size)
+    evict(c);
+
+  size_t nbuckets = 16;
+  while (nbuckets < size)
+    nbuckets *= 2;
+  if (size > 0 && nbuckets != c->nbuckets)
+  {
+    struct line_entry **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (buckets == NULL)
+      return -1;
+    for (struct line_entry *e = c->head; e != NULL; e = e->next)
+    {
+      e->chain = buckets[e->hash & (nbuckets - 1)];
+      buckets[e->hash & (nbuckets - 1)] = e;
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = nbuckets;
+  }
+  c->size = size;
+  return 0;
+}
+
+/**
+ * @brief Drop every line in the cache.
+ *
+ * @param c The cache
+ */
+void line_cache_free(struct line_cache *c)
+{
+  while (c->count > 0)
+    evict(c);
+  free(c->buckets);
+  c->buckets = NULL;
+  c->nbuckets = 0;
+  c->size = 0;
+}
+
+/**
+ * @brief The linecache builtin. Shows the hit and miss counters or sets
+ * the size of the parsed-line cache.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, 1 on error
+ */
+int builtin_linecache(struct shell *sh, char **argv)
+{
+  struct line_cache *c = &sh->lines;
+
+  if (argv[1] == NULL)
+  {
+    printf("linecache %zu/%zu lines, %lu hits, %lu misses\n", c->count, c->size,
+           c->hits, c->misses);
+    return 0;
+  }
+  for (int i = 1; argv[i] != NULL; i++)
+  {
+    if (strcmp(argv[i], "-c") == 0)
+    {
+      size_t size = c->size;
+      line_cache_free(c);
+      line_cache_resize(c, size);
+      c->hits = 0;
+      c->misses = 0;
+    }
+    else if (strcmp(argv[i], "-s") == 0 && argv[i + 1] != NULL)
+    {
+      char *end;
+      unsigned long size = strtoul(argv[++i], &end, 10);
+      if (*end != '\0' || line_cache_resize(c, size) != 0)
+      {
+        fprintf(stderr, "linecache: bad size '%s', at most %d\n", argv[i], LINE_CACHE_MAX);
+        return 1;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "usage: linecache [-c] [-s LINES]\n");
+      return 1;
+    }
+  }
+  return 0;
+}
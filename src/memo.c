@@ -0,0 +1,893 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define MEMO_MAGIC "MYSHMEM1"
+#define MEMO_DEFAULT_MAX (64ULL * 1024 * 1024)
+#define MEMO_CHUNK 65536
+/* Seconds a new blob is safe from eviction, while its record is written */
+#define MEMO_GRACE 60
+
+/**
+ * @brief A 128 bit hash made of two independent 64 bit lanes. It names
+ * cache entries, it does not protect them from anyone who can write to
+ * the cache directory.
+ */
+struct memo_hash
+{
+  uint64_t a;
+  uint64_t b;
+};
+
+/**
+ * @brief A cached run. The output itself is stored in blobs named by the
+ * hash of their contents, so runs with the same output share them.
+ */
+struct memo_record
+{
+  char magic[8];
+  int64_t created;
+  int32_t status;
+  uint32_t pad;
+  uint64_t out_len;
+  uint64_t err_len;
+  struct memo_hash out;
+  struct memo_hash err;
+};
+
+/**
+ * @brief A growable buffer for the output of a run.
+ */
+struct memo_buf
+{
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static void memo_hash_init(struct memo_hash *h)
+{
+  h->a = 14695981039346656037ull;
+  h->b = 0x9e3779b97f4a7c15ull;
+}
+
+/**
+ * @brief Add bytes to a hash.
+ *
+ * @param h The hash
+ * @param data The bytes
+ * @param len The number of bytes
+ */
+static void memo_hash_add(struct memo_hash *h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  for (size_t i = 0; i < len; i++)
+  {
+    h->a = (h->a ^ p[i]) * 1099511628211ull;
+    h->b = ((h->b ^ p[i]) * 0xff51afd7ed558ccdull);
+    h->b ^= h->b >> 29;
+  }
+}
+
+/**
+ * @brief Add a string and its terminating NUL to a hash, so "ab" "c" and
+ * "a" "bc" hash differently.
+ *
+ * @param h The hash
+ * @param s The string
+ */
+static void memo_hash_str(struct memo_hash *h, const char *s)
+{
+  memo_hash_add(h, s, strlen(s) + 1);
+}
+
+/**
+ * @brief Hash the contents of a file.
+ *
+ * @param h The hash
+ * @param path The file
+ * @return 0 on success, -1 if the file could not be read
+ */
+static int memo_hash_file(struct memo_hash *h, const char *path)
+{
+  char buf[MEMO_CHUNK];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  for (;;)
+  {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      close(fd);
+      return n == 0 ? 0 : -1;
+    }
+    memo_hash_add(h, buf, (size_t)n);
+  }
+}
+
+/**
+ * @brief Name a cache file after a hash.
+ *
+ * @param dir The cache directory
+ * @param kind 'k' for a record, 'b' for a blob
+ * @param h The hash
+ * @param out Room for the name
+ * @param size The size of out
+ */
+static void memo_path(const char *dir, char kind, const struct memo_hash *h, char *out, size_t size)
+{
+  snprintf(out, size, "%s/%c-%016llx%016llx", dir, kind, (unsigned long long)h->a,
+           (unsigned long long)h->b);
+}
+
+/**
+ * @brief The files of a run on their way into the cache.
+ */
+struct memo_store
+{
+  struct io_file files[3]; /* the blobs, then the record that refers to them */
+  struct iovec iov[3];
+  char tmp[3][PATH_MAX + 8];
+  char path[3][PATH_MAX];
+  size_t n;
+};
+
+/**
+ * @brief Open a cache file under a temporary name. io_commit writes it
+ * and renames it, so other shells see either nothing or the whole file.
+ *
+ * @param st The files so far
+ * @param data The contents
+ * @param len The length of the contents
+ * @return 0 on success, -1 on error
+ */
+static int memo_add(struct memo_store *st, const void *data, size_t len)
+{
+  size_t i = st->n;
+
+  snprintf(st->tmp[i], sizeof(st->tmp[i]), "%s.XXXXXX", st->path[i]);
+  int fd = mkostemp(st->tmp[i], O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  st->iov[i] = (struct iovec){(void *)data, len};
+  /* The record is only made visible once its blobs are there */
+  st->files[i] = (struct io_file){.fd = fd, .linked = 1, .off = 0, .iov = &st->iov[i],
+                                  .count = 1, .tmp = st->tmp[i], .path = st->path[i]};
+  st->n++;
+  return 0;
+}
+
+/**
+ * @brief Queue output as a blob unless a blob with the same contents is
+ * already there.
+ *
+ * @param st The files so far
+ * @param dir The cache directory
+ * @param b The output
+ * @param h Set to the hash of the output
+ * @return 0 on success, -1 on error
+ */
+static int memo_add_blob(struct memo_store *st, const char *dir, const struct memo_buf *b,
+                         struct memo_hash *h)
+{
+  memo_hash_init(h);
+  memo_hash_add(h, b->data, b->len);
+  memo_path(dir, 'b', h, st->path[st->n], sizeof(st->path[st->n]));
+  /* A blob in use again is young again, so eviction leaves it alone */
+  if (utimensat(AT_FDCWD, st->path[st->n], NULL, 0) == 0)
+    return 0;
+  return memo_add(st, b->data, b->len);
+}
+
+/**
+ * @brief Put a run in the cache: the blobs of its output that are new
+ * and its record, written together by io_commit.
+ *
+ * @param dir The cache directory
+ * @param key The key of the run
+ * @param r The record, its blob hashes are set here
+ * @param out The stdout of the run
+ * @param err The stderr of the run
+ * @return 0 on success, -1 on error
+ */
+static int memo_store(const char *dir, const struct memo_hash *key, struct memo_record *r,
+                      const struct memo_buf *out, const struct memo_buf *err)
+{
+  struct memo_store st = {.n = 0};
+  int rval = -1;
+
+  if (memo_add_blob(&st, dir, out, &r->out) == 0 && memo_add_blob(&st, dir, err, &r->err) == 0)
+  {
+    memo_path(dir, 'k', key, st.path[st.n], sizeof(st.path[st.n]));
+    rval = memo_add(&st, r, sizeof(*r));
+  }
+  if (rval != 0)
+  {
+    /* Nothing was written yet, drop the files opened so far */
+    for (size_t i = 0; i < st.n; i++)
+    {
+      close(st.files[i].fd);
+      unlink(st.tmp[i]);
+    }
+    return -1;
+  }
+  return io_commit(st.files, st.n);
+}
+
+/**
+ * @brief Open a blob and check its length.
+ *
+ * @param dir The cache directory
+ * @param h The hash of the blob
+ * @param len The length the blob must have
+ * @return The open blob or -1 if it is missing or damaged
+ */
+static int memo_open_blob(const char *dir, const struct memo_hash *h, uint64_t len)
+{
+  char path[PATH_MAX];
+  struct stat st;
+
+  memo_path(dir, 'b', h, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0 && (fstat(fd, &st) != 0 || (uint64_t)st.st_size != len))
+  {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Copy an open blob to a descriptor.
+ *
+ * @param fd The blob
+ * @param len The length of the blob
+ * @param out The descriptor
+ * @return 0 on success, -1 if it could not be copied
+ */
+static int memo_replay(int fd, uint64_t len, int out)
+{
+  off_t off = 0;
+  while ((uint64_t)off < len)
+  {
+    ssize_t n = sendfile(out, fd, &off, (size_t)(len - (uint64_t)off));
+    if (n < 0 && errno == EINTR)
+      continue;
+    /* Such as a file open for appending, which sendfile refuses */
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS) &&
+        io_copy(fd, off, (size_t)(len - (uint64_t)off), out) == 0)
+      off = (off_t)len;
+    if (n <= 0)
+      break;
+  }
+  return (uint64_t)off == len ? 0 : -1;
+}
+
+/**
+ * @brief Append output to a buffer.
+ *
+ * @param b The buffer
+ * @param data The output
+ * @param n The length of the output
+ * @return 0 on success, -1 if out of memory
+ */
+static int memo_append(struct memo_buf *b, const char *data, size_t n)
+{
+  if (b->len + n > b->cap)
+  {
+    size_t cap = b->cap ? b->cap : MEMO_CHUNK;
+    while (cap < b->len + n)
+      cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (grown == NULL)
+      return -1;
+    b->data = grown;
+    b->cap = cap;
+  }
+  memcpy(b->data + b->len, data, n);
+  b->len += n;
+  return 0;
+}
+
+/**
+ * @brief Run a command with its stdout and stderr passed through to the
+ * shell's and kept.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param out Set to the stdout of the command
+ * @param err Set to the stderr of the command
+ * @return The wait status, -1 if the command could not be started, or -2
+ * minus the exit status if it ran but its output could not be kept
+ */
+static int memo_run(struct shell *sh, char **argv, struct memo_buf *out, struct memo_buf *err)
+{
+  int out_pipe[2];
+  int err_pipe[2];
+
+  if (pipe2(out_pipe, O_CLOEXEC) != 0)
+    return -1;
+  if (pipe2(err_pipe, O_CLOEXEC) != 0)
+  {
+    close(out_pipe[0]);
+    close(out_pipe[1]);
+    return -1;
+  }
+  char **envp = var_envp(&sh->vars);
+  pid_t pid = shell_fork(sh);
+  if (pid == 0)
+  {
+    if (sh->shell_is_interactive)
+    {
+      setpgid(0, 0);
+      tcsetpgrp(sh->shell_terminal, getpid());
+      /* Stopping would leave the shell waiting on the pipes */
+      signal(SIGINT, SIG_DFL);
+      signal(SIGQUIT, SIG_DFL);
+    }
+    dup2(out_pipe[1], STDOUT_FILENO);
+    dup2(err_pipe[1], STDERR_FILENO);
+    if (!is_builtin(argv[0]) && func_find(sh, argv[0]) == NULL)
+    {
+      if (envp != NULL)
+        environ = envp;
+      execvp(argv[0], argv);
+      fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+      _exit(127);
+    }
+    sh->shell_is_interactive = 0;
+    run_command(sh, argv, 0);
+    fflush(stdout);
+    _exit(sh->last_status);
+  }
+  close(out_pipe[1]);
+  close(err_pipe[1]);
+  if (pid < 0)
+  {
+    perror("fork");
+    close(out_pipe[0]);
+    close(err_pipe[0]);
+    return -1;
+  }
+  if (sh->shell_is_interactive)
+  {
+    setpgid(pid, pid);
+    tcsetpgrp(sh->shell_terminal, pid);
+  }
+
+  struct pollfd fds[2] = {{out_pipe[0], POLLIN, 0}, {err_pipe[0], POLLIN, 0}};
+  struct memo_buf *bufs[2] = {out, err};
+  int tee[2] = {shell_output_fd(sh, STDOUT_FILENO), shell_output_fd(sh, STDERR_FILENO)};
+  int ok = 1;
+  char chunk[MEMO_CHUNK];
+  while (fds[0].fd >= 0 || fds[1].fd >= 0)
+  {
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+      if (fds[i].fd < 0 || fds[i].revents == 0)
+        continue;
+      ssize_t n = read(fds[i].fd, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+      {
+        close(fds[i].fd);
+        fds[i].fd = -1;
+        continue;
+      }
+      /* The output shows up as it is made, not only when it is replayed */
+      if (write(tee[i], chunk, (size_t)n) < 0 && errno != EPIPE)
+        ok = 0;
+      if (memo_append(bufs[i], chunk, (size_t)n) != 0)
+        ok = 0;
+    }
+  }
+  for (int i = 0; i < 2; i++)
+  {
+    if (fds[i].fd >= 0)
+      close(fds[i].fd);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      status = 0;
+      ok = 0;
+      break;
+    }
+  }
+  if (sh->shell_is_interactive)
+  {
+    tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+  }
+  return ok ? status : -(WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status)) - 2;
+}
+
+/**
+ * @brief A cache file seen while evicting.
+ */
+struct memo_file
+{
+  struct memo_hash hash;
+  off_t size;
+  struct timespec mtime;
+  int refs;           /* records that use a blob */
+  struct memo_hash out; /* the blobs of a record */
+  struct memo_hash err;
+};
+
+static int memo_hash_cmp(const struct memo_hash *x, const struct memo_hash *y)
+{
+  if (x->a != y->a)
+    return x->a < y->a ? -1 : 1;
+  if (x->b != y->b)
+    return x->b < y->b ? -1 : 1;
+  return 0;
+}
+
+static int memo_blob_cmp(const void *x, const void *y)
+{
+  return memo_hash_cmp(&((const struct memo_file *)x)->hash, &((const struct memo_file *)y)->hash);
+}
+
+static int memo_age_cmp(const void *x, const void *y)
+{
+  const struct timespec *p = &((const struct memo_file *)x)->mtime;
+  const struct timespec *q = &((const struct memo_file *)y)->mtime;
+  if (p->tv_sec != q->tv_sec)
+    return p->tv_sec < q->tv_sec ? -1 : 1;
+  return p->tv_nsec < q->tv_nsec ? -1 : p->tv_nsec > q->tv_nsec;
+}
+
+/**
+ * @brief Drop a reference to a blob and remove the blob with the last one,
+ * unless it is young enough that a record may be on its way.
+ *
+ * @param dir The cache directory
+ * @param blobs The blobs, sorted by hash
+ * @param nblobs The number of blobs
+ * @param h The blob
+ * @param young Blobs changed after this time are kept, 0 to keep none
+ * @return The bytes freed
+ */
+static off_t memo_unref(const char *dir, struct memo_file *blobs, size_t nblobs,
+                        const struct memo_hash *h, time_t young)
+{
+  struct memo_file key = {.hash = *h};
+  struct memo_file *b = bsearch(&key, blobs, nblobs, sizeof(*blobs), memo_blob_cmp);
+  if (b == NULL || --b->refs > 0 || (young != 0 && b->mtime.tv_sec > young))
+    return 0;
+  char path[PATH_MAX];
+  memo_path(dir, 'b', h, path, sizeof(path));
+  unlink(path);
+  return b->size;
+}
+
+/**
+ * @brief Parse the hash in the name of a cache file.
+ *
+ * @param name The name
+ * @param h Set to the hash
+ * @return 0 on success, -1 if the name is not one of a cache file
+ */
+static int memo_parse_name(const char *name, struct memo_hash *h)
+{
+  char a[17] = "";
+  char b[17] = "";
+  if (strlen(name) != 34 || name[1] != '-')
+    return -1;
+  memcpy(a, name + 2, 16);
+  memcpy(b, name + 18, 16);
+  char *end_a;
+  char *end_b;
+  h->a = strtoull(a, &end_a, 16);
+  h->b = strtoull(b, &end_b, 16);
+  return *end_a == '\0' && *end_b == '\0' ? 0 : -1;
+}
+
+/**
+ * @brief Remove the least recently used records until the cache fits in
+ * max bytes, and every blob no record uses any more.
+ *
+ * @param dir The cache directory
+ * @param max The most bytes kept, 0 to remove everything
+ * @param entries Set to the number of records left
+ * @return The bytes left in the cache
+ */
+static off_t memo_evict(const char *dir, off_t max, size_t *entries)
+{
+  struct memo_file *keys = NULL;
+  struct memo_file *blobs = NULL;
+  size_t nkeys = 0, nblobs = 0, cap_keys = 0, cap_blobs = 0;
+  off_t total = 0;
+  char path[PATH_MAX];
+
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return 0;
+  for (struct dirent *e; (e = readdir(d)) != NULL;)
+  {
+    struct memo_file f = {0};
+    struct stat st;
+    char kind = e->d_name[0];
+    if ((kind != 'k' && kind != 'b') || memo_parse_name(e->d_name, &f.hash) != 0)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    if (stat(path, &st) != 0)
+      continue;
+    f.size = st.st_size;
+    f.mtime = st.st_mtim;
+    struct memo_file **list = kind == 'k' ? &keys : &blobs;
+    size_t *n = kind == 'k' ? &nkeys : &nblobs;
+    size_t *cap = kind == 'k' ? &cap_keys : &cap_blobs;
+    if (kind == 'k')
+    {
+      struct memo_record r;
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      ssize_t got = fd >= 0 ? read(fd, &r, sizeof(r)) : -1;
+      if (fd >= 0)
+        close(fd);
+      if (got != (ssize_t)sizeof(r) || memcmp(r.magic, MEMO_MAGIC, sizeof(r.magic)) != 0)
+      {
+        unlink(path);
+        continue;
+      }
+      f.out = r.out;
+      f.err = r.err;
+    }
+    if (*n == *cap)
+    {
+      size_t grown_cap = *cap ? *cap * 2 : 64;
+      struct memo_file *grown = realloc(*list, grown_cap * sizeof(**list));
+      if (grown == NULL)
+        break;
+      *list = grown;
+      *cap = grown_cap;
+    }
+    (*list)[(*n)++] = f;
+    total += f.size;
+  }
+  closedir(d);
+
+  if (nblobs > 0)
+    qsort(blobs, nblobs, sizeof(*blobs), memo_blob_cmp);
+  for (size_t i = 0; i < nkeys; i++)
+  {
+    struct memo_hash both[] = {keys[i].out, keys[i].err};
+    for (int j = 0; j < 2; j++)
+    {
+      struct memo_file key = {.hash = both[j]};
+      struct memo_file *b = bsearch(&key, blobs, nblobs, sizeof(*blobs), memo_blob_cmp);
+      if (b != NULL)
+        b->refs++;
+    }
+  }
+  /* Blobs left over by a shell that died between writing and linking, but
+     not those of a shell still between its blob and record renames */
+  time_t young = max > 0 ? time(NULL) - MEMO_GRACE : 0;
+  for (size_t i = 0; i < nblobs; i++)
+  {
+    if (blobs[i].refs == 0)
+    {
+      blobs[i].refs = 1;
+      total -= memo_unref(dir, blobs, nblobs, &blobs[i].hash, young);
+    }
+  }
+
+  if (nkeys > 0)
+    qsort(keys, nkeys, sizeof(*keys), memo_age_cmp);
+  size_t kept = 0;
+  for (size_t i = 0; i < nkeys; i++)
+  {
+    if (total <= max)
+    {
+      kept = nkeys - i;
+      break;
+    }
+    memo_path(dir, 'k', &keys[i].hash, path, sizeof(path));
+    unlink(path);
+    total -= keys[i].size;
+    total -= memo_unref(dir, blobs, nblobs, &keys[i].out, young);
+    total -= memo_unref(dir, blobs, nblobs, &keys[i].err, young);
+  }
+  free(keys);
+  free(blobs);
+  if (entries != NULL)
+    *entries = kept;
+  return total;
+}
+
+/**
+ * @brief Read the size cap of the cache from MY_CACHE_MAX, which takes a
+ * K, M or G suffix.
+ *
+ * @param sh The shell
+ * @return The cap in bytes
+ */
+static off_t memo_max(struct shell *sh)
+{
+  const char *val = var_get(&sh->vars, "MY_CACHE_MAX");
+  if (val == NULL || *val == '\0')
+    return (off_t)MEMO_DEFAULT_MAX;
+  char *end;
+  unsigned long long max = strtoull(val, &end, 10);
+  if (*end == 'K' || *end == 'k')
+    max <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    max <<= 20, end++;
+  else if (*end == 'G' || *end == 'g')
+    max <<= 30, end++;
+  return *end == '\0' ? (off_t)max : (off_t)MEMO_DEFAULT_MAX;
+}
+
+/**
+ * @brief Parse a time to live such as 30, 90s, 10m, 2h or 1d.
+ *
+ * @param s The time
+ * @return The seconds or -1 if the time is malformed
+ */
+static long memo_ttl(const char *s)
+{
+  char *end;
+  long ttl = strtol(s, &end, 10);
+  if (end == s || ttl < 0)
+    return -1;
+  switch (*end)
+  {
+  case '\0':
+  case 's':
+    break;
+  case 'm':
+    ttl *= 60;
+    break;
+  case 'h':
+    ttl *= 3600;
+    break;
+  case 'd':
+    ttl *= 86400;
+    break;
+  default:
+    return -1;
+  }
+  return end[*end != '\0'] == '\0' ? ttl : -1;
+}
+
+/**
+ * @brief Compute the key of a run: the command, the directory it runs in,
+ * the selected variables and the state of the dependencies.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments, options included
+ * @param cmd The command
+ * @param key Set to the key
+ */
+static void memo_key(struct shell *sh, char **argv, char **cmd, struct memo_hash *key)
+{
+  char cwd[PATH_MAX];
+
+  memo_hash_init(key);
+  memo_hash_str(key, MEMO_MAGIC);
+  memo_hash_str(key, getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+  for (int i = 0; cmd[i] != NULL; i++)
+    memo_hash_str(key, cmd[i]);
+  memo_hash_add(key, "", 1);
+
+  for (int i = 1; argv + i < cmd; i++)
+  {
+    const char *opt = argv[i];
+    const char *arg = argv[i + 1];
+    if (arg == NULL || strcmp(opt, "--") == 0)
+      break;
+    if (strcmp(opt, "--env") == 0)
+    {
+      const char *val = var_get(&sh->vars, arg);
+      memo_hash_str(key, "env");
+      memo_hash_str(key, arg);
+      memo_hash_str(key, val != NULL ? val : "\x01unset");
+    }
+    else if (strcmp(opt, "--dep") == 0)
+    {
+      struct stat st;
+      memo_hash_str(key, "dep");
+      memo_hash_str(key, arg);
+      if (stat(arg, &st) == 0)
+      {
+        int64_t sig[] = {(int64_t)st.st_dev, (int64_t)st.st_ino, (int64_t)st.st_size,
+                         (int64_t)st.st_mtim.tv_sec, (int64_t)st.st_mtim.tv_nsec};
+        memo_hash_add(key, sig, sizeof(sig));
+      }
+    }
+    else if (strcmp(opt, "--hash") == 0)
+    {
+      struct memo_hash contents;
+      memo_hash_init(&contents);
+      memo_hash_str(key, "hash");
+      memo_hash_str(key, arg);
+      if (memo_hash_file(&contents, arg) == 0)
+        memo_hash_add(key, &contents, sizeof(contents));
+    }
+    else
+      continue;
+    i++;
+  }
+}
+
+/**
+ * @brief Replay a cached run if there is one that is still fresh.
+ *
+ * @param sh The shell
+ * @param dir The cache directory
+ * @param key The key of the run
+ * @param ttl The most seconds since the run, -1 for no limit
+ * @param status Set to the exit status of the run
+ * @return 0 on a hit, -1 on a miss
+ */
+static int memo_lookup(struct shell *sh, const char *dir, const struct memo_hash *key, long ttl, int *status)
+{
+  char path[PATH_MAX];
+  struct memo_record r;
+
+  memo_path(dir, 'k', key, path, sizeof(path));
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  ssize_t n = read(fd, &r, sizeof(r));
+  close(fd);
+  if (n != (ssize_t)sizeof(r) || memcmp(r.magic, MEMO_MAGIC, sizeof(r.magic)) != 0)
+    return -1;
+  if (ttl >= 0 && time(NULL) - r.created > ttl)
+    return -1;
+
+  /* Both blobs are there before anything is replayed, or it is a miss */
+  int out = memo_open_blob(dir, &r.out, r.out_len);
+  int err = out >= 0 ? memo_open_blob(dir, &r.err, r.err_len) : -1;
+  if (err < 0)
+  {
+    if (out >= 0)
+      close(out);
+    return -1;
+  }
+  /* Once output started the run is not repeated, even if a reader left */
+  fflush(stdout);
+  memo_replay(out, r.out_len, shell_output_fd(sh, STDOUT_FILENO));
+  memo_replay(err, r.err_len, shell_output_fd(sh, STDERR_FILENO));
+  close(out);
+  close(err);
+  /* The modification time orders the records for eviction */
+  utimensat(AT_FDCWD, path, NULL, 0);
+  *status = r.status;
+  return 0;
+}
+
+/**
+ * @brief Print the size of the cache and the hits and misses so far.
+ *
+ * @param sh The shell
+ * @param dir The cache directory
+ */
+static void memo_stats(struct shell *sh, const char *dir)
+{
+  off_t max = memo_max(sh);
+  size_t entries = 0;
+  off_t used = memo_evict(dir, max, &entries);
+  printf("cache %zu entries, %lld of %lld bytes, %lu hits, %lu misses\n", entries,
+         (long long)used, (long long)max, sh->memo_hits, sh->memo_misses);
+}
+
+/**
+ * @brief The cache builtin. Runs a command once and replays its stdout,
+ * stderr and exit status while the command line, the working directory,
+ * the selected variables and the dependencies stay the same.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the command
+ */
+int builtin_cache(struct shell *sh, char **argv)
+{
+  char dir[PATH_MAX];
+  long ttl = -1;
+  int i = 1;
+
+  if (cache_dir(sh, "cmd", dir, sizeof(dir)) != 0)
+  {
+    fprintf(stderr, "cache: no cache directory\n");
+    return 1;
+  }
+  if (argv[1] == NULL || strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--clear") == 0)
+  {
+    if (argv[1] != NULL && argv[1][2] == 'c')
+      memo_evict(dir, 0, NULL);
+    else
+      memo_stats(sh, dir);
+    return 0;
+  }
+
+  for (; argv[i] != NULL && strncmp(argv[i], "--", 2) == 0; i += 2)
+  {
+    if (strcmp(argv[i], "--") == 0)
+    {
+      i++;
+      break;
+    }
+    if (argv[i + 1] == NULL ||
+        (strcmp(argv[i], "--dep") != 0 && strcmp(argv[i], "--hash") != 0 &&
+         strcmp(argv[i], "--env") != 0 && strcmp(argv[i], "--ttl") != 0))
+    {
+      argv[i] = NULL;
+      break;
+    }
+    if (strcmp(argv[i], "--ttl") == 0 && (ttl = memo_ttl(argv[i + 1])) < 0)
+    {
+      fprintf(stderr, "cache: bad time '%s'\n", argv[i + 1]);
+      return 1;
+    }
+  }
+  char **cmd = &argv[i];
+  if (cmd[0] == NULL)
+  {
+    fprintf(stderr, "usage: cache [--ttl T] [--dep FILE] [--hash FILE] [--env NAME] -- cmd [args...]\n"
+                    "       cache [--stats | --clear]\n");
+    return 1;
+  }
+
+  struct memo_hash key;
+  int status;
+  memo_key(sh, argv, cmd, &key);
+  if (memo_lookup(sh, dir, &key, ttl, &status) == 0)
+  {
+    sh->memo_hits++;
+    return status;
+  }
+  sh->memo_misses++;
+
+  struct memo_buf out = {0};
+  struct memo_buf err = {0};
+  int ws = memo_run(sh, cmd, &out, &err);
+  if (ws < -1)
+    status = -ws - 2; /* ran, but the output could not be kept */
+  else if (ws == -1)
+    status = 1;
+  else if (WIFSIGNALED(ws))
+    status = 128 + WTERMSIG(ws);
+  else
+  {
+    /* Only a command that ran to its end is worth replaying */
+    status = WEXITSTATUS(ws);
+    struct memo_record r = {0};
+    memcpy(r.magic, MEMO_MAGIC, sizeof(r.magic));
+    r.created = time(NULL);
+    r.status = status;
+    r.out_len = out.len;
+    r.err_len = err.len;
+    if (memo_store(dir, &key, &r, &out, &err) == 0)
+      memo_evict(dir, memo_max(sh), NULL);
+  }
+  free(out.data);
+  free(err.data);
+  return status;
+}
@@ -0,0 +1,1041 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Tokens of the shell grammar. Words keep their quotes, they are
+ * only removed when the words are expanded.
+ */
+enum token
+{
+  T_WORD,
+  T_NEWLINE,
+  T_SEMI,
+  T_DSEMI,
+  T_AMP,
+  T_AND_IF,
+  T_PIPE,
+  T_OR_IF,
+  T_LPAREN,
+  T_RPAREN,
+  T_EOF,
+};
+
+/**
+ * @brief A here-document whose body starts after the next newline.
+ */
+struct here_pending
+{
+  uint32_t node;
+  char *delim;
+  int strip;
+};
+
+/**
+ * @brief State of the parser. The input grows by whole lines when a
+ * construct is still open at the end of it, so tokens are offsets.
+ */
+struct parser
+{
+  char *text;
+  size_t len;
+  size_t cap;
+  size_t pos;
+  char *(*next_line)(void *);
+  void *arg;
+
+  struct ast *t;
+  int depth; /* open constructs, more input is read while non zero */
+  int error;
+
+  enum token tok;
+  size_t tok_start;
+  size_t tok_len;
+  int have_tok;
+
+  struct here_pending *here;
+  size_t nhere;
+  size_t here_cap;
+};
+
+/**
+ * @brief Append text and a newline to the input.
+ *
+ * @param p The parser
+ * @param s The text
+ * @param n The length of the text
+ * @return 0 on success, -1 if out of memory
+ */
+static int parser_append(struct parser *p, const char *s, size_t n)
+{
+  if (p->len + n + 2 > p->cap)
+  {
+    size_t cap = p->cap ? p->cap : 256;
+    while (cap < p->len + n + 2)
+      cap *= 2;
+    char *text = realloc(p->text, cap);
+    if (text == NULL)
+      return -1;
+    p->text = text;
+    p->cap = cap;
+  }
+  memcpy(p->text + p->len, s, n);
+  p->len += n;
+  p->text[p->len++] = '\n';
+  p->text[p->len] = '\0';
+  return 0;
+}
+
+/**
+ * @brief Read one more line of input.
+ *
+ * @param p The parser
+ * @return 0 on success, -1 at the end of the input
+ */
+static int parser_fetch(struct parser *p)
+{
+  if (p->next_line == NULL)
+    return -1;
+  char *line = p->next_line(p->arg);
+  if (line == NULL)
+    return -1;
+  int rval = parser_append(p, line, strlen(line));
+  free(line);
+  if (rval != 0)
+    p->error = 1;
+  return rval;
+}
+
+/**
+ * @brief Add a string to the string table of the tree.
+ *
+ * @param p The parser
+ * @param s The string
+ * @param n The length of the string
+ * @return The offset of the string
+ */
+static uint32_t ast_string(struct parser *p, const char *s, size_t n)
+{
+  struct ast *t = p->t;
+  if (t->strings_len + n + 1 > t->strings_cap)
+  {
+    uint32_t cap = t->strings_cap ? t->strings_cap : 256;
+    while (cap < t->strings_len + n + 1)
+      cap *= 2;
+    char *strings = realloc(t->strings, cap);
+    if (strings == NULL)
+    {
+      p->error = 1;
+      return 0;
+    }
+    t->strings = strings;
+    t->strings_cap = cap;
+  }
+  uint32_t off = t->strings_len;
+  memcpy(t->strings + off, s, n);
+  t->strings[off + n] = '\0';
+  t->strings_len += (uint32_t)n + 1;
+  return off;
+}
+
+/**
+ * @brief Add a word to the word table of the tree.
+ *
+ * @param p The parser
+ * @param s The word
+ * @param n The length of the word
+ */
+static void ast_word(struct parser *p, const char *s, size_t n)
+{
+  struct ast *t = p->t;
+  uint32_t off = ast_string(p, s, n);
+  if (t->nwords == t->words_cap)
+  {
+    uint32_t cap = t->words_cap ? t->words_cap * 2 : 64;
+    uint32_t *words = realloc(t->words, cap * sizeof(uint32_t));
+    if (words == NULL)
+    {
+      p->error = 1;
+      return;
+    }
+    t->words = words;
+    t->words_cap = cap;
+  }
+  t->words[t->nwords++] = off;
+}
+
+/**
+ * @brief Add a node to the tree.
+ *
+ * @param p The parser
+ * @param kind The kind of node
+ * @return The index of the node, 0 if out of memory
+ */
+static uint32_t ast_node(struct parser *p, enum ast_kind kind)
+{
+  struct ast *t = p->t;
+  if (t->nnodes == t->nodes_cap)
+  {
+    uint32_t cap = t->nodes_cap ? t->nodes_cap * 2 : 32;
+    struct ast_node *nodes = realloc(t->nodes, cap * sizeof(struct ast_node));
+    if (nodes == NULL)
+    {
+      p->error = 1;
+      return 0;
+    }
+    t->nodes = nodes;
+    t->nodes_cap = cap;
+  }
+  struct ast_node *node = &t->nodes[t->nnodes];
+  memset(node, 0, sizeof(*node));
+  node->kind = (uint16_t)kind;
+  return t->nnodes++;
+}
+
+/**
+ * @brief Find the end of the word starting at s. Like the words of
+ * cmd_parse, but an unquoted operator character also ends the word.
+ *
+ * @param s The start of the word
+ * @return The end of the word or NULL if a quote or bracket is still open
+ */
+static const char *token_end(const char *s)
+{
+  char quote = '\0';
+  int depth = 0;
+
+  for (; *s != '\0'; s++)
+  {
+    if (*s == '\\' && quote != '\'')
+    {
+      if (s[1] == '\0')
+        return NULL;
+      s++;
+    }
+    else if (quote != '\0')
+    {
+      if (*s == quote)
+        quote = '\0';
+    }
+    else if (*s == '\'' || *s == '"' || *s == '`')
+      quote = *s;
+    else if ((*s == '$' || *s == '<' || *s == '>') && s[1] == '(')
+    {
+      depth++;
+      s++;
+    }
+    else if (*s == '$' && s[1] == '{')
+    {
+      depth++;
+      s++;
+    }
+    else if (depth > 0 && *s == '(')
+      depth++;
+    else if (depth > 0 && (*s == ')' || *s == '}'))
+      depth--;
+    else if (depth == 0 && strchr(" \t\n;&|()", *s) != NULL)
+      return s;
+  }
+  return quote == '\0' && depth == 0 ? s : NULL;
+}
+
+/**
+ * @brief Read the bodies of the here-documents started on the line that
+ * just ended.
+ *
+ * @param p The parser
+ */
+static void here_bodies(struct parser *p)
+{
+  for (size_t i = 0; i < p->nhere; i++)
+  {
+    struct here_pending *h = &p->here[i];
+    char *body = NULL;
+    size_t len = 0;
+    int found = 0;
+
+    while (!p->error)
+    {
+      if (p->pos >= p->len && parser_fetch(p) != 0)
+        break;
+      char *line = p->text + p->pos;
+      char *nl = strchr(line, '\n');
+      size_t n = nl ? (size_t)(nl - line) : strlen(line);
+      p->pos += n + (nl != NULL);
+      while (h->strip && n > 0 && *line == '\t')
+        line++, n--;
+      if (n == strlen(h->delim) && strncmp(line, h->delim, n) == 0)
+      {
+        found = 1;
+        break;
+      }
+      char *grown = realloc(body, len + n + 1);
+      if (grown == NULL)
+      {
+        p->error = 1;
+        break;
+      }
+      body = grown;
+      memcpy(body + len, line, n);
+      len += n;
+      body[len++] = '\n';
+    }
+    if (!found && !p->error)
+      fprintf(stderr, "warning: here-document delimited by end of file (wanted '%s')\n", h->delim);
+    p->t->nodes[h->node].c = ast_string(p, body ? body : "", len);
+    p->t->nodes[h->node].flags |= AST_HERE;
+    free(body);
+    free(h->delim);
+  }
+  p->nhere = 0;
+}
+
+/**
+ * @brief Read the next token.
+ *
+ * @param p The parser
+ * @return The token
+ */
+static enum token lex(struct parser *p)
+{
+  for (;;)
+  {
+    while (p->text[p->pos] == ' ' || p->text[p->pos] == '\t')
+      p->pos++;
+    if (p->pos >= p->len)
+    {
+      if (p->nhere > 0)
+      {
+        here_bodies(p);
+        continue;
+      }
+      if (p->depth > 0 && !p->error && parser_fetch(p) == 0)
+        continue;
+      return T_EOF;
+    }
+
+    char *s = p->text + p->pos;
+    p->tok_start = p->pos;
+    p->tok_len = 1;
+    switch (*s)
+    {
+    case '#':
+      while (p->pos < p->len && p->text[p->pos] != '\n')
+        p->pos++;
+      continue;
+    case '\n':
+      p->pos++;
+      if (p->nhere > 0)
+        here_bodies(p);
+      return T_NEWLINE;
+    case ';':
+      p->tok_len = s[1] == ';' ? 2 : 1;
+      p->pos += p->tok_len;
+      return p->tok_len == 2 ? T_DSEMI : T_SEMI;
+    case '&':
+      p->tok_len = s[1] == '&' ? 2 : 1;
+      p->pos += p->tok_len;
+      return p->tok_len == 2 ? T_AND_IF : T_AMP;
+    case '|':
+      p->tok_len = s[1] == '|' ? 2 : 1;
+      p->pos += p->tok_len;
+      return p->tok_len == 2 ? T_OR_IF : T_PIPE;
+    case '(':
+      p->pos++;
+      return T_LPAREN;
+    case ')':
+      p->pos++;
+      return T_RPAREN;
+    case '\\':
+      if (s[1] == '\n')
+      {
+        p->pos += 2;
+        continue;
+      }
+      break;
+    }
+
+    const char *end = token_end(s);
+    if (end == NULL)
+    {
+      /* A quote or bracket runs on to the next line */
+      if (!p->error && parser_fetch(p) == 0)
+        continue;
+      p->pos = p->len;
+      p->tok_len = 0;
+      return T_EOF;
+    }
+    p->tok_len = (size_t)(end - s);
+    p->pos += p->tok_len;
+    return T_WORD;
+  }
+}
+
+static enum token peek(struct parser *p)
+{
+  if (!p->have_tok)
+  {
+    p->tok = lex(p);
+    p->have_tok = 1;
+  }
+  return p->tok;
+}
+
+static void advance(struct parser *p)
+{
+  p->have_tok = 0;
+}
+
+/**
+ * @brief Check if the next token is a given word, without quotes.
+ *
+ * @param p The parser
+ * @param word The word
+ * @return Non zero if it is
+ */
+static int is_word(struct parser *p, const char *word)
+{
+  size_t n = strlen(word);
+  return peek(p) == T_WORD && p->tok_len == n && strncmp(p->text + p->tok_start, word, n) == 0;
+}
+
+/**
+ * @brief Report a syntax error at the next token.
+ *
+ * @param p The parser
+ */
+static void parse_error(struct parser *p)
+{
+  if (p->error)
+    return;
+  p->error = 1;
+  enum token tok = peek(p);
+  if (tok == T_EOF)
+    fprintf(stderr, "syntax error: unexpected end of file\n");
+  else if (tok == T_NEWLINE)
+    fprintf(stderr, "syntax error near unexpected newline\n");
+  else
+    fprintf(stderr, "syntax error near '%.*s'\n", (int)p->tok_len, p->text + p->tok_start);
+}
+
+static void expect_word(struct parser *p, const char *word)
+{
+  if (is_word(p, word))
+    advance(p);
+  else
+    parse_error(p);
+}
+
+static void skip_newlines(struct parser *p)
+{
+  while (peek(p) == T_NEWLINE)
+    advance(p);
+}
+
+/**
+ * @brief Check if the next token ends a list.
+ *
+ * @param p The parser
+ * @return Non zero if it does
+ */
+static int list_end(struct parser *p)
+{
+  static const char *const ends[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+  enum token tok = peek(p);
+
+  if (tok == T_EOF || tok == T_RPAREN || tok == T_DSEMI)
+    return 1;
+  for (int i = 0; tok == T_WORD && ends[i] != NULL; i++)
+  {
+    if (is_word(p, ends[i]))
+      return 1;
+  }
+  return 0;
+}
+
+static uint32_t parse_command(struct parser *p);
+
+/**
+ * @brief Parse commands joined by |. A newline may follow a |.
+ *
+ * @param p The parser
+ * @return The command, or the pipeline if there is more than one
+ */
+static uint32_t parse_pipeline(struct parser *p)
+{
+  uint32_t first = parse_command(p);
+  if (p->error || peek(p) != T_PIPE)
+    return p->error ? 0 : first;
+
+  uint32_t pipeline = ast_node(p, AST_PIPELINE);
+  uint32_t last = first;
+  uint32_t count = 1;
+  while (!p->error && peek(p) == T_PIPE)
+  {
+    advance(p);
+    p->depth++;
+    skip_newlines(p);
+    uint32_t cmd = parse_command(p);
+    p->depth--;
+    if (p->error)
+      return 0;
+    p->t->nodes[last].next = cmd;
+    last = cmd;
+    count++;
+  }
+  p->t->nodes[pipeline].a = first;
+  p->t->nodes[pipeline].b = count;
+  return pipeline;
+}
+
+/**
+ * @brief Parse commands joined by && or ||. Both bind equally tight and
+ * group from the left, and a newline may follow either.
+ *
+ * @param p The parser
+ * @return The first command or the last && or || node
+ */
+static uint32_t parse_and_or(struct parser *p)
+{
+  uint32_t left = parse_pipeline(p);
+
+  while (!p->error && (peek(p) == T_AND_IF || peek(p) == T_OR_IF))
+  {
+    uint32_t node = ast_node(p, peek(p) == T_AND_IF ? AST_AND : AST_OR);
+    advance(p);
+    p->depth++;
+    skip_newlines(p);
+    uint32_t right = parse_pipeline(p);
+    p->depth--;
+    if (p->error)
+      return 0;
+    p->t->nodes[node].a = left;
+    p->t->nodes[node].b = right;
+    left = node;
+  }
+  return p->error ? 0 : left;
+}
+
+/**
+ * @brief Parse commands separated by ;, & or newlines.
+ *
+ * @param p The parser
+ * @param nonempty Non zero if the list needs at least one command
+ * @return The list node
+ */
+static uint32_t parse_list(struct parser *p, int nonempty)
+{
+  uint32_t list = ast_node(p, AST_LIST);
+  uint32_t last = 0;
+
+  skip_newlines(p);
+  while (!p->error && !list_end(p))
+  {
+    uint32_t cmd = parse_and_or(p);
+    if (p->error)
+      return 0;
+    if (last == 0)
+      p->t->nodes[list].a = cmd;
+    else
+      p->t->nodes[last].next = cmd;
+    last = cmd;
+
+    enum token tok = peek(p);
+    if (tok == T_AMP)
+      p->t->nodes[cmd].flags |= AST_BACKGROUND;
+    else if (tok != T_SEMI && tok != T_NEWLINE)
+      break;
+    advance(p);
+    skip_newlines(p);
+  }
+  if (nonempty && last == 0)
+    parse_error(p);
+  return p->error ? 0 : list;
+}
+
+/**
+ * @brief Parse a word that follows << or <<< in a simple command.
+ *
+ * @param p The parser
+ * @param node The simple command
+ */
+static void parse_here(struct parser *p, uint32_t node)
+{
+  const char *w = p->text + p->tok_start;
+  int string = p->tok_len >= 3 && w[2] == '<';
+  int strip = !string && p->tok_len >= 3 && w[2] == '-';
+  size_t skip = string || strip ? 3 : 2;
+  size_t start = p->tok_start + skip;
+  size_t len = p->tok_len - skip;
+
+  if (len == 0)
+  {
+    advance(p);
+    if (peek(p) != T_WORD)
+    {
+      parse_error(p);
+      return;
+    }
+    start = p->tok_start;
+    len = p->tok_len;
+  }
+
+  struct ast_node *n = &p->t->nodes[node];
+  n->flags &= (uint16_t) ~(AST_HERE | AST_HERE_STRING | AST_HERE_QUOTED);
+  if (string)
+  {
+    uint32_t off = ast_string(p, p->text + start, len);
+    p->t->nodes[node].c = off;
+    p->t->nodes[node].flags |= AST_HERE | AST_HERE_STRING;
+    return;
+  }
+
+  if (p->nhere == p->here_cap)
+  {
+    size_t cap = p->here_cap ? p->here_cap * 2 : 4;
+    struct here_pending *here = realloc(p->here, cap * sizeof(*here));
+    if (here == NULL)
+    {
+      p->error = 1;
+      return;
+    }
+    p->here = here;
+    p->here_cap = cap;
+  }
+  char *delim = strndup(p->text + start, len);
+  if (delim == NULL)
+  {
+    p->error = 1;
+    return;
+  }
+  if (heredoc_unquote(delim))
+    n->flags |= AST_HERE_QUOTED;
+  p->here[p->nhere].node = node;
+  p->here[p->nhere].delim = delim;
+  p->here[p->nhere++].strip = strip;
+}
+
+/**
+ * @brief Parse a compound command that follows the name of a function.
+ *
+ * @param p The parser
+ * @param name The offset of the name
+ * @return The function node
+ */
+static uint32_t parse_function_body(struct parser *p, uint32_t name)
+{
+  p->depth++;
+  skip_newlines(p);
+  uint32_t body = parse_command(p);
+  p->depth--;
+  if (!p->error && p->t->nodes[body].kind == AST_SIMPLE)
+  {
+    fprintf(stderr, "syntax error: function body must be a compound command\n");
+    p->error = 1;
+  }
+  uint32_t fn = ast_node(p, AST_FUNCTION);
+  if (p->error)
+    return 0;
+  p->t->nodes[fn].a = name;
+  p->t->nodes[fn].b = body;
+  return fn;
+}
+
+/**
+ * @brief Parse a simple command, or a function definition name() body.
+ *
+ * @param p The parser
+ * @return The node
+ */
+static uint32_t parse_simple(struct parser *p)
+{
+  uint32_t node = ast_node(p, AST_SIMPLE);
+  uint32_t first = p->t->nwords;
+
+  while (!p->error && peek(p) == T_WORD)
+  {
+    const char *w = p->text + p->tok_start;
+    if (p->tok_len >= 2 && w[0] == '<' && w[1] == '<')
+      parse_here(p, node);
+    else
+      ast_word(p, w, p->tok_len);
+    advance(p);
+  }
+  if (p->error)
+    return 0;
+  uint32_t count = p->t->nwords - first;
+  p->t->nodes[node].a = first;
+  p->t->nodes[node].b = count;
+
+  if (count == 1 && peek(p) == T_LPAREN && !(p->t->nodes[node].flags & AST_HERE))
+  {
+    const char *name = p->t->strings + p->t->words[first];
+    if (!var_valid_name(name, strlen(name)))
+    {
+      parse_error(p);
+      return 0;
+    }
+    advance(p);
+    if (peek(p) != T_RPAREN)
+    {
+      parse_error(p);
+      return 0;
+    }
+    advance(p);
+    p->t->nwords--;
+    return parse_function_body(p, p->t->words[first]);
+  }
+  return node;
+}
+
+/**
+ * @brief Parse if ... then ... [elif ...] [else ...] fi, starting at the if
+ * or an elif.
+ *
+ * @param p The parser
+ * @return The node
+ */
+static uint32_t parse_if(struct parser *p)
+{
+  p->depth++;
+  advance(p);
+  uint32_t node = ast_node(p, AST_IF);
+  uint32_t cond = parse_list(p, 1);
+  expect_word(p, "then");
+  uint32_t body = parse_list(p, 1);
+  uint32_t other = 0;
+  if (is_word(p, "elif"))
+    other = parse_if(p);
+  else
+  {
+    if (is_word(p, "else"))
+    {
+      advance(p);
+      other = parse_list(p, 1);
+    }
+    expect_word(p, "fi");
+  }
+  p->depth--;
+  if (p->error)
+    return 0;
+  p->t->nodes[node].a = cond;
+  p->t->nodes[node].b = body;
+  p->t->nodes[node].c = other;
+  return node;
+}
+
+/**
+ * @brief Parse while ... do ... done or until ... do ... done.
+ *
+ * @param p The parser
+ * @param kind AST_WHILE or AST_UNTIL
+ * @return The node
+ */
+static uint32_t parse_while(struct parser *p, enum ast_kind kind)
+{
+  p->depth++;
+  advance(p);
+  uint32_t node = ast_node(p, kind);
+  uint32_t cond = parse_list(p, 1);
+  expect_word(p, "do");
+  uint32_t body = parse_list(p, 1);
+  expect_word(p, "done");
+  p->depth--;
+  if (p->error)
+    return 0;
+  p->t->nodes[node].a = cond;
+  p->t->nodes[node].b = body;
+  return node;
+}
+
+/**
+ * @brief Parse for NAME [in WORDS...]; do ... done.
+ *
+ * @param p The parser
+ * @return The node
+ */
+static uint32_t parse_for(struct parser *p)
+{
+  p->depth++;
+  advance(p);
+  uint32_t node = ast_node(p, AST_FOR);
+  if (peek(p) != T_WORD || !var_valid_name(p->text + p->tok_start, p->tok_len))
+  {
+    parse_error(p);
+    return 0;
+  }
+  uint32_t name = ast_string(p, p->text + p->tok_start, p->tok_len);
+  advance(p);
+
+  uint32_t first = p->t->nwords;
+  uint32_t count = 0;
+  uint16_t flags = 0;
+  skip_newlines(p);
+  if (is_word(p, "in"))
+  {
+    advance(p);
+    flags = AST_FOR_IN;
+    while (!p->error && peek(p) == T_WORD)
+    {
+      ast_word(p, p->text + p->tok_start, p->tok_len);
+      advance(p);
+    }
+    count = p->t->nwords - first;
+    if (peek(p) != T_SEMI && peek(p) != T_NEWLINE)
+      parse_error(p);
+    advance(p);
+  }
+  else if (peek(p) == T_SEMI)
+    advance(p);
+  skip_newlines(p);
+  expect_word(p, "do");
+  uint32_t body = parse_list(p, 1);
+  expect_word(p, "done");
+  p->depth--;
+  if (p->error)
+    return 0;
+  struct ast_node *n = &p->t->nodes[node];
+  n->flags |= flags;
+  n->a = name;
+  n->b = body;
+  n->c = first;
+  n->d = count;
+  return node;
+}
+
+/**
+ * @brief Parse case WORD in [(]PATTERN[|PATTERN...]) ... ;; ... esac.
+ *
+ * @param p The parser
+ * @return The node
+ */
+static uint32_t parse_case(struct parser *p)
+{
+  p->depth++;
+  advance(p);
+  uint32_t node = ast_node(p, AST_CASE);
+  if (peek(p) != T_WORD)
+  {
+    parse_error(p);
+    return 0;
+  }
+  uint32_t word = ast_string(p, p->text + p->tok_start, p->tok_len);
+  advance(p);
+  skip_newlines(p);
+  expect_word(p, "in");
+  skip_newlines(p);
+
+  uint32_t last = 0;
+  while (!p->error && !is_word(p, "esac"))
+  {
+    if (peek(p) == T_LPAREN)
+      advance(p);
+    uint32_t item = ast_node(p, AST_CASE_ITEM);
+    uint32_t first = p->t->nwords;
+    for (;;)
+    {
+      if (peek(p) != T_WORD)
+      {
+        parse_error(p);
+        return 0;
+      }
+      ast_word(p, p->text + p->tok_start, p->tok_len);
+      advance(p);
+      if (peek(p) != T_PIPE)
+        break;
+      advance(p);
+    }
+    if (peek(p) != T_RPAREN)
+    {
+      parse_error(p);
+      return 0;
+    }
+    advance(p);
+    uint32_t count = p->t->nwords - first;
+    uint32_t body = parse_list(p, 0);
+    if (p->error)
+      return 0;
+    struct ast_node *n = &p->t->nodes[item];
+    n->a = first;
+    n->b = count;
+    n->c = p->t->nodes[body].a != 0 ? body : 0;
+    if (last == 0)
+      p->t->nodes[node].b = item;
+    else
+      p->t->nodes[last].next = item;
+    last = item;
+
+    if (peek(p) == T_DSEMI)
+    {
+      advance(p);
+      skip_newlines(p);
+    }
+    else if (!is_word(p, "esac"))
+      parse_error(p);
+  }
+  expect_word(p, "esac");
+  p->depth--;
+  if (p->error)
+    return 0;
+  p->t->nodes[node].a = word;
+  return node;
+}
+
+/**
+ * @brief Parse { list } or ( list ).
+ *
+ * @param p The parser
+ * @param kind AST_GROUP or AST_SUBSHELL
+ * @return The node
+ */
+static uint32_t parse_group(struct parser *p, enum ast_kind kind)
+{
+  p->depth++;
+  advance(p);
+  uint32_t node = ast_node(p, kind);
+  uint32_t list = parse_list(p, 1);
+  if (kind == AST_GROUP)
+    expect_word(p, "}");
+  else if (peek(p) == T_RPAREN)
+    advance(p);
+  else
+    parse_error(p);
+  p->depth--;
+  if (p->error)
+    return 0;
+  p->t->nodes[node].a = list;
+  return node;
+}
+
+/**
+ * @brief Parse one command.
+ *
+ * @param p The parser
+ * @return The node
+ */
+static uint32_t parse_command(struct parser *p)
+{
+  enum token tok = peek(p);
+
+  if (tok == T_LPAREN)
+    return parse_group(p, AST_SUBSHELL);
+  if (tok != T_WORD)
+  {
+    parse_error(p);
+    return 0;
+  }
+  if (is_word(p, "if"))
+    return parse_if(p);
+  if (is_word(p, "while"))
+    return parse_while(p, AST_WHILE);
+  if (is_word(p, "until"))
+    return parse_while(p, AST_UNTIL);
+  if (is_word(p, "for"))
+    return parse_for(p);
+  if (is_word(p, "case"))
+    return parse_case(p);
+  if (is_word(p, "{"))
+    return parse_group(p, AST_GROUP);
+  if (is_word(p, "function"))
+  {
+    advance(p);
+    if (peek(p) != T_WORD || !var_valid_name(p->text + p->tok_start, p->tok_len))
+    {
+      parse_error(p);
+      return 0;
+    }
+    uint32_t name = ast_string(p, p->text + p->tok_start, p->tok_len);
+    advance(p);
+    if (peek(p) == T_LPAREN)
+    {
+      advance(p);
+      if (peek(p) != T_RPAREN)
+      {
+        parse_error(p);
+        return 0;
+      }
+      advance(p);
+    }
+    return parse_function_body(p, name);
+  }
+  return parse_simple(p);
+}
+
+/**
+ * @brief Parse a command line or a script into a tree. Lines are read with
+ * next_line while an if, loop, quote or here-document is still open.
+ *
+ * @param text The first line or the whole script
+ * @param next_line Returns the next line to be freed or NULL at the end,
+ * may be NULL if there is no more input
+ * @param arg Passed to next_line
+ * @return The tree with one reference or NULL after printing an error
+ */
+struct ast *ast_parse(const char *text, char *(*next_line)(void *), void *arg)
+{
+  struct parser p = {0};
+  p.next_line = next_line;
+  p.arg = arg;
+  p.t = calloc(1, sizeof(struct ast));
+  if (p.t == NULL || parser_append(&p, text, strlen(text)) != 0)
+  {
+    free(p.t);
+    free(p.text);
+    return NULL;
+  }
+  p.t->refs = 1;
+  /* Node 0 and the empty string at offset 0 stand for none */
+  ast_node(&p, AST_LIST);
+  ast_string(&p, "", 0);
+
+  p.t->root = parse_list(&p, 0);
+  if (!p.error && peek(&p) != T_EOF)
+    parse_error(&p);
+
+  for (size_t i = 0; i < p.nhere; i++)
+    free(p.here[i].delim);
+  free(p.here);
+  free(p.text);
+  if (p.error)
+  {
+    ast_release(p.t);
+    return NULL;
+  }
+  return p.t;
+}
+
+/**
+ * @brief Take a reference to a tree.
+ *
+ * @param t The tree
+ * @return The tree
+ */
+struct ast *ast_ref(struct ast *t)
+{
+  t->refs++;
+  return t;
+}
+
+/**
+ * @brief Drop a reference to a tree and free it with the last one.
+ *
+ * @param t The tree or NULL
+ */
+void ast_release(struct ast *t)
+{
+  if (t == NULL || --t->refs > 0)
+    return;
+  if (t->map != NULL)
+  {
+    munmap(t->map, t->map_len);
+    free(t);
+    return;
+  }
+  free(t->nodes);
+  free(t->words);
+  free(t->strings);
+  free(t);
+}
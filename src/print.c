@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/**
+ * @brief Print the character of one backslash escape.
+ *
+ * @param pp The character after the backslash, advanced past the escape
+ * @param octal_zero Non zero if octal escapes start with \0, as in echo
+ * @return 0 to go on, 1 after \c which ends all output
+ */
+static int print_escape(const char **pp, int octal_zero)
+{
+  static const char letters[] = "abefnrtv";
+  static const char codes[] = "\a\b\033\f\n\r\t\v";
+  const char *p = *pp;
+  const char *hit = *p != '\0' ? strchr(letters, *p) : NULL;
+  int c = 0;
+  int digits = 0;
+
+  if (hit != NULL)
+  {
+    putchar(codes[hit - letters]);
+    *pp = p + 1;
+    return 0;
+  }
+  if (*p == 'c')
+  {
+    *pp = p + 1;
+    return 1;
+  }
+  if (*p == 'x' && isxdigit((unsigned char)p[1]))
+  {
+    for (p++; digits < 2 && isxdigit((unsigned char)*p); p++, digits++)
+      c = c * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+  }
+  else if (*p >= '0' && *p <= '7' && (!octal_zero || *p == '0'))
+  {
+    /* \0NNN in echo and %b, \NNN in a printf format */
+    if (octal_zero)
+      p++;
+    for (; digits < 3 && *p >= '0' && *p <= '7'; p++, digits++)
+      c = c * 8 + (*p - '0');
+  }
+  else
+  {
+    /* Unknown escapes are printed as they are */
+    if (*p != '\\')
+      putchar('\\');
+    c = *p != '\0' ? (unsigned char)*p++ : 0;
+    if (c == 0)
+    {
+      *pp = p;
+      return 0;
+    }
+  }
+  putchar(c);
+  *pp = p;
+  return 0;
+}
+
+/**
+ * @brief The echo builtin. -n leaves out the newline, -e turns on
+ * backslash escapes and -E turns them off again.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0
+ */
+int builtin_echo(struct shell *sh, char **argv)
+{
+  UNUSED(sh);
+  int newline = 1;
+  int escapes = 0;
+  int i = 1;
+
+  for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    const char *opt = argv[i] + 1;
+    if (strspn(opt, "neE") != strlen(opt))
+      break;
+    for (; *opt != '\0'; opt++)
+    {
+      if (*opt == 'n')
+        newline = 0;
+      else
+        escapes = *opt == 'e';
+    }
+  }
+  for (int first = i; argv[i] != NULL; i++)
+  {
+    if (i > first)
+      putchar(' ');
+    if (!escapes)
+    {
+      fputs(argv[i], stdout);
+      continue;
+    }
+    for (const char *p = argv[i]; *p != '\0';)
+    {
+      if (*p != '\\')
+        putchar(*p++);
+      else if (p++, print_escape(&p, 1))
+        return 0;
+    }
+  }
+  if (newline)
+    putchar('\n');
+  return 0;
+}
+
+/**
+ * @brief Convert a printf argument to a number. 'c gives the code of c.
+ *
+ * @param arg The argument or NULL if there is none left
+ * @param bad Set to 1 if the argument is not a number
+ * @return The number
+ */
+static long long print_number(const char *arg, int *bad)
+{
+  if (arg == NULL || *arg == '\0')
+    return 0;
+  if (*arg == '\'' || *arg == '"')
+    return (unsigned char)arg[1];
+  char *end;
+  long long val = strtoll(arg, &end, 0);
+  if (*end != '\0')
+  {
+    fprintf(stderr, "printf: '%s': invalid number\n", arg);
+    *bad = 1;
+  }
+  return val;
+}
+
+/**
+ * @brief Print a %b argument, which has its own backslash escapes.
+ *
+ * @param spec The conversion with the b replaced by s
+ * @param arg The argument
+ * @return 0 to go on, 1 after \c which ends all output
+ */
+static int print_b(const char *spec, const char *arg)
+{
+  char *data = NULL;
+  size_t size = 0;
+  FILE *mem = open_memstream(&data, &size);
+  if (mem == NULL)
+    return 0;
+
+  fflush(stdout);
+  FILE *saved = stdout;
+  stdout = mem;
+  int stop = 0;
+  for (const char *p = arg; *p != '\0' && !stop;)
+  {
+    if (*p != '\\')
+      putchar(*p++);
+    else
+    {
+      p++;
+      stop = print_escape(&p, 1);
+    }
+  }
+  stdout = saved;
+  fclose(mem);
+  printf(spec, data != NULL ? data : "");
+  free(data);
+  return stop;
+}
+
+/**
+ * @brief The printf builtin. The format is used again until every
+ * argument is consumed. Supports the flags, width and precision of C
+ * printf, * for either, and the conversions diouxXcs, eEfFgGaA and b.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, 1 if an argument was not a number
+ */
+int builtin_printf(struct shell *sh, char **argv)
+{
+  UNUSED(sh);
+  if (argv[1] == NULL)
+  {
+    fprintf(stderr, "usage: printf format [arguments...]\n");
+    return 2;
+  }
+  const char *format = argv[1];
+  char **args = argv + 2;
+  int bad = 0;
+
+  do
+  {
+    char **start = args;
+    for (const char *p = format; *p != '\0';)
+    {
+      if (*p == '\\')
+      {
+        p++;
+        if (print_escape(&p, 0))
+          return bad;
+        continue;
+      }
+      if (*p != '%')
+      {
+        putchar(*p++);
+        continue;
+      }
+      if (p[1] == '%')
+      {
+        putchar('%');
+        p += 2;
+        continue;
+      }
+
+      /* Copy the conversion, with * replaced by the argument */
+      char spec[64];
+      size_t n = 0;
+      spec[n++] = *p++;
+      while (*p != '\0' && strchr("-+ #0", *p) != NULL && n < 16)
+        spec[n++] = *p++;
+      for (int part = 0; part < 2; part++)
+      {
+        if (part == 1)
+        {
+          if (*p != '.')
+            break;
+          spec[n++] = *p++;
+        }
+        if (*p == '*')
+        {
+          long long val = print_number(*args, &bad);
+          if (*args != NULL)
+            args++;
+          n += (size_t)snprintf(spec + n, 24, "%d", (int)val);
+          p++;
+        }
+        while (isdigit((unsigned char)*p) && n < 48)
+          spec[n++] = *p++;
+      }
+      char conv = *p;
+      if (conv == '\0' || strchr("diouxXcsbeEfFgGaA", conv) == NULL)
+      {
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", conv ? conv : ' ');
+        return 1;
+      }
+      p++;
+      const char *arg = *args;
+      if (arg != NULL)
+        args++;
+
+      switch (conv)
+      {
+      case 'd':
+      case 'i':
+        memcpy(spec + n, "lld", 4);
+        printf(spec, print_number(arg, &bad));
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        spec[n++] = 'l';
+        spec[n++] = 'l';
+        spec[n++] = conv;
+        spec[n] = '\0';
+        printf(spec, (unsigned long long)print_number(arg, &bad));
+        break;
+      case 'c':
+      {
+        char first[2] = {arg != NULL ? *arg : '\0', '\0'};
+        memcpy(spec + n, "s", 2);
+        printf(spec, first);
+        break;
+      }
+      case 's':
+        memcpy(spec + n, "s", 2);
+        printf(spec, arg != NULL ? arg : "");
+        break;
+      case 'b':
+        memcpy(spec + n, "s", 2);
+        if (print_b(spec, arg != NULL ? arg : ""))
+          return bad;
+        break;
+      default:
+      {
+        char *end = "";
+        double val = arg != NULL ? strtod(arg, &end) : 0;
+        if (*end != '\0')
+        {
+          fprintf(stderr, "printf: '%s': invalid number\n", arg);
+          bad = 1;
+        }
+        spec[n++] = conv;
+        spec[n] = '\0';
+        printf(spec, val);
+      }
+      }
+    }
+    /* A format without conversions is printed once */
+    if (args == start)
+      break;
+  } while (*args != NULL);
+  return bad;
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/prctl.h>
+
+/**
+ * @brief Add a pid to the tracked descendants of a job unless it is
+ * already there.
+ *
+ * @param bgp The job
+ * @param pid The pid to add
+ */
+void job_track(struct bg_process *bgp, pid_t pid)
+{
+  if (pid == bgp->pid)
+    return;
+  for (size_t i = 0; i < bgp->num_tracked; i++)
+  {
+    if (bgp->tracked[i] == pid)
+      return;
+  }
+  if (bgp->num_tracked == bgp->cap_tracked)
+  {
+    size_t cap = bgp->cap_tracked ? bgp->cap_tracked * 2 : 8;
+    pid_t *tracked = realloc(bgp->tracked, cap * sizeof(pid_t));
+    if (tracked == NULL)
+      return;
+    bgp->tracked = tracked;
+    bgp->cap_tracked = cap;
+  }
+  bgp->tracked[bgp->num_tracked++] = pid;
+}
+
+/**
+ * @brief Walk the process tree below a pid and track everything found.
+ *
+ * @param bgp The job to track the processes in
+ * @param dirfd The /proc/<pid> directory to start from
+ */
+static void track_tree(struct bg_process *bgp, int dirfd)
+{
+  pid_t *pids = NULL;
+  size_t count = 0, cap = 0;
+
+  proc_children(dirfd, &pids, &count, &cap);
+  for (size_t i = 0; i < count; i++)
+  {
+    char path[32];
+    job_track(bgp, pids[i]);
+    snprintf(path, sizeof(path), "/proc/%d", pids[i]);
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    proc_children(fd, &pids, &count, &cap);
+    close(fd);
+  }
+  free(pids);
+}
+
+/**
+ * @brief Record the current descendants of every live job.
+ *
+ * @param sh The shell
+ */
+void track_descendants(struct shell *sh)
+{
+  /* Orphans the shell adopted show up as our own children */
+  int self = open("/proc/self", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (self >= 0)
+  {
+    pid_t *pids = NULL;
+    size_t count = 0, cap = 0;
+
+    proc_children(self, &pids, &count, &cap);
+    close(self);
+    for (size_t i = 0; i < count; i++)
+    {
+      struct bg_process *bgp = job_for_pid(sh, pids[i], proc_pgid(pids[i]));
+      if (bgp != NULL)
+        job_track(bgp, pids[i]);
+    }
+    free(pids);
+  }
+
+  for (int i = 0; i < sh->num_bg_processes; i++)
+  {
+    struct bg_process *bgp = &sh->bg_processes[i];
+    if (job_finished(bgp))
+      continue;
+
+    /* Forget descendants that exited and were reaped by their parent */
+    for (size_t j = 0; j < bgp->num_tracked;)
+    {
+      if (kill(bgp->tracked[j], 0) != 0 && errno == ESRCH)
+        bgp->tracked[j] = bgp->tracked[--bgp->num_tracked];
+      else
+        j++;
+    }
+
+    if (bgp->proc_fd >= 0)
+      track_tree(bgp, bgp->proc_fd);
+    for (size_t j = 0, n = bgp->num_tracked; j < n; j++)
+    {
+      char path[32];
+      snprintf(path, sizeof(path), "/proc/%d", bgp->tracked[j]);
+      int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (fd < 0)
+        continue;
+      track_tree(bgp, fd);
+      close(fd);
+    }
+  }
+}
+
+/**
+ * @brief The subreaper builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_subreaper(struct shell *sh, char **argv)
+{
+  if (argv[1] == NULL)
+  {
+    printf("subreaper %s (%lu unattributed orphans reaped)\n",
+           sh->subreaper ? "on" : "off", sh->orphans_reaped);
+    return 0;
+  }
+
+  int on;
+  if (strcmp(argv[1], "on") == 0)
+    on = 1;
+  else if (strcmp(argv[1], "off") == 0)
+    on = 0;
+  else
+  {
+    fprintf(stderr, "usage: subreaper [on|off]\n");
+    return -1;
+  }
+
+  if (prctl(PR_SET_CHILD_SUBREAPER, on, 0, 0, 0) != 0)
+  {
+    perror("prctl");
+    return -1;
+  }
+  sh->subreaper = on;
+  if (on)
+    track_descendants(sh);
+  return 0;
+}
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* A request is one datagram: the directory, the environment and the command */
+#define SERVE_MAX_REQUEST 65536
+#define SERVE_BACKLOG 128
+#define SERVE_EVENTS 64
+
+/**
+ * @brief What an epoll event is about: a client socket or the request
+ * running for it.
+ */
+struct serve_watch
+{
+  struct serve_conn *conn;
+  int child;
+};
+
+/**
+ * @brief A client connection. It runs one request at a time, a client
+ * sends the next after the status of the last one came back.
+ */
+struct serve_conn
+{
+  int fd;
+  pid_t pid; /* the running request, 0 if none */
+  int pidfd;
+  int hangup; /* the client went away, close once the request is reaped */
+  struct serve_watch sock_watch;
+  struct serve_watch child_watch;
+};
+
+/**
+ * @brief Run one request in the forked child and exit with its status.
+ * The child gets its own session, the descriptors the client sent as
+ * stdin, stdout and stderr, the client's directory and, on top of the
+ * server's variables, the client's environment.
+ *
+ * @param sh The shell
+ * @param req The request, NUL terminated
+ * @param len The length of the request
+ * @param fds The descriptors that came with the request
+ * @param nfds The number of descriptors
+ * @param mask The signal mask to restore
+ */
+static void serve_child(struct shell *sh, char *req, size_t len, int *fds, int nfds,
+                        const sigset_t *mask)
+{
+  setsid();
+  sigprocmask(SIG_SETMASK, mask, NULL);
+  signal(SIGPIPE, SIG_DFL);
+
+  int null = open("/dev/null", O_RDWR);
+  for (int i = 0; i < 3; i++)
+    dup2(i < nfds ? fds[i] : null, i);
+  /* Nothing of the server is left open, neither its sockets nor the pidfds */
+  syscall(SYS_close_range, 3, ~0U, 0);
+
+  /* The directory, then NAME=value strings up to an empty one, then the command */
+  char *end = req + len;
+  char *cwd = req;
+  char *p = cwd + strlen(cwd) + 1;
+  char **env = calloc(len / 2 + 1, sizeof(*env));
+  size_t nenv = 0;
+  for (; p < end && *p != '\0'; p += strlen(p) + 1)
+  {
+    if (env != NULL)
+      env[nenv++] = p;
+  }
+  char *command = p < end ? p + 1 : end;
+  if (env != NULL)
+    vars_import(&sh->vars, env);
+  free(env);
+
+  if (*cwd != '\0' && chdir(cwd) != 0)
+  {
+    fprintf(stderr, "cd: %s: %s\n", cwd, strerror(errno));
+    _exit(1);
+  }
+  struct ast *tree = ast_parse(command, NULL, NULL);
+  if (tree == NULL)
+    _exit(2);
+  exec_tree(sh, tree);
+  fflush(stdout);
+  _exit(sh->last_status);
+}
+
+/**
+ * @brief Hang up on every process of a request's session. The shell puts
+ * each command in a process group of its own, so the session is the one
+ * thing they all share.
+ *
+ * @param sid The session, the pid of the request
+ */
+static void serve_hangup(pid_t sid)
+{
+  char path[64];
+  char buf[512];
+
+  DIR *d = opendir("/proc");
+  if (d == NULL)
+  {
+    kill(sid, SIGHUP);
+    return;
+  }
+  for (struct dirent *e; (e = readdir(d)) != NULL;)
+  {
+    char *end;
+    long pid = strtol(e->d_name, &end, 10);
+    if (*end != '\0' || pid <= 0)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%ld/stat", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      continue;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+      continue;
+    buf[n] = '\0';
+    int session = -1;
+    char *p = strrchr(buf, ')');
+    if (p != NULL && sscanf(p + 2, "%*c %*d %*d %d", &session) == 1 && session == sid)
+    {
+      kill((pid_t)pid, SIGHUP);
+      kill((pid_t)pid, SIGCONT);
+    }
+  }
+  closedir(d);
+}
+
+/**
+ * @brief Send the exit status of a request back to its client.
+ *
+ * @param conn The client
+ * @param status The exit status
+ */
+static void serve_reply(struct serve_conn *conn, int32_t status)
+{
+  if (!conn->hangup)
+    send(conn->fd, &status, sizeof(status), MSG_NOSIGNAL);
+}
+
+/**
+ * @brief Close a client connection, the request must be reaped.
+ *
+ * @param conn The client
+ */
+static void serve_close(struct serve_conn *conn)
+{
+  close(conn->fd);
+  free(conn);
+}
+
+/**
+ * @brief Read a request from a client and start it.
+ *
+ * @param sh The shell
+ * @param ep The event loop
+ * @param conn The client
+ * @param mask The signal mask for the request
+ * @return 0 to keep the client, -1 to close it
+ */
+static int serve_read(struct shell *sh, int ep, struct serve_conn *conn, const sigset_t *mask)
+{
+  static char req[SERVE_MAX_REQUEST + 1];
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } ctl;
+  struct iovec iov = {req, SERVE_MAX_REQUEST};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                       .msg_controllen = sizeof(ctl.buf)};
+
+  ssize_t len = recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  if (len < 0)
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  if (len == 0)
+    return -1;
+
+  int fds[3];
+  int nfds = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c))
+  {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    for (int i = 0; i < n; i++)
+    {
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (nfds < 3)
+        fds[nfds++] = fd;
+      else
+        close(fd);
+    }
+  }
+  req[len] = '\0';
+
+  pid_t pid = -1;
+  if (!(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+  {
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+      serve_child(sh, req, (size_t)len, fds, nfds, mask);
+  }
+  else if (nfds > 2)
+    dprintf(fds[2], "request larger than %d bytes\n", SERVE_MAX_REQUEST);
+  for (int i = 0; i < nfds; i++)
+    close(fds[i]);
+
+  int pidfd = pid > 0 ? (int)syscall(SYS_pidfd_open, pid, 0) : -1;
+  if (pidfd < 0)
+  {
+    if (pid > 0)
+    {
+      int status;
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+      {
+      }
+      serve_reply(conn, exit_status(status));
+      return 0;
+    }
+    serve_reply(conn, 126);
+    return 0;
+  }
+  conn->pid = pid;
+  conn->pidfd = pidfd;
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &conn->child_watch};
+  epoll_ctl(ep, EPOLL_CTL_ADD, pidfd, &ev);
+  /* The next request waits until this one is done */
+  ev.data.ptr = &conn->sock_watch;
+  ev.events = EPOLLRDHUP;
+  epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+  return 0;
+}
+
+/**
+ * @brief Reap a finished request and report its status.
+ *
+ * @param ep The event loop
+ * @param conn The client
+ * @return 0 to keep the client, -1 to close it
+ */
+static int serve_reap(int ep, struct serve_conn *conn)
+{
+  int status;
+  while (waitpid(conn->pid, &status, 0) < 0)
+  {
+    if (errno != EINTR)
+    {
+      status = 0;
+      break;
+    }
+  }
+  epoll_ctl(ep, EPOLL_CTL_DEL, conn->pidfd, NULL);
+  close(conn->pidfd);
+  conn->pidfd = -1;
+  conn->pid = 0;
+  serve_reply(conn, exit_status(status));
+  if (conn->hangup)
+    return -1;
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = &conn->sock_watch};
+  epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev);
+  return 0;
+}
+
+/**
+ * @brief Accept every client that is waiting.
+ *
+ * @param ep The event loop
+ * @param listener The listening socket
+ */
+static void serve_accept(int ep, int listener)
+{
+  for (;;)
+  {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN)
+        perror("accept");
+      return;
+    }
+    struct serve_conn *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+    {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    conn->pidfd = -1;
+    conn->sock_watch = (struct serve_watch){conn, 0};
+    conn->child_watch = (struct serve_watch){conn, 1};
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = &conn->sock_watch};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) != 0)
+      serve_close(conn);
+  }
+}
+
+/**
+ * @brief Open the listening socket, replacing a stale one at the path.
+ *
+ * @param path The socket path
+ * @return The socket or -1 after printing an error
+ */
+static int serve_listen(const char *path)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+  {
+    perror("socket");
+    return -1;
+  }
+  struct stat st;
+  if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+  /* Requests run as this user, so only this user may send them */
+  mode_t old = umask(077);
+  int ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old);
+  if (ret != 0 || listen(fd, SERVE_BACKLOG) != 0)
+  {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Serve command requests on a Unix socket until SIGINT or SIGTERM.
+ * Each request runs in a forked child of the already initialized shell,
+ * so it starts with the functions and variables of the rc file but
+ * without the cost of starting a shell.
+ *
+ * @param sh The shell
+ * @param path The socket path
+ * @return 0 after a clean shutdown, 1 on error
+ */
+int shell_serve(struct shell *sh, const char *path)
+{
+  sigset_t stop;
+  sigset_t mask;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigprocmask(SIG_BLOCK, &stop, &mask);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listener = serve_listen(path);
+  int sigfd = signalfd(-1, &stop, SFD_CLOEXEC | SFD_NONBLOCK);
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (listener < 0 || sigfd < 0 || ep < 0)
+  {
+    if (sigfd < 0 || ep < 0)
+      perror("serve");
+    if (listener >= 0)
+      close(listener);
+    if (sigfd >= 0)
+      close(sigfd);
+    if (ep >= 0)
+      close(ep);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    return 1;
+  }
+  struct serve_watch listen_watch = {NULL, 0};
+  struct serve_watch signal_watch = {NULL, 1};
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &listen_watch};
+  epoll_ctl(ep, EPOLL_CTL_ADD, listener, &ev);
+  ev.data.ptr = &signal_watch;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sigfd, &ev);
+
+  struct epoll_event events[SERVE_EVENTS];
+  for (int running = 1; running;)
+  {
+    int n = epoll_wait(ep, events, SERVE_EVENTS, -1);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n; i++)
+    {
+      struct serve_watch *w = events[i].data.ptr;
+      struct serve_conn *conn = w->conn;
+      if (w == &listen_watch)
+        serve_accept(ep, listener);
+      else if (w == &signal_watch)
+      {
+        /* Taken off the queue, or it would kill the shell once unblocked */
+        struct signalfd_siginfo si;
+        if (read(sigfd, &si, sizeof(si)) == (ssize_t)sizeof(si))
+          running = 0;
+      }
+      else if (w->child)
+      {
+        if (serve_reap(ep, conn) != 0)
+          serve_close(conn);
+      }
+      else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      {
+        /* A request nobody waits for is hung up on, like a closed terminal */
+        epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+        if (conn->pid > 0)
+        {
+          conn->hangup = 1;
+          serve_hangup(conn->pid);
+        }
+        else
+          serve_close(conn);
+      }
+      else if (conn->pid == 0 && serve_read(sh, ep, conn, &mask) != 0)
+      {
+        epoll_ctl(ep, EPOLL_CTL_DEL, conn->fd, NULL);
+        serve_close(conn);
+      }
+    }
+  }
+
+  /* Requests still running finish on their own, their clients get no status */
+  unlink(path);
+  close(listener);
+  close(sigfd);
+  close(ep);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  return 0;
+}
+
+/**
+ * @brief Send a command to a shell serving on a Unix socket and wait for
+ * it to finish.
+ *
+ * @param path The socket path
+ * @param command The command
+ * @param env The environment for the command, usually environ
+ * @param fds The stdin, stdout and stderr for the command
+ * @return The exit status or -1 after printing an error
+ */
+int serve_request(const char *path, const char *command, char **env, const int fds[3])
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  char cwd[PATH_MAX];
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    cwd[0] = '\0';
+
+  /* The same layout serve_child takes apart */
+  size_t len = strlen(cwd) + 1;
+  for (char **e = env; e != NULL && *e != NULL; e++)
+    len += strlen(*e) + 1;
+  len += 1 + strlen(command);
+  if (len > SERVE_MAX_REQUEST)
+  {
+    fprintf(stderr, "request larger than %d bytes\n", SERVE_MAX_REQUEST);
+    return -1;
+  }
+  char *req = malloc(len);
+  if (req == NULL)
+    return -1;
+  char *p = stpcpy(req, cwd) + 1;
+  for (char **e = env; e != NULL && *e != NULL; e++)
+    p = stpcpy(p, *e) + 1;
+  *p++ = '\0';
+  memcpy(p, command, strlen(command));
+
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  struct iovec iov = {req, len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                       .msg_controllen = sizeof(ctl.buf)};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(3 * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, 3 * sizeof(int));
+
+  int32_t status = -1;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)len)
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  else
+  {
+    ssize_t n;
+    while ((n = recv(fd, &status, sizeof(status), 0)) < 0 && errno == EINTR)
+    {
+    }
+    if (n != (ssize_t)sizeof(status))
+    {
+      fprintf(stderr, "%s: the server went away\n", path);
+      status = -1;
+    }
+  }
+  if (fd >= 0)
+    close(fd);
+  free(req);
+  return status;
+}
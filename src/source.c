@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+/* Bump whenever the layout of struct ast_node or the meaning of a field changes */
+#define AST_CACHE_VERSION "2"
+#define AST_CACHE_MAGIC "MYSHAST" AST_CACHE_VERSION
+#define AST_CACHE_SUFFIX ".ast"
+
+/**
+ * @brief The start of a cache file. The node, word and string tables
+ * follow it as they are in memory. They only hold indexes and offsets, so
+ * the file is used where it is mapped without any fixing up.
+ */
+struct ast_cache_header
+{
+  char magic[8];
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t hash; /* of the contents of the script */
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint32_t node_size;
+  uint32_t root;
+  uint32_t nnodes;
+  uint32_t nwords;
+  uint32_t strings_len;
+  uint32_t pad;
+};
+
+/**
+ * @brief Hash some bytes with 64 bit FNV-1a.
+ *
+ * @param data The bytes
+ * @param len The number of bytes
+ * @return The hash
+ */
+static uint64_t fnv64(const char *data, size_t len)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+  return h;
+}
+
+/**
+ * @brief Find the cache directory of the shell, creating it if needed.
+ * The directory is MY_CACHE_DIR, $XDG_CACHE_HOME/mysh or ~/.cache/mysh.
+ * An empty MY_CACHE_DIR turns every cache off.
+ *
+ * @param sh The shell
+ * @param sub A subdirectory to use instead, or NULL
+ * @param out Room for the name of the directory
+ * @param size The size of out
+ * @return 0 on success, -1 if there is no cache
+ */
+int cache_dir(struct shell *sh, const char *sub, char *out, size_t size)
+{
+  const char *env = var_get(&sh->vars, "MY_CACHE_DIR");
+  int n;
+
+  if (env != NULL)
+  {
+    if (*env == '\0')
+      return -1;
+    n = snprintf(out, size, "%s", env);
+  }
+  else if ((env = var_get(&sh->vars, "XDG_CACHE_HOME")) != NULL && *env != '\0')
+    n = snprintf(out, size, "%s/mysh", env);
+  else
+  {
+    const char *home = home_dir(var_get(&sh->vars, "HOME"));
+    if (home == NULL)
+      return -1;
+    n = snprintf(out, size, "%s/.cache", home);
+    if (n > 0 && (size_t)n < size)
+      mkdir(out, 0700);
+    n = snprintf(out, size, "%s/.cache/mysh", home);
+  }
+  if (n <= 0 || (size_t)n >= size || (mkdir(out, 0700) != 0 && errno != EEXIST))
+    return -1;
+  if (sub != NULL)
+  {
+    size_t len = (size_t)n;
+    n = snprintf(out + len, size - len, "/%s", sub);
+    if (n <= 0 || (size_t)n >= size - len || (mkdir(out, 0700) != 0 && errno != EEXIST))
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Find the cache file of a script.
+ *
+ * @param sh The shell
+ * @param path The script
+ * @param out Room for the name of the cache file
+ * @param size The size of out
+ * @return 0 on success, -1 if there is no cache
+ */
+static int cache_path(struct shell *sh, const char *path, char *out, size_t size)
+{
+  char dir[PATH_MAX];
+  if (cache_dir(sh, NULL, dir, sizeof(dir)) != 0)
+    return -1;
+
+  /* The same script reached by another name gets the same file */
+  char real[PATH_MAX];
+  if (realpath(path, real) != NULL)
+    path = real;
+  int n = snprintf(out, size, "%s/%016llx" AST_CACHE_SUFFIX, dir,
+               (unsigned long long)fnv64(path, strlen(path)));
+  return n > 0 && (size_t)n < size ? 0 : -1;
+}
+
+/**
+ * @brief Read a whole script.
+ *
+ * @param fd The script
+ * @param size The size of the script
+ * @param len Set to the number of bytes read
+ * @return The contents ending with a NUL, or NULL on error
+ */
+static char *read_all(int fd, size_t size, size_t *len)
+{
+  char *text = malloc(size + 1);
+  size_t done = 0;
+
+  if (text == NULL)
+    return NULL;
+  while (done < size)
+  {
+    ssize_t n = pread(fd, text + done, size - done, (off_t)done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+    {
+      free(text);
+      return NULL;
+    }
+    if (n == 0)
+      break;
+    done += (size_t)n;
+  }
+  text[done] = '\0';
+  *len = done;
+  return text;
+}
+
+/**
+ * @brief Check if a cache header was written for the script as it is now.
+ *
+ * @param h The header
+ * @param st The script
+ * @return Non zero if the file is the one the cache was made from
+ */
+static int cache_current(const struct ast_cache_header *h, const struct stat *st)
+{
+  return h->dev == (uint64_t)st->st_dev && h->ino == (uint64_t)st->st_ino &&
+         h->size == (uint64_t)st->st_size && h->mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+         h->mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief Check that every node of a cached tree only refers to nodes,
+ * words and strings inside their tables, that the nodes form a tree and
+ * that each pipeline has as many commands as it says.
+ *
+ * @param h The header
+ * @param nodes The node table
+ * @return Non zero if the nodes can be run as they are
+ */
+static int cache_nodes_valid(const struct ast_cache_header *h, const struct ast_node *nodes)
+{
+  /* With one parent per node and none for the root nothing loops */
+  uint8_t *parents = calloc(h->nnodes, 1);
+  if (parents == NULL)
+    return 0;
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < h->nnodes; i++)
+  {
+    const struct ast_node *n = &nodes[i];
+    uint32_t kids[4] = {n->next, 0, 0, 0};
+    uint32_t string = 0;
+    uint32_t first = 0;
+    uint32_t count = 0;
+    switch (n->kind)
+    {
+    case AST_SIMPLE:
+      first = n->a;
+      count = n->b;
+      string = n->c;
+      break;
+    case AST_IF:
+      kids[3] = n->c;
+      /* fall through */
+    case AST_WHILE:
+    case AST_UNTIL:
+    case AST_AND:
+    case AST_OR:
+      kids[1] = n->a;
+      kids[2] = n->b;
+      break;
+    case AST_LIST:
+    case AST_GROUP:
+    case AST_SUBSHELL:
+    case AST_PIPELINE:
+      kids[1] = n->a;
+      break;
+    case AST_FOR:
+      string = n->a;
+      kids[1] = n->b;
+      first = n->c;
+      count = n->d;
+      break;
+    case AST_CASE:
+    case AST_FUNCTION:
+      string = n->a;
+      kids[1] = n->b;
+      break;
+    case AST_CASE_ITEM:
+      first = n->a;
+      count = n->b;
+      kids[1] = n->c;
+      break;
+    default:
+      ok = 0;
+    }
+    ok = ok && string < h->strings_len && (uint64_t)first + count <= h->nwords;
+    for (int k = 0; ok && k < 4; k++)
+      ok = kids[k] == 0 || (kids[k] < h->nnodes && parents[kids[k]]++ == 0);
+  }
+  ok = ok && parents[h->root] == 0;
+  free(parents);
+
+  for (uint32_t i = 0; ok && i < h->nnodes; i++)
+  {
+    if (nodes[i].kind != AST_PIPELINE)
+      continue;
+    uint32_t cmd = nodes[i].a;
+    uint32_t k = 0;
+    for (; k < nodes[i].b && cmd != 0; k++)
+      cmd = nodes[cmd].next;
+    ok = nodes[i].b > 0 && k == nodes[i].b && cmd == 0;
+  }
+  return ok;
+}
+
+/**
+ * @brief Map a cached tree. The tables are checked against the size of the
+ * file and every word, string and node reference against its table, so a
+ * truncated, damaged or foreign file is treated as a miss.
+ *
+ * @param cache The cache file
+ * @param st The script
+ * @param hash The hash of the script, 0 to accept only an unchanged stat
+ * @return The tree or NULL on a miss
+ */
+static struct ast *cache_load(const char *cache, const struct stat *st, uint64_t hash)
+{
+  int fd = open(cache, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  struct stat cst;
+  if (fstat(fd, &cst) != 0 || (size_t)cst.st_size < sizeof(struct ast_cache_header))
+  {
+    close(fd);
+    return NULL;
+  }
+  size_t len = (size_t)cst.st_size;
+  void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  const struct ast_cache_header *h = map;
+  size_t nodes = sizeof(*h);
+  size_t words = nodes + (size_t)h->nnodes * sizeof(struct ast_node);
+  size_t strings = words + (size_t)h->nwords * sizeof(uint32_t);
+  int ok = memcmp(h->magic, AST_CACHE_MAGIC, sizeof(h->magic)) == 0 &&
+           h->node_size == sizeof(struct ast_node) && h->root < h->nnodes &&
+           h->strings_len > 0 && strings + h->strings_len == len &&
+           (cache_current(h, st) || (hash != 0 && h->hash == hash));
+  const char *table = (const char *)map + strings;
+  const uint32_t *word = (const uint32_t *)((const char *)map + words);
+  ok = ok && table[h->strings_len - 1] == '\0';
+  for (uint32_t i = 0; ok && i < h->nwords; i++)
+    ok = word[i] < h->strings_len;
+  ok = ok && cache_nodes_valid(h, (const struct ast_node *)((const char *)map + nodes));
+
+  struct ast *t = ok ? calloc(1, sizeof(*t)) : NULL;
+  if (t == NULL)
+  {
+    munmap(map, len);
+    return NULL;
+  }
+  t->refs = 1;
+  t->root = h->root;
+  t->nodes = (struct ast_node *)((char *)map + nodes);
+  t->nnodes = t->nodes_cap = h->nnodes;
+  t->words = (uint32_t *)((char *)map + words);
+  t->nwords = t->words_cap = h->nwords;
+  t->strings = (char *)map + strings;
+  t->strings_len = t->strings_cap = h->strings_len;
+  t->map = map;
+  t->map_len = len;
+  return t;
+}
+
+/**
+ * @brief Write a tree to the cache. The file is written under a temporary
+ * name and renamed, so other shells see either the old or the new file.
+ *
+ * @param cache The cache file
+ * @param t The tree
+ * @param st The script
+ * @param hash The hash of the script
+ */
+static void cache_store(const char *cache, const struct ast *t, const struct stat *st, uint64_t hash)
+{
+  char tmp[PATH_MAX + 8];
+  struct ast_cache_header h = {0};
+
+  memcpy(h.magic, AST_CACHE_MAGIC, sizeof(h.magic));
+  h.dev = (uint64_t)st->st_dev;
+  h.ino = (uint64_t)st->st_ino;
+  h.size = (uint64_t)st->st_size;
+  h.hash = hash;
+  h.mtime_sec = (int64_t)st->st_mtim.tv_sec;
+  h.mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+  h.node_size = sizeof(struct ast_node);
+  h.root = t->root;
+  h.nnodes = t->nnodes;
+  h.nwords = t->nwords;
+  h.strings_len = t->strings_len;
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cache);
+  int fd = mkostemp(tmp, O_CLOEXEC);
+  if (fd < 0)
+    return;
+  struct iovec iov[] = {
+      {&h, sizeof(h)},
+      {t->nodes, t->nnodes * sizeof(struct ast_node)},
+      {t->words, t->nwords * sizeof(uint32_t)},
+      {t->strings, t->strings_len},
+  };
+  struct io_file f = {.fd = fd, .iov = iov, .count = sizeof(iov) / sizeof(iov[0]), .tmp = tmp,
+                      .path = cache};
+  io_commit(&f, 1);
+}
+
+/**
+ * @brief Get the tree of a script, from the cache when it is current.
+ *
+ * @param sh The shell
+ * @param path The script
+ * @param fd The open script
+ * @param st The script
+ * @return The tree or NULL after printing an error
+ */
+static struct ast *source_parse(struct shell *sh, const char *path, int fd, const struct stat *st)
+{
+  char cache[PATH_MAX];
+  int cached = cache_path(sh, path, cache, sizeof(cache)) == 0;
+  struct ast *t = cached ? cache_load(cache, st, 0) : NULL;
+  if (t != NULL)
+    return t;
+
+  size_t len;
+  char *text = read_all(fd, (size_t)st->st_size, &len);
+  if (text == NULL)
+  {
+    fprintf(stderr, "source: %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  uint64_t hash = fnv64(text, len);
+  /* A touched or copied script with the same contents keeps its tree */
+  t = cached ? cache_load(cache, st, hash) : NULL;
+  if (t == NULL)
+  {
+    t = ast_parse(text, NULL, NULL);
+    if (t == NULL)
+      fprintf(stderr, "source: %s: parse failed\n", path);
+  }
+  if (t != NULL && cached)
+    cache_store(cache, t, st, hash);
+  free(text);
+  return t;
+}
+
+/**
+ * @brief Run a script in the current shell. The parsed tree is kept in
+ * the cache directory and mapped back in while the script is unchanged.
+ *
+ * @param sh The shell
+ * @param path The script
+ * @param args The positional parameters or NULL to keep the current ones
+ * @return The exit status of the script
+ */
+int source_file(struct shell *sh, const char *path, char **args)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+  {
+    fprintf(stderr, "source: %s: %s\n", path, fd < 0 ? strerror(errno) : "not a regular file");
+    if (fd >= 0)
+      close(fd);
+    return sh->last_status = 1;
+  }
+  struct ast *t = source_parse(sh, path, fd, &st);
+  close(fd);
+  if (t == NULL)
+    return sh->last_status = 2;
+
+  char **saved_args = sh->args;
+  int nargs = sh->nargs;
+  int loop_depth = sh->loop_depth;
+  if (args != NULL)
+  {
+    sh->args = args;
+    for (sh->nargs = 0; args[sh->nargs] != NULL; sh->nargs++)
+    {
+    }
+  }
+  sh->loop_depth = 0;
+  sh->source_depth++;
+  sh->last_status = 0;
+  exec_tree(sh, t);
+  sh->source_depth--;
+  sh->returning = 0;
+  sh->loop_depth = loop_depth;
+  sh->args = saved_args;
+  sh->nargs = nargs;
+  ast_release(t);
+  return sh->last_status;
+}
+
+/**
+ * @brief The source and . builtins.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the script
+ */
+int builtin_source(struct shell *sh, char **argv)
+{
+  if (argv[1] == NULL)
+  {
+    fprintf(stderr, "usage: %s file [args...]\n", argv[0]);
+    return 2;
+  }
+  return source_file(sh, argv[1], argv[2] != NULL ? argv + 2 : NULL);
+}
+
+/**
+ * @brief Run the startup file named by MY_RC, or ~/.myshrc, if it exists.
+ *
+ * @param sh The shell
+ */
+void source_rc(struct shell *sh)
+{
+  char path[PATH_MAX];
+  const char *rc = var_get(&sh->vars, "MY_RC");
+
+  if (rc == NULL)
+  {
+    const char *home = home_dir(var_get(&sh->vars, "HOME"));
+    if (home == NULL)
+      return;
+    snprintf(path, sizeof(path), "%s/.myshrc", home);
+    rc = path;
+  }
+  if (*rc != '\0' && access(rc, F_OK) == 0)
+    source_file(sh, rc, NULL);
+}
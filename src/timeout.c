@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#define DEFAULT_KILL_AFTER 2.0
+
+/**
+ * @brief Parse a duration such as "10", "1.5s", "250ms", "2m" or "1h".
+ *
+ * @param str The string to parse
+ * @param seconds The parsed duration in seconds
+ * @return 0 on success, -1 if the string is not a valid duration
+ */
+int parse_duration(const char *str, double *seconds)
+{
+  char *end;
+  double val = strtod(str, &end);
+
+  if (end == str || val < 0 || !isfinite(val))
+    return -1;
+  if (*end == '\0' || strcmp(end, "s") == 0)
+    *seconds = val;
+  else if (strcmp(end, "ms") == 0)
+    *seconds = val / 1e3;
+  else if (strcmp(end, "m") == 0)
+    *seconds = val * 60;
+  else if (strcmp(end, "h") == 0)
+    *seconds = val * 3600;
+  else
+    return -1;
+  return 0;
+}
+
+/**
+ * @brief Arm a one shot timerfd.
+ *
+ * @param tfd The timer
+ * @param seconds Time until the timer fires
+ */
+static void arm_timer(int tfd, double seconds)
+{
+  struct itimerspec its = {0};
+  its.it_value.tv_sec = (time_t)seconds;
+  its.it_value.tv_nsec = (long)((seconds - (double)its.it_value.tv_sec) * 1e9);
+  if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+    its.it_value.tv_nsec = 1;
+  timerfd_settime(tfd, 0, &its, NULL);
+}
+
+/**
+ * @brief Wait for a foreground child with a deadline.
+ *
+ * @param sh The shell
+ * @param pid The child, also the leader of its process group
+ * @param status The wait status of the child
+ * @param limit The deadline in seconds
+ * @return 1 if the deadline expired, 0 if the child exited or stopped on
+ * its own and -1 if pidfd or timerfd are unavailable and nothing was
+ * waited for
+ */
+int wait_deadline(struct shell *sh, pid_t pid, int *status, double limit)
+{
+  int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd < 0)
+    return -1;
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (tfd < 0)
+  {
+    close(pidfd);
+    return -1;
+  }
+
+  /* A pidfd only shows the exit, a stop arrives as SIGCHLD */
+  int wake = child_wake_start();
+  int stage = 0;
+  int stopped = 0;
+  arm_timer(tfd, limit);
+  for (;;)
+  {
+    siginfo_t si = {0};
+    if (stage == 0 && waitid(P_PID, (id_t)pid, &si, WSTOPPED | WNOHANG | WNOWAIT) == 0 &&
+        si.si_pid == pid)
+    {
+      /* Handed back so the stopped command becomes a job as without a deadline */
+      stopped = 1;
+      break;
+    }
+    struct pollfd fds[3] = {{pidfd, POLLIN, 0}, {tfd, POLLIN, 0}, {wake, POLLIN, 0}};
+    if (poll(fds, 3, wake >= 0 ? -1 : 100) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+    if (wake >= 0)
+      child_wake_clear();
+    if (fds[0].revents & POLLIN)
+      break;
+    if (fds[1].revents & POLLIN)
+    {
+      uint64_t expirations;
+      if (read(tfd, &expirations, sizeof(expirations)) < 0)
+        continue;
+      if (stage == 0)
+      {
+        /* A stopped group only sees SIGTERM once it is continued */
+        kill(-pid, SIGTERM);
+        kill(-pid, SIGCONT);
+        arm_timer(tfd, sh->kill_after > 0 ? sh->kill_after : DEFAULT_KILL_AFTER);
+      }
+      else if (stage == 1)
+      {
+        kill(-pid, SIGKILL);
+      }
+      stage++;
+    }
+  }
+  if (wake >= 0)
+    child_wake_stop();
+  close(tfd);
+  close(pidfd);
+
+  while (wait4(pid, status, stopped ? WUNTRACED : 0, &sh->last_usage) < 0 && errno == EINTR)
+  {
+  }
+  return stage > 0 ? 1 : 0;
+}
+
+/**
+ * @brief The timeout builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return The exit status of the command, 124 if it timed out
+ */
+int builtin_timeout(struct shell *sh, char **argv)
+{
+  double limit;
+  double def = -1;
+  double kill_after = -1;
+  int i = 1;
+
+  if (argv[1] == NULL)
+  {
+    printf("default %gs, kill after %gs\n", sh->default_timeout,
+           sh->kill_after > 0 ? sh->kill_after : DEFAULT_KILL_AFTER);
+    return 0;
+  }
+  for (; argv[i] != NULL && argv[i][0] == '-'; i += 2)
+  {
+    if (strcmp(argv[i], "--") == 0)
+    {
+      i++;
+      break;
+    }
+    if ((strcmp(argv[i], "-d") != 0 && strcmp(argv[i], "-k") != 0) || argv[i + 1] == NULL)
+    {
+      fprintf(stderr, "usage: timeout [-k KILL_AFTER] [-d DEFAULT | DURATION cmd [args...]]\n");
+      return 1;
+    }
+    if (parse_duration(argv[i + 1], &limit) != 0)
+    {
+      fprintf(stderr, "timeout: bad duration '%s'\n", argv[i + 1]);
+      return 1;
+    }
+    if (argv[i][1] == 'd')
+      def = limit;
+    else
+      kill_after = limit;
+  }
+
+  /* Without a command the options change the shell wide settings */
+  if (argv[i] == NULL)
+  {
+    if (def >= 0)
+      sh->default_timeout = def;
+    if (kill_after >= 0)
+      sh->kill_after = kill_after;
+    return 0;
+  }
+  if (def >= 0 || parse_duration(argv[i], &limit) != 0 || argv[i + 1] == NULL)
+  {
+    fprintf(stderr, "usage: timeout [-k KILL_AFTER] [-d DEFAULT | DURATION cmd [args...]]\n");
+    return 1;
+  }
+
+  double saved_limit = sh->command_timeout;
+  double saved_kill = sh->kill_after;
+  sh->command_timeout = limit;
+  if (kill_after >= 0)
+    sh->kill_after = kill_after;
+  int rval = run_command(sh, &argv[i + 1], 0);
+  sh->command_timeout = saved_limit;
+  sh->kill_after = saved_kill;
+  return rval;
+}
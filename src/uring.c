@@ -0,0 +1,611 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/* Room for a few files of write, close and rename each */
+#define URING_ENTRIES 32
+#define URING_OPS_PER_FILE 3
+
+/* A copy moves this much per read and write pair, a few pairs per call */
+#define COPY_CHUNK (64 * 1024)
+#define COPY_PAIRS 8
+
+/**
+ * @brief The ring of the process, set up on first use. It is only used
+ * by the process that set it up, a forked copy of the shell shares its
+ * memory with the parent and writes with plain syscalls.
+ */
+struct uring
+{
+  int state; /* 0 not tried yet, 1 ready, -1 plain syscalls */
+  int fd;
+  pid_t pid;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map;
+  size_t sq_len;
+  void *cq_map; /* the same as sq_map with a single mapping */
+  size_t cq_len;
+  size_t sqes_len;
+};
+
+static struct uring ring = {.fd = -1};
+
+/* Builtins feeding pipelines write from threads of their own */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Unmap and close the ring.
+ */
+static void uring_close(void)
+{
+  if (ring.sqes != NULL)
+    munmap(ring.sqes, ring.sqes_len);
+  if (ring.cq_map != NULL && ring.cq_map != ring.sq_map)
+    munmap(ring.cq_map, ring.cq_len);
+  if (ring.sq_map != NULL)
+    munmap(ring.sq_map, ring.sq_len);
+  if (ring.fd >= 0)
+    close(ring.fd);
+  ring = (struct uring){.state = -1, .fd = -1};
+}
+
+/**
+ * @brief Check that the kernel knows every operation used here.
+ *
+ * @return 0 if it does, -1 if not
+ */
+static int uring_probe(void)
+{
+  size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p = calloc(1, len);
+  if (p == NULL)
+    return -1;
+  int rval = -1;
+  if (syscall(SYS_io_uring_register, ring.fd, IORING_REGISTER_PROBE, p, 256) == 0)
+  {
+    int ops[] = {IORING_OP_WRITEV, IORING_OP_CLOSE, IORING_OP_RENAMEAT, IORING_OP_READ,
+                 IORING_OP_WRITE};
+    rval = 0;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    {
+      if (ops[i] > p->last_op || !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+        rval = -1;
+    }
+  }
+  free(p);
+  return rval;
+}
+
+/**
+ * @brief Set up the ring and map its queues. A kernel without io_uring,
+ * or a seccomp filter or sysctl that turns it off, leaves plain syscalls.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int uring_open(void)
+{
+  struct io_uring_params p = {0};
+
+  ring.fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+  if (ring.fd < 0)
+    return -1;
+  ring.pid = getpid();
+
+  ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring.cq_len > ring.sq_len)
+      ring.sq_len = ring.cq_len;
+    ring.cq_len = ring.sq_len;
+  }
+  ring.sq_map = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sq_map == MAP_FAILED)
+  {
+    ring.sq_map = NULL;
+    return -1;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    ring.cq_map = ring.sq_map;
+  else
+  {
+    ring.cq_map = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cq_map == MAP_FAILED)
+    {
+      ring.cq_map = NULL;
+      return -1;
+    }
+  }
+  ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED)
+  {
+    ring.sqes = NULL;
+    return -1;
+  }
+
+  char *sq = ring.sq_map;
+  char *cq = ring.cq_map;
+  ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+  ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return uring_probe();
+}
+
+/**
+ * @brief Check that this process can use the ring, setting it up the
+ * first time. Call with ring_lock held.
+ *
+ * @return Non zero if the ring is ready
+ */
+static int uring_ready(void)
+{
+  if (ring.state == 0)
+  {
+    if (uring_open() == 0)
+      ring.state = 1;
+    else
+      uring_close();
+  }
+  return ring.state == 1 && ring.pid == getpid();
+}
+
+/**
+ * @brief Queue one operation. The caller has checked there is room.
+ *
+ * @return The entry to fill in, cleared
+ */
+static struct io_uring_sqe *uring_sqe(unsigned *tail)
+{
+  unsigned i = *tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = &ring.sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sq_array[i] = i;
+  (*tail)++;
+  return sqe;
+}
+
+/**
+ * @brief Submit the queued operations with one system call and wait for
+ * all of them to complete.
+ *
+ * @param tail The tail after the last queued operation
+ * @param count The number of queued operations
+ * @param res Set to the result of each operation, by its user_data, and
+ * left alone for operations whose result never came
+ * @return 0 on success, -1 if nothing was submitted, 1 if the ring broke
+ * after submitting; it is closed then
+ */
+static int uring_submit(unsigned tail, unsigned count, int *res)
+{
+  __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+  unsigned pending = count;
+  unsigned done = 0;
+  while (done < count)
+  {
+    int n = (int)syscall(SYS_io_uring_enter, ring.fd, pending, count - done,
+                         IORING_ENTER_GETEVENTS, NULL, 0);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      /* Closing the ring waits for what is in flight */
+      uring_close();
+      return pending == count ? -1 : 1;
+    }
+    pending -= (unsigned)n < pending ? (unsigned)n : pending;
+    unsigned head = *ring.cq_head;
+    unsigned end = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != end; head++)
+    {
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->user_data < count)
+        res[cqe->user_data] = cqe->res;
+      done++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/**
+ * @brief Write a file with plain syscalls, with pwritev at the offset of
+ * the file or writev at the position of the descriptor.
+ *
+ * @param f The file
+ * @return 0 if everything was written, -1 on error
+ */
+static int plain_write(const struct io_file *f)
+{
+  struct iovec iov[IO_FILE_IOV_MAX];
+  int count = f->count;
+  struct iovec *v = iov;
+  size_t total = 0;
+  off_t off = f->off;
+
+  memcpy(iov, f->iov, (size_t)count * sizeof(*iov));
+  for (int i = 0; i < count; i++)
+    total += iov[i].iov_len;
+  size_t done = 0;
+  while (done < total)
+  {
+    ssize_t n = off >= 0 ? pwritev(f->fd, v, count, off) : writev(f->fd, v, count);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    done += (size_t)n;
+    if (off >= 0)
+      off += n;
+    /* Skip the pieces that are written, then the written part of the next */
+    while (count > 0 && (size_t)n >= v->iov_len)
+    {
+      n -= (ssize_t)v->iov_len;
+      v++;
+      count--;
+    }
+    if (count > 0)
+    {
+      v->iov_base = (char *)v->iov_base + n;
+      v->iov_len -= (size_t)n;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Write, close and rename files one syscall at a time.
+ *
+ * @param files The files
+ * @param n The number of files
+ * @return The number of files that failed
+ */
+static int plain_commit(struct io_file *files, size_t n)
+{
+  int failed = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    struct io_file *f = &files[i];
+    int ok = (i == 0 || !f->linked || files[i - 1].ok) && plain_write(f) == 0;
+    if (!f->keep)
+      close(f->fd);
+    if (f->tmp != NULL && (!ok || rename(f->tmp, f->path) != 0))
+    {
+      unlink(f->tmp);
+      ok = 0;
+    }
+    f->ok = ok;
+    failed += !ok;
+  }
+  return failed;
+}
+
+/**
+ * @brief Write, close and rename as many files as fit in the ring with a
+ * single system call. The operations of a file are linked, so a failed
+ * or short write cancels its close and rename, which are then done here.
+ *
+ * @param files The files
+ * @param n The number of files, at most URING_ENTRIES / URING_OPS_PER_FILE
+ * @return The number of files that failed, or -1 if the ring broke
+ * before anything was submitted
+ */
+static int uring_commit(struct io_file *files, size_t n)
+{
+  int res[URING_ENTRIES];
+  size_t first[URING_ENTRIES / URING_OPS_PER_FILE];
+  unsigned tail = *ring.sq_tail;
+  unsigned count = 0;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    struct io_file *f = &files[i];
+    if (i > 0 && f->linked)
+      ring.sqes[(tail - 1) & *ring.sq_mask].flags |= IOSQE_IO_LINK;
+    first[i] = count;
+
+    struct io_uring_sqe *sqe = uring_sqe(&tail);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = f->fd;
+    sqe->addr = (unsigned long)f->iov;
+    sqe->len = (unsigned)f->count;
+    sqe->off = f->off >= 0 ? (uint64_t)f->off : (uint64_t)-1;
+    sqe->user_data = count++;
+    if (!f->keep)
+    {
+      sqe->flags |= IOSQE_IO_LINK;
+      sqe = uring_sqe(&tail);
+      sqe->opcode = IORING_OP_CLOSE;
+      sqe->fd = f->fd;
+      sqe->user_data = count++;
+      if (f->tmp != NULL)
+      {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_sqe(&tail);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)f->tmp;
+        sqe->len = (unsigned)AT_FDCWD;
+        sqe->addr2 = (unsigned long)f->path;
+        sqe->user_data = count++;
+      }
+    }
+  }
+  /* An operation without a result may or may not have happened */
+  for (unsigned i = 0; i < count; i++)
+    res[i] = INT_MIN;
+  if (uring_submit(tail, count, res) < 0)
+    return -1;
+
+  int failed = 0;
+  for (size_t i = 0; i < n; i++)
+  {
+    struct io_file *f = &files[i];
+    const int *r = &res[first[i]];
+    size_t total = 0;
+    for (int j = 0; j < f->count; j++)
+      total += f->iov[j].iov_len;
+    int ok = r[0] >= 0 && (size_t)r[0] == total;
+    if (!f->keep)
+    {
+      if (r[1] == -ECANCELED)
+        close(f->fd);
+      else
+        ok = ok && r[1] == 0;
+    }
+    if (f->tmp != NULL)
+    {
+      ok = ok && r[2] == 0;
+      if (!ok)
+        unlink(f->tmp);
+    }
+    /* A failed rename does not end a chain, so undo what came after it */
+    if (ok && i > 0 && f->linked && !files[i - 1].ok)
+    {
+      if (f->tmp != NULL)
+        unlink(f->path);
+      ok = 0;
+    }
+    f->ok = ok;
+    failed += !ok;
+  }
+  return failed;
+}
+
+/**
+ * @brief Write files the shell made itself in as few system calls as
+ * possible. With io_uring every file is written, closed and renamed
+ * by one batch of linked operations and a few files share a single
+ * system call, which counts where seccomp makes each one expensive.
+ * Without it, or in a forked copy of the shell, plain syscalls do the
+ * same. A file whose write fails is closed anyway and its temporary
+ * name removed.
+ *
+ * @param files The files, ok is set for each
+ * @param n The number of files
+ * @return 0 if every file was written, -1 if any failed
+ */
+int io_commit(struct io_file *files, size_t n)
+{
+  int failed = 0;
+
+  for (size_t i = 0; i < n; i++)
+  {
+    if (files[i].count < 0 || files[i].count > IO_FILE_IOV_MAX ||
+        (files[i].tmp != NULL && files[i].keep))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  pthread_mutex_lock(&ring_lock);
+  while (n > 0)
+  {
+    /* Whole chains of linked files that fit in the ring go in one batch */
+    size_t batch = 1;
+    while (batch < n && files[batch].linked)
+      batch++;
+    int fits = batch <= URING_ENTRIES / URING_OPS_PER_FILE;
+    while (fits && batch < n)
+    {
+      size_t next = batch + 1;
+      while (next < n && files[next].linked)
+        next++;
+      if (next > URING_ENTRIES / URING_OPS_PER_FILE)
+        break;
+      batch = next;
+    }
+    int rval = fits && uring_ready() ? uring_commit(files, batch) : -1;
+    if (rval < 0)
+      rval = plain_commit(files, batch);
+    failed += rval;
+    files += batch;
+    n -= batch;
+  }
+  pthread_mutex_unlock(&ring_lock);
+  return failed == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Copy with pread and write.
+ *
+ * @param in The source
+ * @param off Where to start in the source
+ * @param len The number of bytes
+ * @param out The destination, written at its position
+ * @param buf A buffer of COPY_CHUNK bytes
+ * @return The bytes copied
+ */
+static size_t plain_copy(int in, off_t off, size_t len, int out, char *buf)
+{
+  size_t done = 0;
+  while (done < len)
+  {
+    size_t want = len - done < COPY_CHUNK ? len - done : COPY_CHUNK;
+    ssize_t n = pread(in, buf, want, off + (off_t)done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    ssize_t w = 0;
+    while (w < n)
+    {
+      ssize_t m = write(out, buf + w, (size_t)(n - w));
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m <= 0)
+        return done + (size_t)w;
+      w += m;
+    }
+    done += (size_t)n;
+  }
+  return done;
+}
+
+/**
+ * @brief Copy with chains of linked reads and writes, several chunks for
+ * each system call. A short read or write ends the chain, the rest of it
+ * is cancelled and the copy goes on from where it stopped.
+ *
+ * @param in The source
+ * @param off Where to start in the source
+ * @param len The number of bytes
+ * @param out The destination, written at its position
+ * @param buf A buffer of COPY_PAIRS chunks
+ * @param done Set to the bytes copied
+ * @return 0 if the copy went as far as it could, -1 if the ring broke
+ * before anything was submitted
+ */
+static int uring_copy(int in, off_t off, size_t len, int out, char *buf, size_t *done)
+{
+  int res[2 * COPY_PAIRS];
+
+  *done = 0;
+  while (*done < len)
+  {
+    unsigned tail = *ring.sq_tail;
+    unsigned count = 0;
+    size_t want[COPY_PAIRS];
+    size_t at = *done;
+    for (int i = 0; i < COPY_PAIRS && at < len; i++)
+    {
+      want[i] = len - at < COPY_CHUNK ? len - at : COPY_CHUNK;
+      struct io_uring_sqe *sqe = uring_sqe(&tail);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = in;
+      sqe->addr = (unsigned long)(buf + (size_t)i * COPY_CHUNK);
+      sqe->len = (unsigned)want[i];
+      sqe->off = (uint64_t)(off + (off_t)at);
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = count++;
+      sqe = uring_sqe(&tail);
+      sqe->opcode = IORING_OP_WRITE;
+      sqe->fd = out;
+      sqe->addr = (unsigned long)(buf + (size_t)i * COPY_CHUNK);
+      sqe->len = (unsigned)want[i];
+      sqe->off = (uint64_t)-1;
+      sqe->user_data = count++;
+      at += want[i];
+      if (at < len && i + 1 < COPY_PAIRS)
+        sqe->flags = IOSQE_IO_LINK;
+    }
+    for (unsigned i = 0; i < count; i++)
+      res[i] = INT_MIN;
+    int rval = uring_submit(tail, count, res);
+    if (rval < 0)
+      return *done == 0 ? -1 : 0;
+
+    unsigned pair = 0;
+    for (; pair < count / 2; pair++)
+    {
+      int w = res[2 * pair + 1];
+      if (w > 0)
+        *done += (size_t)w;
+      if (w < 0 || (size_t)w != want[pair])
+        break;
+    }
+    if (pair < count / 2)
+    {
+      /* A read or write that moved nothing ends the copy */
+      if (res[2 * pair] <= 0 || res[2 * pair + 1] <= 0 || rval != 0)
+        return 0;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy part of a file to a descriptor, for when sendfile cannot
+ * write to it, such as a file open for appending. With io_uring a few
+ * chunks are read and written for each system call, without it every
+ * chunk takes a pread and a write.
+ *
+ * @param in The source
+ * @param off Where to start in the source
+ * @param len The number of bytes
+ * @param out The destination, written at its position
+ * @return 0 if all of it was copied, -1 on error
+ */
+int io_copy(int in, off_t off, size_t len, int out)
+{
+  size_t size = len < (size_t)COPY_PAIRS * COPY_CHUNK ? len : (size_t)COPY_PAIRS * COPY_CHUNK;
+  char *buf = malloc(size > COPY_CHUNK ? size : COPY_CHUNK);
+  if (buf == NULL)
+    return -1;
+
+  size_t done = 0;
+  pthread_mutex_lock(&ring_lock);
+  if (!uring_ready() || uring_copy(in, off, len, out, buf, &done) != 0)
+    done = plain_copy(in, off, len, out, buf);
+  pthread_mutex_unlock(&ring_lock);
+  free(buf);
+  return done == len ? 0 : -1;
+}
+
+/**
+ * @brief Pick whether io_commit and io_copy may use io_uring. It is on by default
+ * and falls back to plain syscalls by itself where io_uring is missing.
+ *
+ * @param on Non zero to use io_uring when it is there
+ * @return Non zero if io_uring is now in use
+ */
+int io_use_uring(int on)
+{
+  pthread_mutex_lock(&ring_lock);
+  if (!on)
+    uring_close();
+  else if (ring.state == -1 && ring.fd < 0)
+    ring.state = 0;
+  int rval = on && uring_ready();
+  pthread_mutex_unlock(&ring_lock);
+  return rval;
+}
@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#define VARS_MIN_CAP 64
+#define TOMBSTONE ((char *)-1)
+
+/**
+ * @brief FNV-1a hash of a variable name.
+ *
+ * @param name The name
+ * @param len The length of the name
+ * @return The hash
+ */
+static uint32_t var_hash(const char *name, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= (unsigned char)name[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/**
+ * @brief Check if a string is a valid variable name.
+ *
+ * @param name The string
+ * @param len The number of characters to check
+ * @return Non zero if the name is valid
+ */
+int var_valid_name(const char *name, size_t len)
+{
+  if (len == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_'))
+    return 0;
+  for (size_t i = 1; i < len; i++)
+  {
+    if (!(isalnum((unsigned char)name[i]) || name[i] == '_'))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * @brief Find the slot for a name, either the one holding it or the empty
+ * slot where it would be inserted.
+ *
+ * @param t The table
+ * @param name The name
+ * @param len The length of the name
+ * @param hash The hash of the name
+ * @return The slot
+ */
+static struct var *var_slot(struct var_table *t, const char *name, size_t len, uint32_t hash)
+{
+  size_t mask = t->cap - 1;
+  struct var *tomb = NULL;
+
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+  {
+    struct var *v = &t->slots[i];
+    if (v->name == NULL)
+      return tomb ? tomb : v;
+    if (v->name == TOMBSTONE)
+    {
+      if (tomb == NULL)
+        tomb = v;
+      continue;
+    }
+    if (v->hash == hash && v->name_len == len && memcmp(v->name, name, len) == 0)
+      return v;
+  }
+}
+
+/**
+ * @brief Grow or clean the table so that it stays at most half full.
+ *
+ * @param t The table
+ * @return 0 on success, -1 if out of memory
+ */
+static int var_reserve(struct var_table *t)
+{
+  if ((t->count + t->tombstones + 1) * 2 <= t->cap)
+    return 0;
+
+  size_t cap = t->cap ? t->cap : VARS_MIN_CAP;
+  while ((t->count + 1) * 2 > cap)
+    cap *= 2;
+  struct var *slots = calloc(cap, sizeof(struct var));
+  if (slots == NULL)
+    return -1;
+
+  struct var *old = t->slots;
+  size_t old_cap = t->cap;
+  t->slots = slots;
+  t->cap = cap;
+  t->tombstones = 0;
+  for (size_t i = 0; i < old_cap; i++)
+  {
+    struct var *v = &old[i];
+    if (v->name == NULL || v->name == TOMBSTONE)
+      continue;
+    size_t mask = cap - 1;
+    size_t j = v->hash & mask;
+    while (slots[j].name != NULL)
+      j = (j + 1) & mask;
+    slots[j] = *v;
+  }
+  free(old);
+  return 0;
+}
+
+/**
+ * @brief Initialize an empty variable table.
+ *
+ * @param t The table
+ */
+void vars_init(struct var_table *t)
+{
+  memset(t, 0, sizeof(*t));
+  t->envp_dirty = 1;
+}
+
+/**
+ * @brief Free a variable table and everything in it.
+ *
+ * @param t The table
+ */
+void vars_free(struct var_table *t)
+{
+  for (size_t i = 0; i < t->cap; i++)
+  {
+    struct var *v = &t->slots[i];
+    if (v->name == NULL || v->name == TOMBSTONE)
+      continue;
+    free(v->name);
+  }
+  free(t->slots);
+  free(t->envp);
+  memset(t, 0, sizeof(*t));
+}
+
+/**
+ * @brief Look up a variable.
+ *
+ * @param t The table
+ * @param name The name
+ * @return The value or NULL if the variable is not set
+ */
+const char *var_get(struct var_table *t, const char *name)
+{
+  return var_get_n(t, name, strlen(name));
+}
+
+/**
+ * @brief Look up a variable by a name that is not NUL terminated.
+ *
+ * @param t The table
+ * @param name The name
+ * @param len The length of the name
+ * @return The value or NULL if the variable is not set
+ */
+const char *var_get_n(struct var_table *t, const char *name, size_t len)
+{
+  if (t->count == 0)
+    return NULL;
+  struct var *v = var_slot(t, name, len, var_hash(name, len));
+  if (v->name == NULL || v->name == TOMBSTONE)
+    return NULL;
+  return v->value;
+}
+
+/**
+ * @brief Set a variable.
+ *
+ * @param t The table
+ * @param name The name
+ * @param value The value, NULL keeps the current value
+ * @param flags VAR_EXPORT to export the variable, existing flags are kept
+ * @return 0 on success, -1 on error
+ */
+int var_set(struct var_table *t, const char *name, const char *value, int flags)
+{
+  size_t len = strlen(name);
+  if (!var_valid_name(name, len))
+    return -1;
+  if (var_reserve(t) != 0)
+    return -1;
+
+  uint32_t hash = var_hash(name, len);
+  struct var *v = var_slot(t, name, len, hash);
+  int existed = v->name != NULL && v->name != TOMBSTONE;
+
+  if (value == NULL)
+    value = existed ? v->value : "";
+
+  /* The name, '=' and value live in one block that doubles as the envp entry */
+  size_t vlen = strlen(value);
+  char *entry = malloc(len + vlen + 2);
+  if (entry == NULL)
+    return -1;
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, vlen + 1);
+
+  int old_flags = existed ? v->flags : 0;
+  if (existed)
+    free(v->name);
+  else
+  {
+    if (v->name == TOMBSTONE)
+      t->tombstones--;
+    t->count++;
+  }
+
+  v->name = entry;
+  v->name_len = len;
+  v->value = entry + len + 1;
+  v->hash = hash;
+  v->flags = old_flags | flags;
+  if (v->flags & VAR_EXPORT)
+    t->envp_dirty = 1;
+  return 0;
+}
+
+/**
+ * @brief Remove a variable.
+ *
+ * @param t The table
+ * @param name The name
+ * @return 0 if the variable was removed, -1 if it was not set
+ */
+int var_unset(struct var_table *t, const char *name)
+{
+  size_t len = strlen(name);
+  if (t->count == 0)
+    return -1;
+  struct var *v = var_slot(t, name, len, var_hash(name, len));
+  if (v->name == NULL || v->name == TOMBSTONE)
+    return -1;
+  if (v->flags & VAR_EXPORT)
+    t->envp_dirty = 1;
+  free(v->name);
+  v->name = TOMBSTONE;
+  v->value = NULL;
+  t->count--;
+  t->tombstones++;
+  return 0;
+}
+
+/**
+ * @brief Get the environment for a new process.
+ *
+ * @param t The table
+ * @return A NULL terminated array of "NAME=value" strings owned by the table
+ */
+char **var_envp(struct var_table *t)
+{
+  if (!t->envp_dirty && t->envp != NULL)
+    return t->envp;
+
+  size_t n = 0;
+  for (size_t i = 0; i < t->cap; i++)
+  {
+    struct var *v = &t->slots[i];
+    if (v->name != NULL && v->name != TOMBSTONE && (v->flags & VAR_EXPORT))
+      n++;
+  }
+  char **envp = realloc(t->envp, (n + 1) * sizeof(char *));
+  if (envp == NULL)
+    return t->envp;
+  t->envp = envp;
+
+  n = 0;
+  for (size_t i = 0; i < t->cap; i++)
+  {
+    struct var *v = &t->slots[i];
+    if (v->name == NULL || v->name == TOMBSTONE || !(v->flags & VAR_EXPORT))
+      continue;
+    envp[n++] = v->name;
+  }
+  envp[n] = NULL;
+  t->envp_dirty = 0;
+  return envp;
+}
+
+/**
+ * @brief Import an environment array as exported variables.
+ *
+ * @param t The table
+ * @param env The environment, usually environ
+ */
+void vars_import(struct var_table *t, char **env)
+{
+  for (int i = 0; env != NULL && env[i] != NULL; i++)
+  {
+    const char *eq = strchr(env[i], '=');
+    if (eq == NULL || !var_valid_name(env[i], (size_t)(eq - env[i])))
+      continue;
+    char *name = strndup(env[i], (size_t)(eq - env[i]));
+    if (name == NULL)
+      continue;
+    var_set(t, name, eq + 1, VAR_EXPORT);
+    free(name);
+  }
+}
+
+/**
+ * @brief Check if a word is an assignment such as NAME=value.
+ *
+ * @param word The word
+ * @return The length of the name or 0 if the word is not an assignment
+ */
+size_t var_assignment(const char *word)
+{
+  const char *eq = strchr(word, '=');
+  if (eq == NULL || !var_valid_name(word, (size_t)(eq - word)))
+    return 0;
+  return (size_t)(eq - word);
+}
+
+/**
+ * @brief Set a variable from an assignment word.
+ *
+ * @param t The table
+ * @param word The word, NAME=value
+ * @param len The length of the name
+ * @param flags The flags to add
+ * @return 0 on success, -1 on error
+ */
+static int var_assign(struct var_table *t, const char *word, size_t len, int flags)
+{
+  char *name = strndup(word, len);
+  if (name == NULL)
+    return -1;
+  int rval = var_set(t, name, word + len + 1, flags);
+  free(name);
+  return rval;
+}
+
+static int compare_var(const void *a, const void *b)
+{
+  const struct var *x = *(const struct var *const *)a;
+  const struct var *y = *(const struct var *const *)b;
+  size_t len = x->name_len < y->name_len ? x->name_len : y->name_len;
+  int cmp = memcmp(x->name, y->name, len);
+  if (cmp != 0)
+    return cmp;
+  return (x->name_len > y->name_len) - (x->name_len < y->name_len);
+}
+
+/**
+ * @brief Print variables sorted by name.
+ *
+ * @param t The table
+ * @param flags Only print variables with all of these flags
+ * @param prefix Printed before each variable
+ */
+static void vars_print(struct var_table *t, int flags, const char *prefix)
+{
+  struct var **list = malloc(sizeof(struct var *) * (t->count + 1));
+  size_t n = 0;
+
+  if (list == NULL)
+    return;
+  for (size_t i = 0; i < t->cap; i++)
+  {
+    struct var *v = &t->slots[i];
+    if (v->name != NULL && v->name != TOMBSTONE && (v->flags & flags) == flags)
+      list[n++] = v;
+  }
+  qsort(list, n, sizeof(struct var *), compare_var);
+  for (size_t i = 0; i < n; i++)
+    printf("%s%s\n", prefix, list[i]->name);
+  free(list);
+}
+
+/**
+ * @brief Run a command with assignments in front of it. Without a command
+ * the assignments set shell variables, otherwise they are exported to the
+ * command only and the old values are put back afterwards.
+ *
+ * @param sh The shell
+ * @param argv The words, starting with at least one assignment
+ * @param background Non zero to run the command as a background job
+ * @return The exit status
+ */
+int run_assignments(struct shell *sh, char **argv, int background)
+{
+  struct var_table *t = &sh->vars;
+  int n = 0;
+
+  while (argv[n] != NULL && var_assignment(argv[n]) > 0)
+    n++;
+
+  if (argv[n] == NULL)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      if (var_assign(t, argv[i], var_assignment(argv[i]), 0) != 0)
+      {
+        fprintf(stderr, "%s: cannot assign\n", argv[i]);
+        return sh->last_status = 1;
+      }
+    }
+    return sh->last_status = 0;
+  }
+
+  struct saved_var
+  {
+    char *name;
+    char *value;
+    int flags;
+  } *saved = calloc((size_t)n, sizeof(struct saved_var));
+  if (saved == NULL)
+  {
+    perror("calloc");
+    return sh->last_status = 1;
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    size_t len = var_assignment(argv[i]);
+    saved[i].name = strndup(argv[i], len);
+    if (saved[i].name == NULL)
+      break;
+    struct var *v = t->count ? var_slot(t, argv[i], len, var_hash(argv[i], len)) : NULL;
+    if (v != NULL && v->name != NULL && v->name != TOMBSTONE)
+    {
+      saved[i].value = strdup(v->value);
+      saved[i].flags = v->flags;
+    }
+    var_set(t, saved[i].name, argv[i] + len + 1, VAR_EXPORT);
+  }
+
+  int rval = run_command(sh, &argv[n], background);
+
+  /* Restore in reverse so a name assigned twice gets its original back */
+  for (int i = n - 1; i >= 0; i--)
+  {
+    if (saved[i].name == NULL)
+      continue;
+    var_unset(t, saved[i].name);
+    if (saved[i].value != NULL)
+      var_set(t, saved[i].name, saved[i].value, saved[i].flags);
+    free(saved[i].name);
+    free(saved[i].value);
+  }
+  free(saved);
+  return rval;
+}
+
+/**
+ * @brief The export builtin.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_export(struct shell *sh, char **argv)
+{
+  int rval = 0;
+
+  if (argv[1] == NULL)
+  {
+    vars_print(&sh->vars, VAR_EXPORT, "export ");
+    return 0;
+  }
+  for (int i = 1; argv[i] != NULL; i++)
+  {
+    size_t len = var_assignment(argv[i]);
+    int err = len > 0 ? var_assign(&sh->vars, argv[i], len, VAR_EXPORT)
+                      : var_set(&sh->vars, argv[i], NULL, VAR_EXPORT);
+    if (err != 0)
+    {
+      fprintf(stderr, "export: '%s': not a valid identifier\n", argv[i]);
+      rval = -1;
+    }
+  }
+  return rval;
+}
+
+/**
+ * @brief The unset builtin. Unsetting a variable that is not set is not
+ * an error.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_unset(struct shell *sh, char **argv)
+{
+  int rval = 0;
+
+  for (int i = 1; argv[i] != NULL; i++)
+  {
+    if (!var_valid_name(argv[i], strlen(argv[i])))
+    {
+      fprintf(stderr, "unset: '%s': not a valid identifier\n", argv[i]);
+      rval = -1;
+      continue;
+    }
+    var_unset(&sh->vars, argv[i]);
+  }
+  return rval;
+}
+
+/**
+ * @brief The set builtin. Lists every variable, or sets shell variables
+ * from NAME=value arguments without exporting them.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, -1 on error
+ */
+int builtin_set(struct shell *sh, char **argv)
+{
+  int rval = 0;
+
+  if (argv[1] == NULL)
+  {
+    vars_print(&sh->vars, 0, "");
+    return 0;
+  }
+  for (int i = 1; argv[i] != NULL; i++)
+  {
+    size_t len = var_assignment(argv[i]);
+    if (len == 0 || var_assign(&sh->vars, argv[i], len, 0) != 0)
+    {
+      fprintf(stderr, "usage: set [NAME=value...]\n");
+      rval = -1;
+    }
+  }
+  return rval;
+}
@@ -0,0 +1,372 @@
+#define _GNU_SOURCE
+#include "../src/lab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/* Bigger requests, such as a huge environment, are forked by the shell */
+#define ZYGOTE_MAX_REQUEST (128 * 1024)
+
+#define ZYGOTE_POLICY 0x1      /* policy holds a placement to apply */
+#define ZYGOTE_FOREGROUND 0x2  /* take the terminal, default signals */
+
+/**
+ * @brief The fixed part of a spawn request. It is followed by the
+ * directory, nargs arguments and nenv environment strings, each NUL
+ * terminated. The descriptors for stdin, stdout and stderr, and for a
+ * foreground command the terminal, come along with SCM_RIGHTS.
+ */
+struct zygote_request
+{
+  pid_t pgid; /* 0 for a process group of its own */
+  int flags;
+  int nargs;
+  int nenv;
+  struct job_policy policy;
+};
+
+/**
+ * @brief The answer to a spawn request.
+ */
+struct zygote_reply
+{
+  pid_t pid;
+  int err;
+};
+
+/**
+ * @brief Become the command of a request. Runs in the new process, which
+ * is a child of the shell, not of the zygote.
+ *
+ * @param req The request
+ * @param strings The strings of the request
+ * @param fds The descriptors of the request
+ * @param nfds The number of descriptors
+ */
+static void zygote_exec(const struct zygote_request *req, char *strings, int *fds, int nfds)
+{
+  char *argv[req->nargs + 1];
+  char *envp[req->nenv + 1];
+  char *cwd = strings;
+  char *p = cwd + strlen(cwd) + 1;
+  for (int i = 0; i < req->nargs; i++, p += strlen(p) + 1)
+    argv[i] = p;
+  argv[req->nargs] = NULL;
+  for (int i = 0; i < req->nenv; i++, p += strlen(p) + 1)
+    envp[i] = p;
+  envp[req->nenv] = NULL;
+
+  setpgid(0, req->pgid);
+  for (int i = 0; i < 3 && i < nfds; i++)
+    dup2(fds[i], i);
+  if (req->flags & ZYGOTE_FOREGROUND)
+  {
+    if (nfds > 3)
+      tcsetpgrp(fds[3], getpid());
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+  }
+  syscall(SYS_close_range, 3, ~0U, 0);
+  if (*cwd != '\0' && chdir(cwd) != 0)
+    _exit(EXIT_FAILURE);
+  if (req->flags & ZYGOTE_POLICY)
+    job_policy_apply(&req->policy);
+  if (req->nenv > 0)
+    environ = envp;
+  execvp(argv[0], argv);
+  _exit(EXIT_FAILURE);
+}
+
+/**
+ * @brief Serve spawn requests until the shell closes its end.
+ *
+ * @param fd The zygote's end of the socket pair
+ */
+static void zygote_loop(int fd)
+{
+  static char buf[ZYGOTE_MAX_REQUEST + 1];
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(4 * sizeof(int))];
+  } ctl;
+
+  for (;;)
+  {
+    struct iovec iov = {buf, ZYGOTE_MAX_REQUEST};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                         .msg_controllen = sizeof(ctl.buf)};
+    ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      return;
+
+    int fds[4];
+    int nfds = 0;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c != NULL && c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    {
+      nfds = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      memcpy(fds, CMSG_DATA(c), (size_t)nfds * sizeof(int));
+    }
+
+    struct zygote_reply reply = {-1, EINVAL};
+    struct zygote_request req;
+    if ((size_t)len > sizeof(req) && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+    {
+      memcpy(&req, buf, sizeof(req));
+      buf[len] = '\0';
+      /* The new process is the shell's child, so the shell can wait for it */
+      pid_t pid = (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+      if (pid == 0)
+        zygote_exec(&req, buf + sizeof(req), fds, nfds);
+      reply.pid = pid;
+      reply.err = pid < 0 ? errno : 0;
+    }
+    for (int i = 0; i < nfds; i++)
+      close(fds[i]);
+    send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+  }
+}
+
+/**
+ * @brief Start the zygote, a copy of the shell made while it is still
+ * small, which forks commands for it. The fork cost of the shell grows
+ * with its heap, that of the zygote stays the same.
+ *
+ * @param sh The shell
+ * @return 0 on success, -1 on error
+ */
+int zygote_start(struct shell *sh)
+{
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+    return -1;
+  fflush(stdout);
+  pid_t parent = getpid();
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    close(sv[0]);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != parent)
+      _exit(0);
+    zygote_loop(sv[1]);
+    _exit(0);
+  }
+  close(sv[1]);
+  if (pid < 0)
+  {
+    close(sv[0]);
+    return -1;
+  }
+  sh->zygote.fd = sv[0];
+  sh->zygote.pid = pid;
+  sh->zygote.owner = parent;
+  return 0;
+}
+
+/**
+ * @brief Stop the zygote. Commands it started keep running.
+ *
+ * @param sh The shell
+ */
+void zygote_stop(struct shell *sh)
+{
+  if (sh->zygote.pid <= 0)
+    return;
+  close(sh->zygote.fd);
+  /* A forked copy of the shell closes its end but leaves the zygote alone */
+  if (getpid() == sh->zygote.owner)
+  {
+    while (waitpid(sh->zygote.pid, NULL, 0) < 0 && errno == EINTR)
+    {
+    }
+  }
+  sh->zygote.fd = -1;
+  sh->zygote.pid = 0;
+}
+
+/**
+ * @brief Ask the zygote for a new process running a command.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param envp The environment or NULL to keep the one the shell started with
+ * @param fds The stdin, stdout and stderr for the command
+ * @param foreground Non zero to give the command the terminal
+ * @param policy The placement to apply or NULL
+ * @param pid Set to the new process
+ * @return 0 on success, -1 if the zygote could not take the request
+ */
+static int zygote_request(struct shell *sh, char **argv, char **envp, const int fds[3],
+                          int foreground, const struct job_policy *policy, pid_t *pid)
+{
+  struct zygote_request req = {0};
+  char cwd[PATH_MAX];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    cwd[0] = '\0';
+
+  size_t len = sizeof(req) + strlen(cwd) + 1;
+  for (; argv[req.nargs] != NULL; req.nargs++)
+    len += strlen(argv[req.nargs]) + 1;
+  for (; envp != NULL && envp[req.nenv] != NULL; req.nenv++)
+    len += strlen(envp[req.nenv]) + 1;
+  if (len > ZYGOTE_MAX_REQUEST)
+    return -1;
+  if (policy != NULL)
+  {
+    req.flags |= ZYGOTE_POLICY;
+    req.policy = *policy;
+  }
+  if (foreground)
+    req.flags |= ZYGOTE_FOREGROUND;
+
+  char *buf = malloc(len);
+  if (buf == NULL)
+    return -1;
+  memcpy(buf, &req, sizeof(req));
+  char *p = stpcpy(buf + sizeof(req), cwd) + 1;
+  for (int i = 0; i < req.nargs; i++)
+    p = stpcpy(p, argv[i]) + 1;
+  for (int i = 0; i < req.nenv; i++)
+    p = stpcpy(p, envp[i]) + 1;
+
+  union
+  {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(4 * sizeof(int))];
+  } ctl;
+  int nfds = foreground ? 4 : 3;
+  memset(&ctl, 0, sizeof(ctl));
+  struct iovec iov = {buf, len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.buf,
+                       .msg_controllen = CMSG_SPACE((size_t)nfds * sizeof(int))};
+  struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN((size_t)nfds * sizeof(int));
+  memcpy(CMSG_DATA(c), fds, 3 * sizeof(int));
+  if (foreground)
+    memcpy(CMSG_DATA(c) + 3 * sizeof(int), &sh->shell_terminal, sizeof(int));
+
+  struct zygote_reply reply;
+  ssize_t sent;
+  while ((sent = sendmsg(sh->zygote.fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+  {
+  }
+  free(buf);
+  ssize_t got = -1;
+  if (sent == (ssize_t)len)
+  {
+    while ((got = recv(sh->zygote.fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR)
+    {
+    }
+  }
+  if (got != (ssize_t)sizeof(reply))
+  {
+    /* The zygote is gone, the shell forks by itself from now on */
+    fprintf(stderr, "zygote: %s, forking directly\n", got < 0 ? strerror(errno) : "exited");
+    zygote_stop(sh);
+    return -1;
+  }
+  if (reply.pid < 0)
+  {
+    errno = reply.err;
+    *pid = -1;
+    return 0;
+  }
+  sh->zygote.spawns++;
+  *pid = reply.pid;
+  return 0;
+}
+
+/**
+ * @brief Check if the command about to start may be given /dev/fd paths
+ * of process substitutions. Their pipes are open only in the shell.
+ *
+ * @param sh The shell
+ * @return Non zero if a running expansion holds a process substitution
+ */
+static int zygote_procsubst(struct shell *sh)
+{
+  for (size_t i = 0; i < sh->exp_depth; i++)
+  {
+    if (sh->exps[i]->nprocs > 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Start a command from the zygote, or fork the shell if there is
+ * none. Returns as fork does, so the caller has to handle a child that
+ * returns 0 like after fork. A forked copy of the shell always forks
+ * itself, the zygote's processes become children of the shell that
+ * started it. So does a command given process substitutions, which has
+ * to inherit their pipes at the same numbers.
+ *
+ * @param sh The shell
+ * @param argv The command
+ * @param envp The environment or NULL to keep the one the shell started with
+ * @param fds The stdin, stdout and stderr for the command
+ * @param foreground Non zero to give the command the terminal
+ * @param policy The placement to apply or NULL
+ * @return The new process, 0 in a child forked by the shell, -1 on error
+ */
+pid_t zygote_spawn(struct shell *sh, char **argv, char **envp, const int fds[3], int foreground,
+                   const struct job_policy *policy)
+{
+  pid_t pid;
+  if (sh->zygote.pid > 0 && !sh->zygote.paused && getpid() == sh->zygote.owner &&
+      !zygote_procsubst(sh) && zygote_request(sh, argv, envp, fds, foreground, policy, &pid) == 0)
+    return pid;
+  return shell_fork(sh);
+}
+
+/**
+ * @brief The zygote builtin. Shows the zygote, or with on or off picks
+ * whether commands start from it or from a fork of the shell. The zygote
+ * itself only starts with the shell, when MY_ZYGOTE is set.
+ *
+ * @param sh The shell
+ * @param argv The builtin arguments
+ * @return 0 on success, 1 on error
+ */
+int builtin_zygote(struct shell *sh, char **argv)
+{
+  if (argv[1] == NULL)
+  {
+    if (sh->zygote.pid > 0)
+      printf("zygote %d %s, %lu spawns\n", sh->zygote.pid, sh->zygote.paused ? "off" : "on",
+             sh->zygote.spawns);
+    else
+      printf("zygote not running\n");
+    return 0;
+  }
+  if (strcmp(argv[1], "on") == 0 || strcmp(argv[1], "off") == 0)
+  {
+    if (sh->zygote.pid <= 0)
+    {
+      fprintf(stderr, "zygote: not running, start the shell with MY_ZYGOTE=1\n");
+      return 1;
+    }
+    sh->zygote.paused = argv[1][1] == 'f';
+    return 0;
+  }
+  fprintf(stderr, "usage: zygote [on|off]\n");
+  return 1;
+}
@@ -1,4 +1,9 @@
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
 
@@ -35,6 +40,8 @@ void test_cmd_parse2(void)
   free(expected[0]);
   free(expected[1]);
   free(expected);
+  cmd_free(actual);
+  free(stng);
 }
 
 void test_cmd_parse(void)
@@ -160,6 +167,909 @@ void test_ch_dir_root(void)
   cmd_free(cmd);
 }
 
+void test_job_policy_parse(void)
+{
+  struct job_policy policy;
+  job_policy_init(&policy);
+  char **cmd = cmd_parse("run -c 0-2,5 -n 10 -- sleep 1");
+  int first = job_policy_parse(&policy, cmd);
+  TEST_ASSERT_EQUAL_INT(6, first);
+  TEST_ASSERT_EQUAL_STRING("sleep", cmd[first]);
+  TEST_ASSERT_TRUE(policy.has_cpus);
+  TEST_ASSERT_EQUAL_UINT64(0x27, policy.cpus[0]);
+  TEST_ASSERT_TRUE(policy.has_nice);
+  TEST_ASSERT_EQUAL_INT(10, policy.nice);
+  TEST_ASSERT_EQUAL_INT(-1, policy.sched);
+  cmd_free(cmd);
+
+  cmd = cmd_parse("run -c 3-1 ls");
+  TEST_ASSERT_EQUAL_INT(-1, job_policy_parse(&policy, cmd));
+  cmd_free(cmd);
+}
+
+void test_bench_compute(void)
+{
+  double samples[] = {5.0, 1.0, 4.0, 2.0, 3.0};
+  struct bench_stats stats;
+  bench_compute(samples, 5, &stats);
+  TEST_ASSERT_EQUAL_FLOAT(3.0, stats.mean);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 1.58113883, stats.stddev);
+  TEST_ASSERT_EQUAL_FLOAT(1.0, stats.min);
+  TEST_ASSERT_EQUAL_FLOAT(3.0, stats.p50);
+  TEST_ASSERT_EQUAL_FLOAT(5.0, stats.p99);
+  TEST_ASSERT_EQUAL_FLOAT(5.0, stats.max);
+}
+
+void test_parse_duration(void)
+{
+  double secs;
+  TEST_ASSERT_EQUAL_INT(0, parse_duration("10", &secs));
+  TEST_ASSERT_EQUAL_FLOAT(10.0, secs);
+  TEST_ASSERT_EQUAL_INT(0, parse_duration("250ms", &secs));
+  TEST_ASSERT_EQUAL_FLOAT(0.25, secs);
+  TEST_ASSERT_EQUAL_INT(0, parse_duration("2m", &secs));
+  TEST_ASSERT_EQUAL_FLOAT(120.0, secs);
+  TEST_ASSERT_EQUAL_INT(-1, parse_duration("5x", &secs));
+  TEST_ASSERT_EQUAL_INT(-1, parse_duration("", &secs));
+}
+
+void test_vars(void)
+{
+  struct var_table t;
+  vars_init(&t);
+  TEST_ASSERT_EQUAL_INT(0, var_set(&t, "FOO", "bar", 0));
+  TEST_ASSERT_EQUAL_INT(-1, var_set(&t, "1FOO", "bar", 0));
+  TEST_ASSERT_EQUAL_STRING("bar", var_get(&t, "FOO"));
+  TEST_ASSERT_NULL(var_get(&t, "FO"));
+
+  char **envp = var_envp(&t);
+  TEST_ASSERT_NULL(envp[0]);
+  TEST_ASSERT_EQUAL_INT(0, var_set(&t, "FOO", NULL, VAR_EXPORT));
+  envp = var_envp(&t);
+  TEST_ASSERT_EQUAL_STRING("FOO=bar", envp[0]);
+  TEST_ASSERT_NULL(envp[1]);
+
+  /* Shell only variables leave the cached environment alone */
+  for (int i = 0; i < 200; i++)
+  {
+    char name[16];
+    snprintf(name, sizeof(name), "V%d", i);
+    var_set(&t, name, "x", 0);
+  }
+  TEST_ASSERT_FALSE(t.envp_dirty);
+  TEST_ASSERT_EQUAL_STRING("x", var_get(&t, "V199"));
+  TEST_ASSERT_EQUAL_STRING("bar", var_get(&t, "FOO"));
+
+  TEST_ASSERT_EQUAL_INT(0, var_unset(&t, "FOO"));
+  TEST_ASSERT_EQUAL_INT(-1, var_unset(&t, "FOO"));
+  TEST_ASSERT_NULL(var_get(&t, "FOO"));
+  TEST_ASSERT_NULL(var_envp(&t)[0]);
+  vars_free(&t);
+}
+
+void test_arith_eval(void)
+{
+  struct var_table t;
+  long long val;
+  vars_init(&t);
+  var_set(&t, "N", "6", 0);
+  TEST_ASSERT_EQUAL_INT(0, arith_eval(&t, "1 + 2 * 3", 9, &val));
+  TEST_ASSERT_EQUAL_INT(7, (int)val);
+  TEST_ASSERT_EQUAL_INT(0, arith_eval(&t, "(N - 2) * -$N / 4", 17, &val));
+  TEST_ASSERT_EQUAL_INT(-6, (int)val);
+  TEST_ASSERT_EQUAL_INT(0, arith_eval(&t, "2-3-4 == -5 && 1<<3 == 8", 24, &val));
+  TEST_ASSERT_EQUAL_INT(1, (int)val);
+  TEST_ASSERT_EQUAL_INT(-1, arith_eval(&t, "1 / 0", 5, &val));
+  TEST_ASSERT_EQUAL_INT(-1, arith_eval(&t, "(1 +", 4, &val));
+  vars_free(&t);
+}
+
+void test_expand_words(void)
+{
+  struct shell sh = {0};
+  struct expansion ex = {0};
+  vars_init(&sh.vars);
+  var_set(&sh.vars, "X", "a b", 0);
+  char **words = cmd_parse("echo $X \"$X\" '$X' ${Y:-y z} $((1+1))x \"\"");
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(9, (int)ex.argc);
+  TEST_ASSERT_EQUAL_STRING("a", ex.argv[1]);
+  TEST_ASSERT_EQUAL_STRING("b", ex.argv[2]);
+  TEST_ASSERT_EQUAL_STRING("a b", ex.argv[3]);
+  TEST_ASSERT_EQUAL_STRING("$X", ex.argv[4]);
+  TEST_ASSERT_EQUAL_STRING("y", ex.argv[5]);
+  TEST_ASSERT_EQUAL_STRING("z", ex.argv[6]);
+  TEST_ASSERT_EQUAL_STRING("2x", ex.argv[7]);
+  TEST_ASSERT_EQUAL_STRING("", ex.argv[8]);
+  TEST_ASSERT_NULL(ex.argv[9]);
+  cmd_free(words);
+  expansion_free(&ex);
+  vars_free(&sh.vars);
+}
+
+void test_command_subst(void)
+{
+  struct shell sh = {0};
+  struct expansion ex = {0};
+  vars_init(&sh.vars);
+  char **words = cmd_parse("x$(printf 'a  b\\n\\n')y \"$(printf 'c d\\n')\" `echo e`");
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(4, (int)ex.argc);
+  TEST_ASSERT_EQUAL_STRING("xa", ex.argv[0]);
+  TEST_ASSERT_EQUAL_STRING("by", ex.argv[1]);
+  TEST_ASSERT_EQUAL_STRING("c d", ex.argv[2]);
+  TEST_ASSERT_EQUAL_STRING("e", ex.argv[3]);
+  cmd_free(words);
+  expansion_free(&ex);
+  vars_free(&sh.vars);
+}
+
+void test_process_subst(void)
+{
+  struct shell sh = {0};
+  struct expansion ex = {0};
+  char line[16] = "";
+  vars_init(&sh.vars);
+  char **words = cmd_parse("cat <(echo hi)");
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(2, (int)ex.argc);
+  TEST_ASSERT_EQUAL_INT(0, strncmp(ex.argv[1], "/dev/fd/", 8));
+  FILE *in = fopen(ex.argv[1], "r");
+  TEST_ASSERT_NOT_NULL(in);
+  TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), in));
+  TEST_ASSERT_EQUAL_STRING("hi\n", line);
+  fclose(in);
+  procsubst_reap(&sh, &ex);
+  TEST_ASSERT_EQUAL_INT(0, (int)ex.nprocs);
+  cmd_free(words);
+
+  /* A compound body sees EOF once the command closes its end */
+  words = cmd_parse("tee <(echo a) >(for i in 1; do grep -q x; done)");
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(3, (int)ex.argc);
+  FILE *out = fopen(ex.argv[2], "w");
+  TEST_ASSERT_NOT_NULL(out);
+  fputs("hi\n", out);
+  fclose(out);
+  procsubst_reap(&sh, &ex);
+  TEST_ASSERT_EQUAL_INT(0, (int)ex.nprocs);
+  cmd_free(words);
+  expansion_free(&ex);
+  vars_free(&sh.vars);
+}
+
+static char *test_lines(void *arg)
+{
+  const char ***lines = arg;
+  return **lines ? strdup(*(*lines)++) : NULL;
+}
+
+void test_heredoc(void)
+{
+  struct shell sh = {0};
+  char buf[64] = "";
+  const char *input[] = {"a $X", "'q'", "EOF", "tail", NULL};
+  const char **next = input;
+  vars_init(&sh.vars);
+  var_set(&sh.vars, "X", "x", 0);
+  struct ast *t = ast_parse("cat <<EOF -n", test_lines, &next);
+  TEST_ASSERT_NOT_NULL(t);
+  const struct ast_node *cmd = &t->nodes[t->nodes[t->root].a];
+  TEST_ASSERT_EQUAL_INT(AST_SIMPLE, cmd->kind);
+  TEST_ASSERT_EQUAL_INT(AST_HERE, cmd->flags);
+  TEST_ASSERT_EQUAL_INT(2, (int)cmd->b);
+  TEST_ASSERT_EQUAL_STRING("-n", t->strings + t->words[cmd->a + 1]);
+  TEST_ASSERT_EQUAL_STRING("tail", *next);
+  int here = heredoc_open(&sh, t->strings + cmd->c, 0, 0);
+  TEST_ASSERT_TRUE(here >= 0);
+  TEST_ASSERT_EQUAL_INT(8, (int)read(here, buf, sizeof(buf)));
+  TEST_ASSERT_EQUAL_STRING("a x\n'q'\n", buf);
+  close(here);
+  ast_release(t);
+
+  /* Large bodies go to a memfd that can be read from the start */
+  size_t len = 100000;
+  char *data = malloc(len);
+  memset(data, 'z', len);
+  int fd = heredoc_fd(data, len);
+  TEST_ASSERT_TRUE(fd >= 0);
+  TEST_ASSERT_EQUAL_INT((int)len, (int)lseek(fd, 0, SEEK_END));
+  TEST_ASSERT_EQUAL_INT(-1, (int)write(fd, "x", 1));
+  close(fd);
+  free(data);
+  vars_free(&sh.vars);
+}
+
+static void run_line(struct shell *sh, const char *line)
+{
+  struct ast *t = ast_parse(line, NULL, NULL);
+  TEST_ASSERT_NOT_NULL(t);
+  exec_tree(sh, t);
+  ast_release(t);
+}
+
+static void run_line_out(struct shell *sh, const char *line, char *buf, size_t size)
+{
+  char path[] = "/tmp/test-out-XXXXXX";
+  int fd = mkstemp(path);
+  TEST_ASSERT_TRUE(fd >= 0);
+  unlink(path);
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  dup2(fd, STDOUT_FILENO);
+  run_line(sh, line);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  ssize_t n = pread(fd, buf, size - 1, 0);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+}
+
+void test_job_control(void)
+{
+  struct shell sh = {0};
+  sh_init_state(&sh);
+
+  /* wait -n returns as each job ends, the quicker one first */
+  run_line(&sh, "sh -c 'sleep 0.5; exit 3' &");
+  run_line(&sh, "sh -c 'sleep 0.1; exit 5' &");
+  run_line(&sh, "wait -n");
+  TEST_ASSERT_EQUAL_INT(5, sh.last_status);
+  run_line(&sh, "wait -n");
+  TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+
+  /* A stop and a continue reach the job through job_event */
+  run_line(&sh, "sleep 5 &");
+  struct bg_process *bgp = &sh.bg_processes[sh.num_bg_processes - 1];
+  kill(bgp->pid, SIGSTOP);
+  while (bgp->state != JOB_STOPPED)
+    TEST_ASSERT_EQUAL_INT(1, job_event(&sh, 1));
+  kill(bgp->pid, SIGCONT);
+  while (bgp->state != JOB_RUNNING)
+    TEST_ASSERT_EQUAL_INT(1, job_event(&sh, 1));
+  kill(bgp->pid, SIGKILL);
+  while (!job_finished(bgp))
+    TEST_ASSERT_EQUAL_INT(1, job_event(&sh, 1));
+  TEST_ASSERT_EQUAL_INT(128 + SIGKILL, job_exit_status(bgp));
+
+  /* A command stopping under a deadline becomes a stopped job at once */
+  sh.default_timeout = 2;
+  run_line(&sh, "sh -c 'kill -STOP $$; exit 4'");
+  TEST_ASSERT_EQUAL_INT(128 + SIGSTOP, sh.last_status);
+  bgp = &sh.bg_processes[sh.num_bg_processes - 1];
+  TEST_ASSERT_EQUAL_INT(JOB_STOPPED, bgp->state);
+  kill(bgp->pid, SIGCONT);
+  while (!job_finished(bgp))
+    TEST_ASSERT_EQUAL_INT(1, job_event(&sh, 1));
+  TEST_ASSERT_EQUAL_INT(4, job_exit_status(bgp));
+  sh_destroy(&sh);
+}
+
+void test_capture_cap(void)
+{
+  struct shell sh = {0};
+  char out[8192];
+  struct stat st;
+  sh_init_state(&sh);
+
+  run_line(&sh, "capture on -c 4K");
+  run_line(&sh, "seq 1 5000 &");
+  run_line(&sh, "wait");
+  struct bg_process *bgp = &sh.bg_processes[sh.num_bg_processes - 1];
+  TEST_ASSERT_EQUAL_INT(0, fstat(bgp->out_fd, &st));
+  /* Only the last 4K are kept and the whole pages before them given back */
+  TEST_ASSERT_EQUAL_INT(st.st_size - 4096, bgp->out_start);
+  TEST_ASSERT_TRUE(st.st_blocks * 512 <= 2 * 4096);
+  run_line_out(&sh, "jobs -o 1", out, sizeof(out));
+  TEST_ASSERT_EQUAL_size_t(4096, strlen(out));
+  TEST_ASSERT_EQUAL_STRING("4999\n5000\n", out + 4096 - 10);
+  sh_destroy(&sh);
+}
+
+void test_job_stats_descendants(void)
+{
+  struct shell sh = {0};
+  char out[1024];
+  int procs = 0;
+  sh_init_state(&sh);
+
+  /* The shell and both of its children are counted in the job's row */
+  run_line(&sh, "sh -c 'sleep 5 & sleep 5; wait' &");
+  struct bg_process *bgp = &sh.bg_processes[sh.num_bg_processes - 1];
+  for (int i = 0; i < 100 && procs != 3; i++)
+  {
+    usleep(10000);
+    run_line_out(&sh, "jobs --stats", out, sizeof(out));
+    char *row = strchr(out, '\n');
+    TEST_ASSERT_NOT_NULL(row);
+    TEST_ASSERT_EQUAL_INT(1, sscanf(row + 1, "%*s %*d %*s %*f %*s %*s %*s %*d %d", &procs));
+  }
+  TEST_ASSERT_EQUAL_INT(3, procs);
+  kill(-bgp->pgid, SIGKILL);
+  run_line(&sh, "wait");
+  TEST_ASSERT_TRUE(job_finished(bgp));
+  sh_destroy(&sh);
+}
+
+void test_subreaper(void)
+{
+  struct shell sh = {0};
+  sh_init_state(&sh);
+
+  /* The orphan left behind by the leader keeps the job running */
+  run_line(&sh, "subreaper on");
+  TEST_ASSERT_EQUAL_INT(1, sh.subreaper);
+  run_line(&sh, "sh -c 'sleep 0.6 & sleep 0.3' &");
+  struct bg_process *bgp = &sh.bg_processes[sh.num_bg_processes - 1];
+  for (int i = 0; i < 100 && bgp->num_tracked == 0; i++)
+  {
+    usleep(2000);
+    update_jobs(&sh);
+  }
+  TEST_ASSERT_TRUE(bgp->num_tracked > 0);
+  unsigned long orphans = sh.orphans_reaped;
+  run_line(&sh, "wait");
+  TEST_ASSERT_EQUAL_INT(JOB_DONE, bgp->state);
+  TEST_ASSERT_EQUAL_INT(2, bgp->reaped);
+  TEST_ASSERT_EQUAL_size_t(0, bgp->num_tracked);
+  TEST_ASSERT_EQUAL_UINT(orphans, sh.orphans_reaped);
+  run_line(&sh, "subreaper off");
+  TEST_ASSERT_EQUAL_INT(0, sh.subreaper);
+  sh_destroy(&sh);
+}
+
+void test_control_flow(void)
+{
+  struct shell sh = {0};
+  vars_init(&sh.vars);
+  const char *script[] = {
+      "for i in a b c; do X=$X$i; done",
+      "f() { case $1 in b*) return 4;; esac; Y=$1; }; f x; f bar",
+      "for k in 1 2; do for j in 1 2; do W=$W$k$j; continue 2; done; W=no; done",
+      "i=0; while true; do i=$((i+1)); if [ $i = 3 ]; then break; fi; done",
+      "true && Q=1 || Q=2; false && R=1 || R=2; false || false && S=1",
+      "P=$(printf '%s-' a b | tr - + | cat); L=$(false | echo z)",
+  };
+  for (size_t k = 0; k < sizeof(script) / sizeof(script[0]); k++)
+  {
+    struct ast *t = ast_parse(script[k], NULL, NULL);
+    TEST_ASSERT_NOT_NULL(t);
+    exec_tree(&sh, t);
+    ast_release(t);
+  }
+  TEST_ASSERT_EQUAL_STRING("abc", var_get(&sh.vars, "X"));
+  TEST_ASSERT_EQUAL_STRING("x", var_get(&sh.vars, "Y"));
+  TEST_ASSERT_EQUAL_STRING("1121", var_get(&sh.vars, "W"));
+  TEST_ASSERT_EQUAL_STRING("3", var_get(&sh.vars, "i"));
+  TEST_ASSERT_EQUAL_STRING("1", var_get(&sh.vars, "Q"));
+  TEST_ASSERT_EQUAL_STRING("2", var_get(&sh.vars, "R"));
+  TEST_ASSERT_NULL(var_get(&sh.vars, "S"));
+  TEST_ASSERT_EQUAL_STRING("a+b+", var_get(&sh.vars, "P"));
+  TEST_ASSERT_EQUAL_STRING("z", var_get(&sh.vars, "L"));
+  TEST_ASSERT_NULL(ast_parse("true &&", NULL, NULL));
+  TEST_ASSERT_NULL(ast_parse("if true; then", NULL, NULL));
+  TEST_ASSERT_NULL(ast_parse("done", NULL, NULL));
+  exec_free(&sh);
+  vars_free(&sh.vars);
+}
+
+void test_source(void)
+{
+  struct shell sh = {0};
+  char dir[] = "/tmp/test-source-XXXXXX";
+  char path[512];
+  char *args[] = {"a1", NULL};
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  vars_init(&sh.vars);
+  var_set(&sh.vars, "MY_CACHE_DIR", dir, 0);
+  snprintf(path, sizeof(path), "%s/lib.sh", dir);
+  FILE *out = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(out);
+  fputs("f() { X=$1; }\nf $1\nreturn 7\nX=no\n", out);
+  fclose(out);
+
+  /* The second run maps the tree written by the first */
+  for (int i = 0; i < 2; i++)
+  {
+    TEST_ASSERT_EQUAL_INT(7, source_file(&sh, path, args));
+    TEST_ASSERT_EQUAL_STRING("a1", var_get(&sh.vars, "X"));
+    TEST_ASSERT_EQUAL_INT(i == 1, func_find(&sh, "f")->tree->map != NULL);
+  }
+  TEST_ASSERT_EQUAL_INT(0, sh.source_depth);
+  TEST_ASSERT_EQUAL_INT(0, sh.returning);
+  TEST_ASSERT_EQUAL_INT(1, source_file(&sh, "/nonexistent", NULL));
+
+  /* A tree with every kind of node passes the checks of the loader */
+  snprintf(path, sizeof(path), "%s/all.sh", dir);
+  out = fopen(path, "w");
+  TEST_ASSERT_NOT_NULL(out);
+  fputs("g() { if false; then :; elif true; then Y=1; else :; fi\n"
+        "while false; do :; done; until true; do :; done\n"
+        "for i in a b; do case $i in a|c) Y=$Y$i;; *) ;; esac; done\n"
+        "echo x | cat | cat; true && (true) || { false; }\n"
+        "cat <<EOF\nhi\nEOF\ncat <<< there; }\ng\n",
+        out);
+  fclose(out);
+  for (int i = 0; i < 2; i++)
+  {
+    TEST_ASSERT_EQUAL_INT(0, source_file(&sh, path, NULL));
+    TEST_ASSERT_EQUAL_STRING("1a", var_get(&sh.vars, "Y"));
+    TEST_ASSERT_EQUAL_INT(i == 1, func_find(&sh, "g")->tree->map != NULL);
+  }
+
+  /* A cached list that contains itself is a miss, not endless recursion */
+  char cache[512];
+  snprintf(path, sizeof(path), "%s/lib.sh", dir);
+  DIR *d = opendir(dir);
+  TEST_ASSERT_NOT_NULL(d);
+  for (struct dirent *e; (e = readdir(d)) != NULL;)
+  {
+    snprintf(cache, sizeof(cache), "%s/%s", dir, e->d_name);
+    uint32_t root;
+    int fd = open(cache, O_RDWR);
+    /* The root index follows seven 8 byte fields, the 24 byte nodes the 80 byte header */
+    if (strstr(e->d_name, ".ast") != NULL && fd >= 0 && pread(fd, &root, 4, 60) == 4)
+      TEST_ASSERT_EQUAL_INT(4, pwrite(fd, &root, 4, 80 + 24 * (off_t)root + 4));
+    if (fd >= 0)
+      close(fd);
+  }
+  closedir(d);
+  TEST_ASSERT_EQUAL_INT(7, source_file(&sh, path, args));
+  TEST_ASSERT_NULL(func_find(&sh, "f")->tree->map);
+
+  exec_free(&sh);
+  vars_free(&sh.vars);
+  d = opendir(dir);
+  TEST_ASSERT_NOT_NULL(d);
+  int files = 0;
+  for (struct dirent *e; (e = readdir(d)) != NULL;)
+  {
+    if (e->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    unlink(path);
+    files++;
+  }
+  closedir(d);
+  rmdir(dir);
+  TEST_ASSERT_EQUAL_INT(4, files);
+}
+
+void test_memo_cache(void)
+{
+  struct shell sh = {0};
+  char dir[] = "/tmp/test-memo-XXXXXX";
+  char path[512];
+  char *argv[] = {"cache", "--ttl", "1h", "--", "sh", "-c", "echo x; echo x >> $0/count; exit 5",
+                  dir, NULL};
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  vars_init(&sh.vars);
+  var_set(&sh.vars, "MY_CACHE_DIR", dir, 0);
+  snprintf(path, sizeof(path), "%s/out", dir);
+  fflush(stdout);
+  int saved = dup(STDOUT_FILENO);
+  int out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  dup2(out, STDOUT_FILENO);
+
+  /* The second run is replayed, the command only ran once */
+  TEST_ASSERT_EQUAL_INT(5, builtin_cache(&sh, argv));
+  TEST_ASSERT_EQUAL_INT(5, builtin_cache(&sh, argv));
+  TEST_ASSERT_EQUAL_UINT(1, sh.memo_hits);
+  TEST_ASSERT_EQUAL_UINT(1, sh.memo_misses);
+  /* Without its stderr blob the record is a miss before anything is replayed */
+  snprintf(path, sizeof(path), "%s/cmd/b-cbf29ce4842223259e3779b97f4a7c15", dir);
+  TEST_ASSERT_EQUAL_INT(0, unlink(path));
+  TEST_ASSERT_EQUAL_INT(5, builtin_cache(&sh, argv));
+  TEST_ASSERT_EQUAL_UINT(2, sh.memo_misses);
+  fflush(stdout);
+  dup2(saved, STDOUT_FILENO);
+  close(saved);
+  close(out);
+
+  struct stat st;
+  snprintf(path, sizeof(path), "%s/out", dir);
+  TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+  TEST_ASSERT_EQUAL_INT(6, st.st_size);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/count", dir);
+  TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+  TEST_ASSERT_EQUAL_INT(4, st.st_size);
+
+  char *clear[] = {"cache", "--clear", NULL};
+  TEST_ASSERT_EQUAL_INT(0, builtin_cache(&sh, clear));
+  snprintf(path, sizeof(path), "%s/cmd", dir);
+  TEST_ASSERT_EQUAL_INT(0, rmdir(path));
+  snprintf(path, sizeof(path), "%s/count", dir);
+  unlink(path);
+  rmdir(dir);
+  vars_free(&sh.vars);
+}
+
+static void collect_output(void *arg, int fd, const char *data, size_t len)
+{
+  char *buf = (char *)arg + (fd == 2 ? 256 : 0);
+  strncat(buf, data, len < 255 - strlen(buf) ? len : 255 - strlen(buf));
+}
+
+void test_embedded_shell(void)
+{
+  char out[512] = {0};
+  char cwd[512];
+  char now[512];
+  TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+  struct shell *sh = shell_new(collect_output, out);
+  TEST_ASSERT_NOT_NULL(sh);
+
+  /* Builtins and children both reach the callback, in order */
+  TEST_ASSERT_EQUAL_INT(3, shell_run_line(sh, "X=5\necho a $X\nsh -c 'echo b; echo c >&2; exit 3'"));
+  TEST_ASSERT_EQUAL_STRING("a 5\nb\n", out);
+  TEST_ASSERT_EQUAL_STRING("c\n", out + 256);
+  TEST_ASSERT_EQUAL_INT(2, shell_run_line(sh, "if true"));
+
+  /* cd moves the shell, not the program, and exit ends only the shell */
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "cd /"));
+  TEST_ASSERT_NOT_NULL(getcwd(now, sizeof(now)));
+  TEST_ASSERT_EQUAL_STRING(cwd, now);
+  out[0] = '\0';
+  TEST_ASSERT_EQUAL_INT(4, shell_run_line(sh, "pwd | cat; exit 4; echo no"));
+  TEST_ASSERT_EQUAL_STRING("/\n", out);
+  TEST_ASSERT_EQUAL_INT(4, shell_run_line(sh, "echo no"));
+  TEST_ASSERT_EQUAL_STRING("/\n", out);
+  shell_free(sh);
+
+  /* Output the shell copies itself, kept or replayed, reaches the callback too */
+  char dir[] = "/tmp/test-embed-XXXXXX";
+  char line[256];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  memset(out, 0, sizeof(out));
+  sh = shell_new(collect_output, out);
+  TEST_ASSERT_NOT_NULL(sh);
+  snprintf(line, sizeof(line), "MY_CACHE_DIR=%s\ncache -- sh -c 'echo m; echo e >&2'", dir);
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, line));
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "cache -- sh -c 'echo m; echo e >&2'"));
+  TEST_ASSERT_EQUAL_UINT(1, sh->memo_hits);
+  TEST_ASSERT_EQUAL_STRING("m\nm\n", out);
+  TEST_ASSERT_EQUAL_STRING("e\ne\n", out + 256);
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "cache --clear\ncapture on\nsh -c 'echo j' &\nwait"));
+  out[0] = '\0';
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "jobs -o 1"));
+  TEST_ASSERT_EQUAL_STRING("j\n", out);
+  shell_free(sh);
+  snprintf(line, sizeof(line), "%s/cmd", dir);
+  TEST_ASSERT_EQUAL_INT(0, rmdir(line));
+  rmdir(dir);
+}
+
+void test_embedded_jobs(void)
+{
+  char out[512] = {0};
+  struct shell *sh = shell_new(collect_output, out);
+  TEST_ASSERT_NOT_NULL(sh);
+
+  /* More jobs than one poll used to take, the last one stops itself */
+  for (int i = 0; i < 70; i++)
+    TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "sleep 5 &"));
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "sh -c 'kill -STOP $$; exit 3' &"));
+  TEST_ASSERT_EQUAL_INT(128 + SIGTSTP, shell_run_line(sh, "wait 71"));
+  struct bg_process *bgp = &sh->bg_processes[70];
+  TEST_ASSERT_EQUAL_INT(JOB_STOPPED, bgp->state);
+  kill(bgp->pid, SIGCONT);
+  TEST_ASSERT_EQUAL_INT(3, shell_run_line(sh, "wait 71"));
+  for (int i = 0; i < 70; i++)
+    kill(sh->bg_processes[i].pid, SIGKILL);
+  TEST_ASSERT_EQUAL_INT(128 + SIGKILL, shell_run_line(sh, "wait 70"));
+  TEST_ASSERT_EQUAL_INT(0, shell_run_line(sh, "wait"));
+  TEST_ASSERT_EQUAL_size_t(0, sh->num_watch);
+  shell_free(sh);
+}
+
+void test_serve(void)
+{
+  char path[64] = "/tmp/test-serve-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(path));
+  strcat(path, "/sock");
+  fflush(stdout);
+  pid_t server = fork();
+  if (server == 0)
+  {
+    struct shell sh = {0};
+    sh_init_state(&sh);
+    _exit(shell_serve(&sh, path));
+  }
+  for (int i = 0; i < 200 && access(path, F_OK) != 0; i++)
+    usleep(10000);
+
+  /* The request gets our stdout pipe, environment and nothing of the last one */
+  int out[2];
+  TEST_ASSERT_EQUAL_INT(0, pipe(out));
+  int fds[3] = {STDIN_FILENO, out[1], STDERR_FILENO};
+  char *env[] = {"FOO=bar", NULL};
+  int first = serve_request(path, "cd /; X=1; echo $FOO; pwd; exit 3", env, fds);
+  int second = serve_request(path, "echo x$X", NULL, fds);
+  close(out[1]);
+  char buf[64] = {0};
+  ssize_t n = read(out[0], buf, sizeof(buf) - 1);
+  close(out[0]);
+
+  int status;
+  kill(server, SIGTERM);
+  TEST_ASSERT_EQUAL_INT(server, waitpid(server, &status, 0));
+  TEST_ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  TEST_ASSERT_NOT_EQUAL(0, access(path, F_OK));
+  *strrchr(path, '/') = '\0';
+  rmdir(path);
+  TEST_ASSERT_EQUAL_INT(3, first);
+  TEST_ASSERT_EQUAL_INT(0, second);
+  TEST_ASSERT_EQUAL_INT(8, n);
+  TEST_ASSERT_EQUAL_STRING("bar\n/\nx\n", buf);
+}
+
+void test_zygote(void)
+{
+  struct shell sh = {0};
+  vars_init(&sh.vars);
+  TEST_ASSERT_EQUAL_INT(0, zygote_start(&sh));
+
+  /* The command is the shell's child, so its status is waited for as usual */
+  char *argv[] = {"sh", "-c", "exit 7", NULL};
+  TEST_ASSERT_EQUAL_INT(7, run_command(&sh, argv, 0));
+  TEST_ASSERT_EQUAL_UINT(1, sh.zygote.spawns);
+  /* The zygote has none of the pipes /dev/fd/N names, the shell forks */
+  char out[64];
+  run_line_out(&sh, "cat <(echo hi)", out, sizeof(out));
+  TEST_ASSERT_EQUAL_STRING("hi\n", out);
+  TEST_ASSERT_EQUAL_UINT(1, sh.zygote.spawns);
+  TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+  sh.zygote.paused = 1;
+  TEST_ASSERT_EQUAL_INT(7, run_command(&sh, argv, 0));
+  TEST_ASSERT_EQUAL_UINT(1, sh.zygote.spawns);
+
+  zygote_stop(&sh);
+  TEST_ASSERT_EQUAL_INT(0, sh.zygote.pid);
+  TEST_ASSERT_EQUAL_INT(7, run_command(&sh, argv, 0));
+  exec_free(&sh);
+  vars_free(&sh.vars);
+}
+
+void test_io_commit(void)
+{
+  char dir[] = "/tmp/io-test-XXXXXX";
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  char tmp[2][64];
+  char path[2][64];
+  char data[] = "record";
+  char buf[16];
+
+  /* The same files both ways, then the second one linked after a failure */
+  for (int pass = 0; pass < 3; pass++)
+  {
+    io_use_uring(pass != 1);
+    struct iovec iov[] = {{"ab", 2}, {"c", 1}, {data, sizeof(data) - 1}};
+    struct io_file f[2];
+    for (int i = 0; i < 2; i++)
+    {
+      snprintf(path[i], sizeof(path[i]), "%s/f%d", dir, i);
+      snprintf(tmp[i], sizeof(tmp[i]), "%s/t%d.XXXXXX", dir, i);
+      int fd = mkstemp(tmp[i]);
+      TEST_ASSERT_TRUE(fd >= 0);
+      f[i] = (struct io_file){.fd = fd, .linked = 1, .off = 0, .iov = &iov[i * 2],
+                              .count = 2 - i, .tmp = tmp[i], .path = path[i]};
+    }
+    if (pass == 2)
+    {
+      unlink(path[0]);
+      unlink(path[1]);
+      snprintf(path[0], sizeof(path[0]), "%s/missing/f0", dir);
+      TEST_ASSERT_EQUAL_INT(-1, io_commit(f, 2));
+      TEST_ASSERT_FALSE(f[1].ok);
+      TEST_ASSERT_EQUAL_INT(-1, access(path[1], F_OK));
+      TEST_ASSERT_EQUAL_INT(-1, access(tmp[1], F_OK));
+      break;
+    }
+    TEST_ASSERT_EQUAL_INT(0, io_commit(f, 2));
+    int fd = open(path[0], O_RDONLY);
+    TEST_ASSERT_EQUAL_INT(3, read(fd, buf, sizeof(buf)));
+    close(fd);
+    TEST_ASSERT_EQUAL_MEMORY("abc", buf, 3);
+    fd = open(path[1], O_RDONLY);
+    TEST_ASSERT_EQUAL_INT(6, read(fd, buf, sizeof(buf)));
+    close(fd);
+  }
+
+  /* sendfile refuses a file open for appending, io_copy does not */
+  snprintf(path[0], sizeof(path[0]), "%s/f0", dir);
+  int in = open(path[1], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  TEST_ASSERT_EQUAL_INT(6, write(in, data, 6));
+  close(in);
+  in = open(path[1], O_RDONLY);
+  int out = open(path[0], O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0600);
+  TEST_ASSERT_EQUAL_INT(0, io_copy(in, 2, 4, out));
+  io_use_uring(0);
+  TEST_ASSERT_EQUAL_INT(0, io_copy(in, 0, 3, out));
+  TEST_ASSERT_EQUAL_INT(-1, io_copy(in, 0, 7, out));
+  io_use_uring(1);
+  close(in);
+  close(out);
+  in = open(path[0], O_RDONLY);
+  TEST_ASSERT_EQUAL_INT(13, read(in, buf, sizeof(buf)));
+  close(in);
+  TEST_ASSERT_EQUAL_MEMORY("cordrecrecord", buf, 13);
+  unlink(path[0]);
+  unlink(path[1]);
+  TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+}
+
+void test_print_builtins(void)
+{
+  struct shell sh = {0};
+  size_t len;
+  vars_init(&sh.vars);
+  char *printf_argv[] = {"printf", "%s=%03d%%\\n", "a", "7", "b", "0x10", NULL};
+  char *out = builtin_render(&sh, printf_argv, &len);
+  TEST_ASSERT_EQUAL_STRING("a=007%\nb=016%\n", out);
+  free(out);
+  char *echo_argv[] = {"echo", "-ne", "x\\ty\\0101", "z", NULL};
+  out = builtin_render(&sh, echo_argv, &len);
+  TEST_ASSERT_EQUAL_STRING("x\tyA z", out);
+  free(out);
+  TEST_ASSERT_TRUE(builtin_pure(&sh, echo_argv));
+  char *cd_argv[] = {"cd", "/", NULL};
+  TEST_ASSERT_FALSE(builtin_pure(&sh, cd_argv));
+  vars_free(&sh.vars);
+}
+
+void test_line_cache(void)
+{
+  struct line_cache c = {0};
+  const char *lines[] = {"echo a", "echo b", "echo c"};
+  TEST_ASSERT_EQUAL_INT(0, line_cache_resize(&c, 2));
+  for (int i = 0; i < 3; i++)
+  {
+    struct ast *t = ast_parse(lines[i], NULL, NULL);
+    line_cache_put(&c, lines[i], t);
+    ast_release(t);
+    if (i == 1)
+      ast_release(line_cache_get(&c, "echo a"));
+  }
+  /* echo a was used after echo b, so echo b was the one dropped */
+  struct ast *t = line_cache_get(&c, "echo a");
+  TEST_ASSERT_NOT_NULL(t);
+  TEST_ASSERT_EQUAL_STRING("a", t->strings + t->words[1]);
+  ast_release(t);
+  TEST_ASSERT_NULL(line_cache_get(&c, "echo b"));
+  TEST_ASSERT_EQUAL_INT(2, (int)c.count);
+  TEST_ASSERT_EQUAL_INT(2, (int)c.hits);
+  TEST_ASSERT_EQUAL_INT(1, (int)c.misses);
+  TEST_ASSERT_EQUAL_INT(-1, line_cache_resize(&c, 1 << 30));
+  TEST_ASSERT_EQUAL_INT(0, line_cache_resize(&c, 0));
+  TEST_ASSERT_EQUAL_INT(0, (int)c.count);
+  TEST_ASSERT_NULL(line_cache_get(&c, "echo c"));
+  line_cache_free(&c);
+}
+
+void test_glob_match(void)
+{
+  TEST_ASSERT_TRUE(glob_match("*.log", 5, "x.log"));
+  TEST_ASSERT_FALSE(glob_match("*.log", 5, "x.log.1"));
+  TEST_ASSERT_TRUE(glob_match("a*b*c", 5, "axxbyybc"));
+  TEST_ASSERT_TRUE(glob_match("?[xy][!0-9]", 11, "ayz"));
+  TEST_ASSERT_FALSE(glob_match("?[xy][!0-9]", 11, "ay5"));
+  TEST_ASSERT_TRUE(glob_match("[]]", 3, "]"));
+  TEST_ASSERT_TRUE(glob_match("\\*", 2, "*"));
+  TEST_ASSERT_FALSE(glob_match("\\*", 2, "x"));
+  TEST_ASSERT_TRUE(glob_match("[x", 2, "[x"));
+}
+
+void test_glob_cache(void)
+{
+  char dir[] = "/tmp/test-glob-XXXXXX";
+  char path[128];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  snprintf(path, sizeof(path), "%s/sub", dir);
+  mkdir(path, 0700);
+  snprintf(path, sizeof(path), "%s/sub/s.c", dir);
+  fclose(fopen(path, "w"));
+  snprintf(path, sizeof(path), "%s/a.c", dir);
+  fclose(fopen(path, "w"));
+
+  struct shell sh = {0};
+  struct expansion ex = {0};
+  vars_init(&sh.vars);
+  int cwd = open(".", O_RDONLY | O_DIRECTORY);
+  TEST_ASSERT_EQUAL_INT(0, chdir(dir));
+  char *words[] = {"*.c", NULL};
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(1, (int)ex.argc);
+
+  /* The listing lasts for the line but follows changes made on it */
+  snprintf(path, sizeof(path), "%s/b.c", dir);
+  fclose(fopen(path, "w"));
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(2, (int)ex.argc);
+  TEST_ASSERT_EQUAL_INT(0, chdir("sub"));
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(1, (int)ex.argc);
+  TEST_ASSERT_EQUAL_STRING("s.c", ex.argv[0]);
+  TEST_ASSERT_EQUAL_INT(0, fchdir(cwd));
+  close(cwd);
+  expansion_free(&ex);
+  vars_free(&sh.vars);
+
+  const char *names[] = {"sub/s.c", "a.c", "b.c"};
+  for (int i = 0; i < 3; i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/sub", dir);
+  rmdir(path);
+  TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+}
+
+void test_glob_parallel(void)
+{
+  char dir[] = "/tmp/test-glob-XXXXXX";
+  char path[128];
+  TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+  const char *files[] = {"a/x.c", "a/b/y.c", "a/b/c/z.c", "d/w.c", "v.c", "a/.h/u.c"};
+  const char *dirs[] = {"a", "a/b", "a/b/c", "d", "a/.h"};
+  for (int i = 0; i < 5; i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+    mkdir(path, 0700);
+  }
+  for (int i = 0; i < 6; i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+    fclose(fopen(path, "w"));
+  }
+
+  struct shell sh = {0};
+  struct expansion ex = {0};
+  vars_init(&sh.vars);
+  snprintf(path, sizeof(path), "%s/**/*.c", dir);
+  char *words[] = {path, NULL};
+  var_set(&sh.vars, "GLOB_THREADS", "4", 0);
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(5, (int)ex.argc);
+  size_t len = ex.len;
+  char *parallel = malloc(len);
+  memcpy(parallel, ex.buf, len);
+  var_set(&sh.vars, "GLOB_THREADS", "1", 0);
+  TEST_ASSERT_EQUAL_INT(0, expand_words(&sh, words, &ex));
+  TEST_ASSERT_EQUAL_INT(len, ex.len);
+  TEST_ASSERT_EQUAL_MEMORY(ex.buf, parallel, len);
+  TEST_ASSERT_EQUAL_STRING("a/b/c/z.c", ex.argv[0] + strlen(dir) + 1);
+  free(parallel);
+  expansion_free(&ex);
+  vars_free(&sh.vars);
+
+  for (int i = 5; i >= 0; i--)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+    unlink(path);
+  }
+  for (int i = 4; i >= 0; i--)
+  {
+    snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+    rmdir(path);
+  }
+  rmdir(dir);
+}
+
+void test_batch_chunk(void)
+{
+  char *items[] = {"aaa", "bbb", "ccc", "ddd", NULL};
+  size_t cost = 4 + sizeof(char *);
+  TEST_ASSERT_EQUAL_INT(4, (int)batch_chunk(items, 4, 100 * cost, 0));
+  TEST_ASSERT_EQUAL_INT(2, (int)batch_chunk(items, 4, 2 * cost, 0));
+  TEST_ASSERT_EQUAL_INT(2, (int)batch_chunk(items, 4, 3 * cost - 1, 0));
+  TEST_ASSERT_EQUAL_INT(3, (int)batch_chunk(items, 4, 100 * cost, 3));
+  TEST_ASSERT_EQUAL_INT(1, (int)batch_chunk(items, 4, 1, 0));
+  TEST_ASSERT_EQUAL_INT(0, (int)batch_chunk(items, 0, 100, 0));
+}
+
 int main(void)
 {
   UNITY_BEGIN();
@@ -175,6 +1085,33 @@ int main(void)
   RUN_TEST(test_get_prompt_custom);
   RUN_TEST(test_ch_dir_home);
   RUN_TEST(test_ch_dir_root);
+  RUN_TEST(test_job_policy_parse);
+  RUN_TEST(test_job_control);
+  RUN_TEST(test_capture_cap);
+  RUN_TEST(test_job_stats_descendants);
+  RUN_TEST(test_subreaper);
+  RUN_TEST(test_bench_compute);
+  RUN_TEST(test_parse_duration);
+  RUN_TEST(test_vars);
+  RUN_TEST(test_arith_eval);
+  RUN_TEST(test_expand_words);
+  RUN_TEST(test_command_subst);
+  RUN_TEST(test_process_subst);
+  RUN_TEST(test_heredoc);
+  RUN_TEST(test_control_flow);
+  RUN_TEST(test_source);
+  RUN_TEST(test_print_builtins);
+  RUN_TEST(test_line_cache);
+  RUN_TEST(test_memo_cache);
+  RUN_TEST(test_embedded_shell);
+  RUN_TEST(test_embedded_jobs);
+  RUN_TEST(test_serve);
+  RUN_TEST(test_zygote);
+  RUN_TEST(test_io_commit);
+  RUN_TEST(test_glob_match);
+  RUN_TEST(test_glob_parallel);
+  RUN_TEST(test_glob_cache);
+  RUN_TEST(test_batch_chunk);
 
   return UNITY_END();
 }
\ No newline at end of file